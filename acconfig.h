@@ -135,6 +135,15 @@
 /* Define this to use alpha assembler routines in sshmath library. */
 #undef SSHMATH_ALPHA
 
+/* Define this to use x86-64 assembler macros in sshmath library. */
+#undef SSHMATH_X86_64
+
+/* Define this to use AArch64 assembler macros in sshmath library. */
+#undef SSHMATH_AARCH64
+
+/* Define this if the compiler supports unsigned __int128. */
+#undef HAVE_UINT128
+
 /* Define this to use Digital CC V5.3 assembler inline macros in sshmath
 library. */
 #undef SSHMATH_ALPHA_DEC_CC_ASM
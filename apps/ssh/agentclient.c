@@ -33,7 +33,7 @@ Client-side interface to the SSH authentication agent.
    SshCrossDown couldn't handle them.  Thus, we don't need can_send
    callbacks.  */
 
-/* Internal status of the agent client. */
+/* Internal status of a connection to the agent. */
 typedef enum {
   SSH_AC_IDLE,
   SSH_AC_WAITING_SUCCESS,
@@ -42,10 +42,36 @@ typedef enum {
   SSH_AC_WAITING_VERSION
 } SshAgentClientState;
 
-struct SshAgentRec {
+/* A request to the agent.  The agent answers one request at a time, so
+   the requests on a connection are queued, and sent one after another in
+   the order they were made. */
+typedef struct SshAgentRequestRec {
+  struct SshAgentRequestRec *next;
+
+  /* The handle the request was made through, or NULL if that has been
+     closed while the request was in progress. */
+  SshAgent agent;
+
+  /* The state while waiting for the reply. */
+  SshAgentClientState state;
+
+  /* The request packet. */
+  SshCrossPacketType type;
+  unsigned char *data;
+  size_t len;
+
+  /* Callback for the reply, depending on the state. */
+  SshAgentCompletion completion_callback;
+  SshAgentListCallback list_callback;
+  SshAgentOpCallback op_callback;
+  void *context;
+} *SshAgentRequest;
+
+typedef struct SshAgentConnectionRec {
   /* The agent uses a packet format identical to the cross layer protocol.
      Thus, we can use the SshCrossDown and SshCrossUp objects for handling
-     the packets.  In the client, we use SshCrossDown. */
+     the packets.  In the client, we use SshCrossDown.  This is NULL
+     while connecting. */
   SshCrossDown down;
 
   /* Agent version, as returned by agent request. */
@@ -57,49 +83,273 @@ struct SshAgentRec {
   /* Is agent from ssh-2.0.{6,7,8,9,10}? */
   Boolean broken_agent;
 
-  /* Various callbacks, depending on the state. */
+  /* TRUE if the connection has failed, or timed out. */
+  Boolean lost;
+
+  /* The request sent to the agent, and the requests waiting for it. */
+  SshAgentRequest current;
+  SshAgentRequest queue;
+
+  /* The handles to this connection. */
+  SshAgent handles;
+
+  /* Number of callbacks in progress.  The connection is not freed while
+     there are any. */
+  unsigned int callbacks;
+} *SshAgentConnection;
+
+/* What ssh_agent_open returns.  Normally each handle has a connection of
+   its own, but see ssh_agent_share_connection. */
+struct SshAgentRec {
+  SshAgentConnection connection;
+  struct SshAgentRec *next;
+
+  /* Called once the version of the agent is known. */
   SshAgentOpenCallback open_callback;
-  SshAgentCompletion completion_callback;
-  SshAgentListCallback list_callback;
-  SshAgentOpCallback op_callback;
-  void *context;
+  void *open_context;
 };
 
-/* This is called if a request times out. */
+/* The connection shared by ssh_agent_open, if sharing. */
+static Boolean ssh_agent_sharing = FALSE;
+static SshAgentConnection ssh_agent_shared = NULL;
 
-void ssh_agent_timeout(void *context)
+void ssh_agent_send_next(SshAgentConnection conn);
+
+/* Frees the connection if nobody is using it any more.  Returns TRUE if
+   it was freed. */
+
+Boolean ssh_agent_connection_check_free(SshAgentConnection conn)
 {
-  SshAgent agent = (SshAgent)context;
+  SshAgentRequest req;
+
+  if (conn->handles != NULL || conn->callbacks > 0 ||
+      (conn == ssh_agent_shared && !conn->lost))
+    return FALSE;
+
+  if (conn == ssh_agent_shared)
+    ssh_agent_shared = NULL;
+  if (conn->down)
+    ssh_cross_down_destroy(conn->down);
+  ssh_cancel_timeouts(SSH_ALL_CALLBACKS, (void *)conn);
+  while (conn->queue)
+    {
+      req = conn->queue;
+      conn->queue = req->next;
+      ssh_xfree(req->data);
+      ssh_xfree(req);
+    }
+  if (conn->current)
+    {
+      ssh_xfree(conn->current->data);
+      ssh_xfree(conn->current);
+    }
+  memset(conn, 'F', sizeof(*conn));
+  ssh_xfree(conn);
+  return TRUE;
+}
 
-  switch (agent->state)
+/* Calls the callback of `req' with `error'. */
+
+void ssh_agent_request_fail(SshAgentRequest req, SshAgentError error)
+{
+  switch (req->state)
     {
-    case SSH_AC_IDLE:
-      ssh_debug("ssh_agent_timeout when IDLE???");
-      break;
     case SSH_AC_WAITING_SUCCESS:
-      if (agent->completion_callback)
-        (*agent->completion_callback)(SSH_AGENT_ERROR_TIMEOUT, agent->context);
+      if (req->completion_callback)
+        (*req->completion_callback)(error, req->context);
       break;
     case SSH_AC_WAITING_LIST:
-      if (agent->list_callback)
-        (*agent->list_callback)(SSH_AGENT_ERROR_TIMEOUT, 0, NULL,
-                                agent->context);
+      if (req->list_callback)
+        (*req->list_callback)(error, 0, NULL, req->context);
       break;
     case SSH_AC_WAITING_OPERATION_COMPLETE:
-      if (agent->op_callback)
-        (*agent->op_callback)(SSH_AGENT_ERROR_TIMEOUT, NULL, 0,
-                              agent->context);
-      break;
-    case SSH_AC_WAITING_VERSION:
-      if (agent->open_callback)
-        (*agent->open_callback)(NULL, agent->context);
-      ssh_agent_close(agent);
+      if (req->op_callback)
+        (*req->op_callback)(error, NULL, 0, req->context);
       break;
     default:
-      ssh_debug("ssh_agent_timeout: bad state %d", (int)agent->state);
+      ssh_debug("ssh_agent_request_fail: bad state %d", (int)req->state);
     }
 }
 
+/* Fails everything on the connection with `error'.  Handles that were
+   still waiting for the connection to open get a NULL agent, and are
+   freed. */
+
+void ssh_agent_connection_lost(SshAgentConnection conn, SshAgentError error)
+{
+  SshAgentRequest req;
+  SshAgent agent, *agentp;
+  SshAgentOpenCallback open_callback;
+  void *open_context;
+
+  ssh_cancel_timeouts(SSH_ALL_CALLBACKS, (void *)conn);
+  if (conn == ssh_agent_shared)
+    ssh_agent_shared = NULL;
+  conn->lost = TRUE;
+  conn->state = SSH_AC_IDLE;
+  conn->callbacks++;
+
+  for (agentp = &conn->handles; *agentp; )
+    {
+      agent = *agentp;
+      if (agent->open_callback == NULL)
+        {
+          agentp = &agent->next;
+          continue;
+        }
+      *agentp = agent->next;
+      open_callback = agent->open_callback;
+      open_context = agent->open_context;
+      memset(agent, 'F', sizeof(*agent));
+      ssh_xfree(agent);
+      (*open_callback)(NULL, open_context);
+      /* The callback may have closed other handles. */
+      agentp = &conn->handles;
+    }
+
+  while ((req = conn->current) != NULL || (req = conn->queue) != NULL)
+    {
+      if (req == conn->current)
+        conn->current = NULL;
+      else
+        conn->queue = req->next;
+      ssh_agent_request_fail(req, error);
+      ssh_xfree(req->data);
+      ssh_xfree(req);
+    }
+
+  conn->callbacks--;
+  ssh_agent_connection_check_free(conn);
+}
+
+/* This is called if a request times out. */
+
+void ssh_agent_timeout(void *context)
+{
+  SshAgentConnection conn = (SshAgentConnection)context;
+
+  ssh_debug("ssh_agent_timeout: state %d", (int)conn->state);
+
+  /* A late reply could not be told apart from the reply to the next
+     request, so the connection cannot be used any more. */
+  ssh_agent_connection_lost(conn, SSH_AGENT_ERROR_TIMEOUT);
+}
+
+/* Takes the request in progress off the connection when its reply has
+   been received.  The caller calls its callback, and then
+   ssh_agent_request_done. */
+
+SshAgentRequest ssh_agent_reply_received(SshAgentConnection conn)
+{
+  SshAgentRequest req;
+
+  ssh_cancel_timeouts(ssh_agent_timeout, (void *)conn);
+  req = conn->current;
+  conn->current = NULL;
+  conn->state = SSH_AC_IDLE;
+  conn->callbacks++;
+  return req;
+}
+
+/* Frees `req', and sends the next request, if any. */
+
+void ssh_agent_request_done(SshAgentConnection conn, SshAgentRequest req)
+{
+  ssh_xfree(req->data);
+  ssh_xfree(req);
+  conn->callbacks--;
+  if (ssh_agent_connection_check_free(conn))
+    return;
+  ssh_agent_send_next(conn);
+}
+
+/* Sends the first queued request if the agent is not busy with an
+   earlier one. */
+
+void ssh_agent_send_next(SshAgentConnection conn)
+{
+  SshAgentRequest req;
+
+  if (conn->lost || conn->state != SSH_AC_IDLE || conn->queue == NULL)
+    return;
+
+  req = conn->queue;
+  conn->queue = req->next;
+  req->next = NULL;
+  conn->current = req;
+  conn->state = req->state;
+  ssh_register_timeout(SSH_AGENT_TIMEOUT, 0L,
+                       ssh_agent_timeout, (void *)conn);
+  ssh_cross_down_send(conn->down, req->type, req->data, req->len);
+}
+
+/* Queues a request to the agent.  The packet is given as for
+   ssh_encode_buffer after `context'.  Exactly one of the callbacks
+   is used, as selected by `state'. */
+
+void ssh_agent_request(SshAgent agent, SshAgentClientState state,
+                       SshCrossPacketType type,
+                       SshAgentCompletion completion_callback,
+                       SshAgentListCallback list_callback,
+                       SshAgentOpCallback op_callback,
+                       void *context, ...)
+{
+  SshAgentConnection conn = agent->connection;
+  SshAgentRequest req, *reqp;
+  va_list va;
+
+  req = ssh_xcalloc(1, sizeof(*req));
+  req->agent = agent;
+  req->state = state;
+  req->type = type;
+  req->completion_callback = completion_callback;
+  req->list_callback = list_callback;
+  req->op_callback = op_callback;
+  req->context = context;
+
+  if (conn->lost)
+    {
+      ssh_debug("ssh_agent_request: connection to the agent lost");
+      ssh_agent_request_fail(req, SSH_AGENT_ERROR_FAILURE);
+      ssh_xfree(req);
+      return;
+    }
+
+  va_start(va, context);
+  req->len = ssh_encode_alloc_va(&req->data, va);
+  va_end(va);
+
+  for (reqp = &conn->queue; *reqp; reqp = &(*reqp)->next)
+    ;
+  *reqp = req;
+  ssh_agent_send_next(conn);
+}
+
+/* Calls the open callbacks of the handles waiting for the connection. */
+
+void ssh_agent_opened(SshAgentConnection conn)
+{
+  SshAgent agent;
+  SshAgentOpenCallback open_callback;
+
+  conn->callbacks++;
+  for (;;)
+    {
+      for (agent = conn->handles; agent; agent = agent->next)
+        if (agent->open_callback)
+          break;
+      if (agent == NULL)
+        break;
+      open_callback = agent->open_callback;
+      agent->open_callback = NULL;
+      (*open_callback)(agent, agent->open_context);
+    }
+  conn->callbacks--;
+  if (ssh_agent_connection_check_free(conn))
+    return;
+  ssh_agent_send_next(conn);
+}
+
 /* This is called when a packet is received from the agent. */
 
 void ssh_agent_received_packet(SshCrossPacketType type,
@@ -107,7 +357,8 @@ void ssh_agent_received_packet(SshCrossPacketType type,
                                size_t len,
                                void *context)
 {
-  SshAgent agent = (void *)context;
+  SshAgentConnection conn = (SshAgentConnection)context;
+  SshAgentRequest req;
   SshAgentError err;
   SshUInt32 code, temp, num_keys;
   const unsigned char *result;
@@ -115,49 +366,49 @@ void ssh_agent_received_packet(SshCrossPacketType type,
   SshAgentKeyInfo keys;
   int i;
 
+  if (conn->lost)
+    return;
+
   switch ((int)type)
     {
     case 2: /* Version response from old (version 1.x) ssh-agent. */
       ssh_debug("ssh_agent_received_packet: packet number 2 (version response from 1.x agent)");
-      agent->version = 1;
+      conn->version = 1;
 
       /* We don't support the 1.x agent yet.  Nor will we ever. */
-      agent->state = SSH_AC_IDLE;
-      if (agent->open_callback)
-        (*agent->open_callback)(NULL, agent->context);
-      ssh_agent_close(agent);
+      ssh_agent_connection_lost(conn, SSH_AGENT_ERROR_FAILURE);
       return;
 
     case SSH_AGENT_SUCCESS:
-      if (agent->state != SSH_AC_WAITING_SUCCESS)
+      if (conn->state != SSH_AC_WAITING_SUCCESS)
         {
           ssh_debug("ssh_agent_received_packet: unexpected %d", (int)type);
           return;
         }
       if (len != 0)
         ssh_debug("ssh_agent_received_packet: SUCCESS bad data");
-      ssh_cancel_timeouts(ssh_agent_timeout, (void *)agent);
-      agent->state = SSH_AC_IDLE;
-      if (agent->completion_callback)
-        (*agent->completion_callback)(SSH_AGENT_ERROR_OK, agent->context);
+      req = ssh_agent_reply_received(conn);
+      if (req->completion_callback)
+        (*req->completion_callback)(SSH_AGENT_ERROR_OK, req->context);
+      ssh_agent_request_done(conn, req);
       break;
       
     case SSH_AGENT_FAILURE:
-      if (agent->state == SSH_AC_WAITING_VERSION)
+      if (conn->state == SSH_AC_WAITING_VERSION)
         {
           /* This may happen, if we have agent from versions
              ssh-2.0.{7-10} and our client is newer.  We now send
              the version request again without identifying our own
              version and leaving the state waiting for version 
              response. */
-          agent->broken_agent = TRUE;
-          ssh_cross_down_send_encode(agent->down,
+          conn->broken_agent = TRUE;
+          ssh_cross_down_send_encode(conn->down,
                                 (SshCrossPacketType)SSH_AGENT_REQUEST_VERSION,
                                  SSH_FORMAT_END);
           return;
         }
-      if (agent->state != SSH_AC_WAITING_SUCCESS &&
-          agent->state != SSH_AC_WAITING_OPERATION_COMPLETE)
+      if (conn->state != SSH_AC_WAITING_SUCCESS &&
+          conn->state != SSH_AC_WAITING_OPERATION_COMPLETE)
         {
           ssh_debug("ssh_agent_received_packet: unexpected %d", (int)type);
           return;
@@ -172,28 +423,17 @@ void ssh_agent_received_packet(SshCrossPacketType type,
       else
         err = (SshAgentError)code;
 
-      ssh_cancel_timeouts(ssh_agent_timeout, (void *)agent);
-      if (agent->state == SSH_AC_WAITING_SUCCESS)
-        {
-          agent->state = SSH_AC_IDLE;
-          if (agent->completion_callback)
-            (*agent->completion_callback)(err, agent->context);
-        }
-      else
-        {
-          agent->state = SSH_AC_IDLE;
-          if (agent->op_callback)
-            (*agent->op_callback)(err, NULL, 0, agent->context);
-        }
+      req = ssh_agent_reply_received(conn);
+      ssh_agent_request_fail(req, err);
+      ssh_agent_request_done(conn, req);
       break;
 
     case SSH_AGENT_VERSION_RESPONSE:
-      if (agent->state != SSH_AC_WAITING_VERSION)
+      if (conn->state != SSH_AC_WAITING_VERSION)
         {
           ssh_debug("ssh_agent_received_packet: unexpected %d", (int)type);
           return;
         }
-      ssh_cancel_timeouts(ssh_agent_timeout, (void *)agent);
       if (ssh_decode_array(data, len,
                                SSH_FORMAT_UINT32, &temp,
                                SSH_FORMAT_END) != len)
@@ -201,18 +441,19 @@ void ssh_agent_received_packet(SshCrossPacketType type,
           ssh_debug("ssh_agent_received_packet: VERSION_RESPONSE bad data");
           return;
         }
-      agent->version = temp;
-      agent->state = SSH_AC_IDLE;
-      if (agent->open_callback)
-        (*agent->open_callback)(agent, agent->context);
+      ssh_cancel_timeouts(ssh_agent_timeout, (void *)conn);
+      conn->version = temp;
+      conn->state = SSH_AC_IDLE;
+      ssh_agent_opened(conn);
       break;
       
     case SSH_AGENT_KEY_LIST:
-      if (agent->state != SSH_AC_WAITING_LIST)
+      if (conn->state != SSH_AC_WAITING_LIST)
         {
           ssh_debug("ssh_agent_received_packet: unexpected %d", (int)type);
           return;
         }
+      req = ssh_agent_reply_received(conn);
       bytes = ssh_decode_array(data, len,
                                SSH_FORMAT_UINT32, &num_keys,
                                SSH_FORMAT_END);
@@ -220,9 +461,8 @@ void ssh_agent_received_packet(SshCrossPacketType type,
         {
           ssh_debug("ssh_agent_received_packet: KEY_LIST bad data");
         list_fail:
-          if (agent->list_callback)
-            (*agent->list_callback)(SSH_AGENT_ERROR_FAILURE, 0, NULL,
-                                    agent->context);
+          ssh_agent_request_fail(req, SSH_AGENT_ERROR_FAILURE);
+          ssh_agent_request_done(conn, req);
           return;
         }
 
@@ -256,18 +496,17 @@ void ssh_agent_received_packet(SshCrossPacketType type,
           ssh_xfree(keys);
           goto list_fail;
         }
-      ssh_cancel_timeouts(ssh_agent_timeout, (void *)agent);
-      agent->state = SSH_AC_IDLE;
-      if (agent->list_callback)
-        (*agent->list_callback)(SSH_AGENT_ERROR_OK, (unsigned int)num_keys,
-                                keys, agent->context);
+      if (req->list_callback)
+        (*req->list_callback)(SSH_AGENT_ERROR_OK, (unsigned int)num_keys,
+                              keys, req->context);
       for (i = 0; i < num_keys; i++)
         ssh_xfree(keys[i].description);
       ssh_xfree(keys);
+      ssh_agent_request_done(conn, req);
       break;
       
     case SSH_AGENT_OPERATION_COMPLETE:
-      if (agent->state != SSH_AC_WAITING_OPERATION_COMPLETE)
+      if (conn->state != SSH_AC_WAITING_OPERATION_COMPLETE)
         {
           ssh_debug("ssh_agent_received_packet: unexpected OP_COMPLETE");
           return;
@@ -279,11 +518,11 @@ void ssh_agent_received_packet(SshCrossPacketType type,
           ssh_debug("ssh_agent_received_packet: OP_COMPLETE bad data");
           return;
         }
-      ssh_cancel_timeouts(ssh_agent_timeout, (void *)agent);
-      agent->state = SSH_AC_IDLE;
-      if (agent->op_callback)
-        (*agent->op_callback)(SSH_AGENT_ERROR_OK, result, result_len,
-                              agent->context);
+      req = ssh_agent_reply_received(conn);
+      if (req->op_callback)
+        (*req->op_callback)(SSH_AGENT_ERROR_OK, result, result_len,
+                            req->context);
+      ssh_agent_request_done(conn, req);
       break;
 
     default:
@@ -296,36 +535,10 @@ void ssh_agent_received_packet(SshCrossPacketType type,
 
 void ssh_agent_received_eof(void *context)
 {
-  SshAgent agent = (SshAgent)context;
+  SshAgentConnection conn = (SshAgentConnection)context;
 
-  ssh_cancel_timeouts(ssh_agent_timeout, (void *)agent);
-  
-  switch (agent->state)
-    {
-    case SSH_AC_IDLE:
-      break;
-    case SSH_AC_WAITING_SUCCESS:
-      if (agent->completion_callback)
-        (*agent->completion_callback)(SSH_AGENT_ERROR_FAILURE, agent->context);
-      break;
-    case SSH_AC_WAITING_LIST:
-      if (agent->list_callback)
-        (*agent->list_callback)(SSH_AGENT_ERROR_FAILURE, 0, NULL,
-                                agent->context);
-      break;
-    case SSH_AC_WAITING_OPERATION_COMPLETE:
-      if (agent->op_callback)
-        (*agent->op_callback)(SSH_AGENT_ERROR_FAILURE, NULL, 0,
-                              agent->context);
-      break;
-    case SSH_AC_WAITING_VERSION:
-      if (agent->open_callback)
-        (*agent->open_callback)(NULL, agent->context);
-      ssh_agent_close(agent);
-      break;
-    default:
-      ssh_debug("ssh_agent_received_eof: bad state %d", (int)agent->state);
-    }
+  if (!conn->lost)
+    ssh_agent_connection_lost(conn, SSH_AGENT_ERROR_FAILURE);
 }
 
 /* Checks whether the authentication agent is present.  Returns TRUE if yes.
@@ -339,51 +552,37 @@ Boolean ssh_agent_present()
           (getenv(SSH_AA_VAR) != NULL));
 }
 
-typedef struct SshAgentOpenContextRec {
-  SshAgentOpenCallback callback;
-  void *context;
-} *SshAgentOpenContext;
-
 /* Called when connecting to the agent socket completes. */
 
 void ssh_agent_open_complete(SshStream stream, void *context)
 {
-  SshAgentOpenContext c = (SshAgentOpenContext)context;
-  SshAgent agent;
+  SshAgentConnection conn = (SshAgentConnection)context;
 
-  /* If failed to connect, simply return. */
+  /* If failed to connect, tell everybody waiting. */
   if (stream == NULL)
     {
-      (*c->callback)(NULL, c->context);
-      ssh_xfree(c);
+      ssh_agent_connection_lost(conn, SSH_AGENT_ERROR_FAILURE);
       return;
     }
 
-  /* Initialize the agent connection object. */
-  agent = ssh_xcalloc(1, sizeof(*agent));
-  agent->down = ssh_cross_down_create(stream,
-                                      ssh_agent_received_packet,
-                                      ssh_agent_received_eof,
-                                      NULL,
-                                      (void *)agent);
-  ssh_cross_down_can_receive(agent->down, TRUE);
-
-  /* Prepare to send version request. */
-  agent->state = SSH_AC_WAITING_VERSION;
-  agent->open_callback = c->callback;
-  agent->context = c->context;
-  ssh_xfree(c);
+  conn->down = ssh_cross_down_create(stream,
+                                     ssh_agent_received_packet,
+                                     ssh_agent_received_eof,
+                                     NULL,
+                                     (void *)conn);
+  ssh_cross_down_can_receive(conn->down, TRUE);
+
   ssh_register_timeout(SSH_AGENT_TIMEOUT, 0L,
-                       ssh_agent_timeout, (void *)agent);
+                       ssh_agent_timeout, (void *)conn);
 
   /* Send a version request message. */
-  ssh_cross_down_send_encode(agent->down,
+  ssh_cross_down_send_encode(conn->down,
                              (SshCrossPacketType)SSH_AGENT_REQUEST_VERSION,
                              SSH_FORMAT_UINT32_STR,
                              SSH2_VERSION_STRING, strlen(SSH2_VERSION_STRING),
                              SSH_FORMAT_END);
 
-  /* The callback will be called when a version number has been received
+  /* The callbacks will be called when a version number has been received
      or the request times out. */
 }
 
@@ -392,15 +591,38 @@ void ssh_agent_open_complete(SshStream stream, void *context)
 
 void ssh_agent_open(SshAgentOpenCallback callback, void *context)
 {
-  SshAgentOpenContext c;
+  SshAgentConnection conn;
+  SshAgent agent;
+  Boolean connect;
 
-  /* Prepare the context structure. */
-  c = ssh_xmalloc(sizeof(*c));
-  c->callback = callback;
-  c->context = context;
+  conn = ssh_agent_sharing ? ssh_agent_shared : NULL;
+  connect = (conn == NULL);
+  if (connect)
+    {
+      conn = ssh_xcalloc(1, sizeof(*conn));
+      conn->state = SSH_AC_WAITING_VERSION;
+      if (ssh_agent_sharing)
+        ssh_agent_shared = conn;
+    }
+
+  agent = ssh_xcalloc(1, sizeof(*agent));
+  agent->connection = conn;
+  agent->next = conn->handles;
+  conn->handles = agent;
+
+  /* A shared connection may already be open. */
+  if (conn->state != SSH_AC_WAITING_VERSION)
+    {
+      (*callback)(agent, context);
+      return;
+    }
+
+  agent->open_callback = callback;
+  agent->open_context = context;
 
   /* Connect to the agent socket. */
-  ssh_agenti_connect(ssh_agent_open_complete, FALSE, (void *)c);
+  if (connect)
+    ssh_agenti_connect(ssh_agent_open_complete, FALSE, (void *)conn);
 }
 
 /* Closes the connection to the authentication agent.  If a command is
@@ -408,10 +630,55 @@ void ssh_agent_open(SshAgentOpenCallback callback, void *context)
 
 void ssh_agent_close(SshAgent agent)
 {
-  ssh_cross_down_destroy(agent->down);
-  ssh_cancel_timeouts(ssh_agent_timeout, (void *)agent);
+  SshAgentConnection conn = agent->connection;
+  SshAgent *agentp;
+  SshAgentRequest req, *reqp;
+
+  for (agentp = &conn->handles; *agentp; agentp = &(*agentp)->next)
+    if (*agentp == agent)
+      {
+        *agentp = agent->next;
+        break;
+      }
+
+  /* The reply to a request in progress still has to be read, but nobody
+     gets it. */
+  if (conn->current && conn->current->agent == agent)
+    {
+      conn->current->agent = NULL;
+      conn->current->completion_callback = NULL;
+      conn->current->list_callback = NULL;
+      conn->current->op_callback = NULL;
+    }
+  for (reqp = &conn->queue; *reqp; )
+    if ((*reqp)->agent == agent)
+      {
+        req = *reqp;
+        *reqp = req->next;
+        ssh_xfree(req->data);
+        ssh_xfree(req);
+      }
+    else
+      reqp = &(*reqp)->next;
+
   memset(agent, 'F', sizeof(*agent));
   ssh_xfree(agent);
+  ssh_agent_connection_check_free(conn);
+}
+
+/* Makes ssh_agent_open share one connection to the agent. */
+
+void ssh_agent_share_connection(Boolean share)
+{
+  SshAgentConnection conn;
+
+  ssh_agent_sharing = share;
+  if (!share && ssh_agent_shared)
+    {
+      conn = ssh_agent_shared;
+      ssh_agent_shared = NULL;
+      ssh_agent_connection_check_free(conn);
+    }
 }
 
 void ssh_agent_init_key_attrs(SshAgentKeyAttrs attrs)
@@ -438,14 +705,6 @@ void ssh_agent_add_generic(SshAgent agent,
   SshRandomState dummy_random_state;
   SshBuffer buffer;
 
-  if (agent->state != SSH_AC_IDLE)
-    {
-      ssh_debug("ssh_agent_add: busy");
-      if (callback)
-        (*callback)(SSH_AGENT_ERROR_BUSY, context);
-      return;
-    }
-  
   /* Allocate a dummy random state.  This is needed to export a private
      key.  However, we export without encryption, so it doesn't matter
      whether the random state is initialized.  For that reason, we don't
@@ -472,23 +731,17 @@ void ssh_agent_add_generic(SshAgent agent,
       blob_len = 0;
     }
 
-  /* Prepare to send the request. */
-  ssh_register_timeout(SSH_AGENT_TIMEOUT, 0L,
-                       ssh_agent_timeout, (void *)agent);
-  agent->state = SSH_AC_WAITING_SUCCESS;
-  agent->completion_callback = callback;
-  agent->context = context;
-  
   /* Send the request. */
   if (attrs == NULL)
     {
-      ssh_cross_down_send_encode(agent->down,
-                                 (SshCrossPacketType)SSH_AGENT_ADD_KEY,
-                                 SSH_FORMAT_UINT32_STR, blob, blob_len,
-                                 SSH_FORMAT_UINT32_STR, certs, certs_len,
-                                 SSH_FORMAT_UINT32_STR,
-                                 description, strlen(description),
-                                 SSH_FORMAT_END);
+      ssh_agent_request(agent, SSH_AC_WAITING_SUCCESS,
+                        (SshCrossPacketType)SSH_AGENT_ADD_KEY,
+                        callback, NULL, NULL, context,
+                        SSH_FORMAT_UINT32_STR, blob, blob_len,
+                        SSH_FORMAT_UINT32_STR, certs, certs_len,
+                        SSH_FORMAT_UINT32_STR,
+                        description, strlen(description),
+                        SSH_FORMAT_END);
     }
   else
     {
@@ -524,16 +777,17 @@ void ssh_agent_add_generic(SshAgent agent,
                         (unsigned int)SSH_AGENT_CONSTRAINT_COMPAT,
                         SSH_FORMAT_BOOLEAN, attrs->compat_allowed,
                         SSH_FORMAT_END);
-      ssh_cross_down_send_encode(agent->down,
-                                 (SshCrossPacketType)SSH_AGENT_ADD_KEY,
-                                 SSH_FORMAT_UINT32_STR, blob, blob_len,
-                                 SSH_FORMAT_UINT32_STR, certs, certs_len,
-                                 SSH_FORMAT_UINT32_STR,
-                                 description, strlen(description),
-                                 SSH_FORMAT_DATA,
-                                 ssh_buffer_ptr(&buffer),
-                                 ssh_buffer_len(&buffer),
-                                 SSH_FORMAT_END);
+      ssh_agent_request(agent, SSH_AC_WAITING_SUCCESS,
+                        (SshCrossPacketType)SSH_AGENT_ADD_KEY,
+                        callback, NULL, NULL, context,
+                        SSH_FORMAT_UINT32_STR, blob, blob_len,
+                        SSH_FORMAT_UINT32_STR, certs, certs_len,
+                        SSH_FORMAT_UINT32_STR,
+                        description, strlen(description),
+                        SSH_FORMAT_DATA,
+                        ssh_buffer_ptr(&buffer),
+                        ssh_buffer_len(&buffer),
+                        SSH_FORMAT_END);
       ssh_buffer_uninit(&buffer);
     }
 
@@ -572,7 +826,7 @@ void ssh_agent_add_with_attrs(SshAgent agent,
 {
   struct SshAgentKeyAttrsRec attrs;
   
-  if (agent->broken_agent)
+  if (agent->connection->broken_agent)
     {
       ssh_debug("ssh_agent_add: remote agent broken");
       if (callback)
@@ -594,25 +848,11 @@ void ssh_agent_add_with_attrs(SshAgent agent,
 void ssh_agent_delete_all(SshAgent agent, SshAgentCompletion callback,
                           void *context)
 {
-  if (agent->state != SSH_AC_IDLE)
-    {
-      ssh_debug("ssh_agent_delete_all: busy");
-      if (callback)
-        (*callback)(SSH_AGENT_ERROR_BUSY, context);
-      return;
-    }
-
-  /* Prepare to send the request. */
-  ssh_register_timeout(SSH_AGENT_TIMEOUT, 0L,
-                       ssh_agent_timeout, (void *)agent);
-  agent->state = SSH_AC_WAITING_SUCCESS;
-  agent->completion_callback = callback;
-  agent->context = context;
-
   /* Send the request. */
-  ssh_cross_down_send_encode(agent->down,
-                             (SshCrossPacketType)SSH_AGENT_DELETE_ALL_KEYS,
-                             SSH_FORMAT_END);
+  ssh_agent_request(agent, SSH_AC_WAITING_SUCCESS,
+                    (SshCrossPacketType)SSH_AGENT_DELETE_ALL_KEYS,
+                    callback, NULL, NULL, context,
+                    SSH_FORMAT_END);
 }
 
 /* Deletes the given key from the agent. */
@@ -621,62 +861,34 @@ void ssh_agent_delete(SshAgent agent,
                       const char *description,
                       SshAgentCompletion callback, void *context)
 {
-  if (agent->state != SSH_AC_IDLE)
-    {
-      ssh_debug("ssh_agent_delete: busy");
-      if (callback)
-        (*callback)(SSH_AGENT_ERROR_BUSY, context);
-      return;
-    }
-
-  /* Prepare to send the request. */
-  ssh_register_timeout(SSH_AGENT_TIMEOUT, 0L,
-                       ssh_agent_timeout, (void *)agent);
-  agent->state = SSH_AC_WAITING_SUCCESS;
-  agent->completion_callback = callback;
-  agent->context = context;
-
   /* Send the request. */
-  ssh_cross_down_send_encode(agent->down,
-                             (SshCrossPacketType)SSH_AGENT_DELETE_KEY,
-                             SSH_FORMAT_UINT32_STR, certs, certs_len,
-                             SSH_FORMAT_UINT32_STR, description, 
-                             (description ? strlen(description) : 0),
-                             SSH_FORMAT_END);
+  ssh_agent_request(agent, SSH_AC_WAITING_SUCCESS,
+                    (SshCrossPacketType)SSH_AGENT_DELETE_KEY,
+                    callback, NULL, NULL, context,
+                    SSH_FORMAT_UINT32_STR, certs, certs_len,
+                    SSH_FORMAT_UINT32_STR, description, 
+                    (description ? strlen(description) : 0),
+                    SSH_FORMAT_END);
 }
 
 /* Returns the public keys for all private keys in possession of the agent.
-   Only a single operation may be in progress on the connection at any
-   one time. */
+   Requests made while an earlier one is in progress are sent
+   once it is complete. */
 
 void ssh_agent_list(SshAgent agent, SshAgentListCallback callback,
                     void *context)
 {
-  if (agent->state != SSH_AC_IDLE)
-    {
-      ssh_debug("ssh_agent_list: busy");
-      if (callback)
-        (*callback)(SSH_AGENT_ERROR_BUSY, 0, NULL, context);
-      return;
-    }
-  
-  /* Prepare to send the request. */
-  ssh_register_timeout(SSH_AGENT_TIMEOUT, 0L,
-                       ssh_agent_timeout, (void *)agent);
-  agent->state = SSH_AC_WAITING_LIST;
-  agent->list_callback = callback;
-  agent->context = context;
-
   /* Send the request. */
-  ssh_cross_down_send_encode(agent->down,
-                             (SshCrossPacketType)SSH_AGENT_LIST_KEYS,
-                             SSH_FORMAT_END);
+  ssh_agent_request(agent, SSH_AC_WAITING_LIST,
+                    (SshCrossPacketType)SSH_AGENT_LIST_KEYS,
+                    NULL, callback, NULL, context,
+                    SSH_FORMAT_END);
 }
 
 /* Performs a private-key operation using the agent.  Calls the given
    callback when a reply has been received or a timeout occurs.
-   Only a single operation may be in progress on the connection at any
-   one time. */
+   Requests made while an earlier one is in progress are sent
+   once it is complete. */
 
 void ssh_agent_op(SshAgent agent, SshAgentOp op,
                   const unsigned char *certs, size_t certs_len,
@@ -685,14 +897,6 @@ void ssh_agent_op(SshAgent agent, SshAgentOp op,
 {
   const char *name;
 
-  if (agent->state != SSH_AC_IDLE)
-    {
-      ssh_debug("ssh_agent_op: busy");
-      if (callback)
-        (*callback)(SSH_AGENT_ERROR_BUSY, NULL, 0, context);
-      return;
-    }
-
   switch (op)
     {
     case SSH_AGENT_SIGN:
@@ -712,20 +916,14 @@ void ssh_agent_op(SshAgent agent, SshAgentOp op,
       return;
     }
 
-  /* Prepare to send request. */
-  ssh_register_timeout(SSH_AGENT_TIMEOUT, 0L,
-                       ssh_agent_timeout, (void *)agent);
-  agent->state = SSH_AC_WAITING_OPERATION_COMPLETE;
-  agent->op_callback = callback;
-  agent->context = context;
-
   /* Send the request packet. */
-  ssh_cross_down_send_encode(agent->down,
-                             (SshCrossPacketType)SSH_AGENT_PRIVATE_KEY_OP,
-                             SSH_FORMAT_UINT32_STR, name, strlen(name),
-                             SSH_FORMAT_UINT32_STR, certs, certs_len,
-                             SSH_FORMAT_UINT32_STR, data, len,
-                             SSH_FORMAT_END);
+  ssh_agent_request(agent, SSH_AC_WAITING_OPERATION_COMPLETE,
+                    (SshCrossPacketType)SSH_AGENT_PRIVATE_KEY_OP,
+                    NULL, NULL, callback, context,
+                    SSH_FORMAT_UINT32_STR, name, strlen(name),
+                    SSH_FORMAT_UINT32_STR, certs, certs_len,
+                    SSH_FORMAT_UINT32_STR, data, len,
+                    SSH_FORMAT_END);
 }
 
 
@@ -733,52 +931,24 @@ void ssh_agent_op(SshAgent agent, SshAgentOp op,
 void ssh_agent_lock(SshAgent agent, const char *password,
                     SshAgentCompletion callback, void *context)
 {
-  if (agent->state != SSH_AC_IDLE)
-    {
-      ssh_debug("ssh_agent_lock: busy");
-      if (callback)
-        (*callback)(SSH_AGENT_ERROR_BUSY, context);
-      return;
-    }
-
-  /* Prepare to send the request. */
-  ssh_register_timeout(SSH_AGENT_TIMEOUT, 0L,
-                       ssh_agent_timeout, (void *)agent);
-  agent->state = SSH_AC_WAITING_SUCCESS;
-  agent->completion_callback = callback;
-  agent->context = context;
-
   /* Send the request. */
-  ssh_cross_down_send_encode(agent->down,
-                             (SshCrossPacketType)SSH_AGENT_LOCK,
-                             SSH_FORMAT_UINT32_STR, 
-                             password, (password ? strlen(password) : 0),
-                             SSH_FORMAT_END);
+  ssh_agent_request(agent, SSH_AC_WAITING_SUCCESS,
+                    (SshCrossPacketType)SSH_AGENT_LOCK,
+                    callback, NULL, NULL, context,
+                    SSH_FORMAT_UINT32_STR, 
+                    password, (password ? strlen(password) : 0),
+                    SSH_FORMAT_END);
 }
 
 /* Attempts to unlock the agent with given password */
 void ssh_agent_unlock(SshAgent agent, const char *password,
                       SshAgentCompletion callback, void *context)
 {
-  if (agent->state != SSH_AC_IDLE)
-    {
-      ssh_debug("ssh_agent_unlock: busy");
-      if (callback)
-        (*callback)(SSH_AGENT_ERROR_BUSY, context);
-      return;
-    }
-
-  /* Prepare to send the request. */
-  ssh_register_timeout(SSH_AGENT_TIMEOUT, 0L,
-                       ssh_agent_timeout, (void *)agent);
-  agent->state = SSH_AC_WAITING_SUCCESS;
-  agent->completion_callback = callback;
-  agent->context = context;
-
   /* Send the request. */
-  ssh_cross_down_send_encode(agent->down,
-                             (SshCrossPacketType)SSH_AGENT_UNLOCK,
-                             SSH_FORMAT_UINT32_STR, 
-                             password, (password ? strlen(password) : 0),
-                             SSH_FORMAT_END);
+  ssh_agent_request(agent, SSH_AC_WAITING_SUCCESS,
+                    (SshCrossPacketType)SSH_AGENT_UNLOCK,
+                    callback, NULL, NULL, context,
+                    SSH_FORMAT_UINT32_STR, 
+                    password, (password ? strlen(password) : 0),
+                    SSH_FORMAT_END);
 }
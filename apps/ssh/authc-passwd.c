@@ -47,6 +47,12 @@ void ssh_client_auth_passwd(SshAuthClientOperation op,
   switch (op)
     {
     case SSH_AUTH_CLIENT_OP_START:
+      /* In batch mode there is nobody to ask. */
+      if (clientconf->batch_mode)
+        {
+          (*completion)(SSH_AUTH_CLIENT_FAIL, user, NULL, completion_context);
+          break;
+        }
       if (clientconf->password_prompt == NULL)
         snprintf(buf, sizeof(buf), "%s's password: ", user);
       else
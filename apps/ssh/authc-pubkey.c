@@ -229,6 +229,7 @@ void ssh_client_auth_pubkey_sign_complete(SshAgentError error,
 SshPrivateKey ssh_authc_pubkey_privkey_read(SshUser user,
                                             const char *fname,
                                             const char *passphrase,
+                                            Boolean batch_mode,
                                             char **comment)
 {
   SshPrivateKey privkey;
@@ -246,6 +247,10 @@ SshPrivateKey ssh_authc_pubkey_privkey_read(SshUser user,
   if (privkey != NULL)
     return privkey;
 
+  /* In batch mode there is nobody to ask. */
+  if (batch_mode)
+    return NULL;
+
   snprintf(buf, sizeof (buf),
            "Passphrase for key \"%s\"%s%s%s",
            fname,
@@ -271,6 +276,7 @@ SshPrivateKey ssh_authc_pubkey_privkey_read(SshUser user,
 SshPrivateKey ssh_authc_pubkey_pgpprivkey_import(unsigned char *blob,
                                                  size_t blob_len,
                                                  const char *passphrase,
+                                                 Boolean batch_mode,
                                                  const char *comment)
 {
   SshPgpSecretKey pgpkey;
@@ -306,6 +312,8 @@ SshPrivateKey ssh_authc_pubkey_pgpprivkey_import(unsigned char *blob,
     {
       ssh_pgp_secret_key_free(pgpkey);
     }
+  if (batch_mode)
+    return NULL;
   snprintf(buf, sizeof (buf),
            "Passphrase for pgp key%s%s%s: ",
            comment ? " \"" : "",
@@ -449,6 +457,8 @@ Boolean ssh_client_auth_pubkey_send_signature(SshClientPubkeyAuth state,
           privkey = ssh_authc_pubkey_privkey_read(state->client->user_data,
                                                   c->privkeyfile,
                                                   NULL,
+                                                  state->client->config->
+                                                  batch_mode,
                                                   &key_comment);
           ssh_xfree(key_comment);
           break;
@@ -460,6 +470,8 @@ Boolean ssh_client_auth_pubkey_send_signature(SshClientPubkeyAuth state,
           privkey = ssh_authc_pubkey_pgpprivkey_import(c->pgp_seckey,
                                                        c->pgp_seckey_len,
                                                        NULL,
+                                                       state->client->config->
+                                                       batch_mode,
                                                        c->pgp_keyname);
           break;
 #endif /* WITH_PGP */
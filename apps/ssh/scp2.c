@@ -29,6 +29,9 @@
 #include "sshgetopt.h"
 #include "sshtimemeasure.h"
 #include "sshmatch.h"
+#include "sshcrypt.h"
+#include "namelist.h"
+#include "sshcrc32.h"
 
 #define SSH_DEBUG_MODULE "Scp2"
 
@@ -37,8 +40,41 @@
 #define SCP_FILESERVER_TIMEOUT          300      /*XXX*/
 #define SCP_BUF_SIZE                    0x8000
 #define SCP_READ_MAX                    0x8000
-#define SCP_WRITE_MAX                   0x8000
-#define SCP_BUF_SIZE_MAX                0x40000
+/* Limits for the number of reads and writes kept in flight while
+   copying a file. */
+#define SCP_REQUESTS_INITIAL            4
+#define SCP_REQUESTS_MAX                64
+/* When the server copies a file itself, the size of each copy-data
+   request and the number of them kept in flight. */
+#define SCP_COPY_DATA_MAX               0x100000
+#define SCP_COPY_DATA_REQUESTS          4
+/* When skipping the holes of a sparse file, the amount asked for with
+   each data-extents request. */
+#define SCP_EXTENTS_RANGE               0x4000000
+/* When verifying copies, the hash functions tried in order of
+   preference, the size of the blocks hashed, and the amount asked for
+   with each block-hash request. */
+#define SCP_VERIFY_HASHES               "sha1,md5"
+#define SCP_VERIFY_BLOCK_SIZE           0x100000
+#define SCP_VERIFY_RANGE                0x4000000
+/* When copying over an old copy of a file with -s, the hash functions
+   tried in order of preference, the limits for the size of the blocks
+   compared and for their number, the amount asked for with each
+   block-signatures request and the number of those kept in flight,
+   how far the source is read ahead, the largest write of new data,
+   and the number of blocks with the same CRC tried at one position. */
+#define SCP_DELTA_HASHES                "md5,sha1"
+#define SCP_DELTA_BLOCK_MIN             0x800
+#define SCP_DELTA_BLOCK_MAX             0x20000
+#define SCP_DELTA_BLOCKS_MAX            0x100000
+#define SCP_DELTA_RANGE                 0x1000000
+#define SCP_DELTA_SIGNATURE_REQUESTS    4
+#define SCP_DELTA_READ_AHEAD            0x100000
+#define SCP_DELTA_LITERAL_MAX           0x8000
+#define SCP_DELTA_CANDIDATES            64
+/* Number of files copied at a time, unless told otherwise with -j. */
+#define SCP_FILES_DEFAULT               8
+#define SCP_FILES_MAX                   64
 #define SCP_ERROR_MULTIPLE              -1
 #define SCP_ERROR_USAGE                 1
 #define SCP_ERROR_NOT_REGULAR_FILE      2
@@ -47,6 +83,7 @@
 #define SCP_ERROR_CANNOT_OPEN           5
 #define SCP_ERROR_READ_ERROR            6
 #define SCP_ERROR_WRITE_ERROR           7
+#define SCP_ERROR_VERIFY_FAILED         8
 
 #ifdef HAVE_LIBWRAP
 int allow_severity = SSH_LOG_INFORMATIONAL;
@@ -87,6 +124,12 @@ typedef struct ScpSessionRec {
   Boolean preserve_flag;
   /* Whether directories will be copied recursively */
   Boolean recurse_flag;
+  /* If TRUE, copies are compared with their sources by hashing both
+     on their servers. */
+  Boolean verify_flag;
+  /* If TRUE, a file that already exists at the destination is
+     brought up to date by sending only what differs. */
+  Boolean delta_flag;
   /* If TRUE, source files will be unlinked (removed) after
      copying. */
   Boolean unlink_flag;
@@ -144,29 +187,124 @@ typedef struct ScpSessionRec {
   Boolean callback_fired;
   /* This will contain the error that scp2 will return with. */
   int error;
+  /* Number of reads and writes kept in flight while copying, or 0 to
+     size it from the round trip times. */
+  int max_requests;
+  /* Number of files copied at the same time, and the number being
+     copied now. */
+  int max_files;
+  int transfers_active;
+  /* TRUE while scp_wait_transfers() runs the event loop and wants it
+     aborted when a file is done. */
+  Boolean transfers_waiting;
 } *ScpSession;
 
 typedef enum {
   SCP_FC_ERROR,
   SCP_FC_TIMEOUT,
   SCP_FC_RUNNING,
-  SCP_FC_BUFFER_FULL,
-  SCP_FC_READ_COMPLETE,
   SCP_FC_COMPLETE
 } ScpFileCopyState;
 
-typedef struct ScpFileCopyContextRec {
+typedef struct ScpFileCopyContextRec *ScpFileCopyContext;
+
+/* A block of the file being copied; first read, then written. */
+typedef struct ScpFileCopyBlockRec {
+  ScpFileCopyContext fc;
+  struct ScpFileCopyBlockRec *next;
+  off_t offset;
+  size_t len;
+  unsigned char *data;
+  /* When the request for the block was sent, in microseconds. */
+  SshUInt64 sent;
+} *ScpFileCopyBlock;
+
+struct ScpFileCopyContextRec {
   ScpSession session;
-  SshBuffer buffer;
   ScpFileCopyState state;
   SshFileHandle src_handle;
   SshFileHandle dst_handle;
+  Boolean src_is_remote;
+  Boolean dst_is_remote;
+  /* TRUE if the server copies the data with copy-data requests; the
+     blocks then only tell the ranges, and hold no data. */
+  Boolean server_copy;
   off_t file_size;
   off_t read_offset;
-  off_t write_offset;
-  size_t write_pending;
+  off_t bytes_written;
+  int reads_pending;
+  int writes_pending;
+  /* TRUE if the holes of the source are skipped.  The data extents
+     not yet passed are kept as pairs of offset and length, from
+     `first_extent' on; they are known up to `extents_end'.  The holes
+     count as written, and the size of the destination is set at the
+     end, as the destination starts out empty. */
+  Boolean sparse;
+  off_t *extents;
+  int first_extent;
+  int num_extents;
+  off_t extents_end;
+  Boolean extents_pending;
+  Boolean extents_calling;
+  off_t hole_bytes;
+  /* Blocks whose write has completed, for reuse. */
+  ScpFileCopyBlock free_blocks;
+  /* Number of reads kept in flight, and whether it is adjusted from
+     the round trip times. */
+  int window;
+  Boolean auto_window;
+  SshTimeMeasure timer;
+  SshUInt64 read_rtt_min;
+  SshUInt64 write_rtt_min;
+  /* TRUE if a request has completed since the timeout was
+     registered. */
+  Boolean progressed;
+  /* Whether the progress bar is drawn, and how wide it is. */
+  Boolean show_progress;
   int term_width;
-} *ScpFileCopyContext;
+  /* Called once the copy has completed or failed. */
+  void (*done)(Boolean ok, void *context);
+  void *done_context;
+};
+
+/* A file being copied.  All the file operations are made
+   asynchronously, so that the round trips for opening, stat'ing and
+   closing one file overlap with those of the others. */
+typedef struct ScpTransferRec {
+  ScpSession session;
+  char *src_host;
+  char *src_file;
+  SshFileClient src_client;
+  char *dst_host;
+  char *dst_file;
+  SshFileClient dst_client;
+  SshFileHandle src_handle;
+  SshFileHandle dst_handle;
+  SshFileAttributes src_attributes;
+  off_t file_len;
+  /* TRUE if this is the only file being copied, and it may print its
+     progress bar; otherwise everything about the file is printed at
+     once when it is done. */
+  Boolean show_progress;
+  int width;
+  SshTimeMeasure timer;
+  /* When verifying the copy: the hash function used, the length of its
+     digests, how far the files have been compared, and the reply of
+     the side that answered first. */
+  char *verify_hash;
+  size_t verify_digest_len;
+  off_t verify_offset;
+  int verify_replies;
+  SshFileClientError verify_error;
+  unsigned char *verify_digests;
+  size_t verify_digests_len;
+  /* When copying over an old copy at the destination: the hash
+     function its blocks are compared with, and the number of bytes
+     that had to be sent once it is done. */
+  char *delta_hash;
+  Boolean delta_done;
+  off_t delta_sent;
+} *ScpTransfer;
 
 /********************************************************************
  * Function prototypes for internal functions.
@@ -181,6 +319,10 @@ SshFileClient scp_open_remote_connection(ScpSession session,
                                          char *host,
                                          char *user, 
                                          int port);
+SshFileClient scp_open_src_remote_connection(ScpSession session,
+                                             char *host,
+                                             char *user, 
+                                             int port);
 void scp_set_src_remote_location(ScpSession session, 
                                  char *host, 
                                  int port, 
@@ -257,13 +399,15 @@ int scp_file_write(ScpSession session,
                    off_t offset, 
                    char *buf, 
                    size_t bufsize);
-Boolean scp_move_file(ScpSession session,
-                      char *src_host,
-                      char *src_path,
-                      SshFileClient src_client, 
-                      char *dst_host,
-                      char *dst_path,
-                      SshFileClient dst_client);
+void scp_move_file(ScpSession session,
+                   char *src_host,
+                   char *src_path,
+                   SshFileClient src_client, 
+                   char *dst_host,
+                   char *dst_path,
+                   SshFileClient dst_client);
+void scp_wait_transfers(ScpSession session, int max_active);
+void scp_drop_src_remote_client(ScpSession session);
 void scp_set_next_src_location(void *context);
 void scp_timeout_callback(void *context);
 void scp_remote_dead_timeout(void *context);
@@ -341,7 +485,8 @@ int main(int argc, char **argv)
   ssh_debug_register_callbacks(NULL, scp_warning, scp_debug,
                                (void *)(&session));
 
-  while ((ch = ssh_getopt(argc, argv, "qQdpvnuhS:P:c:D:tf1rO", NULL)) != -1)
+  while ((ch = ssh_getopt(argc, argv, "qQdpksvnuhS:P:c:D:tf1rON:j:", NULL))
+         != -1)
     {
       if (!ssh_optval)
         {
@@ -395,6 +540,12 @@ int main(int argc, char **argv)
         case 'p':
           session.preserve_flag = TRUE;
           break;
+        case 'k':
+          session.verify_flag = TRUE;
+          break;
+        case 's':
+          session.delta_flag = TRUE;
+          break;
         case 'r':
           session.recurse_flag = TRUE;
           session.need_dst_dir = TRUE;
@@ -456,6 +607,18 @@ int main(int argc, char **argv)
         case 'O':
           session.use_ssh1 = TRUE;
           break;
+        case 'N':
+          session.max_requests = atoi(ssh_optarg);
+          if ((session.max_requests <= 0) ||
+              (session.max_requests > SCP_REQUESTS_MAX))
+            usage();
+          break;
+        case 'j':
+          session.max_files = atoi(ssh_optarg);
+          if ((session.max_files <= 0) ||
+              (session.max_files > SCP_FILES_MAX))
+            usage();
+          break;
         default:
           usage();
         }
@@ -557,10 +720,11 @@ int main(int argc, char **argv)
  */
 void usage()
 {
-  fprintf(stderr, "usage: scp [-D debug_level_spec] [-d] [-p] [-n] [-u] "
-                  "[-v] [-1]\n");
+  fprintf(stderr, "usage: scp [-D debug_level_spec] [-d] [-p] [-k] [-s] "
+                  "[-n] [-u] [-v] [-1]\n");
   fprintf(stderr, "           [-c cipher] [-S ssh2-path] [-h] "
-                  "[-P ssh2-port]\n");
+                  "[-P ssh2-port] [-N requests]\n");
+  fprintf(stderr, "           [-j files]\n");
   fprintf(stderr, "           [[user@]host[#port]:]file ...\n");
   fprintf(stderr, "           [[user@]host[#port]:]file_or_dir\n");
   fprintf(stderr, "\n");
@@ -571,6 +735,13 @@ void usage()
                   "progress indicator).\n");
   fprintf(stderr, "  -p                   Preserve file attributes and "
                   "timestamps.\n");
+  fprintf(stderr, "  -k                   Verify the copies by comparing "
+                  "hashes of them and\n");
+  fprintf(stderr, "                       their sources, made by the "
+                  "servers.\n");
+  fprintf(stderr, "  -s                   Only send what differs from "
+                  "the files already at a\n");
+  fprintf(stderr, "                       remote destination.\n");
   fprintf(stderr, "  -n                   Show what would've been done "
                   "without actually copying\n");
   fprintf(stderr, "                       any files.\n");
@@ -585,6 +756,12 @@ void usage()
   fprintf(stderr, "  -S ssh2-path         Tell scp2 where to find ssh2.\n");
   fprintf(stderr, "  -P ssh2-port         Tell scp2 which port sshd2 "
                   "listens on the remote machine.\n");
+  fprintf(stderr, "  -N requests          Keep this many reads and writes "
+                  "in flight (default: as\n");
+  fprintf(stderr, "                       many as the link takes, "
+                  "up to %d).\n", SCP_REQUESTS_MAX);
+  fprintf(stderr, "  -j files             Copy this many files at a time "
+                  "(default: %d).\n", SCP_FILES_DEFAULT);
   fprintf(stderr, "  -h                   Display this help.\n");
   fprintf(stderr, "\n");
   exit(SCP_ERROR_USAGE);
@@ -599,6 +776,8 @@ void scp_init_session(ScpSession session)
   session->debug_flag = NULL;
   session->preserve_flag = FALSE;
   session->recurse_flag = FALSE;
+  session->verify_flag = FALSE;
+  session->delta_flag = FALSE;
   session->unlink_flag = FALSE;
   session->child_pid = 0;
   session->port = 0;
@@ -640,6 +819,10 @@ void scp_init_session(ScpSession session)
   session->tmp_data_len = 0;
   session->callback_fired = FALSE;
   session->error = 0;
+  session->max_requests = 0;
+  session->max_files = SCP_FILES_DEFAULT;
+  session->transfers_active = 0;
+  session->transfers_waiting = FALSE;
   
   return;
 }
@@ -689,6 +872,8 @@ void scp_print_session_info(ScpSession session)
           
   fprintf(stderr, "  verbose            = %d\n", session->verbose);
   fprintf(stderr, "  preserve_flag      = %d\n", session->preserve_flag);
+  fprintf(stderr, "  verify_flag        = %d\n", session->verify_flag);
+  fprintf(stderr, "  delta_flag         = %d\n", session->delta_flag);
   fprintf(stderr, "  port               = %d\n", session->port);
   fprintf(stderr, "  need_dst_dir       = %d\n", session->need_dst_dir);
   fprintf(stderr, "  dst_is_dir         = %d\n", session->dst_is_dir);
@@ -1388,6 +1573,30 @@ SshFileClient scp_open_remote_connection(ScpSession session,
   return NULL;
 }
 
+/*
+ * Opens the connection to a remote source.  A source on the same
+ * server as the destination uses the connection of the destination,
+ * so that the server can copy the files by itself.
+ */
+SshFileClient scp_open_src_remote_connection(ScpSession session,
+                                             char *host,
+                                             char *user, 
+                                             int port)
+{
+  ScpFileLocation dst = session->dst_location;
+
+  if (!session->dst_is_local && session->dst_remote_client != NULL &&
+      strcmp(dst->host, host) == 0 && dst->port == port &&
+      ((dst->user == NULL && user == NULL) ||
+       (dst->user != NULL && user != NULL && strcmp(dst->user, user) == 0)))
+    {
+      SSH_DEBUG(4, ("Source %s is on the destination server.", host));
+      return session->dst_remote_client;
+    }
+
+  return scp_open_remote_connection(session, host, user, port);
+}
+
 /*
  * Copies information about a remote connection to be
  * used in connecting.
@@ -1493,16 +1702,12 @@ void scp_set_next_src_location(void *context)
                                              session->src_list->user))
         {
           
-          if (session->src_remote_client != NULL)
-            {
-              ssh_file_client_destroy(session->src_remote_client);
-              session->src_remote_client = NULL;
-            }
+          scp_drop_src_remote_client(session);
           session->src_remote_client =
-            scp_open_remote_connection(session,
-                                       session->src_list->host, 
-                                       session->src_list->user,
-                                       session->src_list->port);
+            scp_open_src_remote_connection(session,
+                                           session->src_list->host, 
+                                           session->src_list->user,
+                                           session->src_list->port);
           scp_set_src_remote_location(session, 
                                       session->src_list->host,
                                       session->src_list->port,
@@ -1571,17 +1776,13 @@ void scp_set_next_src_location(void *context)
                                                  session->src_list->port,
                                                  session->src_list->user))
             {
-              if (session->src_remote_client != NULL)
-                {
-                  ssh_file_client_destroy(session->src_remote_client);
-                  session->src_remote_client = NULL;
-                }
+              scp_drop_src_remote_client(session);
 
               session->src_remote_client =
-                scp_open_remote_connection(session,
-                                           session->src_list->host, 
-                                           session->src_list->user,
-                                           session->src_list->port);
+                scp_open_src_remote_connection(session,
+                                               session->src_list->host, 
+                                               session->src_list->user,
+                                               session->src_list->port);
               scp_set_src_remote_location(session, 
                                           session->src_list->host,
                                           session->src_list->port,
@@ -1675,11 +1876,7 @@ void scp_set_next_src_location(void *context)
   if (session->src_list == NULL)
     {
       session->src_list_tail = NULL;    
-      if (session->src_remote_client != NULL)
-        {
-          ssh_file_client_destroy(session->src_remote_client);
-          session->src_remote_client = NULL;
-        }
+      scp_drop_src_remote_client(session);
       return;
     }
   
@@ -1769,16 +1966,12 @@ void scp_set_next_src_location(void *context)
                                           session->
                                           current_src_location->user)))
     {
-      if (session->src_remote_client != NULL)
-        {
-          ssh_file_client_destroy(session->src_remote_client);
-          session->src_remote_client = NULL;
-        }
+      scp_drop_src_remote_client(session);
       session->src_remote_client =
-        scp_open_remote_connection(session,
-                                   session->current_src_location->host, 
-                                   session->current_src_location->user,
-                                   session->current_src_location->port);
+        scp_open_src_remote_connection(session,
+                                       session->current_src_location->host, 
+                                       session->current_src_location->user,
+                                       session->current_src_location->port);
       scp_set_src_remote_location(session, 
                                   session->current_src_location->host,
                                   session->current_src_location->port,
@@ -2283,7 +2476,16 @@ Boolean scp_file_mkdir(ScpSession session, SshFileClient client,
 
 /*
  * For performance reasons the actual file data copy is done
- * asynchronously with concurrent read and write operations.
+ * asynchronously, with several reads and writes in flight at once.
+ * Each block of the file is read into a buffer of its own and written
+ * at its own offset as soon as it arrives, so the order in which the
+ * replies come back does not matter.
+ *
+ * Unless given with -N, the number of requests kept in flight is sized
+ * from the round trip times of the requests to the remote side: while
+ * the replies come back about as fast as the quickest one did, the
+ * link is not full and more requests are sent; when they start to
+ * queue up, fewer.
  */
 void scp_copy_file_write_callback(SshFileClientError error, void *context);
 void scp_copy_file_read_callback(SshFileClientError error,
@@ -2291,11 +2493,200 @@ void scp_copy_file_read_callback(SshFileClientError error,
                                  size_t len,
                                  void *context);
 void scp_copy_file_timeout(void *context);
-Boolean scp_copy_file(ScpSession session,
-                      SshFileHandle src_handle,
-                      SshFileHandle dst_handle,
-                      off_t file_size,
-                      int width);
+void scp_copy_file_start(ScpSession session,
+                         SshFileHandle src_handle,
+                         SshFileHandle dst_handle,
+                         Boolean src_is_remote,
+                         Boolean dst_is_remote,
+                         Boolean server_copy,
+                         Boolean sparse,
+                         off_t file_size,
+                         Boolean show_progress,
+                         int width,
+                         void (*done)(Boolean ok, void *context),
+                         void *done_context);
+
+/* Takes the round trip time of a request that has completed into
+   account, and adjusts the number of requests in flight. */
+
+void scp_copy_file_adjust(ScpFileCopyContext fc, SshUInt64 *rtt_min,
+                          SshUInt64 sent)
+{
+  SshUInt64 rtt;
+  unsigned long queued;
+
+  if (!fc->auto_window)
+    return;
+
+  rtt = ssh_time_measure_stamp(fc->timer, SSH_TIME_GRANULARITY_MICROSECOND) -
+    sent;
+  if (rtt == 0)
+    rtt = 1;
+  if (*rtt_min == 0 || rtt < *rtt_min)
+    *rtt_min = rtt;
+
+  /* Estimate of the requests waiting somewhere on the way rather than
+     being served: the throughput we would expect at the best round trip
+     time, less what we get. */
+  queued = (unsigned long)((fc->window * (rtt - *rtt_min)) / rtt);
+  if (queued < 1 && fc->window < SCP_REQUESTS_MAX)
+    fc->window++;
+  else if (queued > 3 && fc->window > 1)
+    fc->window--;
+  SSH_DEBUG(9, ("rtt %lu us, min %lu us, window %d",
+                (unsigned long)rtt, (unsigned long)*rtt_min, fc->window));
+}
+
+void scp_copy_file_extents_callback(SshFileClientError error,
+                                    const unsigned char *data,
+                                    size_t len,
+                                    void *context);
+
+/* Skips the hole at the read offset, if any, and stores the end of the
+   data that follows in `limit'.  Asks for more extents as the known
+   ones run out.  Returns FALSE if it is not known yet what is at the
+   read offset. */
+
+Boolean scp_copy_file_next_data(ScpFileCopyContext fc, off_t *limit)
+{
+  off_t *extent, hole_end;
+
+  for (;;)
+    {
+      while (fc->first_extent < fc->num_extents &&
+             (fc->extents[2 * fc->first_extent] +
+              fc->extents[2 * fc->first_extent + 1]) <= fc->read_offset)
+        fc->first_extent++;
+
+      /* Ask for the next extents while the last known one is being
+         read. */
+      if (!fc->extents_pending && fc->extents_end < fc->file_size &&
+          fc->num_extents - fc->first_extent <= 1)
+        {
+          fc->extents_pending = TRUE;
+          fc->extents_calling = TRUE;
+          ssh_file_client_data_extents(fc->src_handle, fc->extents_end,
+                                       SCP_EXTENTS_RANGE,
+                                       scp_copy_file_extents_callback, fc);
+          fc->extents_calling = FALSE;
+          if (!fc->sparse)
+            {
+              *limit = fc->file_size;
+              return TRUE;
+            }
+        }
+
+      if (fc->read_offset >= fc->extents_end)
+        return FALSE;
+      if (fc->first_extent < fc->num_extents)
+        {
+          extent = fc->extents + 2 * fc->first_extent;
+          if (extent[0] <= fc->read_offset)
+            {
+              *limit = extent[0] + extent[1];
+              return TRUE;
+            }
+          hole_end = extent[0];
+        }
+      else
+        hole_end = fc->extents_end;
+
+      SSH_DEBUG(8, ("Skipping a hole of %lu bytes at %lu",
+                    (unsigned long)(hole_end - fc->read_offset),
+                    (unsigned long)fc->read_offset));
+      fc->hole_bytes += hole_end - fc->read_offset;
+      fc->bytes_written += hole_end - fc->read_offset;
+      fc->read_offset = hole_end;
+      if (fc->read_offset >= fc->file_size)
+        return FALSE;
+    }
+}
+
+/* Sends reads until there are as many in flight as the window allows.
+   Writes count against the window too, so that the blocks read do not
+   pile up if the destination is the slow side. */
+
+void scp_copy_file_send_reads(ScpFileCopyContext fc)
+{
+  ScpFileCopyBlock block;
+  off_t limit;
+
+  /* Copy-data requests are counted as writes, and complete like
+     them. */
+  if (fc->server_copy)
+    {
+      while (fc->read_offset < fc->file_size &&
+             fc->writes_pending < fc->window)
+        {
+          if (fc->free_blocks)
+            {
+              block = fc->free_blocks;
+              fc->free_blocks = block->next;
+            }
+          else
+            {
+              block = ssh_xcalloc(1, sizeof(*block));
+              block->fc = fc;
+            }
+          block->next = NULL;
+          block->offset = fc->read_offset;
+          block->len = ((SCP_COPY_DATA_MAX <
+                         (fc->file_size - fc->read_offset)) ?
+                        SCP_COPY_DATA_MAX :
+                        (size_t)(fc->file_size - fc->read_offset));
+          fc->read_offset += block->len;
+          fc->writes_pending++;
+          ssh_file_client_copy_data(fc->src_handle, block->offset,
+                                    (off_t)block->len,
+                                    fc->dst_handle, block->offset,
+                                    scp_copy_file_write_callback, block);
+        }
+      return;
+    }
+
+  while (fc->read_offset < fc->file_size &&
+         fc->reads_pending < fc->window &&
+         fc->reads_pending + fc->writes_pending < 2 * fc->window)
+    {
+      limit = fc->file_size;
+      if (fc->sparse && !scp_copy_file_next_data(fc, &limit))
+        break;
+
+      if (fc->free_blocks)
+        {
+          block = fc->free_blocks;
+          fc->free_blocks = block->next;
+        }
+      else
+        {
+          block = ssh_xcalloc(1, sizeof(*block));
+          block->fc = fc;
+          block->data = ssh_xmalloc(SCP_READ_MAX);
+        }
+      block->next = NULL;
+      block->offset = fc->read_offset;
+      block->len = ((SCP_READ_MAX < (limit - fc->read_offset)) ?
+                    SCP_READ_MAX :
+                    (size_t)(limit - fc->read_offset));
+      fc->read_offset += block->len;
+      fc->reads_pending++;
+      block->sent = ssh_time_measure_stamp(fc->timer,
+                                           SSH_TIME_GRANULARITY_MICROSECOND);
+      ssh_file_client_read(fc->src_handle, block->offset, block->len,
+                           scp_copy_file_read_callback, block);
+    }
+}
+
+/* Notes that the copy is moving.  The timeout is not registered again
+   for every request, as the event loop keeps a cancelled timeout until
+   it would have expired, and with many small requests the list grows
+   long; instead the timeout registers itself again if there has been
+   progress since. */
+
+void scp_copy_file_progress(ScpFileCopyContext fc)
+{
+  fc->progressed = TRUE;
+}
 
 void scp_copy_file_read_callback(SshFileClientError error,
                                  const unsigned char *data,
@@ -2303,7 +2694,9 @@ void scp_copy_file_read_callback(SshFileClientError error,
                                  void *context)
 
 {
-  ScpFileCopyContext fc = (ScpFileCopyContext)context;
+  ScpFileCopyBlock block = (ScpFileCopyBlock)context;
+  ScpFileCopyContext fc = block->fc;
+  ScpFileCopyBlock rest;
 
   SSH_DEBUG(7, ("error = %d, data = %p, len = %lu",
                 (int)error, data, (unsigned long)len));
@@ -2314,63 +2707,42 @@ void scp_copy_file_read_callback(SshFileClientError error,
       return;
     }
 
-  if (error == SSH_FX_OK)
+  fc->reads_pending--;
+  if (error == SSH_FX_OK && len > 0 && len <= block->len)
     {
-      ssh_buffer_append(&(fc->buffer), data, len);
-      if (fc->write_pending == 0)
-        {
-          fc->write_pending = 
-            ((SCP_WRITE_MAX > ssh_buffer_len(&(fc->buffer))) ?
-             ssh_buffer_len(&(fc->buffer)) :
-             SCP_WRITE_MAX);
-          SSH_DEBUG(8, ("Activating write of %lu bytes",
-                        (unsigned long)fc->write_pending));
-          ssh_file_client_write(fc->dst_handle, 
-                                fc->write_offset, 
-                                ssh_buffer_ptr(&(fc->buffer)),
-                                fc->write_pending,
-                                scp_copy_file_write_callback,
-                                fc);
-          ssh_buffer_consume(&(fc->buffer), fc->write_pending);
-        }
-      else
-        {
-          SSH_DEBUG(8, ("Not activating write of %lu bytes, %lu bytes pending",
-                        (unsigned long)(ssh_buffer_len(&(fc->buffer))),
-                        (unsigned long)fc->write_pending));
-        }
-      fc->read_offset += len;
-      if (((ssh_buffer_len(&(fc->buffer)) + fc->write_pending) > 
-           SCP_BUF_SIZE_MAX) &&
-          (fc->read_offset < fc->file_size))
-        {
-          SSH_DEBUG(8, ("Maximum read buffer exceeded; waiting for write"));
-          fc->state = SCP_FC_BUFFER_FULL;
-        }
-      else if (fc->read_offset < fc->file_size)
-        {
-          SSH_DEBUG(8, ("Reactivating read."));
-          ssh_file_client_read(fc->src_handle, 
-                               fc->read_offset, 
-                               ((SCP_READ_MAX < 
-                                 (fc->file_size - fc->read_offset)) ? 
-                                SCP_READ_MAX : 
-                                (fc->file_size - fc->read_offset)), 
-                               scp_copy_file_read_callback,
-                               fc);
-        }
-      else
+      if (fc->src_is_remote)
+        scp_copy_file_adjust(fc, &fc->read_rtt_min, block->sent);
+
+      if (len < block->len)
         {
-          SSH_DEBUG(8, ("Read completed.  offset = %lu, size = %lu",
-                        (unsigned long)fc->read_offset,
-                        (unsigned long)fc->file_size));
-          fc->state = SCP_FC_READ_COMPLETE;
+          /* Short read; ask for the rest separately. */
+          SSH_DEBUG(8, ("Short read of %lu bytes at %lu",
+                        (unsigned long)len, (unsigned long)block->offset));
+          rest = ssh_xcalloc(1, sizeof(*rest));
+          rest->fc = fc;
+          rest->data = ssh_xmalloc(SCP_READ_MAX);
+          rest->offset = block->offset + len;
+          rest->len = block->len - len;
+          block->len = len;
+          fc->reads_pending++;
+          rest->sent = ssh_time_measure_stamp(fc->timer,
+                                              SSH_TIME_GRANULARITY_MICROSECOND);
+          ssh_file_client_read(fc->src_handle, rest->offset, rest->len,
+                               scp_copy_file_read_callback, rest);
         }
-      ssh_cancel_timeouts(scp_copy_file_timeout, fc);
-      ssh_register_timeout(SCP_FILESERVER_TIMEOUT,
-                           0,
-                           scp_copy_file_timeout,
-                           fc);
+
+      memcpy(block->data, data, len);
+      fc->writes_pending++;
+      block->sent = ssh_time_measure_stamp(fc->timer,
+                                           SSH_TIME_GRANULARITY_MICROSECOND);
+      ssh_file_client_write(fc->dst_handle, 
+                            block->offset, 
+                            block->data,
+                            block->len,
+                            scp_copy_file_write_callback,
+                            block);
+      scp_copy_file_send_reads(fc);
+      scp_copy_file_progress(fc);
     }
   else
     {
@@ -2381,9 +2753,145 @@ void scp_copy_file_read_callback(SshFileClientError error,
     }
 }
 
-void scp_copy_file_write_callback(SshFileClientError error, void *context)
+/* Frees the context of a copy that has completed, and tells the
+   caller. */
+
+void scp_copy_file_complete(ScpFileCopyContext fc)
+{
+  ScpFileCopyBlock block;
+  void (*done)(Boolean ok, void *context) = fc->done;
+  void *done_context = fc->done_context;
+
+  ssh_cancel_timeouts(scp_copy_file_timeout, fc);
+  SSH_DEBUG(4, ("Copy done, %d requests in flight at the end", fc->window));
+  while ((block = fc->free_blocks) != NULL)
+    {
+      fc->free_blocks = block->next;
+      ssh_xfree(block->data);
+      ssh_xfree(block);
+    }
+  ssh_xfree(fc->extents);
+  ssh_time_measure_free(fc->timer);
+  ssh_xfree(fc);
+  (*done)(TRUE, done_context);
+}
+
+void scp_copy_file_size_callback(SshFileClientError error, void *context)
+{
+  ScpFileCopyContext fc = (ScpFileCopyContext)context;
+
+  if ((fc->state == SCP_FC_ERROR) || (fc->state == SCP_FC_TIMEOUT))
+    return;
+  if (error != SSH_FX_OK)
+    {
+      ssh_warning("Cannot set the size of the file (%d).", (int)error);
+      fc->state = SCP_FC_ERROR;
+      scp_set_error(fc->session, SCP_ERROR_WRITE_ERROR);
+      scp_copy_file_timeout(fc);
+      return;
+    }
+  scp_copy_file_complete(fc);
+}
+
+/* Called once all of the file has been written.  If holes were
+   skipped, the destination may end short of the last of them, and its
+   size is set first; the server extends it with a hole. */
+
+void scp_copy_file_finish(ScpFileCopyContext fc)
+{
+  struct SshFileAttributesRec attrs;
+
+  fc->state = SCP_FC_COMPLETE;
+  if (fc->hole_bytes == 0)
+    {
+      scp_copy_file_complete(fc);
+      return;
+    }
+  SSH_DEBUG(2, ("%lu bytes of holes skipped", (unsigned long)fc->hole_bytes));
+  memset(&attrs, 0, sizeof(attrs));
+  attrs.flags = SSH_FILEXFER_ATTR_SIZE;
+  attrs.size = fc->file_size;
+  ssh_file_client_fsetstat(fc->dst_handle, &attrs,
+                           scp_copy_file_size_callback, fc);
+}
+
+/* Takes in the data extents returned by the source.  If it cannot
+   tell them, the rest of the file is simply read. */
+
+void scp_copy_file_extents_callback(SshFileClientError error,
+                                    const unsigned char *data,
+                                    size_t len,
+                                    void *context)
 {
   ScpFileCopyContext fc = (ScpFileCopyContext)context;
+  off_t end, offset, length;
+  int n;
+
+  if ((fc->state == SCP_FC_ERROR) || (fc->state == SCP_FC_TIMEOUT))
+    return;
+
+  fc->extents_pending = FALSE;
+  if (error != SSH_FX_OK || len < 8 || (len - 8) % 16 != 0 ||
+      (end = (off_t)SSH_GET_64BIT(data)) <= fc->extents_end)
+    {
+      SSH_DEBUG(2, ("No data extents (%d); reading the rest of the file.",
+                    (int)error));
+      fc->sparse = FALSE;
+    }
+  else
+    {
+      if (end > fc->file_size)
+        end = fc->file_size;
+
+      /* Drop the extents already passed, and add the new ones. */
+      n = fc->num_extents - fc->first_extent;
+      if (n > 0)
+        memmove(fc->extents, fc->extents + 2 * fc->first_extent,
+                n * 2 * sizeof(off_t));
+      fc->extents = ssh_xrealloc(fc->extents,
+                                 (n + (len - 8) / 16 + 1) * 2 * sizeof(off_t));
+      fc->first_extent = 0;
+      for (data += 8, len -= 8; len > 0; data += 16, len -= 16)
+        {
+          offset = (off_t)SSH_GET_64BIT(data);
+          length = (off_t)SSH_GET_64BIT(data + 8);
+          if (offset < fc->extents_end || length <= 0 ||
+              offset + length > end)
+            continue;
+
+          /* A hole shorter than a read is not worth the extra
+             requests; it is read with the data around it. */
+          if (n > 0 &&
+              offset - (fc->extents[2 * n - 2] + fc->extents[2 * n - 1]) <
+              SCP_READ_MAX)
+            {
+              fc->extents[2 * n - 1] =
+                offset + length - fc->extents[2 * n - 2];
+              continue;
+            }
+          fc->extents[2 * n] = offset;
+          fc->extents[2 * n + 1] = length;
+          n++;
+        }
+      fc->num_extents = n;
+      fc->extents_end = end;
+    }
+
+  if (fc->extents_calling)
+    return;
+  scp_copy_file_send_reads(fc);
+  if (fc->bytes_written == fc->file_size && fc->writes_pending == 0)
+    {
+      scp_copy_file_finish(fc);
+      return;
+    }
+  scp_copy_file_progress(fc);
+}
+
+void scp_copy_file_write_callback(SshFileClientError error, void *context)
+{
+  ScpFileCopyBlock block = (ScpFileCopyBlock)context;
+  ScpFileCopyContext fc = block->fc;
 
   SSH_DEBUG(7, ("error = %d", (int)error));
 
@@ -2393,58 +2901,33 @@ void scp_copy_file_write_callback(SshFileClientError error, void *context)
       return;
     }
 
+  fc->writes_pending--;
   if (error == SSH_FX_OK)
     {
-      fc->write_offset += fc->write_pending;
-      SSH_ASSERT(fc->write_offset <= fc->file_size);
-      fc->write_pending = 0;
-      if (!fc->session->nostat)
-        scp_kitt(fc->write_offset, fc->file_size, fc->term_width);
-      if (ssh_buffer_len(&(fc->buffer)) > 0)
-        {
-          fc->write_pending = 
-            ((SCP_WRITE_MAX > ssh_buffer_len(&(fc->buffer))) ?
-             ssh_buffer_len(&(fc->buffer)) :
-             SCP_WRITE_MAX);
-          SSH_DEBUG(8, ("Reactivating write of %lu bytes",
-                        (unsigned long)fc->write_pending));
-          ssh_file_client_write(fc->dst_handle, 
-                                fc->write_offset, 
-                                ssh_buffer_ptr(&(fc->buffer)),
-                                fc->write_pending,
-                                scp_copy_file_write_callback,
-                                fc);
-          ssh_buffer_consume(&(fc->buffer), fc->write_pending);
-        }
-      if (fc->state == SCP_FC_BUFFER_FULL)
-        {
-          ssh_file_client_read(fc->src_handle, 
-                               fc->read_offset, 
-                               ((SCP_READ_MAX < 
-                                 (fc->file_size - fc->read_offset)) ? 
-                                SCP_READ_MAX : 
-                                (fc->file_size - fc->read_offset)), 
-                               scp_copy_file_read_callback, 
-                               fc);
-          fc->state = SCP_FC_RUNNING;
-        }
-      ssh_cancel_timeouts(scp_copy_file_timeout, fc);
-      ssh_register_timeout(SCP_FILESERVER_TIMEOUT,
-                           0,
-                           scp_copy_file_timeout,
-                           fc);
-      if (fc->write_offset == fc->file_size)
+      if (fc->dst_is_remote)
+        scp_copy_file_adjust(fc, &fc->write_rtt_min, block->sent);
+
+      fc->bytes_written += block->len;
+      SSH_ASSERT(fc->bytes_written <= fc->file_size);
+      block->next = fc->free_blocks;
+      fc->free_blocks = block;
+      if (fc->show_progress)
+        scp_kitt(fc->bytes_written, fc->file_size, fc->term_width);
+
+      /* Skipping holes may take the rest of the file. */
+      scp_copy_file_send_reads(fc);
+      if (fc->bytes_written == fc->file_size && fc->writes_pending == 0)
         {
-          fc->state = SCP_FC_COMPLETE;
-          ssh_cancel_timeouts(scp_copy_file_timeout, fc);
-          ssh_event_loop_abort();
+          scp_copy_file_finish(fc);
+          return;
         }
+      scp_copy_file_progress(fc);
     }
   else
     {
       ssh_warning("Write failed (%d).", (int)error);
       fc->state = SCP_FC_ERROR;
-      scp_set_error(fc->session, SCP_ERROR_READ_ERROR);
+      scp_set_error(fc->session, SCP_ERROR_WRITE_ERROR);
       scp_copy_file_timeout(fc);
     }
 }
@@ -2455,6 +2938,16 @@ void scp_copy_file_timeout(void *context)
 
   SSH_DEBUG(5, ("context = %p", context));
 
+  if (fc->state == SCP_FC_RUNNING && fc->progressed)
+    {
+      fc->progressed = FALSE;
+      ssh_register_timeout(SCP_FILESERVER_TIMEOUT,
+                           0,
+                           scp_copy_file_timeout,
+                           fc);
+      return;
+    }
+
   if (fc->state != SCP_FC_ERROR)
     fc->state = SCP_FC_TIMEOUT;
 #if 0
@@ -2465,281 +2958,1481 @@ void scp_copy_file_timeout(void *context)
    * all subsequent callbacks are ignored.
    */
 #endif
-  ssh_event_loop_abort();
+  ssh_cancel_timeouts(scp_copy_file_timeout, fc);
+  (*fc->done)(FALSE, fc->done_context);
 }
 
-Boolean scp_copy_file(ScpSession session,
-                      SshFileHandle src_handle,
-                      SshFileHandle dst_handle,
-                      off_t file_size,
-                      int width)
+/* Starts copying `file_size' bytes from `src_handle' to `dst_handle'.
+   If `server_copy' is TRUE, the handles are on the same server, and it
+   is asked to copy the data itself.  If `sparse' is TRUE, the holes of
+   the source are found with data-extents requests and not copied; the
+   destination must then be empty.  `done' is called from the event
+   loop once all of it has been written, or the copy has failed. */
+
+void scp_copy_file_start(ScpSession session,
+                         SshFileHandle src_handle,
+                         SshFileHandle dst_handle,
+                         Boolean src_is_remote,
+                         Boolean dst_is_remote,
+                         Boolean server_copy,
+                         Boolean sparse,
+                         off_t file_size,
+                         Boolean show_progress,
+                         int width,
+                         void (*done)(Boolean ok, void *context),
+                         void *done_context)
 {
   ScpFileCopyContext fc;
-  Boolean r = FALSE;
   
   SSH_DEBUG(7, ("src_handle = %p dst_handle = %p file_size = %lu",
                 src_handle, dst_handle, (unsigned long)file_size));
+  SSH_PRECOND(file_size > 0);
+
   fc = ssh_xcalloc(1, sizeof (*fc));
   fc->session = session;
   fc->src_handle = src_handle;
   fc->dst_handle = dst_handle;
+  fc->src_is_remote = src_is_remote;
+  fc->dst_is_remote = dst_is_remote;
+  fc->server_copy = server_copy;
+  fc->sparse = sparse && !server_copy;
   fc->file_size = file_size;
   fc->read_offset = 0;
-  fc->write_offset = 0;
-  fc->write_pending = 0;
+  fc->bytes_written = 0;
+  fc->show_progress = show_progress;
   fc->term_width = width;
+  fc->done = done;
+  fc->done_context = done_context;
   fc->state = SCP_FC_RUNNING;
-  ssh_buffer_init(&(fc->buffer));
-  ssh_file_client_read(fc->src_handle, 
-                       fc->read_offset, 
-                       ((SCP_READ_MAX < 
-                         (fc->file_size - fc->read_offset)) ? 
-                        SCP_READ_MAX : 
-                        (fc->file_size - fc->read_offset)), 
-                       scp_copy_file_read_callback, 
-                       fc);
+
+  /* With nothing remote there are no round trips to measure.  The
+     copy-data requests are large, and only a few are needed to keep
+     the server busy. */
+  if (session->max_requests > 0)
+    fc->window = session->max_requests;
+  else if (server_copy)
+    fc->window = SCP_COPY_DATA_REQUESTS;
+  else if (src_is_remote || dst_is_remote)
+    {
+      fc->window = SCP_REQUESTS_INITIAL;
+      fc->auto_window = TRUE;
+    }
+  else
+    fc->window = SCP_REQUESTS_MAX;
+  fc->timer = ssh_time_measure_allocate();
+  ssh_time_measure_start(fc->timer);
+
   ssh_register_timeout(SCP_FILESERVER_TIMEOUT,
                        0,
                        scp_copy_file_timeout,
                        fc);
-  ssh_event_loop_run();
-  r = (fc->state == SCP_FC_COMPLETE);
-  ssh_cancel_timeouts(scp_copy_file_timeout, fc);
-  if (r)
-    {
-      ssh_buffer_uninit(&(fc->buffer));
-      ssh_xfree(fc);
-    }
-  return r;
+  scp_copy_file_send_reads(fc);
 }
 /*
  * End of file copy loop
  */
 
-Boolean scp_move_file(ScpSession session,
-                      char *src_host,
-                      char *src_file,
-                      SshFileClient src_client,
-                      char *dst_host,
-                      char *dst_file,
-                      SshFileClient dst_client)
-{
-  SshFileAttributes src_attributes;
-  SshTimeMeasure timer;  
+/*
+ * Copying over an old copy of the file (-s).
+ *
+ * The server of the destination is asked for the CRCs and digests of
+ * the blocks of the file already there, with block-signatures
+ * requests.  The source is then read through, and a CRC of the bytes
+ * at each position is rolled along it; where it matches the CRC of a
+ * block of the old file, and their digests match too, the block is
+ * copied into place in the destination by its server with copy-data,
+ * and the data in between is written as usual.  Only the new data,
+ * and the signatures, pass over the connection to the destination.
+ *
+ * The new file is built in place of the old one, from the start.  A
+ * block of the old file is only used if it lies at or past the
+ * position being written, since the data before that has already been
+ * overwritten; and as the server may run the requests in any order, a
+ * write is held back while it overlaps a block still being copied.
+ */
+
+typedef struct ScpDeltaContextRec *ScpDeltaContext;
+
+/* A read of the source, or a write or copy-data request to the
+   destination. */
+typedef struct ScpDeltaRequestRec {
+  ScpDeltaContext dc;
+  struct ScpDeltaRequestRec *next;
+  /* For a read, the range read, and for a copy-data request the range
+     of the old file it copies. */
   off_t offset;
-  off_t file_len;
-  int width, r;
-  
-  SshFileHandle src_handle = NULL, dst_handle = NULL;
-  
-  timer = ssh_time_measure_allocate();
-  ssh_time_measure_start(timer);
+  size_t len;
+  /* TRUE when a read has completed and `data' holds what was read. */
+  Boolean done;
+  unsigned char *data;
+} *ScpDeltaRequest;
+
+struct ScpDeltaContextRec {
+  ScpSession session;
+  ScpFileCopyState state;
+  SshFileHandle src_handle;
+  SshFileHandle dst_handle;
+  off_t file_size;
+  off_t old_size;
+  /* The hash function the blocks are compared with, and the size of
+     the blocks. */
+  char *hash_name;
+  SshHash hash;
+  size_t digest_len;
+  size_t block_size;
+  /* The signatures of the whole blocks of the old file, and a hash
+     table of them by CRC.  The chains go from the last block to the
+     first. */
+  long num_blocks;
+  SshUInt32 *block_crcs;
+  unsigned char *block_digests;
+  long *block_next;
+  long *table;
+  SshUInt32 table_mask;
+  SshUInt32 roll_table[256];
+  /* How far the signatures have been asked for, and the number of
+     requests for them in flight. */
+  off_t signatures_offset;
+  int signatures_pending;
+  /* The source data from `buf_offset' on. */
+  unsigned char *buf;
+  size_t buf_size;
+  size_t buf_len;
+  off_t buf_offset;
+  /* Reads in flight, in the order of their offsets, and where the next
+     one starts. */
+  ScpDeltaRequest reads;
+  ScpDeltaRequest reads_tail;
+  off_t read_offset;
+  int reads_pending;
+  /* Copy-data requests in flight, and the number of all the requests
+     to the destination in flight. */
+  ScpDeltaRequest copies;
+  int writes_pending;
+  int window;
+  ScpDeltaRequest free_requests;
+  /* The position being compared, the CRC of the block there if
+     `crc_valid', where the data not yet written starts, and the block
+     of the old file found at the position and not yet copied, or
+     -1. */
+  off_t pos;
+  SshUInt32 crc;
+  Boolean crc_valid;
+  off_t literal_start;
+  long match;
+  /* Bytes written as they were, and bytes found in the old file. */
+  off_t literal_bytes;
+  off_t matched_bytes;
+  Boolean show_progress;
+  int term_width;
+  /* Called once the copy has completed or failed, with the number of
+     bytes that had to be sent. */
+  void (*done)(Boolean ok, off_t bytes_sent, void *context);
+  void *done_context;
+};
+
+void scp_delta_process(ScpDeltaContext dc);
+void scp_delta_timeout(void *context);
+
+void scp_delta_progress(ScpDeltaContext dc)
+{
+  ssh_cancel_timeouts(scp_delta_timeout, dc);
+  ssh_register_timeout(SCP_FILESERVER_TIMEOUT,
+                       0,
+                       scp_delta_timeout,
+                       dc);
+}
+
+void scp_delta_timeout(void *context)
+{
+  ScpDeltaContext dc = (ScpDeltaContext)context;
+
+  SSH_DEBUG(5, ("context = %p", context));
+
+  /* As with scp_copy_file_timeout, the context is left for the
+     callbacks of the requests still in flight, which ignore it. */
+  if (dc->state != SCP_FC_ERROR)
+    dc->state = SCP_FC_TIMEOUT;
+  ssh_cancel_timeouts(scp_delta_timeout, dc);
+  (*dc->done)(FALSE, dc->literal_bytes, dc->done_context);
+}
+
+void scp_delta_fail(ScpDeltaContext dc, int error)
+{
+  dc->state = SCP_FC_ERROR;
+  scp_set_error(dc->session, error);
+  scp_delta_timeout(dc);
+}
+
+ScpDeltaRequest scp_delta_request(ScpDeltaContext dc)
+{
+  ScpDeltaRequest request;
 
-  src_handle = scp_file_open(session, 
-                             src_client,
-                             src_file,
-                             O_RDONLY,
-                             NULL);
-  if (src_handle == NULL)
+  if (dc->free_requests)
     {
-      scp_set_error(session, SCP_ERROR_CANNOT_OPEN);
-      ssh_warning("Cannot open source file %s%s%s",
-                  (src_host != NULL) ? src_host : "",
-                  (src_host != NULL) ? ":" : "",
-                  src_file);
-      goto close_error;
+      request = dc->free_requests;
+      dc->free_requests = request->next;
     }
-  
-  src_attributes = scp_file_fstat(session, src_handle);
-  if (src_attributes == NULL) 
+  else
     {
-      scp_set_error(session, SCP_ERROR_CANNOT_STAT);
-      ssh_warning("Cannot stat source file %s%s%s",
-                  (src_host != NULL) ? src_host : "",
-                  (src_host != NULL) ? ":" : "",
-                  src_file);
-      goto close_error;
+      request = ssh_xcalloc(1, sizeof(*request));
+      request->dc = dc;
     }
-  file_len = src_attributes->size;
+  request->next = NULL;
+  request->done = FALSE;
+  return request;
+}
+
+void scp_delta_request_free(ScpDeltaContext dc, ScpDeltaRequest request)
+{
+  request->next = dc->free_requests;
+  dc->free_requests = request;
+}
 
-  if ((src_attributes->permissions & S_IFMT) != S_IFREG) 
+void scp_delta_complete(ScpDeltaContext dc)
+{
+  ScpDeltaRequest request;
+  void (*done)(Boolean ok, off_t bytes_sent, void *context) = dc->done;
+  void *done_context = dc->done_context;
+  off_t bytes_sent = dc->literal_bytes;
+
+  ssh_cancel_timeouts(scp_delta_timeout, dc);
+  SSH_DEBUG(2, ("%lu bytes sent, %lu bytes found in the old file "
+                "in blocks of %lu",
+                (unsigned long)dc->literal_bytes,
+                (unsigned long)dc->matched_bytes,
+                (unsigned long)dc->block_size));
+  while ((request = dc->free_requests) != NULL)
     {
-      ssh_warning("Source file %s%s%s is not a regular file",
-                  (src_host != NULL) ? src_host : "",
-                  (src_host != NULL) ? ":" : "",
-                  src_file);
-      scp_set_error(session, SCP_ERROR_NOT_REGULAR_FILE);
-      goto close_error;
+      dc->free_requests = request->next;
+      if (request->data)
+        ssh_xfree(request->data);
+      ssh_xfree(request);
     }
+  ssh_hash_free(dc->hash);
+  ssh_xfree(dc->hash_name);
+  ssh_xfree(dc->block_crcs);
+  ssh_xfree(dc->block_digests);
+  ssh_xfree(dc->block_next);
+  ssh_xfree(dc->table);
+  ssh_xfree(dc->buf);
+  ssh_xfree(dc);
+  (*done)(TRUE, bytes_sent, done_context);
+}
 
-  if (! session->do_not_copy)
-    if (session->unlink_flag)
-      scp_file_remove(session, dst_client, dst_file);
+void scp_delta_truncate_callback(SshFileClientError error, void *context)
+{
+  ScpDeltaContext dc = (ScpDeltaContext)context;
 
-  if (! session->do_not_copy)
+  if (dc->state != SCP_FC_RUNNING)
+    return;
+  if (error != SSH_FX_OK)
     {
-      dst_handle = scp_file_open(session,
-                                 dst_client,
-                                 dst_file,
-                                 O_CREAT | O_TRUNC | O_WRONLY,
-                                 NULL);
-      if (dst_handle == NULL) 
-        {
-          ssh_warning("Cannot open destination file %s%s%s",
-                      (dst_host != NULL) ? dst_host : "",
-                      (dst_host != NULL) ? ":" : "",
-                      dst_file);
-          scp_set_error(session, SCP_ERROR_CANNOT_CREATE);
-          goto close_error;
-        }
+      ssh_warning("Cannot set the size of the file (%d).", (int)error);
+      scp_delta_fail(dc, SCP_ERROR_WRITE_ERROR);
+      return;
     }
+  dc->state = SCP_FC_COMPLETE;
+  scp_delta_complete(dc);
+}
 
-  offset = 0;
+void scp_delta_write_callback(SshFileClientError error, void *context)
+{
+  ScpDeltaRequest request = (ScpDeltaRequest)context;
+  ScpDeltaContext dc = request->dc;
+  ScpDeltaRequest *rp;
+
+  SSH_DEBUG(7, ("error = %d", (int)error));
 
-  if (! session->do_not_copy)
+  if ((dc->state == SCP_FC_ERROR) || (dc->state == SCP_FC_TIMEOUT))
     {
-      if (!session->nostat) 
-        {  
-          printf("Transfering %s%s%s -> %s%s%s  (%luk)\n",
-                 (src_host != NULL) ? src_host : "",
-                 (src_host != NULL) ? ":" : "",
-                 src_file,
-                 (dst_host != NULL) ? dst_host : "",
-                 (dst_host != NULL) ? ":" : "",
-                 dst_file,
-                 (unsigned long) (file_len >> 10) + 1);
-          
-          scp_get_win_dim(&width, NULL);
-          scp_kitt(0, file_len, width);
-        }
+      SSH_DEBUG(5, ("Extra callback from earlier failed operation ignored"));
+      return;
     }
-  else
+
+  /* Copy-data requests are on their own list; writes are not. */
+  for (rp = &dc->copies; *rp; rp = &(*rp)->next)
+    if (*rp == request)
+      {
+        *rp = request->next;
+        break;
+      }
+  dc->writes_pending--;
+  scp_delta_request_free(dc, request);
+
+  if (error != SSH_FX_OK)
     {
-      printf("Not transferring %s%s%s -> %s%s%s  (%luk)\n",
-             (src_host != NULL) ? src_host : "",
-             (src_host != NULL) ? ":" : "",
-             src_file,
-             (dst_host != NULL) ? dst_host : "",
-             (dst_host != NULL) ? ":" : "",
-             dst_file,
-             (unsigned long) (file_len >> 10) + 1);
+      ssh_warning("Write failed (%d).", (int)error);
+      scp_delta_fail(dc, SCP_ERROR_WRITE_ERROR);
+      return;
     }
-  
-  /* move the file */
-    
-  if (! session->do_not_copy)
+  scp_delta_progress(dc);
+  scp_delta_process(dc);
+}
+
+/* Returns TRUE if a write to `start'...`end' in the destination must
+   wait: too many requests are in flight, or one of them still copies
+   a block from that range. */
+
+Boolean scp_delta_blocked(ScpDeltaContext dc, off_t start, off_t end)
+{
+  ScpDeltaRequest request;
+
+  if (dc->writes_pending >= dc->window)
+    return TRUE;
+  for (request = dc->copies; request; request = request->next)
+    if (request->offset < end &&
+        start < request->offset + (off_t)request->len)
+      return TRUE;
+  return FALSE;
+}
+
+/* Writes the source data from `literal_start' up to `end' to the
+   destination.  Returns FALSE if it has to wait for requests in flight
+   first; it is then called again as they complete. */
+
+Boolean scp_delta_flush(ScpDeltaContext dc, off_t end)
+{
+  ScpDeltaRequest request;
+  size_t len;
+
+  while (dc->literal_start < end)
     {
-#ifndef OLD_FILE_COPY_LOOP
-      r = scp_copy_file(session, src_handle, dst_handle, file_len, width);
-      if (! r)
-        goto close_error;
-#else /* ! OLD_FILE_COPY_LOOP */
-      {
-        off_t src_len;
-        char data[SCP_BUF_SIZE];
-
-        do {
-          src_len = scp_file_read(session, 
-                                  src_handle,
-                                  offset, 
-                                  data,
-                                  SCP_BUF_SIZE);
-          if (src_len < 0)
-            {
-              ssh_warning("Read error in file %s%s%s",
-                          (src_host != NULL) ? src_host : "",
-                          (src_host != NULL) ? ":" : "",
-                          src_file);
-              scp_set_error(session, SCP_ERROR_READ_ERROR);
-              goto close_error;
-            }
-          
-          if (src_len > 0)
-            {
-              r = scp_file_write(session,
-                                 dst_handle, 
-                                 offset, 
-                                 data, 
-                                 src_len);
-              if (r != src_len)
-                {
-                  ssh_warning("Write error in file %s%s%s",
-                              (dst_host != NULL) ? dst_host : "",
-                              (dst_host != NULL) ? ":" : "",
-                              dst_file);
-                  scp_set_error(session, SCP_ERROR_WRITE_ERROR);
-                  goto close_error;
-                }
-              offset += src_len;
-              
-              if (!session->nostat)
-                scp_kitt(offset, file_len, width);
-            }
-        } while (src_len == SCP_BUF_SIZE);
-      }
-#endif /* OLD_FILE_COPY_LOOP */
+      len = ((SCP_DELTA_LITERAL_MAX < end - dc->literal_start) ?
+             SCP_DELTA_LITERAL_MAX : (size_t)(end - dc->literal_start));
+      if (scp_delta_blocked(dc, dc->literal_start,
+                            dc->literal_start + (off_t)len))
+        return FALSE;
+
+      /* The data is copied into the request as it is sent. */
+      request = scp_delta_request(dc);
+      dc->writes_pending++;
+      ssh_file_client_write(dc->dst_handle, dc->literal_start,
+                            dc->buf + (dc->literal_start - dc->buf_offset),
+                            len, scp_delta_write_callback, request);
+      dc->literal_start += len;
+      dc->literal_bytes += len;
+    }
+  return TRUE;
+}
+
+/* Returns the block of the old file that holds the same data as the
+   source at `pos', or -1 if none does. */
 
-      if (!session->nostat > 0)
+long scp_delta_find(ScpDeltaContext dc)
+{
+  unsigned char digest[SSH_MAX_HASH_DIGEST_LENGTH];
+  const unsigned char *data = dc->buf + (dc->pos - dc->buf_offset);
+  Boolean hashed = FALSE;
+  long block;
+  int tries = 0;
+
+  /* Mostly the data has not moved. */
+  if (dc->pos % dc->block_size == 0)
+    {
+      block = (long)(dc->pos / dc->block_size);
+      if (block < dc->num_blocks && dc->block_crcs[block] == dc->crc)
         {
-          SshUInt64 time_sec;
-          SshUInt32 time_nsec;
-          int minutes;
-          int seconds;
-          double sec_dbl;
-          char str_min[256];
-          char per_sec[256];
-
-          /* Transfer time in seconds */
-          ssh_time_measure_stop(timer);
-          ssh_time_measure_get_value(timer, &time_sec, &time_nsec);
-          minutes = time_sec / 60;
-          seconds = time_sec % 60;
-
-          if (minutes > 0)
-            snprintf(str_min, sizeof(str_min), "%d minute%s ", 
-                     minutes,
-                     (minutes != 1) ? "s" : "");
-          else
-            str_min[0] = '\000';
+          ssh_hash_reset(dc->hash);
+          ssh_hash_update(dc->hash, data, dc->block_size);
+          ssh_hash_final(dc->hash, digest);
+          hashed = TRUE;
+          if (memcmp(digest, dc->block_digests + block * dc->digest_len,
+                     dc->digest_len) == 0)
+            return block;
+        }
+    }
 
-          sec_dbl = (double)ssh_time_measure_get(timer, 
-                                                 SSH_TIME_GRANULARITY_SECOND);
-          if (sec_dbl > 0.0)
-            {
-              snprintf(per_sec, sizeof(per_sec), " [%.2f kB/sec]", 
-                       (((double)file_len) / (sec_dbl * 1024.0)));
-            }
-          else
+  for (block = dc->table[dc->crc & dc->table_mask];
+       block >= 0 && tries < SCP_DELTA_CANDIDATES;
+       block = dc->block_next[block])
+    {
+      /* The rest of the chain has already been overwritten. */
+      if ((off_t)block * dc->block_size < dc->pos)
+        break;
+      if (dc->block_crcs[block] != dc->crc)
+        continue;
+      tries++;
+      if (!hashed)
+        {
+          ssh_hash_reset(dc->hash);
+          ssh_hash_update(dc->hash, data, dc->block_size);
+          ssh_hash_final(dc->hash, digest);
+          hashed = TRUE;
+        }
+      if (memcmp(digest, dc->block_digests + block * dc->digest_len,
+                 dc->digest_len) == 0)
+        return block;
+    }
+  return -1;
+}
+
+void scp_delta_read_callback(SshFileClientError error,
+                             const unsigned char *data,
+                             size_t len,
+                             void *context);
+
+/* Reads the source ahead of the position being compared. */
+
+void scp_delta_send_reads(ScpDeltaContext dc)
+{
+  ScpDeltaRequest request;
+
+  while (dc->read_offset < dc->file_size &&
+         dc->reads_pending < dc->window &&
+         dc->read_offset < (dc->pos + (off_t)dc->block_size +
+                            SCP_DELTA_READ_AHEAD))
+    {
+      request = scp_delta_request(dc);
+      if (request->data == NULL)
+        request->data = ssh_xmalloc(SCP_READ_MAX);
+      request->offset = dc->read_offset;
+      request->len = ((SCP_READ_MAX < (dc->file_size - dc->read_offset)) ?
+                      SCP_READ_MAX :
+                      (size_t)(dc->file_size - dc->read_offset));
+      dc->read_offset += request->len;
+      if (dc->reads_tail)
+        dc->reads_tail->next = request;
+      else
+        dc->reads = request;
+      dc->reads_tail = request;
+      dc->reads_pending++;
+      ssh_file_client_read(dc->src_handle, request->offset, request->len,
+                           scp_delta_read_callback, request);
+    }
+}
+
+void scp_delta_read_callback(SshFileClientError error,
+                             const unsigned char *data,
+                             size_t len,
+                             void *context)
+{
+  ScpDeltaRequest request = (ScpDeltaRequest)context;
+  ScpDeltaContext dc = request->dc;
+  ScpDeltaRequest rest;
+  size_t discard;
+
+  SSH_DEBUG(7, ("error = %d, data = %p, len = %lu",
+                (int)error, data, (unsigned long)len));
+
+  if ((dc->state == SCP_FC_ERROR) || (dc->state == SCP_FC_TIMEOUT))
+    {
+      SSH_DEBUG(5, ("Extra callback from earlier failed operation ignored"));
+      return;
+    }
+
+  dc->reads_pending--;
+  if (error != SSH_FX_OK || len == 0 || len > request->len)
+    {
+      ssh_warning("Read failed (%d).", (int)error);
+      scp_delta_fail(dc, SCP_ERROR_READ_ERROR);
+      return;
+    }
+
+  if (len < request->len)
+    {
+      /* Short read; ask for the rest separately, keeping the reads in
+         order. */
+      rest = scp_delta_request(dc);
+      if (rest->data == NULL)
+        rest->data = ssh_xmalloc(SCP_READ_MAX);
+      rest->offset = request->offset + len;
+      rest->len = request->len - len;
+      request->len = len;
+      rest->next = request->next;
+      request->next = rest;
+      if (dc->reads_tail == request)
+        dc->reads_tail = rest;
+      dc->reads_pending++;
+      ssh_file_client_read(dc->src_handle, rest->offset, rest->len,
+                           scp_delta_read_callback, rest);
+    }
+  memcpy(request->data, data, len);
+  request->done = TRUE;
+
+  /* Move the data that has arrived in order to the buffer, dropping
+     what has already been written. */
+  while (dc->reads && dc->reads->done)
+    {
+      request = dc->reads;
+      dc->reads = request->next;
+      if (dc->reads == NULL)
+        dc->reads_tail = NULL;
+
+      discard = (size_t)(dc->literal_start - dc->buf_offset);
+      if (discard > 0)
+        {
+          memmove(dc->buf, dc->buf + discard, dc->buf_len - discard);
+          dc->buf_len -= discard;
+          dc->buf_offset += discard;
+        }
+      SSH_ASSERT(dc->buf_offset + (off_t)dc->buf_len == request->offset);
+      SSH_ASSERT(dc->buf_len + request->len <= dc->buf_size);
+      memcpy(dc->buf + dc->buf_len, request->data, request->len);
+      dc->buf_len += request->len;
+      scp_delta_request_free(dc, request);
+    }
+
+  if (dc->show_progress)
+    scp_kitt(dc->pos, dc->file_size, dc->term_width);
+  scp_delta_progress(dc);
+  scp_delta_process(dc);
+}
+
+/* Compares the source data received so far with the blocks of the old
+   file, and sends the writes and copies for it. */
+
+void scp_delta_process(ScpDeltaContext dc)
+{
+  off_t data_end = dc->buf_offset + (off_t)dc->buf_len;
+  off_t block_offset;
+  size_t b = dc->block_size;
+  struct SshFileAttributesRec attrs;
+  ScpDeltaRequest request;
+  unsigned char *p;
+
+  if (dc->state != SCP_FC_RUNNING)
+    return;
+
+  for (;;)
+    {
+      if (dc->match >= 0)
+        {
+          /* Write the data before the block, and copy the block into
+             place unless it already is there. */
+          if (!scp_delta_flush(dc, dc->pos))
+            return;
+          block_offset = (off_t)dc->match * b;
+          if (block_offset != dc->pos)
             {
-              per_sec[0] = '\000';
+              if (scp_delta_blocked(dc, dc->pos, dc->pos + (off_t)b))
+                return;
+              request = scp_delta_request(dc);
+              request->offset = block_offset;
+              request->len = b;
+              request->next = dc->copies;
+              dc->copies = request;
+              dc->writes_pending++;
+              ssh_file_client_copy_data(dc->dst_handle, block_offset,
+                                        (off_t)b,
+                                        dc->dst_handle, dc->pos,
+                                        scp_delta_write_callback, request);
             }
+          dc->matched_bytes += b;
+          dc->pos += b;
+          dc->literal_start = dc->pos;
+          dc->crc_valid = FALSE;
+          dc->match = -1;
+          continue;
+        }
+
+      if (dc->pos - dc->literal_start >= SCP_DELTA_LITERAL_MAX &&
+          !scp_delta_flush(dc, dc->pos))
+        return;
+
+      if (dc->pos + (off_t)b > dc->file_size)
+        {
+          /* No whole block is left; the rest is written as it is, and
+             then the file is cut to its new size. */
+          if (data_end < dc->file_size)
+            break;
+          if (!scp_delta_flush(dc, dc->file_size))
+            return;
+          dc->pos = dc->file_size;
+          if (dc->writes_pending > 0)
+            return;
+          memset(&attrs, 0, sizeof(attrs));
+          attrs.flags = SSH_FILEXFER_ATTR_SIZE;
+          attrs.size = dc->file_size;
+          ssh_file_client_fsetstat(dc->dst_handle, &attrs,
+                                   scp_delta_truncate_callback, dc);
+          dc->writes_pending++;
+          return;
+        }
+      if (dc->pos + (off_t)b > data_end)
+        break;
 
-          printf("\n%lu bytes transferred in %s%d.%02d seconds%s.\n",
-                 (unsigned long)file_len,
-                 str_min,
-                 seconds,
-                 (int)(time_nsec / 10000000),
-                 per_sec);
+      p = dc->buf + (dc->pos - dc->buf_offset);
+      if (!dc->crc_valid)
+        {
+          dc->crc = crc32_buffer(p, b);
+          dc->crc_valid = TRUE;
         }
+      dc->match = scp_delta_find(dc);
+      if (dc->match >= 0)
+        continue;
+
+      /* Move on by a byte.  The last byte of the next block is needed
+         for its CRC, unless there is no next block. */
+      if (dc->pos + (off_t)b == dc->file_size)
+        dc->crc_valid = FALSE;
+      else if (dc->pos + (off_t)b == data_end)
+        break;
+      else
+        dc->crc = crc32_roll(dc->roll_table, dc->crc, p[0], p[b]);
+      dc->pos++;
     }
-  
-  ssh_time_measure_free(timer);
-  scp_file_close(session, src_handle);
+  scp_delta_send_reads(dc);
+}
+
+/* Puts the signatures of the old file in a hash table, and starts
+   reading the source. */
 
-  if (!session->do_not_copy)
+void scp_delta_start_reading(ScpDeltaContext dc)
+{
+  SshUInt32 table_size;
+  long block;
+
+  for (table_size = 1; table_size < (SshUInt32)dc->num_blocks;
+       table_size <<= 1)
+    ;
+  dc->table_mask = table_size - 1;
+  dc->table = ssh_xmalloc(table_size * sizeof(long));
+  for (block = 0; block < (long)table_size; block++)
+    dc->table[block] = -1;
+  dc->block_next = ssh_xmalloc((dc->num_blocks + 1) * sizeof(long));
+  for (block = 0; block < dc->num_blocks; block++)
     {
-      if (session->preserve_flag)
-        scp_file_fsetstat(session, dst_handle, src_attributes);
-      scp_file_close(session, dst_handle);
+      dc->block_next[block] = dc->table[dc->block_crcs[block] &
+                                        dc->table_mask];
+      dc->table[dc->block_crcs[block] & dc->table_mask] = block;
     }
-  return TRUE;
-      
- close_error:
-  if (src_handle != NULL)
-    scp_file_close(session, src_handle);
-  if (dst_handle != NULL)
-    scp_file_close(session, dst_handle);
-  return FALSE;
+
+  crc32_roll_table(dc->roll_table, dc->block_size);
+  dc->buf_size = (SCP_DELTA_LITERAL_MAX + dc->block_size +
+                  SCP_DELTA_READ_AHEAD + SCP_READ_MAX);
+  dc->buf = ssh_xmalloc(dc->buf_size);
+  scp_delta_progress(dc);
+  scp_delta_process(dc);
+}
+
+void scp_delta_signatures_next(ScpDeltaContext dc);
+
+void scp_delta_signatures_callback(SshFileClientError error,
+                                   const unsigned char *data,
+                                   size_t len,
+                                   void *context)
+{
+  ScpDeltaRequest request = (ScpDeltaRequest)context;
+  ScpDeltaContext dc = request->dc;
+  size_t entry_len = 4 + dc->digest_len;
+  long block, i, n;
+
+  if (dc->state != SCP_FC_RUNNING)
+    return;
+
+  dc->signatures_pending--;
+  block = (long)(request->offset / dc->block_size);
+  if (error == SSH_FX_EOF)
+    {
+      /* The old file has become shorter; use what there is. */
+      if (block < dc->num_blocks)
+        dc->num_blocks = block;
+    }
+  else if (error != SSH_FX_OK || len % entry_len != 0 || len == 0)
+    {
+      ssh_warning("Cannot get the signatures of the old file (%d).",
+                  (int)error);
+      scp_delta_fail(dc, SCP_ERROR_READ_ERROR);
+      return;
+    }
+  else
+    {
+      n = (long)(len / entry_len);
+      if (n > dc->num_blocks - block)
+        n = (block < dc->num_blocks) ? dc->num_blocks - block : 0;
+      for (i = 0; i < n; i++, data += entry_len)
+        {
+          dc->block_crcs[block + i] = SSH_GET_32BIT(data);
+          memcpy(dc->block_digests + (block + i) * dc->digest_len,
+                 data + 4, dc->digest_len);
+        }
+
+      /* The server may send fewer than were asked for; ask for the
+         rest again. */
+      if ((off_t)n * dc->block_size < (off_t)request->len &&
+          block + n < dc->num_blocks)
+        {
+          request->offset += (off_t)n * dc->block_size;
+          request->len -= n * dc->block_size;
+          dc->signatures_pending++;
+          ssh_file_client_block_signatures(dc->dst_handle, dc->hash_name,
+                                           request->offset,
+                                           (off_t)request->len,
+                                           dc->block_size,
+                                           scp_delta_signatures_callback,
+                                           request);
+          scp_delta_progress(dc);
+          return;
+        }
+    }
+  scp_delta_request_free(dc, request);
+  scp_delta_progress(dc);
+  scp_delta_signatures_next(dc);
+}
+
+/* Asks for the signatures of the whole blocks of the old file, a few
+   ranges at a time so that the server can hash them while the replies
+   are on their way.  Once all have arrived, starts reading the
+   source. */
+
+void scp_delta_signatures_next(ScpDeltaContext dc)
+{
+  off_t end = (off_t)dc->num_blocks * dc->block_size;
+  size_t range = SCP_DELTA_RANGE - SCP_DELTA_RANGE % dc->block_size;
+  ScpDeltaRequest request;
+
+  if (range == 0)
+    range = dc->block_size;
+  while (dc->signatures_pending < SCP_DELTA_SIGNATURE_REQUESTS &&
+         dc->signatures_offset < end)
+    {
+      request = scp_delta_request(dc);
+      request->offset = dc->signatures_offset;
+      request->len = (((off_t)range < end - dc->signatures_offset) ?
+                      range : (size_t)(end - dc->signatures_offset));
+      dc->signatures_offset += request->len;
+      dc->signatures_pending++;
+      ssh_file_client_block_signatures(dc->dst_handle, dc->hash_name,
+                                       request->offset, (off_t)request->len,
+                                       dc->block_size,
+                                       scp_delta_signatures_callback,
+                                       request);
+    }
+  if (dc->signatures_pending == 0)
+    scp_delta_start_reading(dc);
+}
+
+/* Starts copying `file_size' bytes from `src_handle' over the old
+   file of `old_size' bytes in `dst_handle', whose server supports
+   block-signatures with the hash function `hash_name'.  `done' is
+   called from the event loop once the destination has been brought up
+   to date and cut to `file_size', or the copy has failed. */
+
+void scp_delta_start(ScpSession session,
+                     SshFileHandle src_handle,
+                     SshFileHandle dst_handle,
+                     off_t file_size,
+                     off_t old_size,
+                     const char *hash_name,
+                     Boolean show_progress,
+                     int width,
+                     void (*done)(Boolean ok, off_t bytes_sent,
+                                  void *context),
+                     void *done_context)
+{
+  ScpDeltaContext dc;
+  size_t b;
+
+  SSH_DEBUG(7, ("src_handle = %p dst_handle = %p file_size = %lu "
+                "old_size = %lu", src_handle, dst_handle,
+                (unsigned long)file_size, (unsigned long)old_size));
+
+  dc = ssh_xcalloc(1, sizeof(*dc));
+  dc->session = session;
+  dc->state = SCP_FC_RUNNING;
+  dc->src_handle = src_handle;
+  dc->dst_handle = dst_handle;
+  dc->file_size = file_size;
+  dc->old_size = old_size;
+  dc->hash_name = ssh_xstrdup(hash_name);
+  if (ssh_hash_allocate(hash_name, &dc->hash) != SSH_CRYPTO_OK)
+    ssh_fatal("scp_delta_start: cannot allocate %s", hash_name);
+  dc->digest_len = ssh_hash_digest_length(dc->hash);
+  dc->match = -1;
+  dc->show_progress = show_progress;
+  dc->term_width = width;
+  dc->done = done;
+  dc->done_context = done_context;
+  dc->window = (session->max_requests > 0 ? session->max_requests :
+                SCP_REQUESTS_MAX);
+
+  /* Blocks of about the square root of the file size balance the
+     signatures sent against the data sent for a change, as in
+     rsync.  Very large files get larger blocks still, to keep the
+     table of them in bounds. */
+  for (b = SCP_DELTA_BLOCK_MIN;
+       b < SCP_DELTA_BLOCK_MAX && (off_t)b * b < old_size;
+       b += 0x400)
+    ;
+  while (old_size / b > SCP_DELTA_BLOCKS_MAX)
+    b += SCP_DELTA_BLOCK_MAX;
+  dc->block_size = b;
+  /* A new file shorter than a block is just written. */
+  dc->num_blocks = (file_size < (off_t)b) ? 0 : (long)(old_size / b);
+  dc->block_crcs = ssh_xmalloc((dc->num_blocks + 1) * sizeof(SshUInt32));
+  dc->block_digests = ssh_xmalloc((dc->num_blocks + 1) * dc->digest_len);
+
+  ssh_register_timeout(SCP_FILESERVER_TIMEOUT,
+                       0,
+                       scp_delta_timeout,
+                       dc);
+  scp_delta_signatures_next(dc);
+}
+/*
+ * End of copying over an old copy
+ */
+
+/*
+ * Copying of one file.  scp_move_file() starts the copy and returns;
+ * the rest happens in the callbacks below, and at most
+ * session->max_files copies are going on at the same time.
+ */
+
+void scp_transfer_next(ScpTransfer transfer);
+void scp_transfer_close(ScpTransfer transfer);
+
+void scp_transfer_timeout(void *context)
+{
+  ScpTransfer transfer = (ScpTransfer)context;
+
+  scp_remote_dead_timeout(transfer->session);
+}
+
+/* Waits at most SCP_FILESERVER_TIMEOUT for the operation just sent
+   to complete. */
+
+void scp_transfer_wait(ScpTransfer transfer)
+{
+  ssh_cancel_timeouts(scp_transfer_timeout, transfer);
+  ssh_register_timeout(SCP_FILESERVER_TIMEOUT,
+                       0,
+                       scp_transfer_timeout,
+                       transfer);
+}
+
+void scp_transfer_print_stats(ScpTransfer transfer)
+{
+  SshUInt64 time_sec;
+  SshUInt32 time_nsec;
+  int minutes;
+  int seconds;
+  double sec_dbl;
+  char str_min[256];
+  char per_sec[256];
+
+  /* Transfer time in seconds */
+  ssh_time_measure_stop(transfer->timer);
+  ssh_time_measure_get_value(transfer->timer, &time_sec, &time_nsec);
+  minutes = time_sec / 60;
+  seconds = time_sec % 60;
+
+  if (minutes > 0)
+    snprintf(str_min, sizeof(str_min), "%d minute%s ", 
+             minutes,
+             (minutes != 1) ? "s" : "");
+  else
+    str_min[0] = '\000';
+
+  sec_dbl = (double)ssh_time_measure_get(transfer->timer, 
+                                         SSH_TIME_GRANULARITY_SECOND);
+  if (sec_dbl > 0.0)
+    {
+      snprintf(per_sec, sizeof(per_sec), " [%.2f kB/sec]", 
+               (((double)transfer->file_len) / (sec_dbl * 1024.0)));
+    }
+  else
+    {
+      per_sec[0] = '\000';
+    }
+
+  printf("%s%lu bytes transferred in %s%d.%02d seconds%s.\n",
+         transfer->show_progress ? "\n" : "",
+         (unsigned long)transfer->file_len,
+         str_min,
+         seconds,
+         (int)(time_nsec / 10000000),
+         per_sec);
+  if (transfer->delta_done && transfer->file_len > 0)
+    printf("%lu bytes sent, the rest was found in the old file.\n",
+           (unsigned long)transfer->delta_sent);
+}
+
+void scp_transfer_print_header(ScpTransfer transfer, const char *what)
+{
+  printf("%s %s%s%s -> %s%s%s  (%luk)\n",
+         what,
+         (transfer->src_host != NULL) ? transfer->src_host : "",
+         (transfer->src_host != NULL) ? ":" : "",
+         transfer->src_file,
+         (transfer->dst_host != NULL) ? transfer->dst_host : "",
+         (transfer->dst_host != NULL) ? ":" : "",
+         transfer->dst_file,
+         (unsigned long) (transfer->file_len >> 10) + 1);
+}
+
+/* Frees the transfer, and wakes up scp_wait_transfers() if it is
+   waiting for it. */
+
+void scp_transfer_free(ScpTransfer transfer)
+{
+  ScpSession session = transfer->session;
+
+  ssh_cancel_timeouts(scp_transfer_timeout, transfer);
+  ssh_time_measure_free(transfer->timer);
+  if (transfer->src_attributes)
+    ssh_xfree(transfer->src_attributes);
+  ssh_xfree(transfer->src_host);
+  ssh_xfree(transfer->src_file);
+  ssh_xfree(transfer->dst_host);
+  ssh_xfree(transfer->dst_file);
+  if (transfer->verify_hash)
+    ssh_xfree(transfer->verify_hash);
+  if (transfer->verify_digests)
+    ssh_xfree(transfer->verify_digests);
+  if (transfer->delta_hash)
+    ssh_xfree(transfer->delta_hash);
+  ssh_xfree(transfer);
+
+  session->transfers_active--;
+  if (session->transfers_waiting)
+    ssh_event_loop_abort();
+}
+
+void scp_transfer_close_callback(SshFileClientError error, void *context)
+{
+  scp_transfer_close((ScpTransfer)context);
+}
+
+/* Closes the handles still open, one at a time, and frees the
+   transfer when they are closed. */
+
+void scp_transfer_close(ScpTransfer transfer)
+{
+  SshFileHandle handle;
+
+  if (transfer->dst_handle != NULL)
+    {
+      handle = transfer->dst_handle;
+      transfer->dst_handle = NULL;
+    }
+  else if (transfer->src_handle != NULL)
+    {
+      handle = transfer->src_handle;
+      transfer->src_handle = NULL;
+    }
+  else
+    {
+      scp_transfer_free(transfer);
+      return;
+    }
+  scp_transfer_wait(transfer);
+  ssh_file_client_close(handle, scp_transfer_close_callback, transfer);
+}
+
+/* Sets the attributes of the copy if asked to, and closes the files. */
+
+void scp_transfer_finish(ScpTransfer transfer)
+{
+  ScpSession session = transfer->session;
+
+  if (session->preserve_flag)
+    {
+      scp_transfer_wait(transfer);
+      ssh_file_client_fsetstat(transfer->dst_handle,
+                               transfer->src_attributes,
+                               scp_transfer_close_callback,
+                               transfer);
+      return;
+    }
+  scp_transfer_close(transfer);
+}
+
+/* Returns the hash function both servers of the transfer can hash
+   blocks of files with, or NULL if there is none.  The returned string
+   must be freed with ssh_xfree. */
+
+char *scp_transfer_verify_hash(ScpTransfer transfer)
+{
+  const char *src_hashes, *dst_hashes;
+  char *list, *hashes;
+
+  if (!ssh_file_client_extension(transfer->src_client, "block-hash@ssh.com",
+                                 &src_hashes) ||
+      !ssh_file_client_extension(transfer->dst_client, "block-hash@ssh.com",
+                                 &dst_hashes))
+    return NULL;
+
+  list = ssh_name_list_intersection(SCP_VERIFY_HASHES, src_hashes);
+  hashes = ssh_name_list_intersection(list, dst_hashes);
+  ssh_xfree(list);
+  hashes[strcspn(hashes, ",")] = '\0';
+  if (hashes[0] == '\0')
+    {
+      ssh_xfree(hashes);
+      return NULL;
+    }
+  return hashes;
+}
+
+void scp_transfer_verify_next(ScpTransfer transfer);
+
+/* Called with the digests of the blocks of both files.  The files are
+   compared as far as both servers got, and the rest is asked for
+   again. */
+
+void scp_transfer_verify_reply(ScpTransfer transfer, 
+                               SshFileClientError error,
+                               const unsigned char *digests,
+                               size_t len)
+{
+  ScpSession session = transfer->session;
+  size_t blocks;
+
+  /* Keep the reply of the side that answered first. */
+  if (transfer->verify_replies++ == 0)
+    {
+      transfer->verify_error = error;
+      if (error == SSH_FX_OK)
+        {
+          transfer->verify_digests = ssh_xmemdup(digests, len);
+          transfer->verify_digests_len = len;
+        }
+      return;
+    }
+  ssh_cancel_timeouts(scp_transfer_timeout, transfer);
+
+  if (transfer->verify_error != SSH_FX_OK || error != SSH_FX_OK)
+    {
+      /* One of the files ended early; the sizes differ. */
+      if (transfer->verify_error == SSH_FX_EOF || error == SSH_FX_EOF)
+        blocks = 0;
+      else
+        {
+          ssh_warning("Cannot verify %s%s%s: hashing failed",
+                      (transfer->dst_host != NULL) ? transfer->dst_host : "",
+                      (transfer->dst_host != NULL) ? ":" : "",
+                      transfer->dst_file);
+          scp_set_error(session, SCP_ERROR_VERIFY_FAILED);
+          scp_transfer_close(transfer);
+          return;
+        }
+    }
+  else
+    {
+      if (len > transfer->verify_digests_len)
+        len = transfer->verify_digests_len;
+      blocks = len / transfer->verify_digest_len;
+      if (memcmp(digests, transfer->verify_digests,
+                 blocks * transfer->verify_digest_len) != 0)
+        blocks = 0;
+    }
+  if (transfer->verify_digests)
+    {
+      ssh_xfree(transfer->verify_digests);
+      transfer->verify_digests = NULL;
+    }
+
+  if (blocks == 0)
+    {
+      ssh_warning("Verifying %s%s%s failed: it differs from the source",
+                  (transfer->dst_host != NULL) ? transfer->dst_host : "",
+                  (transfer->dst_host != NULL) ? ":" : "",
+                  transfer->dst_file);
+      scp_set_error(session, SCP_ERROR_VERIFY_FAILED);
+      scp_transfer_close(transfer);
+      return;
+    }
+
+  transfer->verify_offset += (off_t)blocks * SCP_VERIFY_BLOCK_SIZE;
+  if (transfer->verify_offset < transfer->file_len)
+    scp_transfer_verify_next(transfer);
+  else
+    scp_transfer_finish(transfer);
+}
+
+void scp_transfer_verify_src_callback(SshFileClientError error,
+                                      const unsigned char *data,
+                                      size_t len,
+                                      void *context)
+{
+  scp_transfer_verify_reply((ScpTransfer)context, error, data, len);
+}
+
+void scp_transfer_verify_dst_callback(SshFileClientError error,
+                                      const unsigned char *data,
+                                      size_t len,
+                                      void *context)
+{
+  scp_transfer_verify_reply((ScpTransfer)context, error, data, len);
+}
+
+/* Asks both servers for the digests of the next part of the files.
+   The files are hashed where they are, so only the digests are sent
+   over the connections. */
+
+void scp_transfer_verify_next(ScpTransfer transfer)
+{
+  transfer->verify_replies = 0;
+  scp_transfer_wait(transfer);
+  ssh_file_client_block_hash(transfer->dst_handle, transfer->verify_hash,
+                             transfer->verify_offset, SCP_VERIFY_RANGE,
+                             SCP_VERIFY_BLOCK_SIZE,
+                             scp_transfer_verify_dst_callback, transfer);
+  ssh_file_client_block_hash(transfer->src_handle, transfer->verify_hash,
+                             transfer->verify_offset, SCP_VERIFY_RANGE,
+                             SCP_VERIFY_BLOCK_SIZE,
+                             scp_transfer_verify_src_callback, transfer);
+}
+
+/* Starts comparing the copy with its source, if both servers can hash
+   them. */
+
+void scp_transfer_verify(ScpTransfer transfer)
+{
+  SshHash hash;
+
+  transfer->verify_hash = scp_transfer_verify_hash(transfer);
+  if (transfer->verify_hash == NULL ||
+      ssh_hash_allocate(transfer->verify_hash, &hash) != SSH_CRYPTO_OK)
+    {
+      ssh_warning("Cannot verify %s%s%s: the server does not support "
+                  "hashing files",
+                  (transfer->dst_host != NULL) ? transfer->dst_host : "",
+                  (transfer->dst_host != NULL) ? ":" : "",
+                  transfer->dst_file);
+      scp_transfer_finish(transfer);
+      return;
+    }
+  transfer->verify_digest_len = ssh_hash_digest_length(hash);
+  ssh_hash_free(hash);
+
+  transfer->verify_offset = 0;
+  scp_transfer_verify_next(transfer);
+}
+
+void scp_transfer_copy_done(Boolean ok, void *context)
+{
+  ScpTransfer transfer = (ScpTransfer)context;
+  ScpSession session = transfer->session;
+
+  if (!ok)
+    {
+      scp_transfer_close(transfer);
+      return;
+    }
+
+  if (!session->nostat)
+    {
+      if (!transfer->show_progress)
+        scp_transfer_print_header(transfer, "Transfering");
+      scp_transfer_print_stats(transfer);
+    }
+
+  if (session->verify_flag && transfer->file_len > 0)
+    {
+      scp_transfer_verify(transfer);
+      return;
+    }
+  scp_transfer_finish(transfer);
+}
+
+void scp_transfer_delta_done(Boolean ok, off_t bytes_sent, void *context)
+{
+  ScpTransfer transfer = (ScpTransfer)context;
+
+  transfer->delta_done = ok;
+  transfer->delta_sent = bytes_sent;
+  scp_transfer_copy_done(ok, transfer);
+}
+
+/* Copies the file into the destination, which is empty. */
+
+void scp_transfer_copy(ScpTransfer transfer)
+{
+  if (transfer->file_len == 0)
+    {
+      scp_transfer_copy_done(TRUE, transfer);
+      return;
+    }
+  /* A file copied within one server is copied by the server, if it
+     can.  Otherwise the holes of the source are skipped, if its server
+     can find them. */
+  scp_copy_file_start(transfer->session,
+                      transfer->src_handle, transfer->dst_handle,
+                      transfer->src_host != NULL,
+                      transfer->dst_host != NULL,
+                      (transfer->src_host != NULL &&
+                       transfer->src_client == transfer->dst_client &&
+                       ssh_file_client_extension(transfer->src_client,
+                                                 "copy-data@ssh.com",
+                                                 NULL)),
+                      ssh_file_client_extension(transfer->src_client,
+                                                "data-extents@ssh.com", NULL),
+                      transfer->file_len,
+                      transfer->show_progress, transfer->width,
+                      scp_transfer_copy_done, transfer);
+}
+
+void scp_transfer_dst_fstat_callback(SshFileClientError error, 
+                                     SshFileAttributes attributes,
+                                     void *context)
+{
+  ScpTransfer transfer = (ScpTransfer)context;
+  ScpSession session = transfer->session;
+
+  ssh_cancel_timeouts(scp_transfer_timeout, transfer);
+  if (error != SSH_FX_OK || attributes == NULL)
+    {
+      scp_set_error(session, SCP_ERROR_CANNOT_STAT);
+      ssh_warning("Cannot stat destination file %s%s%s",
+                  (transfer->dst_host != NULL) ? transfer->dst_host : "",
+                  (transfer->dst_host != NULL) ? ":" : "",
+                  transfer->dst_file);
+      scp_transfer_close(transfer);
+      return;
+    }
+
+  if ((attributes->flags & SSH_FILEXFER_ATTR_SIZE) && attributes->size == 0)
+    {
+      scp_transfer_copy(transfer);
+      return;
+    }
+  scp_delta_start(session, transfer->src_handle, transfer->dst_handle,
+                  transfer->file_len,
+                  ((attributes->flags & SSH_FILEXFER_ATTR_SIZE) ?
+                   attributes->size : 0),
+                  transfer->delta_hash,
+                  transfer->show_progress, transfer->width,
+                  scp_transfer_delta_done, transfer);
+}
+
+void scp_transfer_dst_open_callback(SshFileClientError error, 
+                                    SshFileHandle handle,
+                                    void *context)
+{
+  ScpTransfer transfer = (ScpTransfer)context;
+  ScpSession session = transfer->session;
+
+  ssh_cancel_timeouts(scp_transfer_timeout, transfer);
+  if (error != SSH_FX_OK)
+    {
+      ssh_warning("Cannot open destination file %s%s%s",
+                  (transfer->dst_host != NULL) ? transfer->dst_host : "",
+                  (transfer->dst_host != NULL) ? ":" : "",
+                  transfer->dst_file);
+      scp_set_error(session, SCP_ERROR_CANNOT_CREATE);
+      scp_transfer_close(transfer);
+      return;
+    }
+  transfer->dst_handle = handle;
+
+  if (transfer->show_progress)
+    {
+      scp_transfer_print_header(transfer, "Transfering");
+      scp_get_win_dim(&transfer->width, NULL);
+      scp_kitt(0, transfer->file_len, transfer->width);
+    }
+
+  /* The old file was not truncated; see how much of it there is. */
+  if (transfer->delta_hash != NULL)
+    {
+      scp_transfer_wait(transfer);
+      ssh_file_client_fstat(handle, scp_transfer_dst_fstat_callback,
+                            transfer);
+      return;
+    }
+  scp_transfer_copy(transfer);
+}
+
+/* Returns the hash function to compare the blocks of the file with
+   an old copy at the destination, or NULL if the file is just copied.
+   The returned string must be freed with ssh_xfree. */
+
+char *scp_transfer_delta_hash(ScpTransfer transfer)
+{
+  const char *dst_hashes;
+  char *hashes;
+  SshHash hash;
+
+  /* Reading the whole source to find what has changed only saves
+     something when the destination is remote, and is not worth it when
+     the server copies the file itself. */
+  if (!transfer->session->delta_flag || transfer->dst_host == NULL ||
+      transfer->src_client == transfer->dst_client ||
+      !ssh_file_client_extension(transfer->dst_client,
+                                 "block-signatures@ssh.com", &dst_hashes))
+    return NULL;
+
+  hashes = ssh_name_list_intersection(SCP_DELTA_HASHES, dst_hashes);
+  hashes[strcspn(hashes, ",")] = '\0';
+  if (hashes[0] == '\0' ||
+      ssh_hash_allocate(hashes, &hash) != SSH_CRYPTO_OK)
+    {
+      ssh_xfree(hashes);
+      return NULL;
+    }
+  ssh_hash_free(hash);
+  return hashes;
+}
+
+/* Opens the destination file.  It is truncated, unless the old data
+   in it is to be used. */
+
+void scp_transfer_open_dst(ScpTransfer transfer)
+{
+  ScpSession session = transfer->session;
+
+  transfer->delta_hash = scp_transfer_delta_hash(transfer);
+  if (session->delta_flag && transfer->delta_hash == NULL &&
+      transfer->dst_host != NULL &&
+      transfer->src_client != transfer->dst_client)
+    SSH_DEBUG(2, ("The server cannot compare blocks of files; copying "
+                  "%s in full.", transfer->dst_file));
+  scp_transfer_wait(transfer);
+  ssh_file_client_open(transfer->dst_client,
+                       transfer->dst_file,
+                       O_CREAT |
+                         (transfer->delta_hash != NULL ? 0 : O_TRUNC) |
+                         ((session->verify_flag ||
+                           transfer->delta_hash != NULL) ?
+                          O_RDWR : O_WRONLY),
+                       NULL,
+                       scp_transfer_dst_open_callback,
+                       transfer);
+}
+
+void scp_transfer_remove_callback(SshFileClientError error, void *context)
+{
+  ScpTransfer transfer = (ScpTransfer)context;
+
+  ssh_cancel_timeouts(scp_transfer_timeout, transfer);
+  scp_transfer_open_dst(transfer);
+}
+
+void scp_transfer_fstat_callback(SshFileClientError error, 
+                                 SshFileAttributes attributes,
+                                 void *context)
+{
+  ScpTransfer transfer = (ScpTransfer)context;
+  ScpSession session = transfer->session;
+
+  ssh_cancel_timeouts(scp_transfer_timeout, transfer);
+  if (error != SSH_FX_OK || attributes == NULL)
+    {
+      scp_set_error(session, SCP_ERROR_CANNOT_STAT);
+      ssh_warning("Cannot stat source file %s%s%s",
+                  (transfer->src_host != NULL) ? transfer->src_host : "",
+                  (transfer->src_host != NULL) ? ":" : "",
+                  transfer->src_file);
+      scp_transfer_close(transfer);
+      return;
+    }
+  transfer->src_attributes = ssh_file_attributes_dup(attributes);
+  transfer->file_len = attributes->size;
+
+  if ((attributes->permissions & S_IFMT) != S_IFREG) 
+    {
+      ssh_warning("Source file %s%s%s is not a regular file",
+                  (transfer->src_host != NULL) ? transfer->src_host : "",
+                  (transfer->src_host != NULL) ? ":" : "",
+                  transfer->src_file);
+      scp_set_error(session, SCP_ERROR_NOT_REGULAR_FILE);
+      scp_transfer_close(transfer);
+      return;
+    }
+
+  if (session->do_not_copy)
+    {
+      scp_transfer_print_header(transfer, "Not transferring");
+      scp_transfer_close(transfer);
+      return;
+    }
+
+  if (session->unlink_flag)
+    {
+      scp_transfer_wait(transfer);
+      ssh_file_client_remove(transfer->dst_client, transfer->dst_file,
+                             scp_transfer_remove_callback, transfer);
+    }
+  else
+    scp_transfer_open_dst(transfer);
+}
+
+void scp_transfer_src_open_callback(SshFileClientError error, 
+                                    SshFileHandle handle,
+                                    void *context)
+{
+  ScpTransfer transfer = (ScpTransfer)context;
+
+  ssh_cancel_timeouts(scp_transfer_timeout, transfer);
+  if (error != SSH_FX_OK)
+    {
+      scp_set_error(transfer->session, SCP_ERROR_CANNOT_OPEN);
+      ssh_warning("Cannot open source file %s%s%s",
+                  (transfer->src_host != NULL) ? transfer->src_host : "",
+                  (transfer->src_host != NULL) ? ":" : "",
+                  transfer->src_file);
+      scp_transfer_free(transfer);
+      return;
+    }
+  transfer->src_handle = handle;
+  scp_transfer_wait(transfer);
+  ssh_file_client_fstat(handle, scp_transfer_fstat_callback, transfer);
+}
+
+void scp_move_file(ScpSession session,
+                   char *src_host,
+                   char *src_file,
+                   SshFileClient src_client,
+                   char *dst_host,
+                   char *dst_file,
+                   SshFileClient dst_client)
+{
+  ScpTransfer transfer;
+
+  /* Make room for the file. */
+  scp_wait_transfers(session, session->max_files - 1);
+
+  transfer = ssh_xcalloc(1, sizeof(*transfer));
+  transfer->session = session;
+  transfer->src_host = src_host ? ssh_xstrdup(src_host) : NULL;
+  transfer->src_file = ssh_xstrdup(src_file);
+  transfer->src_client = src_client;
+  transfer->dst_host = dst_host ? ssh_xstrdup(dst_host) : NULL;
+  transfer->dst_file = ssh_xstrdup(dst_file);
+  transfer->dst_client = dst_client;
+
+  /* The progress bar is only drawn for a file that is copied alone:
+     one copied with -j 1, or the last file when the others are
+     already done. */
+  transfer->show_progress = (!session->nostat &&
+                             (session->max_files == 1 ||
+                              (session->transfers_active == 0 &&
+                               session->src_list == NULL)));
+  transfer->timer = ssh_time_measure_allocate();
+  ssh_time_measure_start(transfer->timer);
+
+  session->transfers_active++;
+  scp_transfer_wait(transfer);
+  ssh_file_client_open(src_client, src_file, O_RDONLY, NULL,
+                       scp_transfer_src_open_callback, transfer);
+}
+
+/* Runs the event loop until at most `max_active' files are being
+   copied. */
+
+void scp_wait_transfers(ScpSession session, int max_active)
+{
+  while (session->transfers_active > max_active)
+    {
+      session->transfers_waiting = TRUE;
+      ssh_event_loop_run();
+      session->transfers_waiting = FALSE;
+    }
+}
+
+/* Closes the connection to the current source host, once nothing is
+   being copied from it any more. */
+
+void scp_drop_src_remote_client(ScpSession session)
+{
+  if (session->src_remote_client == NULL)
+    return;
+  scp_wait_transfers(session, 0);
+  if (session->src_remote_client != session->dst_remote_client)
+    ssh_file_client_destroy(session->src_remote_client);
+  session->src_remote_client = NULL;
 }
 
 void scp_set_error(ScpSession session, int error)
@@ -2774,7 +4467,6 @@ Boolean scp_is_dst_directory(ScpSession session)
 int scp_execute(ScpSession session)
 {
   SshStream tmp1a, tmp1b, tmp2a, tmp2b;
-  Boolean r;
 
   ssh_stream_pair_create(&tmp2a, &tmp2b);  
   session->src_local_server = ssh_file_server_wrap(tmp2a);
@@ -2865,18 +4557,20 @@ int scp_execute(ScpSession session)
             }
         }
 
-      r = scp_move_file(session,
-                        session->current_src_location->host,
-                        session->current_src_location->file,
-                        (session->current_src_is_local ? 
-                         session->src_local_client :
-                         session->src_remote_client),
-                        session->dst_location->host,
-                        session->current_dst_file, 
-                        session->dst_client);
+      scp_move_file(session,
+                    session->current_src_location->host,
+                    session->current_src_location->file,
+                    (session->current_src_is_local ? 
+                     session->src_local_client :
+                     session->src_remote_client),
+                    session->dst_location->host,
+                    session->current_dst_file, 
+                    session->dst_client);
     }
 
-  if (session->src_remote_client != NULL)
+  scp_wait_transfers(session, 0);
+  if (session->src_remote_client != NULL &&
+      session->src_remote_client != session->dst_client)
     ssh_file_client_destroy(session->src_remote_client);
   if (session->dst_client != NULL)
     ssh_file_client_destroy(session->dst_client);
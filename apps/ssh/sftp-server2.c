@@ -20,21 +20,50 @@
 #include "sshunixfdstream.h"
 #include "sshfilexfer.h"
 #include "sshsignals.h"
+#include "sshgetopt.h"
 
 #define SSH_DEBUG_MODULE "SshSftpServer"
 
+/* Number of requests processed at a time, unless told otherwise with
+   -j. */
+#define SFTP_SERVER_DEFAULT_REQUESTS    4
+#define SFTP_SERVER_MAX_REQUESTS        64
+
 #ifdef HAVE_LIBWRAP
 int allow_severity = SSH_LOG_INFORMATIONAL;
 int deny_severity = SSH_LOG_WARNING;
 #endif /* HAVE_LIBWRAP */
 
-int main(void)
+void usage(void)
+{
+  fprintf(stderr, "usage: sftp-server2 [-j requests]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
 {       
   SshFileServer server;
+  int max_requests = SFTP_SERVER_DEFAULT_REQUESTS;
+  int ch;
+
+  while ((ch = ssh_getopt(argc, argv, "j:", NULL)) != -1)
+    {
+      switch (ch)
+        {
+        case 'j':
+          max_requests = atoi(ssh_optarg);
+          if (max_requests < 1 || max_requests > SFTP_SERVER_MAX_REQUESTS)
+            usage();
+          break;
+        default:
+          usage();
+        }
+    }
     
   ssh_event_loop_initialize();
   ssh_signals_prevent_core(TRUE, NULL);
   server = ssh_file_server_wrap(ssh_stream_fd_stdio());
+  ssh_file_server_set_concurrency(server, max_requests);
   ssh_event_loop_run();      
   ssh_event_loop_uninitialize();
   ssh_signals_reset();
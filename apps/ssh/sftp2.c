@@ -27,6 +27,8 @@
 #include "sshfilexfer.h"
 #include "sshstreampair.h"
 #include "sshunixpipestream.h"
+#include "sshcrypt.h"
+#include "namelist.h"
 
 #define SSH_DEBUG_MODULE "SshSftp"
 
@@ -41,6 +43,13 @@ const char *av0;
 /* buffer size for put/get */
 #define SFTP_BUF_SIZE 0x4000
 
+/* When verifying transfers, the hash functions tried in order of
+   preference, the size of the blocks hashed, and the amount asked for
+   at a time. */
+#define SFTP_VERIFY_HASHES      "sha1,md5"
+#define SFTP_VERIFY_BLOCK_SIZE  0x100000
+#define SFTP_VERIFY_RANGE       0x4000000
+
 /* sftp context */
 
 typedef struct SftpCallbackCtxRec *SftpCallbackCtx;
@@ -62,6 +71,7 @@ typedef struct
   Boolean bell;
   Boolean quiet;
   Boolean hash;
+  Boolean verify;
   Boolean alive;
   Boolean sort;
   Boolean page;  
@@ -532,6 +542,25 @@ Boolean sftp_file_rmdir(Sftp sftp, SshFileClient client,
   return sftp_error(sftp); 
 }
 
+/* Hash a part of a file in blocks */
+
+Boolean sftp_file_block_hash(Sftp sftp, SshFileHandle handle,
+                             const char *hash_name, off_t offset,
+                             off_t len, size_t block_size)
+{
+  sftp->called = FALSE;
+  ssh_file_client_block_hash(handle, hash_name, offset, len, block_size,
+                             sftp_file_data_callback, sftp);
+  if (!sftp->called)
+    {
+      ssh_register_timeout(sftp->timeout, 0, sftp_timeout_callback, sftp);
+      ssh_event_loop_run();
+      ssh_cancel_timeouts(sftp_timeout_callback, sftp);
+    }
+
+  return sftp_error(sftp);
+}
+
 /* Resolve a real path  */
 
 Boolean sftp_file_realpath(Sftp sftp, SshFileClient client,
@@ -1148,6 +1177,89 @@ void sftp_kitt(off_t pos, off_t total, int width)
   fflush(stdout);
 }
 
+/* Compare the first `file_len' bytes of two open files by having
+   their servers hash them, so that neither file needs to be read
+   again over the connection.  Returns FALSE if the files are the
+   same, and TRUE if they are not or if they could not be compared,
+   after printing a message. */
+
+Boolean sftp_verify_file(SshFileClient src_cl, SshFileHandle src_handle,
+                         SshFileClient dest_cl, SshFileHandle dest_handle,
+                         off_t file_len, Sftp sftp)
+{
+  const char *src_hashes, *dest_hashes;
+  char *list, *hash_name;
+  unsigned char *digests;
+  size_t digests_len, digest_len, blocks;
+  off_t offset;
+  SshHash hash;
+
+  if (file_len == 0)
+    return FALSE;
+
+  /* Pick a hash function both servers have. */
+  if (!ssh_file_client_extension(src_cl, "block-hash@ssh.com",
+                                 &src_hashes) ||
+      !ssh_file_client_extension(dest_cl, "block-hash@ssh.com",
+                                 &dest_hashes))
+    {
+      printf("Error: cannot verify, the server does not support "
+             "hashing files.\n");
+      return TRUE;
+    }
+  list = ssh_name_list_intersection(SFTP_VERIFY_HASHES, src_hashes);
+  hash_name = ssh_name_list_intersection(list, dest_hashes);
+  ssh_xfree(list);
+  hash_name[strcspn(hash_name, ",")] = '\0';
+  if (hash_name[0] == '\0' ||
+      ssh_hash_allocate(hash_name, &hash) != SSH_CRYPTO_OK)
+    {
+      printf("Error: cannot verify, no common hash function.\n");
+      ssh_xfree(hash_name);
+      return TRUE;
+    }
+  digest_len = ssh_hash_digest_length(hash);
+  ssh_hash_free(hash);
+
+  for (offset = 0; offset < file_len; 
+       offset += (off_t)blocks * SFTP_VERIFY_BLOCK_SIZE)
+    {
+      if (sftp_file_block_hash(sftp, dest_handle, hash_name, offset,
+                               SFTP_VERIFY_RANGE, SFTP_VERIFY_BLOCK_SIZE))
+        break;
+      digests = ssh_xmemdup(sftp->data, sftp->len);
+      digests_len = sftp->len;
+      if (sftp_file_block_hash(sftp, src_handle, hash_name, offset,
+                               SFTP_VERIFY_RANGE, SFTP_VERIFY_BLOCK_SIZE))
+        {
+          ssh_xfree(digests);
+          break;
+        }
+
+      /* Compare as far as both servers got. */
+      if (digests_len > sftp->len)
+        digests_len = sftp->len;
+      blocks = digests_len / digest_len;
+      if (blocks == 0 ||
+          memcmp(digests, sftp->data, blocks * digest_len) != 0)
+        {
+          ssh_xfree(digests);
+          break;
+        }
+      ssh_xfree(digests);
+    }
+  ssh_xfree(hash_name);
+
+  if (offset < file_len)
+    {
+      printf("Error: verification failed, the files differ.\n");
+      return TRUE;
+    }
+  if (sftp->verbose)
+    printf("Verified %lu bytes.\n", (unsigned long)file_len);
+  return FALSE;
+}
+
 /* Move a file from one "client" to another */
 
 int sftp_move_file(SshFileClient src_cl, char *src_path,
@@ -1165,7 +1277,9 @@ int sftp_move_file(SshFileClient src_cl, char *src_path,
     }
   src_handle = sftp->handle;
   
-  if (sftp_file_open(sftp, dest_cl, dest_path, O_CREAT | O_TRUNC | O_WRONLY, NULL))
+  if (sftp_file_open(sftp, dest_cl, dest_path, 
+                     O_CREAT | O_TRUNC | (sftp->verify ? O_RDWR : O_WRONLY),
+                     NULL))
     {
       goto close_error;
     }
@@ -1207,6 +1321,10 @@ int sftp_move_file(SshFileClient src_cl, char *src_path,
   
   if (sftp->hash)
     putchar('\n');  
+
+  if (sftp->verify &&
+      sftp_verify_file(src_cl, src_handle, dest_cl, dest_handle, offset, sftp))
+    goto close_error;
   
   sftp_file_close(sftp, src_handle);
   sftp_file_close(sftp, dest_handle);
@@ -1266,6 +1384,20 @@ int sftp_hash(int argc, char **argv, Sftp ctx)
   return 0;
 }  
 
+/* Toggle verifying transfers on / off. */
+
+int sftp_verify(int argc, char **argv, Sftp ctx)
+{ 
+  ctx->verify = !ctx->verify;
+  
+  if (ctx->verify)
+    printf("Verifying transfers enabled.\n");
+  else
+    printf("Verifying transfers disabled.\n");
+  
+  return 0;
+}  
+
 /* Change local directory. */
 
 int sftp_lcd(int argc, char **argv, Sftp sftp)
@@ -1572,6 +1704,7 @@ int sftp_status(int argc, char **argv, Sftp sftp)
   printf("Bell:             %s\n", sftp->bell ? "yes" : "no");
   printf("Quiet mode:       %s\n", sftp->quiet ? "yes" : "no");
   printf("Hashes:           %s\n", sftp->hash ? "yes" : "no");
+  printf("Verify:           %s\n", sftp->verify ? "yes" : "no");
   printf("Sorting:          %s\n", sftp->sort ? "yes" : "no");
   printf("Paginate:         %s\n", sftp->page ? "yes" : "no");
   printf("Timeout:          %ld sec\n", sftp->timeout);
@@ -1862,6 +1995,11 @@ struct SftpCmdRec sftp_cmd[] =
       "verbose", 0, 0, {NULL, NULL}, sftp_verbose, FALSE,
       "Toggle verbose mode on/off."      
     },
+
+    {
+      "verify", 0, 0, {NULL, NULL}, sftp_verify, FALSE,
+      "Toggle verifying transferred files."
+    },
   
     {
       NULL,  0, 0, {NULL, NULL}, NULL, FALSE, NULL
@@ -1887,6 +2025,7 @@ Sftp sftp_init()
   sftp->bell = FALSE;
   sftp->quiet = FALSE;
   sftp->hash = TRUE;
+  sftp->verify = FALSE;
   sftp->alive = TRUE;
   sftp->sort = TRUE;
   sftp->page = TRUE;
@@ -2071,6 +2210,12 @@ int main(int argc, char **argv)
           argc -= 1;
           argv += 1;
         }
+      else if (strcmp(argv[1], "-k") == 0)
+        {
+          sftp->verify = TRUE;
+          argc -= 1;
+          argv += 1;
+        }
       else if (strcmp(argv[1], "-S") == 0)
         {
           if (argc < 3)
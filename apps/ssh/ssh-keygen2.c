@@ -53,7 +53,7 @@ const char keygen_helptext[] =
   "\n"
   "Where `options' are:\n"
   " -b nnn         Specify key strength in bits (e.g. 1024)\n"
-  " -t dsa         Choose the key type (only dsa available).\n"
+  " -t dsa | rsa   Choose the key type (default dsa).\n"
   " -h             Print this help text.\n"
   " -e file        Edit the comment/passphrase of the key.\n"
   " -c comment     Provide the comment.\n"
@@ -106,6 +106,9 @@ const char *keygen_common_names[][2] =
   { "dsa", SSH_CRYPTO_DSS },
   { "dss", SSH_CRYPTO_DSS },
 
+  /* RSA, cheap to verify */
+  { "rsa", SSH_CRYPTO_RSA },
+
 
   /* Last entry */
   { NULL, NULL }
@@ -32,6 +32,8 @@
 #include "sshstdiofilter.h"
 #include "sshgetopt.h"
 #include "sshmiscstring.h"
+#include "sshmux.h"
+#include "sshfanout.h"
 
 #define SSH_DEBUG_MODULE "Ssh2"
 
@@ -49,6 +51,9 @@ int deny_severity = SSH_LOG_WARNING;
 const char *av0;
 SshRandomState random_state;
 
+/* The connection sharing master, if we are one. */
+SshMuxMaster mux_master = NULL;
+
 void client_disconnect(int reason, const char *msg, void *context)
 {
   SshClientData data = (SshClientData)context;
@@ -138,6 +143,11 @@ void client_disconnect(int reason, const char *msg, void *context)
       break;      
     }
   
+  if (mux_master)
+    {
+      ssh_mux_master_stop(mux_master);
+      mux_master = NULL;
+    }
   ssh_client_destroy(data->client);
   data->client = NULL;
 }
@@ -206,6 +216,13 @@ void session_close(void *context)
   
   ssh_debug("session_close");
 
+  /* No new shared sessions once ours is over. */
+  if (mux_master)
+    {
+      ssh_mux_master_stop(mux_master);
+      mux_master = NULL;
+    }
+
   if (num_channels == 0)
     {      
       if (data->client)
@@ -275,6 +292,13 @@ void ssh_stream_sink_filter_destroy(void *context)
   return;
 }
 
+void session_exit_status(SshUInt32 exit_status, void *context)
+{
+  SshClientData data = (SshClientData)context;
+
+  data->exit_status = (int)exit_status;
+}
+
 void remote_forward_completion(Boolean success, void *context)
 {
   SshForward fwd = (SshForward) context;
@@ -333,6 +357,13 @@ void client_authenticated(const char *user, void *context)
 #endif /* HAVE_DAEMON*/
     }
   
+  /* A master opens and closes channels for other clients, and the
+     server must not disconnect when the last of them closes.  This goes
+     before the remote forwards, as only one global request may wait for
+     its reply at a time. */
+  if (data->config->control_master && data->config->control_path)
+    ssh_client_share_connection(data->client);
+
 #ifdef SSH_CHANNEL_TCPFWD  
   for (fwd = data->config->local_forwards; fwd; fwd = fwd->next)
     if (!ssh_client_local_tcp_ip_forward(data->client, fwd->local_addr,
@@ -349,6 +380,16 @@ void client_authenticated(const char *user, void *context)
                                      (void *) fwd);
 #endif /* SSH_CHANNEL_TCPFWD */
 
+  /* Let later clients to this host use our connection. */
+  if (data->config->control_master && data->config->control_path)
+    {
+      mux_master = ssh_mux_master_start(data->config->control_path,
+                                        data->client);
+      if (mux_master == NULL)
+        ssh_warning("Could not create control socket %s.",
+                    data->config->control_path);
+    }
+
   if (data->config->dont_read_stdin)
     {
       freopen("/dev/null", "r", stdin);
@@ -400,7 +441,8 @@ void client_authenticated(const char *user, void *context)
                            data->term, (const char **)data->env,
                            data->forward_x11,
                            data->forward_agent,
-                           NULL, session_close, (void *)data);
+                           NULL, session_exit_status, session_close,
+                           (void *)data);
 }
 
 void connect_done(SshIpError error, SshStream stream, void *context)
@@ -433,6 +475,83 @@ void connect_done(SshIpError error, SshStream stream, void *context)
   data->client->common->no_session_channel = data->no_session_channel;
 }
 
+/* Makes a connection of our own to the server. */
+
+void ssh2_connect(SshClientData data)
+{
+  char *socks_server;
+
+  /* Figure out the name of the socks server, if any.  It can specified
+     at run time using the SSH_SOCKS_SERVER environment variable, or at
+     compile time using the SOCKS_DEFAULT_SERVER define.  The environment
+     variable overrides the compile-time define. */
+  socks_server = getenv("SSH_SOCKS_SERVER");
+#ifdef SOCKS_DEFAULT_SERVER
+  if (!socks_server)
+    socks_server = SOCKS_DEFAULT_SERVER;
+#endif /* SOCKS_DEFAULT_SERVER */
+  if (socks_server && strcmp(socks_server, "") == 0)
+    socks_server = NULL;
+  
+  /* Connect to the remote host. */
+  ssh_debug("connecting to %s...", data->config->host_to_connect);
+  ssh_tcp_connect_with_socks(data->config->host_to_connect,
+                             data->config->port, 
+                             socks_server, 5, 
+                             connect_done, (void *)data);
+}
+
+/* Called when the command has been run on all the hosts. */
+
+void fanout_done(int exit_status, void *context)
+{
+  SshClientData data = (SshClientData)context;
+
+  data->exit_status = exit_status;
+}
+
+/* Called when we know whether a master is running the session for us. */
+
+void mux_client_done(Boolean success, void *context)
+{
+  SshClientData data = (SshClientData)context;
+
+  if (success)
+    ssh_debug("using the shared connection at %s",
+              data->config->control_path);
+  else
+    ssh2_connect(data);
+}
+
+/* Expands ``~/'' and the %h (host), %p (port) and %r (remote user)
+   escapes in the ControlPath. */
+
+static void finalize_control_path(char **path, SshUser tuser,
+                                  const char *host, const char *port,
+                                  const char *user)
+{
+  char *tmp;
+  size_t len;
+
+  if (strncmp(*path, "~/", 2) == 0)
+    {
+      len = strlen(ssh_user_dir(tuser)) + strlen(*path);
+      tmp = ssh_xmalloc(len);
+      snprintf(tmp, len, "%s%s", ssh_user_dir(tuser), *path + 1);
+      ssh_xfree(*path);
+      *path = tmp;
+    }
+  tmp = ssh_replace_in_string(*path, "%h", host);
+  ssh_xfree(*path);
+  *path = tmp;
+  tmp = ssh_replace_in_string(*path, "%p", port);
+  ssh_xfree(*path);
+  *path = tmp;
+  tmp = ssh_replace_in_string(*path, "%r", user);
+  ssh_xfree(*path);
+  *path = tmp;
+}
+
 static void finalize_password_prompt(char **prompt, char *host, char *user)
 {
   char *tmp;
@@ -456,6 +575,8 @@ void ssh2_help(const char *name)
   ssh2_version(name);
   fprintf(stderr, "\n");
   fprintf(stderr, "Usage: %s [options] host [command]\n", name);
+  fprintf(stderr, "       %s [options] host1,host2,... command\n", name);
+  fprintf(stderr, "       %s [options] -H hostfile command\n", name);
   fprintf(stderr, "\n");
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "  -l user     Log in using this user name.\n");
@@ -472,6 +593,9 @@ void ssh2_help(const char *name)
   fprintf(stderr, "  -V          Display version number only.\n");
   fprintf(stderr, "  -q          Quiet; don't display any warning messages.\n");
   fprintf(stderr, "  -f          Fork into background after authentication.\n");
+  fprintf(stderr, "  -M          Share the connection with later clients (ControlMaster).\n");
+  fprintf(stderr, "  -H file     Run the command on the hosts listed in file.\n");
+  fprintf(stderr, "  -j jobs     Connect to at most this many hosts at a time (default: %d).\n", SSH_FANOUT_DEFAULT_JOBS);
   fprintf(stderr, "  -e char     Set escape character; ``none'' = disable (default: ~).\n");
   fprintf(stderr, "  -c cipher   Select encryption algorithm. Multiple -c options are \n");
   fprintf(stderr, "              allowed and a single -c flag can have only one cipher.\n");
@@ -514,6 +638,28 @@ char *ssh_get_host_name_from_command_line(int argc, char **argv)
       return ssh_xstrdup(argv[getopt_data.ind]);
 }
 
+/*
+ *  This function digs out the argument of the last -H option, ie. the
+ * file listing the hosts to run the command on.
+ */
+char *ssh_get_host_file_from_command_line(int argc, char **argv)
+{
+  struct SshGetOptDataRec getopt_data;
+  char *host_file = NULL;
+  int option;
+
+  ssh_getopt_init_data(&getopt_data);
+  getopt_data.reset = 1;
+  getopt_data.allow_plus = 1;
+  getopt_data.err = 0;
+
+  while ((option = ssh_getopt(argc, argv, SSH2_GETOPT_ARGUMENTS,
+                              &getopt_data)) != -1)
+    if (option == 'H' && getopt_data.val)
+      host_file = getopt_data.arg;
+  return host_file ? ssh_xstrdup(host_file) : NULL;
+}
+
 
 /*
  * 
@@ -523,11 +669,14 @@ char *ssh_get_host_name_from_command_line(int argc, char **argv)
 int main(int argc, char **argv)
 {
   int i;
-  char *host, *user, *userdir, *socks_server, *command;
+  char *host, *user, *userdir, *command;
   SshClientData data;
   SshUser tuser;
   char temp_s[1024];
   int have_c_arg;
+  char *host_file, *host_list;
+  int jobs;
+  SshFanOut fanout = NULL;
 
 #if 0
   sleep(30);
@@ -598,10 +747,24 @@ int main(int argc, char **argv)
                        SSH_CLIENT_GLOBAL_CONFIG_FILE, NULL);
 
   host = NULL;
-  
-  host = ssh_get_host_name_from_command_line(argc, argv);
+  host_list = NULL;
+  jobs = 0;
 
-  if (host)
+  /* With -H, or with several hosts separated by commas, the command is
+     run on all of them. */
+  host_file = ssh_get_host_file_from_command_line(argc, argv);
+  if (host_file == NULL)
+    host = ssh_get_host_name_from_command_line(argc, argv);
+
+  if (host_file)
+    {
+      /* The hosts are only known later. */
+    }
+  else if (host && strchr(host, ','))
+    {
+      host_list = host;
+    }
+  else if (host)
     {
       char *p;
       
@@ -630,7 +793,8 @@ int main(int argc, char **argv)
       exit(1);
     }
   
-  ssh_debug("hostname is '%s'.", data->config->host_to_connect);
+  if (data->config->host_to_connect)
+    ssh_debug("hostname is '%s'.", data->config->host_to_connect);
 
   /* Try to read in the user configuration file. */
 
@@ -663,7 +827,7 @@ int main(int argc, char **argv)
       
       option = ssh_getopt(argc, argv, SSH2_GETOPT_ARGUMENTS, NULL);
       
-      if ((option == -1) && (host == NULL))
+      if ((option == -1) && (host == NULL) && (host_file == NULL))
           {
             host = argv[ssh_optind];
             if (!host)
@@ -815,7 +979,26 @@ int main(int argc, char **argv)
         case 'f':
           data->config->go_background = (ssh_optval != 0);
           break;
+
+          /* Be a connection sharing master */
+        case 'M':
+          data->config->control_master = (ssh_optval != 0);
+          break;
               
+          /* Run the command on the hosts in a file */
+        case 'H':
+          if (!ssh_optval)
+            ssh_fatal("%s: Illegal -H parameter.", av0);
+          i++;
+          break;
+
+          /* Number of hosts connected at a time */
+        case 'j':
+          if (!ssh_optval || (jobs = atoi(ssh_optarg)) <= 0)
+            ssh_fatal("%s: Illegal -j parameter.", av0);
+          i++;
+          break;
+
           /* read in an alternative configuration file */
         case 'F':
           if (!ssh_optval)
@@ -976,7 +1159,8 @@ int main(int argc, char **argv)
   data->config->login_as_user = user;
   host = data->config->host_to_connect;
 
-  finalize_password_prompt(&data->config->password_prompt, host, user);
+  if (host)
+    finalize_password_prompt(&data->config->password_prompt, host, user);
 
   data->random_state = ssh_randseed_open(tuser, data->config);
 
@@ -998,23 +1182,54 @@ int main(int argc, char **argv)
   /* Finalize initialization. */
   ssh_config_init_finalize(data->config);
 
-  /* Figure out the name of the socks server, if any.  It can specified
-     at run time using the SSH_SOCKS_SERVER environment variable, or at
-     compile time using the SOCKS_DEFAULT_SERVER define.  The environment
-     variable overrides the compile-time define. */
-  socks_server = getenv("SSH_SOCKS_SERVER");
-#ifdef SOCKS_DEFAULT_SERVER
-  if (!socks_server)
-    socks_server = SOCKS_DEFAULT_SERVER;
-#endif /* SOCKS_DEFAULT_SERVER */
-  if (socks_server && strcmp(socks_server, "") == 0)
-    socks_server = NULL;
-  
-  /* Connect to the remote host. */
-  ssh_debug("connecting to %s...", host);
-  ssh_tcp_connect_with_socks(host, data->config->port, 
-                             socks_server, 5, 
-                             connect_done, (void *)data);
+  if (host_file || host_list)
+    {
+      char *p, *next;
+
+      if (data->command == NULL)
+        ssh_fatal("%s: A command is needed when running on several hosts.",
+                  av0);
+      fanout = ssh_fanout_create(data->config, tuser, data->random_state,
+                                 data->is_subsystem, data->command, jobs,
+                                 fanout_done, (void *)data);
+      if (host_file && !ssh_fanout_read_hosts(fanout, host_file))
+        exit(255);
+      for (p = host_list; p; p = next)
+        {
+          if ((next = strchr(p, ',')) != NULL)
+            *next++ = '\0';
+          if (*p && !ssh_fanout_add_host(fanout, p))
+            ssh_fatal("%s: Bad host \"%s\".", av0, p);
+        }
+      if (ssh_fanout_num_hosts(fanout) == 0)
+        ssh_fatal("%s: No hosts to run the command on.", av0);
+      ssh_fanout_start(fanout);
+    }
+  else
+    {
+      if (data->config->control_path)
+        finalize_control_path(&data->config->control_path, tuser, host,
+                              data->config->port, user);
+
+      /* If a master has a connection to the host, run the session
+         through it.  A pty, remote forwards, going to background, or
+         agent or X11 forwarding need a connection of our own. */
+      if (data->config->control_path && !data->config->control_master &&
+          !data->allocate_pty && !data->config->go_background &&
+          data->config->remote_forwards == NULL &&
+          !data->forward_agent && !data->forward_x11)
+        {
+          if (data->config->dont_read_stdin)
+            freopen("/dev/null", "r", stdin);
+          ssh_mux_client_start(data->config->control_path,
+                               data->no_session_channel, data->is_subsystem,
+                               data->command, data->config->local_forwards,
+                               mux_client_done, session_exit_status,
+                               (void *)data);
+        }
+      else
+        ssh2_connect(data);
+    }
   
   ssh_debug("entering event loop");
   ssh_event_loop_run();
@@ -1023,6 +1238,9 @@ int main(int argc, char **argv)
 
   /* Update random seed file. */
   ssh_randseed_update(tuser, data->random_state, data->config);
+
+  if (fanout)
+    ssh_fanout_destroy(fanout);
   
   ssh_debug("uninitializing event loop");
 
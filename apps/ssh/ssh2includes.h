@@ -34,7 +34,7 @@ ssh2includes.h
 #define SSH_SIGNER_PATH "ssh-signer2"
 
 /* arguments to ssh2 */
-#define SSH2_GETOPT_ARGUMENTS "ac:Cvd:e:fF:hi:l:L:no:p:PqR:s:Stx8gV"
+#define SSH2_GETOPT_ARGUMENTS "ac:Cvd:e:fF:hH:i:j:l:L:Mno:p:PqR:s:Stx8gV"
 
 
 #define SSH2_VERSION_STRING "SSH-" SSH2_VERSION
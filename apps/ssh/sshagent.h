@@ -83,6 +83,13 @@ void ssh_agent_open(SshAgentOpenCallback callback, void *context);
    active, it is terminated and its callback will never be called. */
 void ssh_agent_close(SshAgent agent);
 
+/* Makes ssh_agent_open share one connection to the agent between all the
+   handles it returns, when `share' is TRUE.  The requests made through
+   the handles are sent one at a time, in the order they were made, and
+   the connection stays open until sharing is turned off again.  Each
+   handle is still closed with ssh_agent_close. */
+void ssh_agent_share_connection(Boolean share);
+
 /* Callback to be called by operations that return a success/failure result. */
 typedef void (*SshAgentCompletion)(SshAgentError result, void *context);
 
@@ -135,8 +142,8 @@ typedef void (*SshAgentListCallback)(SshAgentError error,
                                      void *context);
 
 /* Returns the public keys for all private keys in possession of the agent.
-   Only a single operation may be in progress on the connection at any
-   one time. */
+   Requests made while an earlier one is in progress are sent
+   once it is complete. */
 void ssh_agent_list(SshAgent agent, SshAgentListCallback callback,
                     void *context);
 
@@ -150,10 +157,10 @@ typedef void (*SshAgentOpCallback)(SshAgentError error,
 
 /* Performs a private-key operation using the agent.  Calls the given
    callback when a reply has been received or a timeout occurs.
-   Only a single operation may be in progress on the connection at any
-   one time.  The caller can free any argument strings as soon as this
-   has returned (i.e., no need to wait until the callback has been
-   called). */
+   Requests made while an earlier one is in progress are sent
+   once it is complete.  The caller can free any argument strings as
+   soon as this has returned (i.e., no need to wait until the callback
+   has been called). */
 void ssh_agent_op(SshAgent agent, SshAgentOp op,
                   const unsigned char *certs, size_t certs_len,
                   const unsigned char *data, size_t len,
@@ -109,6 +109,10 @@ typedef struct SshChannelSessionRec
      legal to call destroy for the whole protocol from the callback. */
   void (*close_notify)(void *context);
 
+  /* Function to call when the exit status of the command is received.
+     This may be NULL. */
+  void (*exit_notify)(SshUInt32 exit_status, void *context);
+
   /* Context to pass to the various callback functions. */
   void *context;
 
@@ -1007,6 +1011,11 @@ Boolean ssh_channel_session_request_pty(SshChannelSession session,
   session->height_pixels = height_pixels;
   session->have_pty = TRUE;  
 
+  /* Echo and output of an interactive session go out ahead of any bulk
+     data. */
+  ssh_conn_channel_set_priority(session->common->conn, session->channel_id,
+                                SSH_CONN_PRIORITY_INTERACTIVE);
+
   return TRUE;
 }
 
@@ -1159,8 +1168,9 @@ Boolean ssh_channel_session_request_exit_status(SshChannelSession session,
       return FALSE;
     }
 
-  ((SshClientData) session->context)->exit_status = exit_status;
   SSH_DEBUG(2, ("received exit status : %d", exit_status));
+  if (session->exit_notify)
+    (*session->exit_notify)(exit_status, session->context);
   
   return TRUE;
 }
@@ -1680,6 +1690,10 @@ void ssh_channel_start_session_completion(int result,
                                     "pty-req", ssh_buffer_ptr(&buffer),
                                     ssh_buffer_len(&buffer), NULL, NULL);
 
+      /* Keystrokes go out ahead of any bulk data. */
+      ssh_conn_channel_set_priority(session->common->conn, session->channel_id,
+                                    SSH_CONN_PRIORITY_INTERACTIVE);
+
 #ifdef SIGWINCH
       /* Register a signal handler for SIGWINCH to send window change
          notifications to the server. */
@@ -1758,6 +1772,7 @@ void ssh_channel_start_session_completion(int result,
      `forward_x11'  TRUE to request X11 forwarding
      `forward_agent' TRUE to request agent forwarding
      `completion'   completion procedure to be called when done (may be NULL)
+     `exit_notify'  function to call with the exit status (may be NULL)
      `close_notify' function to call when ch closed (may be NULL)
      `context'      argument to pass to ``completion''.
    It is not an error if some forwarding fails, or an environment variable
@@ -1775,6 +1790,8 @@ void ssh_channel_start_session(SshCommon common, SshStream stdio_stream,
                               Boolean forward_x11, Boolean forward_agent,
                               void (*completion)(Boolean success,
                                                  void *context),
+                              void (*exit_notify)(SshUInt32 exit_status,
+                                                  void *context),
                               void (*close_notify)(void *context),
                               void *context)
 {
@@ -1795,6 +1812,7 @@ void ssh_channel_start_session(SshCommon common, SshStream stdio_stream,
   session->start_term = term ? ssh_xstrdup(term) : NULL;
 
   session->close_notify = close_notify;
+  session->exit_notify = exit_notify;
   session->context = context;
 
 #ifdef SSH_CHANNEL_X11
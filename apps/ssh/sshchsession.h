@@ -47,6 +47,7 @@ void ssh_channel_session_open(const char *type,
      `forward_x11'  TRUE to request X11 forwarding
      `forward_agent' TRUE to request agent forwarding
      `completion'   completion procedure to be called when done (may be NULL)
+     `exit_notify'  function to call with the exit status (may be NULL)
      `close_notify' function to call when ch closed (may be NULL)
      `context'      argument to pass to ``completion''.
    It is not an error if some forwarding fails, or an environment variable
@@ -63,6 +64,8 @@ void ssh_channel_start_session(SshCommon common, SshStream stdio_stream,
                                Boolean forward_x11, Boolean forward_agent,
                                void (*completion)(Boolean success,
                                                   void *context),
+                               void (*exit_notify)(SshUInt32 exit_status,
+                                                   void *context),
                                void (*close_notify)(void *context),
                                void *context);
 
@@ -546,6 +546,7 @@ void ssh_client_destroy(SshClient client)
      `forward_x11'  TRUE to request X11 forwarding
      `forward_agent' TRUE to request agent forwarding
      `completion'   completion procedure to be called when done (may be NULL)
+     `exit_notify'  function to call with the exit status (may be NULL)
      `close_notify' function to call when ch closed (may be NULL)
      `context'      argument to pass to ``completion''.
    It is not an error if some forwarding fails, or an environment variable
@@ -563,16 +564,29 @@ void ssh_client_start_session(SshClient client, SshStream stdio_stream,
                               Boolean forward_x11, Boolean forward_agent,
                               void (*completion)(Boolean success,
                                                  void *context),
+                              void (*exit_notify)(SshUInt32 exit_status,
+                                                  void *context),
                               void (*close_notify)(void *context),
                               void *context)
 {
   ssh_channel_start_session(client->common, stdio_stream, stderr_stream,
                             auto_close, is_subsystem, command, allocate_pty,
                             term, env, forward_x11, forward_agent,
-                            completion, close_notify,
+                            completion, exit_notify, close_notify,
                             context);
 }
 
+/* Tells the server that this connection is shared with other clients, so
+   that it does not disconnect when the last channel closes.  No reply is
+   asked for; older servers ignore the request. */
+
+void ssh_client_share_connection(SshClient client)
+{
+  ssh_conn_send_global_request(client->common->conn,
+                               SSH_COMMON_SHARED_REQUEST, NULL, 0,
+                               NULL, NULL);
+}
+
 #ifdef SSH_CHANNEL_TCPFWD
 
 /* Requests forwarding of the given remote TCP/IP port.  If the completion
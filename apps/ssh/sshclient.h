@@ -156,6 +156,7 @@ void ssh_client_destroy(SshClient client);
      `forward_x11'  TRUE to request X11 forwarding
      `forward_agent' TRUE to request agent forwarding
      `completion'   completion procedure to be called when done (may be NULL)
+     `exit_notify'  function to call with the exit status (may be NULL)
      `close_notify' function to call when ch closed (may be NULL)
      `context'      argument to pass to ``completion''.
    It is not an error if some forwarding fails, or an environment variable
@@ -172,9 +173,16 @@ void ssh_client_start_session(SshClient client, SshStream stdio_stream,
                               Boolean forward_x11, Boolean forward_agent,
                               void (*completion)(Boolean success,
                                                  void *context),
+                              void (*exit_notify)(SshUInt32 exit_status,
+                                                  void *context),
                               void (*close_notify)(void *context),
                               void *context);
 
+/* Tells the server that this connection is shared with other clients, so
+   that it does not disconnect when the last channel closes.  This must be
+   called before any other global requests are sent. */
+void ssh_client_share_connection(SshClient client);
+
 /* Requests forwarding of the given remote TCP/IP port.  If the completion
    procedure is non-NULL, it will be called when done. */
 void ssh_client_remote_tcp_ip_forward(SshClient client,
@@ -193,6 +193,19 @@ void ssh_common_special(SshCrossPacketType type, const unsigned char *data,
     }
 }
 
+/* Processes SSH_COMMON_SHARED_REQUEST in the server. */
+
+Boolean ssh_common_shared_request(const char *type,
+                                  const unsigned char *data, size_t len,
+                                  void *context)
+{
+  SshCommon common = (SshCommon) context;
+
+  SSH_DEBUG(2, ("the client shares its connection"));
+  common->no_session_channel = TRUE;
+  return TRUE;
+}
+
 void ssh_common_finalize(SshIpError error,
                          const char *result,
                          void *context)
@@ -225,6 +238,8 @@ void ssh_common_finalize(SshIpError error,
                                ssh_common_debug,
                                ssh_common_special,
                                (void *)common);
+  ssh_conn_set_window_memory(common->conn,
+                             (size_t)common->config->window_memory * 1024);
   SSH_DEBUG(5, ("connection protocol created"));
 }
 
@@ -256,6 +271,7 @@ SshCommon ssh_common_wrap(SshStream connection,
 {
   SshCommon common;
   int i, j, num_requests, num_types;
+  char *remote_host;
 
   SSH_DEBUG(5, ("creating SshCommon object"));
   
@@ -310,8 +326,9 @@ SshCommon ssh_common_wrap(SshStream connection,
     }
   assert(num_types == i);
 
-  /* Allocate memory for channel types and global requests. */
-  common->global_requests = ssh_xcalloc(num_requests + 1,
+  /* Allocate memory for channel types and global requests.  The server
+     also takes SSH_COMMON_SHARED_REQUEST. */
+  common->global_requests = ssh_xcalloc(num_requests + 2,
                                         sizeof(common->global_requests[0]));
   common->channel_opens = ssh_xcalloc(num_types + 1,
                                       sizeof(common->channel_opens[0]));
@@ -338,13 +355,30 @@ SshCommon ssh_common_wrap(SshStream connection,
       else
         common->type_contexts[i] = NULL;
     }
+
+  if (!client)
+    {
+      common->global_requests[num_requests].name = SSH_COMMON_SHARED_REQUEST;
+      common->global_requests[num_requests].proc = ssh_common_shared_request;
+      num_requests++;
+    }
   
   /* Set remote host name to ip address. There is no need to do
      reverse mapping in the client (yet) */
   if (!client)
     {
-      ssh_tcp_get_host_by_addr(common->remote_ip, ssh_common_finalize,
-                               (void *)common);
+      /* The lookup is made here, and not through the event loop, as
+         the host checks of the authentication need the name and the
+         connection protocol.  Only the process serving this
+         connection waits for it. */
+      remote_host = ssh_tcp_get_host_by_addr_sync(common->remote_ip);
+      if (remote_host)
+        {
+          ssh_common_finalize(SSH_IP_OK, remote_host, common);
+          ssh_xfree(remote_host);
+        }
+      else
+        ssh_common_finalize(SSH_IP_NO_ADDRESS, NULL, common);
     }
   else
     {    
@@ -37,6 +37,11 @@
 #  endif /* DISABLE_X11_FORWARDING */
 #endif /* X_DISPLAY_MISSING */
 
+/* Global request with which a client that shares its connection with
+   other clients asks the server not to disconnect when the last channel
+   closes.  The client then closes the connection when it is done. */
+#define SSH_COMMON_SHARED_REQUEST "shared-connection@ssh.com"
+
 /* Data type for representing the common protocol object for both server and
    client. */
 typedef struct SshCommonRec *SshCommon;
@@ -77,7 +82,8 @@ struct SshCommonRec
   char *server_host_name;
 
   /* Whether client should not request for a session channel (and keep
-     alive even if number of channels go to 0)*/
+     alive even if number of channels go to 0).  Set in the server when
+     the client sends SSH_COMMON_SHARED_REQUEST. */
   Boolean no_session_channel;
 
   /* Authenticated user name. */
@@ -23,6 +23,8 @@ Processing configuration data in SSH (both client and server).
 #include "sshcipherlist.h"
 #include "namelist.h"
 #include "sshdllist.h"
+#include "sshconn.h"
+#include "sshtcp.h"
 
 #define SSH_DEBUG_MODULE "SshConfig"
 
@@ -216,6 +218,8 @@ SshConfig ssh_config_init(Boolean client)
   config->strict_host_key_checking = FALSE;
   config->escape_char = ssh_xstrdup("~");
   config->go_background = FALSE;
+  config->control_master = FALSE;
+  config->control_path = NULL;
   config->dont_read_stdin = FALSE;
   config->gateway_ports = FALSE;
   
@@ -230,6 +234,9 @@ SshConfig ssh_config_init(Boolean client)
   config->check_mail = TRUE;
   config->keep_alive = TRUE;
   config->no_delay = FALSE;
+  config->window_memory = SSH_CONN_DEFAULT_WINDOW_MEMORY / 1024;
+  config->connect_parallel = 4;
+  config->connect_stagger = 250;
   config->listen_address = ssh_xstrdup("0.0.0.0");
   config->login_grace_time = 600;
   config->host_key_file = ssh_xstrdup(SSH_HOSTKEY_FILE);
@@ -263,6 +270,10 @@ void ssh_config_init_finalize(SshConfig config)
   if (!config->allowed_authentications)
     ssh_config_parse_list((char *)SSH_AUTH_PASSWD "," SSH_AUTH_PUBKEY,
                           NULL, NULL);
+
+  /* Outgoing connections to hosts with several addresses. */
+  ssh_tcp_set_connect_parallel((unsigned int)config->connect_parallel,
+                               (long)config->connect_stagger);
   
   /* Client. */
   if (config->client)
@@ -330,6 +341,7 @@ void ssh_config_free(SshConfig config)
   ssh_xfree(config->identity_file);
   ssh_xfree(config->authorization_file);
   ssh_xfree(config->escape_char);
+  ssh_xfree(config->control_path);
   ssh_xfree(config->listen_address);
   ssh_xfree(config->host_key_file);
   ssh_xfree(config->password_prompt);
@@ -719,6 +731,39 @@ Boolean ssh_config_set_parameter(SshConfig config, char *var, char *val)
       config->ssh1compatibility = bool;
       return FALSE;
     }
+
+  if (strcmp(var, "windowmemory") == 0)
+    {
+      if (num < 0)
+        {
+          ssh_warning("Ignoring illegal window memory %d", num);
+          return TRUE;
+        }
+      config->window_memory = num;
+      return FALSE;
+    }
+
+  if (strcmp(var, "connectparallel") == 0)
+    {
+      if (num < 1 || num > 8)
+        {
+          ssh_warning("Ignoring illegal connect parallelism %d", num);
+          return TRUE;
+        }
+      config->connect_parallel = num;
+      return FALSE;
+    }
+
+  if (strcmp(var, "connectstagger") == 0)
+    {
+      if (num < 0)
+        {
+          ssh_warning("Ignoring illegal connect stagger %d", num);
+          return TRUE;
+        }
+      config->connect_stagger = num;
+      return FALSE;
+    }
   
   /* for client only */
 
@@ -785,6 +830,19 @@ Boolean ssh_config_set_parameter(SshConfig config, char *var, char *val)
           config->go_background = bool;
           return FALSE;
         }
+
+      if (strcmp(var, "controlmaster") == 0)
+        {
+          config->control_master = bool;
+          return FALSE;
+        }
+
+      if (strcmp(var, "controlpath") == 0)
+        {
+          ssh_xfree(config->control_path);
+          config->control_path = ssh_xstrdup(val);
+          return FALSE;
+        }
       
       if (strcmp(var, "dontreadstdin") == 0)
         {
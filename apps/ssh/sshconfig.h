@@ -130,6 +130,8 @@ struct SshConfigRec
   Boolean batch_mode;
   Boolean strict_host_key_checking;
   Boolean go_background;
+  Boolean control_master;       /* see ControlMaster */
+  char *control_path;           /* see ControlPath */
   Boolean dont_read_stdin;
   Boolean gateway_ports;
   char *escape_char;
@@ -146,6 +148,9 @@ struct SshConfigRec
   Boolean check_mail;
   Boolean keep_alive;
   Boolean no_delay;
+  int window_memory;            /* kilobytes, see WindowMemory */
+  int connect_parallel;         /* see ConnectParallel */
+  int connect_stagger;          /* milliseconds, see ConnectStagger */
   Boolean inetd_mode;
   char *listen_address;
   int login_grace_time;
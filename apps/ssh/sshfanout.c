@@ -0,0 +1,511 @@
+/*
+
+  sshfanout.c
+
+  Copyright (C) 1999 SSH Communications Security Oy, Espoo, Finland
+  All rights reserved.
+
+  Running one command on many hosts from a single client process.
+
+*/
+
+#include "ssh2includes.h"
+#include "sshclient.h"
+#include "sshstreampair.h"
+#include "sshunixfdstream.h"
+#include "sshtcp.h"
+#include "sshtimeouts.h"
+#include "sshbuffer.h"
+#include "sshmsgs.h"
+#include "sshagent.h"
+#include "sshfanout.h"
+
+#define SSH_DEBUG_MODULE "SshFanOut"
+
+/* Longest line of output kept before it is printed anyway. */
+#define SSH_FANOUT_MAX_LINE     8192
+
+typedef struct SshFanOutHostRec
+{
+  SshFanOut fanout;
+  struct SshFanOutHostRec *next;
+
+  /* The host as given; printed in front of its output. */
+  char *name;
+
+  /* Copy of the common configuration, with the host, port and user of
+     this host.  The other fields point to the common one. */
+  struct SshConfigRec config;
+
+  SshClient client;
+
+  /* Our ends of the stdout and stderr of the session, and the partial
+     lines read from them. */
+  SshStream out;
+  SshStream err;
+  SshBuffer out_line;
+  SshBuffer err_line;
+
+  Boolean started;
+  Boolean out_eof;
+  Boolean err_eof;
+  Boolean closed;               /* the client is gone */
+  Boolean finished;
+  Boolean exit_status_valid;
+  SshUInt32 exit_status;
+
+  /* Why the host failed, or NULL. */
+  char *error;
+} *SshFanOutHost;
+
+struct SshFanOutRec
+{
+  SshConfig config;
+  SshUser user_data;
+  SshRandomState random_state;
+  Boolean is_subsystem;
+  char *command;
+  int jobs;
+
+  /* The hosts, in the order they were added, and the next one to start. */
+  SshFanOutHost hosts;
+  SshFanOutHost *last;
+  SshFanOutHost next_host;
+  int num_hosts;
+  int running;
+
+  char *socks_server;
+
+  void (*done)(int exit_status, void *context);
+  void *context;
+};
+
+void ssh_fanout_start_hosts(SshFanOut fanout);
+
+/* Prints the complete lines in `line' to `f', or all of it if `flush'. */
+
+void ssh_fanout_print(SshFanOutHost host, SshBuffer *line, FILE *f,
+                      Boolean flush)
+{
+  unsigned char *p, *nl;
+  size_t len;
+
+  while ((len = ssh_buffer_len(line)) > 0)
+    {
+      p = ssh_buffer_ptr(line);
+      nl = memchr(p, '\n', len);
+      if (nl != NULL)
+        len = nl - p + 1;
+      else if (!flush && len < SSH_FANOUT_MAX_LINE)
+        break;
+
+      fprintf(f, "%s: ", host->name);
+      fwrite(p, 1, len, f);
+      if (nl == NULL)
+        putc('\n', f);
+      ssh_buffer_consume(line, len);
+    }
+  fflush(f);
+}
+
+/* Called from the bottom of the event loop once the host is done with.
+   Destroys the streams, and starts the next host. */
+
+void ssh_fanout_host_finish(void *context)
+{
+  SshFanOutHost host = (SshFanOutHost)context;
+  SshFanOut fanout = host->fanout;
+  SshFanOutHost h;
+  int exit_status;
+
+  if (host->out)
+    ssh_stream_destroy(host->out);
+  if (host->err)
+    ssh_stream_destroy(host->err);
+  host->out = NULL;
+  host->err = NULL;
+  ssh_buffer_uninit(&host->out_line);
+  ssh_buffer_uninit(&host->err_line);
+  if (host->error == NULL && !host->exit_status_valid)
+    host->error = ssh_xstrdup("no exit status from the command");
+
+  fanout->running--;
+  ssh_fanout_start_hosts(fanout);
+  if (fanout->running > 0 || fanout->next_host != NULL)
+    return;
+
+  /* All done.  Tell what went wrong where. */
+  exit_status = 0;
+  for (h = fanout->hosts; h; h = h->next)
+    {
+      if (h->error)
+        {
+          fprintf(stderr, "%s: %s\n", h->name, h->error);
+          exit_status = 255;
+        }
+      else if (h->exit_status != 0)
+        {
+          fprintf(stderr, "%s: exit status %lu\n", h->name,
+                  (unsigned long)h->exit_status);
+          if (h->exit_status > (SshUInt32)exit_status)
+            exit_status = h->exit_status > 255 ? 255 : (int)h->exit_status;
+        }
+    }
+
+  ssh_agent_share_connection(FALSE);
+  (*fanout->done)(exit_status, fanout->context);
+}
+
+void ssh_fanout_host_check_done(SshFanOutHost host)
+{
+  if (host->finished || !host->closed || !host->out_eof || !host->err_eof)
+    return;
+
+  SSH_DEBUG(2, ("%s finished", host->name));
+  host->finished = TRUE;
+  ssh_register_timeout(0L, 0L, ssh_fanout_host_finish, (void *)host);
+}
+
+/* Records `error' as the reason the host failed, unless there already
+   is one, and gets rid of the client. */
+
+void ssh_fanout_host_fail(SshFanOutHost host, const char *error)
+{
+  SshClient client;
+
+  if (host->error == NULL && !host->exit_status_valid)
+    host->error = ssh_xstrdup(error);
+
+  client = host->client;
+  host->client = NULL;
+  host->closed = TRUE;
+  if (client)
+    ssh_client_destroy(client);
+  if (!host->started)
+    host->out_eof = host->err_eof = TRUE;
+  ssh_fanout_host_check_done(host);
+}
+
+void ssh_fanout_read(SshFanOutHost host, SshStream stream, SshBuffer *line,
+                     Boolean *eof, FILE *f)
+{
+  unsigned char buf[4096];
+  int len;
+
+  while (!*eof)
+    {
+      len = ssh_stream_read(stream, buf, sizeof(buf));
+      if (len < 0)
+        break;
+      if (len == 0)
+        *eof = TRUE;
+      else
+        ssh_buffer_append(line, buf, len);
+    }
+  ssh_fanout_print(host, line, f, *eof);
+}
+
+void ssh_fanout_out_callback(SshStreamNotification notification,
+                             void *context)
+{
+  SshFanOutHost host = (SshFanOutHost)context;
+
+  if (notification != SSH_STREAM_INPUT_AVAILABLE)
+    return;
+  ssh_fanout_read(host, host->out, &host->out_line, &host->out_eof, stdout);
+  ssh_fanout_host_check_done(host);
+}
+
+void ssh_fanout_err_callback(SshStreamNotification notification,
+                             void *context)
+{
+  SshFanOutHost host = (SshFanOutHost)context;
+
+  if (notification != SSH_STREAM_INPUT_AVAILABLE)
+    return;
+  ssh_fanout_read(host, host->err, &host->err_line, &host->err_eof, stderr);
+  ssh_fanout_host_check_done(host);
+}
+
+void ssh_fanout_exit_status(SshUInt32 exit_status, void *context)
+{
+  SshFanOutHost host = (SshFanOutHost)context;
+
+  host->exit_status_valid = TRUE;
+  host->exit_status = exit_status;
+}
+
+/* Called when the session channel has been closed.  There is nothing
+   else on the connection, so it is closed too. */
+
+void ssh_fanout_session_close(void *context)
+{
+  SshFanOutHost host = (SshFanOutHost)context;
+  SshClient client;
+
+  SSH_DEBUG(3, ("%s: session closed", host->name));
+  client = host->client;
+  host->client = NULL;
+  host->closed = TRUE;
+  if (client)
+    ssh_client_destroy(client);
+  ssh_fanout_host_check_done(host);
+}
+
+void ssh_fanout_disconnect(int reason, const char *msg, void *context)
+{
+  SshFanOutHost host = (SshFanOutHost)context;
+  char buf[256];
+
+  SSH_DEBUG(2, ("%s: disconnected: %s", host->name, msg));
+  snprintf(buf, sizeof(buf), "disconnected%s%s",
+           (msg && msg[0]) ? ": " : "", (msg && msg[0]) ? msg : "");
+  ssh_fanout_host_fail(host, buf);
+}
+
+void ssh_fanout_debug(int type, const char *msg, void *context)
+{
+  SshFanOutHost host = (SshFanOutHost)context;
+
+  switch (type)
+    {
+    case SSH_DEBUG_DEBUG:
+      if (host->config.verbose_mode)
+        fprintf(stderr, "%s: %s\n", host->name, msg);
+      break;
+
+    case SSH_DEBUG_DISPLAY:
+      fprintf(stderr, "%s: %s\n", host->name, msg);
+      break;
+
+    default:
+      fprintf(stderr, "%s: UNKNOWN DEBUG DATA TYPE %d: %s\n",
+              host->name, type, msg);
+      break;
+    }
+}
+
+void ssh_fanout_authenticated(const char *user, void *context)
+{
+  SshFanOutHost host = (SshFanOutHost)context;
+  SshStream s1, s2, e1, e2;
+
+  SSH_DEBUG(2, ("%s: authenticated as %s", host->name, user));
+
+  ssh_stream_pair_create(&s1, &s2);
+  ssh_stream_pair_create(&e1, &e2);
+  host->out = s2;
+  host->err = e2;
+  host->started = TRUE;
+  ssh_stream_set_callback(s2, ssh_fanout_out_callback, (void *)host);
+  ssh_stream_set_callback(e2, ssh_fanout_err_callback, (void *)host);
+
+  /* The command gets no input. */
+  ssh_stream_output_eof(s2);
+
+  ssh_client_start_session(host->client, s1, e1, TRUE,
+                           host->fanout->is_subsystem,
+                           host->fanout->command,
+                           FALSE, NULL, NULL, FALSE, FALSE,
+                           NULL, ssh_fanout_exit_status,
+                           ssh_fanout_session_close, (void *)host);
+}
+
+void ssh_fanout_connected(SshIpError error, SshStream stream, void *context)
+{
+  SshFanOutHost host = (SshFanOutHost)context;
+  char buf[256];
+
+  if (error != SSH_IP_OK)
+    {
+      snprintf(buf, sizeof(buf), "connecting failed: %s",
+               ssh_tcp_error_string(error));
+      ssh_fanout_host_fail(host, buf);
+      return;
+    }
+
+  ssh_socket_set_nodelay(stream, host->config.no_delay);
+  ssh_socket_set_keepalive(stream, host->config.keep_alive);
+
+  host->client = ssh_client_wrap(stream, &host->config,
+                                 host->fanout->user_data,
+                                 host->config.host_to_connect,
+                                 host->config.login_as_user,
+                                 host->fanout->random_state,
+                                 ssh_fanout_disconnect, ssh_fanout_debug,
+                                 ssh_fanout_authenticated, (void *)host);
+}
+
+/* Starts hosts until there are as many running as allowed. */
+
+void ssh_fanout_start_hosts(SshFanOut fanout)
+{
+  SshFanOutHost host;
+
+  while (fanout->next_host && fanout->running < fanout->jobs)
+    {
+      host = fanout->next_host;
+      fanout->next_host = host->next;
+      fanout->running++;
+
+      SSH_DEBUG(2, ("connecting to %s", host->name));
+      ssh_buffer_init(&host->out_line);
+      ssh_buffer_init(&host->err_line);
+      ssh_tcp_connect_with_socks(host->config.host_to_connect,
+                                 host->config.port,
+                                 fanout->socks_server, 5,
+                                 ssh_fanout_connected, (void *)host);
+    }
+}
+
+SshFanOut ssh_fanout_create(SshConfig config, SshUser user_data,
+                            SshRandomState random_state,
+                            Boolean is_subsystem, const char *command,
+                            int jobs,
+                            void (*done)(int exit_status, void *context),
+                            void *context)
+{
+  SshFanOut fanout;
+  char *socks_server;
+
+  fanout = ssh_xcalloc(1, sizeof(*fanout));
+  fanout->config = config;
+  fanout->user_data = user_data;
+  fanout->random_state = random_state;
+  fanout->is_subsystem = is_subsystem;
+  fanout->command = command ? ssh_xstrdup(command) : NULL;
+  fanout->jobs = jobs > 0 ? jobs : SSH_FANOUT_DEFAULT_JOBS;
+  fanout->last = &fanout->hosts;
+  fanout->done = done;
+  fanout->context = context;
+
+  /* The same socks server as for a single host. */
+  socks_server = getenv("SSH_SOCKS_SERVER");
+#ifdef SOCKS_DEFAULT_SERVER
+  if (!socks_server)
+    socks_server = SOCKS_DEFAULT_SERVER;
+#endif /* SOCKS_DEFAULT_SERVER */
+  if (socks_server && strcmp(socks_server, "") != 0)
+    fanout->socks_server = ssh_xstrdup(socks_server);
+
+  return fanout;
+}
+
+Boolean ssh_fanout_add_host(SshFanOut fanout, const char *spec)
+{
+  SshFanOutHost host;
+  char *tmp, *name, *user, *port;
+
+  tmp = ssh_xstrdup(spec);
+  name = tmp;
+  user = NULL;
+  port = NULL;
+  if ((name = strchr(tmp, '@')) != NULL)
+    {
+      *name++ = '\0';
+      user = tmp;
+    }
+  else
+    name = tmp;
+  if ((port = strchr(name, ':')) != NULL)
+    *port++ = '\0';
+
+  if (*name == '\0' || (user && *user == '\0') || (port && *port == '\0'))
+    {
+      ssh_xfree(tmp);
+      return FALSE;
+    }
+
+  host = ssh_xcalloc(1, sizeof(*host));
+  host->fanout = fanout;
+  host->name = ssh_xstrdup(spec);
+  host->config = *fanout->config;
+  host->config.host_to_connect = ssh_xstrdup(name);
+  host->config.port = ssh_xstrdup(port ? port : fanout->config->port);
+  host->config.login_as_user = ssh_xstrdup(user ? user :
+                                           fanout->config->login_as_user);
+
+  /* Nothing that would go to the terminal or stay behind, and no
+     questions asked. */
+  host->config.ssh1compatibility = FALSE;
+  host->config.local_forwards = NULL;
+  host->config.remote_forwards = NULL;
+  host->config.control_master = FALSE;
+  host->config.go_background = FALSE;
+  host->config.batch_mode = TRUE;
+  ssh_xfree(tmp);
+
+  *fanout->last = host;
+  fanout->last = &host->next;
+  fanout->num_hosts++;
+  return TRUE;
+}
+
+Boolean ssh_fanout_read_hosts(SshFanOut fanout, const char *filename)
+{
+  FILE *f;
+  char line[1024], *p, *e;
+  int lineno = 0;
+
+  if ((f = fopen(filename, "r")) == NULL)
+    {
+      ssh_warning("Could not open host list %s: %s", filename,
+                  strerror(errno));
+      return FALSE;
+    }
+
+  while (fgets(line, sizeof(line), f))
+    {
+      lineno++;
+      for (p = line; *p == ' ' || *p == '\t'; p++)
+        ;
+      for (e = p + strlen(p); e > p && isspace((unsigned char)e[-1]); e--)
+        ;
+      *e = '\0';
+      if (*p == '\0' || *p == '#')
+        continue;
+      if (!ssh_fanout_add_host(fanout, p))
+        {
+          ssh_warning("%s line %d: bad host \"%s\".", filename, lineno, p);
+          fclose(f);
+          return FALSE;
+        }
+    }
+  fclose(f);
+  return TRUE;
+}
+
+int ssh_fanout_num_hosts(SshFanOut fanout)
+{
+  return fanout->num_hosts;
+}
+
+void ssh_fanout_start(SshFanOut fanout)
+{
+  /* One connection to the agent for all the hosts. */
+  ssh_agent_share_connection(TRUE);
+
+  fanout->next_host = fanout->hosts;
+  ssh_fanout_start_hosts(fanout);
+}
+
+void ssh_fanout_destroy(SshFanOut fanout)
+{
+  SshFanOutHost host, next;
+
+  for (host = fanout->hosts; host; host = next)
+    {
+      next = host->next;
+      ssh_xfree(host->name);
+      ssh_xfree(host->config.host_to_connect);
+      ssh_xfree(host->config.port);
+      ssh_xfree(host->config.login_as_user);
+      ssh_xfree(host->error);
+      memset(host, 'F', sizeof(*host));
+      ssh_xfree(host);
+    }
+  ssh_xfree(fanout->command);
+  ssh_xfree(fanout->socks_server);
+  memset(fanout, 'F', sizeof(*fanout));
+  ssh_xfree(fanout);
+}
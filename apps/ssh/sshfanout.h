@@ -0,0 +1,70 @@
+/*
+
+  sshfanout.h
+
+  Copyright (C) 1999 SSH Communications Security Oy, Espoo, Finland
+  All rights reserved.
+
+*/
+
+/*
+
+  Running one command on many hosts from a single client process.  Each
+  host gets its own SshClient on the common event loop; a limited number
+  of them are connected at a time.  The output of every host is printed
+  line by line with the name of the host in front, and the exit status
+  of each host is collected.
+
+  All the clients authenticate through one shared connection to the
+  authentication agent, and nothing is ever prompted for: the hosts are
+  run in batch mode.
+
+*/
+
+#ifndef SSHFANOUT_H
+#define SSHFANOUT_H
+
+#include "sshclient.h"
+
+/* Number of hosts connected at a time, unless told otherwise. */
+#define SSH_FANOUT_DEFAULT_JOBS         16
+
+/* Data type for a fan-out run. */
+typedef struct SshFanOutRec *SshFanOut;
+
+/* Creates a run of `command' (or the subsystem `command', if
+   `is_subsystem') on the hosts added later.  `config' is used for every
+   host, with the host name, port and user taken from the host list; it
+   must stay valid until `done' has been called.  At most `jobs' hosts
+   are connected at the same time.  `done' is called once all the hosts
+   have finished, with the largest exit status of the hosts (255 for a
+   host that could not be connected to or did not return an exit
+   status). */
+SshFanOut ssh_fanout_create(SshConfig config, SshUser user_data,
+                            SshRandomState random_state,
+                            Boolean is_subsystem, const char *command,
+                            int jobs,
+                            void (*done)(int exit_status, void *context),
+                            void *context);
+
+/* Adds a host of the form [user@]host[:port].  Returns FALSE if `spec'
+   is not valid. */
+Boolean ssh_fanout_add_host(SshFanOut fanout, const char *spec);
+
+/* Adds the hosts listed in `filename', one per line.  Empty lines and
+   lines starting with `#' are ignored.  Returns FALSE if the file could
+   not be read or had a bad line. */
+Boolean ssh_fanout_read_hosts(SshFanOut fanout, const char *filename);
+
+/* Returns the number of hosts added. */
+int ssh_fanout_num_hosts(SshFanOut fanout);
+
+/* Starts connecting to the hosts.  The work is done from the event
+   loop. */
+void ssh_fanout_start(SshFanOut fanout);
+
+/* Frees the run.  This must not be called before `done' has been
+   called. */
+void ssh_fanout_destroy(SshFanOut fanout);
+
+#endif /* SSHFANOUT_H */
@@ -0,0 +1,788 @@
+/*
+
+  sshmux.c
+
+  Copyright (C) 1999 SSH Communications Security Oy, Espoo, Finland
+  All rights reserved.
+
+  Connection sharing: the master that opens channels for other clients on
+  its connection, and the client side that talks to the master.
+
+*/
+
+#include "ssh2includes.h"
+#include "sshclient.h"
+#include "sshpacketstream.h"
+#include "sshlocalstream.h"
+#include "sshstreampair.h"
+#include "sshunixfdstream.h"
+#include "sshtcp.h"
+#include "sshencode.h"
+#include "sshbuffer.h"
+#include "sshmux.h"
+
+#define SSH_DEBUG_MODULE "SshMux"
+
+/* Largest amount of channel data sent in one packet.  The packet wrapper
+   takes some 10000 bytes after ssh_packet_wrapper_can_send has turned
+   FALSE, and drops anything beyond that. */
+#define SSH_MUX_DATA_SIZE       8192
+
+/* One connection to the control socket, and the channel it carries.  The
+   same structure is used on both sides. */
+
+typedef struct SshMuxChannelRec
+{
+  /* The master this came to, or NULL on the client side and after the
+     master has been stopped. */
+  SshMuxMaster master;
+
+  /* Master side: the connection the channel is opened on. */
+  SshClient client;
+
+  /* Client side: the client this belongs to. */
+  SshMuxClient mux_client;
+
+  /* Next channel of the master. */
+  struct SshMuxChannelRec *next;
+
+  /* Packets to and from the control socket. */
+  SshPacketWrapper wrapper;
+
+  /* Our end of the channel data.  On the master these are stream pairs
+     to the channel; on the client they are stdio or the forwarded
+     connection.  `err_stream' is only read on the master. */
+  SshStream stream;
+  SshStream err_stream;
+
+  /* Received data that `pending_stream' did not take yet.  Receiving
+     packets is stopped while there is some. */
+  SshBuffer pending;
+  SshStream pending_stream;
+
+  Boolean is_session;
+  Boolean opened;
+  Boolean stream_eof;           /* read eof from stream */
+  Boolean err_eof;              /* read eof from err_stream */
+  Boolean eof_sent;
+  Boolean eof_received;
+  Boolean peer_gone;            /* the control connection was closed */
+  Boolean closed;               /* master: the channel has been closed */
+  Boolean failed;               /* client: the master could not open it */
+  Boolean exit_status_valid;
+  SshUInt32 exit_status;
+} *SshMuxChannel;
+
+struct SshMuxMasterRec
+{
+  char *path;
+  SshLocalListener listener;
+  SshClient client;
+  SshMuxChannel channels;
+};
+
+/* A local forward run by the client through the master. */
+
+typedef struct SshMuxForwardRec
+{
+  struct SshMuxForwardRec *next;
+  SshMuxClient mux_client;
+  SshForward fwd;
+  SshTcpListener listener;
+} *SshMuxForward;
+
+/* A forwarded connection waiting for its control connection. */
+
+typedef struct SshMuxIncomingRec
+{
+  SshMuxForward forward;
+  SshStream stream;
+  char ip[20], port[20];
+} *SshMuxIncoming;
+
+struct SshMuxClientRec
+{
+  char *path;
+  Boolean no_session;
+  Boolean is_subsystem;
+  char *command;
+  SshForward local_forwards;
+  SshMuxForward forwards;
+  SshMuxChannel session;
+  void (*done)(Boolean success, void *context);
+  void (*exit_notify)(SshUInt32 exit_status, void *context);
+  void *context;
+};
+
+void ssh_mux_channel_send_output(SshMuxChannel ch);
+void ssh_mux_channel_check_done(SshMuxChannel ch);
+
+/***********************************************************************
+ * Common to both sides.
+ ***********************************************************************/
+
+void ssh_mux_channel_destroy(SshMuxChannel ch)
+{
+  SshMuxChannel *chp;
+
+  if (ch->master)
+    for (chp = &ch->master->channels; *chp; chp = &(*chp)->next)
+      if (*chp == ch)
+        {
+          *chp = ch->next;
+          break;
+        }
+
+  if (ch->wrapper)
+    ssh_packet_wrapper_destroy(ch->wrapper);
+  if (ch->stream)
+    ssh_stream_destroy(ch->stream);
+  if (ch->err_stream)
+    ssh_stream_destroy(ch->err_stream);
+  ssh_buffer_uninit(&ch->pending);
+  memset(ch, 'F', sizeof(*ch));
+  ssh_xfree(ch);
+}
+
+/* Writes what is pending, and starts receiving packets again when all
+   of it has been written. */
+
+void ssh_mux_channel_flush(SshMuxChannel ch)
+{
+  int len;
+
+  while (ssh_buffer_len(&ch->pending) > 0)
+    {
+      len = ssh_stream_write(ch->pending_stream, ssh_buffer_ptr(&ch->pending),
+                             ssh_buffer_len(&ch->pending));
+      if (len < 0)
+        return;
+      if (len == 0)
+        {
+          /* The stream has been closed; the data goes nowhere. */
+          ssh_buffer_clear(&ch->pending);
+          break;
+        }
+      ssh_buffer_consume(&ch->pending, len);
+    }
+
+  if (ch->wrapper)
+    ssh_packet_wrapper_can_receive(ch->wrapper, TRUE);
+  ssh_mux_channel_check_done(ch);
+}
+
+/* Writes received data to `stream', keeping whatever it does not take. */
+
+void ssh_mux_channel_write(SshMuxChannel ch, SshStream stream,
+                           const unsigned char *data, size_t len)
+{
+  int ret;
+
+  while (len > 0)
+    {
+      ret = ssh_stream_write(stream, data, len);
+      if (ret == 0)
+        return;
+      if (ret < 0)
+        {
+          ssh_buffer_append(&ch->pending, data, len);
+          ch->pending_stream = stream;
+          ssh_packet_wrapper_can_receive(ch->wrapper, FALSE);
+          return;
+        }
+      data += ret;
+      len -= ret;
+    }
+}
+
+/* Sends what can be read from our streams, and eof when both have
+   reached it. */
+
+void ssh_mux_channel_send_output(SshMuxChannel ch)
+{
+  unsigned char buf[SSH_MUX_DATA_SIZE];
+  Boolean progress;
+  int len;
+
+  if (!ch->opened || ch->wrapper == NULL || ch->eof_sent)
+    return;
+
+  do
+    {
+      progress = FALSE;
+      if (!ch->stream_eof && ssh_packet_wrapper_can_send(ch->wrapper))
+        {
+          len = ssh_stream_read(ch->stream, buf, sizeof(buf));
+          if (len == 0)
+            ch->stream_eof = TRUE;
+          else if (len > 0)
+            {
+              ssh_packet_wrapper_send_encode(ch->wrapper, SSH_MUX_DATA,
+                                             SSH_FORMAT_UINT32_STR,
+                                             buf, (size_t)len,
+                                             SSH_FORMAT_END);
+              progress = TRUE;
+            }
+        }
+      if (!ch->err_eof && ssh_packet_wrapper_can_send(ch->wrapper))
+        {
+          len = ssh_stream_read(ch->err_stream, buf, sizeof(buf));
+          if (len == 0)
+            ch->err_eof = TRUE;
+          else if (len > 0)
+            {
+              ssh_packet_wrapper_send_encode(ch->wrapper,
+                                             SSH_MUX_EXTENDED_DATA,
+                                             SSH_FORMAT_UINT32_STR,
+                                             buf, (size_t)len,
+                                             SSH_FORMAT_END);
+              progress = TRUE;
+            }
+        }
+    }
+  while (progress);
+
+  if (ch->stream_eof && ch->err_eof)
+    {
+      ssh_packet_wrapper_send_encode(ch->wrapper, SSH_MUX_EOF,
+                                     SSH_FORMAT_END);
+      ch->eof_sent = TRUE;
+      ssh_mux_channel_check_done(ch);
+    }
+}
+
+void ssh_mux_stream_callback(SshStreamNotification notification,
+                             void *context)
+{
+  SshMuxChannel ch = (SshMuxChannel)context;
+
+  switch (notification)
+    {
+    case SSH_STREAM_INPUT_AVAILABLE:
+      ssh_mux_channel_send_output(ch);
+      break;
+
+    case SSH_STREAM_CAN_OUTPUT:
+      if (ssh_buffer_len(&ch->pending) > 0)
+        ssh_mux_channel_flush(ch);
+      break;
+
+    case SSH_STREAM_DISCONNECTED:
+      SSH_DEBUG(2, ("stream disconnected"));
+      break;
+    }
+}
+
+/* Gives the channel its streams and starts moving data.  `err_stream'
+   is NULL if there is nothing to read besides `stream'. */
+
+void ssh_mux_channel_set_streams(SshMuxChannel ch, SshStream stream,
+                                 SshStream err_stream)
+{
+  ch->opened = TRUE;
+  ch->stream = stream;
+  ssh_stream_set_callback(stream, ssh_mux_stream_callback, (void *)ch);
+  ch->err_stream = err_stream;
+  if (err_stream)
+    ssh_stream_set_callback(err_stream, ssh_mux_stream_callback, (void *)ch);
+  else
+    ch->err_eof = TRUE;
+  ssh_mux_channel_send_output(ch);
+}
+
+void ssh_mux_client_channel_finished(SshMuxChannel ch);
+Boolean ssh_mux_master_open(SshMuxChannel ch, SshPacketType type,
+                            const unsigned char *data, size_t len);
+
+/* Called when the other end of the control connection has gone away,
+   or has broken the protocol. */
+
+void ssh_mux_channel_lost(SshMuxChannel ch)
+{
+  ch->peer_gone = TRUE;
+  if (ch->wrapper)
+    {
+      ssh_packet_wrapper_destroy(ch->wrapper);
+      ch->wrapper = NULL;
+    }
+
+  if (ch->mux_client == NULL)
+    {
+      /* Closing our ends gives eof to the channel. */
+      ssh_buffer_clear(&ch->pending);
+      if (ch->stream)
+        ssh_stream_destroy(ch->stream);
+      if (ch->err_stream)
+        ssh_stream_destroy(ch->err_stream);
+      ch->stream = ch->err_stream = NULL;
+      ch->stream_eof = ch->err_eof = TRUE;
+    }
+  ssh_mux_channel_check_done(ch);
+}
+
+/* Destroys the channel once it has nothing more to do. */
+
+void ssh_mux_channel_check_done(SshMuxChannel ch)
+{
+  if (ch->mux_client == NULL)
+    {
+      if (!ch->opened)
+        {
+          if (ch->peer_gone)
+            ssh_mux_channel_destroy(ch);
+          return;
+        }
+      if (ch->is_session)
+        {
+          /* Everything the channel sent must be passed on first. */
+          if (!ch->closed || !(ch->eof_sent || ch->peer_gone))
+            return;
+          if (!ch->peer_gone && ch->exit_status_valid)
+            ssh_packet_wrapper_send_encode(ch->wrapper, SSH_MUX_EXIT_STATUS,
+                                           SSH_FORMAT_UINT32,
+                                           ch->exit_status,
+                                           SSH_FORMAT_END);
+          ssh_mux_channel_destroy(ch);
+        }
+      else if ((ch->eof_sent && ch->eof_received) || ch->peer_gone)
+        ssh_mux_channel_destroy(ch);
+    }
+  else
+    {
+      if (ssh_buffer_len(&ch->pending) > 0)
+        return;
+      if (ch->peer_gone ||
+          (!ch->is_session && ch->eof_sent && ch->eof_received))
+        ssh_mux_client_channel_finished(ch);
+    }
+}
+
+void ssh_mux_received_packet(SshPacketType type,
+                             const unsigned char *data, size_t len,
+                             void *context)
+{
+  SshMuxChannel ch = (SshMuxChannel)context;
+  unsigned char *str;
+  size_t str_len;
+  SshUInt32 exit_status;
+  SshStream stream;
+  char *msg;
+
+  switch (type)
+    {
+    case SSH_MUX_OPEN_SESSION:
+    case SSH_MUX_OPEN_DIRECT_TCPIP:
+      if (ch->mux_client != NULL || ch->opened || ch->master == NULL)
+        break;
+      if (!ssh_mux_master_open(ch, type, data, len))
+        break;
+      return;
+
+    case SSH_MUX_DATA:
+    case SSH_MUX_EXTENDED_DATA:
+      if (!ch->opened || ch->eof_received)
+        break;
+      if (ssh_decode_array(data, len,
+                           SSH_FORMAT_UINT32_STR_NOCOPY, &str, &str_len,
+                           SSH_FORMAT_END) != len)
+        break;
+      if (type == SSH_MUX_DATA)
+        stream = ch->stream;
+      else
+        stream = ch->mux_client != NULL ? ch->err_stream : NULL;
+      if (stream == NULL)
+        break;
+      ssh_mux_channel_write(ch, stream, str, str_len);
+      return;
+
+    case SSH_MUX_EOF:
+      if (!ch->opened || ch->eof_received || len != 0)
+        break;
+      ch->eof_received = TRUE;
+      ssh_stream_output_eof(ch->stream);
+      ssh_mux_channel_check_done(ch);
+      return;
+
+    case SSH_MUX_EXIT_STATUS:
+      if (ch->mux_client == NULL || !ch->is_session)
+        break;
+      if (ssh_decode_array(data, len,
+                           SSH_FORMAT_UINT32, &exit_status,
+                           SSH_FORMAT_END) != len)
+        break;
+      (*ch->mux_client->exit_notify)(exit_status,
+                                     ch->mux_client->context);
+      return;
+
+    case SSH_MUX_FAILURE:
+      if (ch->mux_client == NULL)
+        break;
+      if (ssh_decode_array(data, len,
+                           SSH_FORMAT_UINT32_STR, &msg, NULL,
+                           SSH_FORMAT_END) != len)
+        break;
+      ssh_warning("%s", msg);
+      ssh_xfree(msg);
+      ch->failed = TRUE;
+      if (ch->is_session)
+        (*ch->mux_client->exit_notify)(255, ch->mux_client->context);
+      return;
+
+    default:
+      break;
+    }
+
+  ssh_warning("Protocol error on connection sharing socket (packet %d).",
+              (int)type);
+  ssh_mux_channel_lost(ch);
+}
+
+void ssh_mux_received_eof(void *context)
+{
+  SshMuxChannel ch = (SshMuxChannel)context;
+
+  ssh_mux_channel_lost(ch);
+}
+
+void ssh_mux_can_send(void *context)
+{
+  SshMuxChannel ch = (SshMuxChannel)context;
+
+  ssh_mux_channel_send_output(ch);
+}
+
+SshMuxChannel ssh_mux_channel_create(SshStream stream, SshMuxClient mux_client)
+{
+  SshMuxChannel ch;
+
+  ch = ssh_xcalloc(1, sizeof(*ch));
+  ch->mux_client = mux_client;
+  ssh_buffer_init(&ch->pending);
+  ch->wrapper = ssh_packet_wrap(stream, ssh_mux_received_packet,
+                                ssh_mux_received_eof, ssh_mux_can_send,
+                                (void *)ch);
+  return ch;
+}
+
+/***********************************************************************
+ * The master.
+ ***********************************************************************/
+
+void ssh_mux_master_session_open(Boolean success, void *context)
+{
+  SshMuxChannel ch = (SshMuxChannel)context;
+
+  if (!success && ch->wrapper)
+    ssh_packet_wrapper_send_encode(ch->wrapper, SSH_MUX_FAILURE,
+                                   SSH_FORMAT_UINT32_STR,
+                                   "Opening the session failed.",
+                                   strlen("Opening the session failed."),
+                                   SSH_FORMAT_END);
+}
+
+void ssh_mux_master_exit_status(SshUInt32 exit_status, void *context)
+{
+  SshMuxChannel ch = (SshMuxChannel)context;
+
+  ch->exit_status_valid = TRUE;
+  ch->exit_status = exit_status;
+}
+
+void ssh_mux_master_session_close(void *context)
+{
+  SshMuxChannel ch = (SshMuxChannel)context;
+
+  ch->closed = TRUE;
+  ssh_mux_channel_check_done(ch);
+}
+
+/* Opens the channel the client asked for.  Returns FALSE if the packet
+   was bad. */
+
+Boolean ssh_mux_master_open(SshMuxChannel ch, SshPacketType type,
+                            const unsigned char *data, size_t len)
+{
+  Boolean is_subsystem;
+  char *command, *host, *port, *originator_ip, *originator_port;
+  SshStream s1, s2, e1, e2;
+
+  if (type == SSH_MUX_OPEN_SESSION)
+    {
+      if (ssh_decode_array(data, len,
+                           SSH_FORMAT_BOOLEAN, &is_subsystem,
+                           SSH_FORMAT_UINT32_STR, &command, NULL,
+                           SSH_FORMAT_END) != len)
+        return FALSE;
+
+      SSH_DEBUG(2, ("session for a client: %s", command));
+      ch->is_session = TRUE;
+      ssh_stream_pair_create(&s1, &s2);
+      ssh_stream_pair_create(&e1, &e2);
+      ssh_mux_channel_set_streams(ch, s2, e2);
+
+      /* Never a pty, nor X11 or agent forwarding: those would tie the
+         session to the terminal and environment of the master. */
+      ssh_client_start_session(ch->client, s1, e1, TRUE, is_subsystem,
+                               command[0] ? command : NULL,
+                               FALSE, NULL, NULL, FALSE, FALSE,
+                               ssh_mux_master_session_open,
+                               ssh_mux_master_exit_status,
+                               ssh_mux_master_session_close, (void *)ch);
+      ssh_xfree(command);
+      return TRUE;
+    }
+
+#ifdef SSH_CHANNEL_TCPFWD
+  if (ssh_decode_array(data, len,
+                       SSH_FORMAT_UINT32_STR, &host, NULL,
+                       SSH_FORMAT_UINT32_STR, &port, NULL,
+                       SSH_FORMAT_UINT32_STR, &originator_ip, NULL,
+                       SSH_FORMAT_UINT32_STR, &originator_port, NULL,
+                       SSH_FORMAT_END) != len)
+    return FALSE;
+
+  SSH_DEBUG(2, ("direct-tcpip for a client: %s:%s", host, port));
+  ssh_stream_pair_create(&s1, &s2);
+  ssh_mux_channel_set_streams(ch, s2, NULL);
+  ssh_client_open_remote_tcp_ip(ch->client, s1, host, port,
+                                originator_ip, originator_port);
+  ssh_xfree(host);
+  ssh_xfree(port);
+  ssh_xfree(originator_ip);
+  ssh_xfree(originator_port);
+  return TRUE;
+#else /* SSH_CHANNEL_TCPFWD */
+  return FALSE;
+#endif /* SSH_CHANNEL_TCPFWD */
+}
+
+void ssh_mux_master_new_connection(SshStream stream, void *context)
+{
+  SshMuxMaster master = (SshMuxMaster)context;
+  SshMuxChannel ch;
+
+  if (stream == NULL)
+    return;
+
+  ch = ssh_mux_channel_create(stream, NULL);
+  ch->master = master;
+  ch->client = master->client;
+  ch->next = master->channels;
+  master->channels = ch;
+}
+
+SshMuxMaster ssh_mux_master_start(const char *path, SshClient client)
+{
+  SshMuxMaster master;
+  mode_t old_umask;
+
+  master = ssh_xcalloc(1, sizeof(*master));
+  master->client = client;
+  master->path = ssh_xstrdup(path);
+
+  /* Only the user may connect; the socket is created with the right
+     mode rather than changed afterwards. */
+  (void)remove(path);
+  old_umask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+  master->listener = ssh_local_make_listener(path,
+                                             ssh_mux_master_new_connection,
+                                             (void *)master);
+  umask(old_umask);
+  if (master->listener == NULL)
+    {
+      ssh_xfree(master->path);
+      ssh_xfree(master);
+      return NULL;
+    }
+
+  SSH_DEBUG(2, ("listening for clients at %s", path));
+  return master;
+}
+
+void ssh_mux_master_stop(SshMuxMaster master)
+{
+  SshMuxChannel ch, next;
+
+  ssh_local_destroy_listener(master->listener);
+  (void)remove(master->path);
+
+  for (ch = master->channels; ch; ch = next)
+    {
+      next = ch->next;
+      ch->master = NULL;
+      ch->next = NULL;
+      if (!ch->opened)
+        ssh_mux_channel_destroy(ch);
+    }
+
+  ssh_xfree(master->path);
+  memset(master, 'F', sizeof(*master));
+  ssh_xfree(master);
+}
+
+/***********************************************************************
+ * The client.
+ ***********************************************************************/
+
+void ssh_mux_client_channel_finished(SshMuxChannel ch)
+{
+  SshMuxClient mc = ch->mux_client;
+  SshMuxForward f;
+
+  if (ch->is_session)
+    {
+      if (!ch->eof_received && !ch->failed)
+        {
+          ssh_warning("Lost the connection to the master.");
+          (*mc->exit_notify)(255, mc->context);
+        }
+
+      /* The session is over; so are the forwards. */
+      mc->session = NULL;
+      while ((f = mc->forwards) != NULL)
+        {
+          mc->forwards = f->next;
+          ssh_tcp_destroy_listener(f->listener);
+          ssh_xfree(f);
+        }
+    }
+  ssh_mux_channel_destroy(ch);
+}
+
+void ssh_mux_client_forward_connected(SshStream stream, void *context)
+{
+  SshMuxIncoming in = (SshMuxIncoming)context;
+  SshForward fwd = in->forward->fwd;
+  SshMuxChannel ch;
+
+  if (stream == NULL)
+    {
+      ssh_warning("Could not reach the master for forwarded port %s.",
+                  fwd->port);
+      ssh_stream_destroy(in->stream);
+      ssh_xfree(in);
+      return;
+    }
+
+  ch = ssh_mux_channel_create(stream, in->forward->mux_client);
+  ssh_packet_wrapper_send_encode(ch->wrapper, SSH_MUX_OPEN_DIRECT_TCPIP,
+                                 SSH_FORMAT_UINT32_STR, fwd->connect_to_host,
+                                 strlen(fwd->connect_to_host),
+                                 SSH_FORMAT_UINT32_STR, fwd->connect_to_port,
+                                 strlen(fwd->connect_to_port),
+                                 SSH_FORMAT_UINT32_STR, in->ip,
+                                 strlen(in->ip),
+                                 SSH_FORMAT_UINT32_STR, in->port,
+                                 strlen(in->port),
+                                 SSH_FORMAT_END);
+  ssh_mux_channel_set_streams(ch, in->stream, NULL);
+  ssh_xfree(in);
+}
+
+void ssh_mux_client_forward_connection(SshIpError error, SshStream stream,
+                                       void *context)
+{
+  SshMuxForward f = (SshMuxForward)context;
+  SshMuxIncoming in;
+
+  if (error != SSH_IP_NEW_CONNECTION)
+    return;
+
+  in = ssh_xcalloc(1, sizeof(*in));
+  in->forward = f;
+  in->stream = stream;
+  if (!ssh_tcp_get_remote_address(stream, in->ip, sizeof(in->ip)))
+    strcpy(in->ip, "UNKNOWN");
+  if (!ssh_tcp_get_remote_port(stream, in->port, sizeof(in->port)))
+    strcpy(in->port, "UNKNOWN");
+
+  ssh_local_connect(f->mux_client->path, ssh_mux_client_forward_connected,
+                    (void *)in);
+}
+
+void ssh_mux_client_connected(SshStream stream, void *context)
+{
+  SshMuxClient mc = (SshMuxClient)context;
+  SshMuxForward f;
+  SshForward fwd;
+  SshMuxChannel ch;
+  const char *command;
+
+  if (stream == NULL)
+    {
+      SSH_DEBUG(2, ("no master at %s", mc->path));
+      (*mc->done)(FALSE, mc->context);
+      ssh_xfree(mc->path);
+      ssh_xfree(mc->command);
+      ssh_xfree(mc);
+      return;
+    }
+
+  SSH_DEBUG(2, ("connected to the master at %s", mc->path));
+
+  for (fwd = mc->local_forwards; fwd; fwd = fwd->next)
+    {
+      f = ssh_xcalloc(1, sizeof(*f));
+      f->mux_client = mc;
+      f->fwd = fwd;
+      f->listener = ssh_tcp_make_listener(fwd->local_addr, fwd->port,
+                                          ssh_mux_client_forward_connection,
+                                          (void *)f);
+      if (f->listener == NULL)
+        {
+          ssh_warning("Local TCP/IP forwarding for port %s failed.",
+                      fwd->port);
+          ssh_xfree(f);
+          continue;
+        }
+      f->next = mc->forwards;
+      mc->forwards = f;
+    }
+
+  if (mc->no_session)
+    ssh_stream_destroy(stream);
+  else
+    {
+      command = mc->command ? mc->command : "";
+      ch = ssh_mux_channel_create(stream, mc);
+      ch->is_session = TRUE;
+      ssh_packet_wrapper_send_encode(ch->wrapper, SSH_MUX_OPEN_SESSION,
+                                     SSH_FORMAT_BOOLEAN, mc->is_subsystem,
+                                     SSH_FORMAT_UINT32_STR,
+                                     command, strlen(command),
+                                     SSH_FORMAT_END);
+      ssh_mux_channel_set_streams(ch, ssh_stream_fd_stdio(), NULL);
+
+      /* Stderr is only written to. */
+      ch->err_stream = ssh_stream_fd_wrap2(-1, 2, FALSE);
+      ssh_stream_set_callback(ch->err_stream, ssh_mux_stream_callback,
+                              (void *)ch);
+      mc->session = ch;
+    }
+
+  (*mc->done)(TRUE, mc->context);
+}
+
+void ssh_mux_client_start(const char *path,
+                          Boolean no_session, Boolean is_subsystem,
+                          const char *command,
+                          SshForward local_forwards,
+                          void (*done)(Boolean success, void *context),
+                          void (*exit_notify)(SshUInt32 exit_status,
+                                              void *context),
+                          void *context)
+{
+  SshMuxClient mc;
+
+  mc = ssh_xcalloc(1, sizeof(*mc));
+  mc->path = ssh_xstrdup(path);
+  mc->no_session = no_session;
+  mc->is_subsystem = is_subsystem;
+  mc->command = command ? ssh_xstrdup(command) : NULL;
+  mc->local_forwards = local_forwards;
+  mc->done = done;
+  mc->exit_notify = exit_notify;
+  mc->context = context;
+
+  ssh_local_connect(path, ssh_mux_client_connected, (void *)mc);
+}
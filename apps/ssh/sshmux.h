@@ -0,0 +1,83 @@
+/*
+
+  sshmux.h
+
+  Copyright (C) 1999 SSH Communications Security Oy, Espoo, Finland
+  All rights reserved.
+
+*/
+
+/*
+
+  Connection sharing for the ssh client.  A client that has an
+  authenticated connection can act as a master, and listen on a local
+  control socket.  Later clients to the same host connect to the control
+  socket instead of making a connection of their own, and the master opens
+  session and forwarding channels for them on its connection.
+
+  The master and the other clients talk with packets over the control
+  socket.  Channel data flows as packets in both directions; the
+  connection protocol of the master takes care of the windows.
+
+*/
+
+#ifndef SSHMUX_H
+#define SSHMUX_H
+
+#include "sshclient.h"
+
+/* Packets on the control socket.  The first packet from a client opens
+   the channel; after that, data and eof flow in both directions. */
+
+/* boolean is_subsystem, string command (empty for none) */
+#define SSH_MUX_OPEN_SESSION            1
+/* string host, string port, string originator ip, string originator port */
+#define SSH_MUX_OPEN_DIRECT_TCPIP       2
+/* string data */
+#define SSH_MUX_DATA                    3
+/* string data (stderr of the session, from the master only) */
+#define SSH_MUX_EXTENDED_DATA           4
+/* (no payload) */
+#define SSH_MUX_EOF                     5
+/* uint32 exit status (from the master only) */
+#define SSH_MUX_EXIT_STATUS             6
+/* string message (from the master only) */
+#define SSH_MUX_FAILURE                 7
+
+/* Data type for the master. */
+typedef struct SshMuxMasterRec *SshMuxMaster;
+
+/* Data type for a client of the master. */
+typedef struct SshMuxClientRec *SshMuxClient;
+
+/* Starts listening for clients on the control socket `path', and
+   opens channels on `client' for them.  Any old socket at `path' is
+   removed first.  Returns NULL if the listener could not be created. */
+SshMuxMaster ssh_mux_master_start(const char *path, SshClient client);
+
+/* Stops accepting new clients and removes the control socket.  Channels
+   that are already open are left to finish on their own; they do not
+   refer to `master' after this.  This should be called before the
+   SshClient object is destroyed. */
+void ssh_mux_master_stop(SshMuxMaster master);
+
+/* Connects to the master at `path'.  `done' is called with FALSE
+   if there is no master at `path', in which case nothing has been
+   done and the caller should make a connection of its own.  Otherwise
+   `done' is called with TRUE, and the session (unless `no_session')
+   and the local forwards are run through the master.  Stdin, stdout
+   and stderr are used for the session.  `exit_notify' is called with
+   the exit status of the session (255 if the master could not run it
+   or was lost).  When the session has finished, everything is closed
+   and the event loop will return once the forwarded connections have
+   finished. */
+void ssh_mux_client_start(const char *path,
+                          Boolean no_session, Boolean is_subsystem,
+                          const char *command,
+                          SshForward local_forwards,
+                          void (*done)(Boolean success, void *context),
+                          void (*exit_notify)(SshUInt32 exit_status,
+                                              void *context),
+                          void *context);
+
+#endif /* SSHMUX_H */
@@ -25,6 +25,8 @@ implementation is actually shared with the client (in sshcommon.c).
 #include "sshserver.h"
 #include "sshuserfiles.h"
 #include "sshcipherlist.h"
+#include "ssh2pubkeyencode.h"
+#include "namelist.h"
 #include "sshtimeouts.h"
 
 #define SSH_DEBUG_MODULE "SshServer"
@@ -92,6 +94,7 @@ SshServer ssh_server_wrap(SshStream stream, SshConfig config,
   SshServer server;
   SshStream trans, auth;
   SshTransportParams params;
+  char *hlp, *cp;
 
   /* Create parameters. */
   params = ssh_transport_create_params();
@@ -108,6 +111,18 @@ SshServer ssh_server_wrap(SshStream stream, SshConfig config,
       config->public_host_key_blob == NULL)
     ssh_fatal("ssh_server_wrap: no host key !");
 
+  /* Offer only the algorithm of our host key, the client would
+     otherwise be free to choose one we have no key for. */
+  hlp = ssh_pubkeyblob_type(config->public_host_key_blob,
+                            config->public_host_key_blob_len);
+  if (hlp != NULL)
+    {
+      cp = ssh_name_list_intersection(params->host_key_algorithms, hlp);
+      ssh_xfree(params->host_key_algorithms);
+      params->host_key_algorithms = cp;
+      ssh_xfree(hlp);
+    }
+
   /* Create the server object. */
   server = ssh_xcalloc(1, sizeof(*server));
   server->config = config;
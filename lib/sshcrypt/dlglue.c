@@ -84,6 +84,9 @@ typedef struct SshDLParamRec
 
   /* Information about the policy when generating random numbers. */
   unsigned int exponent_entropy;
+
+  /* Scratch arena for the private and public key operations. */
+  SshMpScratch scratch;
 } SshDLParam;
 
 /* Global parameter list. This will contain only _unique_ parameters,
@@ -110,6 +113,8 @@ void ssh_dlp_init_param(SshDLParam *param)
   /* Handle the entropy! Lets denote by zero that most secure settings
      should be used. */
   param->exponent_entropy = 0;
+
+  ssh_mp_scratch_init(&param->scratch);
 }
 
 /* Free parameter set only if reference count tells so. */
@@ -136,6 +141,8 @@ void ssh_dlp_clear_param(SshDLParam *param)
   ssh_mp_clear(&param->g);
   ssh_mp_clear(&param->q);
 
+  ssh_mp_scratch_clear(&param->scratch);
+
   /* Clean pointers. */
   param->next  = NULL;
   param->prev  = NULL;
@@ -1190,6 +1197,7 @@ Boolean ssh_dlp_dsa_public_key_verify(const void *public_key,
   unsigned int len = ssh_mp_byte_size(&pub_key->param->q);
   unsigned int vlen;
   SshInt v, w, s, r, e, invs, u1, u2;
+  SshMpScratchFrame frame;
   void *hash_context;
   unsigned char *digest;
   /* Assume failure. */
@@ -1202,6 +1210,9 @@ Boolean ssh_dlp_dsa_public_key_verify(const void *public_key,
   if (vlen > len)
     return FALSE;
 
+  ssh_mp_scratch_begin(&pub_key->param->scratch, &frame,
+                       &pub_key->param->p);
+
   ssh_mp_init(&v);
   ssh_mp_init(&w);
   ssh_mp_init(&e);
@@ -1298,6 +1309,8 @@ failed:
   ssh_mp_clear(&u1);
   ssh_mp_clear(&u2);
 
+  ssh_mp_scratch_end(&frame);
+
   return rv;
 }
 
@@ -1327,6 +1340,7 @@ Boolean ssh_dlp_dsa_private_key_sign(const void *private_key,
   const SshDLPrivateKey *prv_key = private_key;
   SshDLStackRandomizer *stack;
   SshInt k, e, r, invk, s;
+  SshMpScratchFrame frame;
   unsigned int len = ssh_mp_byte_size(&prv_key->param->q);
   unsigned char *digest;
   void *hash_context;
@@ -1351,6 +1365,9 @@ Boolean ssh_dlp_dsa_private_key_sign(const void *private_key,
         return FALSE;
     }
 
+  ssh_mp_scratch_begin(&prv_key->param->scratch, &frame,
+                       &prv_key->param->p);
+
   ssh_mp_init(&k);
   ssh_mp_init(&e);
   ssh_mp_init(&r);
@@ -1427,6 +1444,8 @@ retry0:
   ssh_mp_clear(&invk);
   ssh_mp_clear(&s);
 
+  ssh_mp_scratch_end(&frame);
+
   return TRUE;
 }
 
@@ -1509,11 +1528,14 @@ Boolean ssh_dlp_diffie_hellman_generate(void *parameters,
   const SshDLParam *param = parameters;
   SshInt e;
   SshInt k;
+  SshMpScratchFrame frame;
   unsigned int len = ssh_mp_byte_size(&param->p);
   
   if (exchange_length < len)
     return FALSE;
 
+  ssh_mp_scratch_begin((SshMpScratch *)&param->scratch, &frame, &param->p);
+
   ssh_mp_init(&k);
   ssh_mp_init(&e);
   
@@ -1535,6 +1557,8 @@ Boolean ssh_dlp_diffie_hellman_generate(void *parameters,
 
   *diffie_hellman = ssh_dlp_mp_out(&k);
   ssh_mp_clear(&k);
+
+  ssh_mp_scratch_end(&frame);
   
   return TRUE;
 }
@@ -1562,6 +1586,7 @@ Boolean ssh_dlp_diffie_hellman_final(void *parameters,
 {
   const SshDLParam *param = parameters;
   SshInt v, k;
+  SshMpScratchFrame frame;
   unsigned int len = ssh_mp_byte_size(&param->p);
   
 #if 0
@@ -1571,6 +1596,8 @@ Boolean ssh_dlp_diffie_hellman_final(void *parameters,
   if (secret_length < len)
     return FALSE;
 
+  ssh_mp_scratch_begin((SshMpScratch *)&param->scratch, &frame, &param->p);
+
   ssh_mp_init(&v);
   ssh_mp_init(&k);
 
@@ -1590,6 +1617,8 @@ Boolean ssh_dlp_diffie_hellman_final(void *parameters,
   if (ssh_dlp_diffie_hellman_internal_final(&v, &v, param, &k) == FALSE)
     {
       ssh_mp_clear(&v);
+      ssh_mp_clear(&k);
+      ssh_mp_scratch_end(&frame);
       return FALSE;
     }
 
@@ -1606,6 +1635,7 @@ Boolean ssh_dlp_diffie_hellman_final(void *parameters,
 
   /* Clear memory. */
   ssh_mp_clear(&v);
+  ssh_mp_scratch_end(&frame);
   return TRUE;
 }
 
@@ -1630,12 +1660,16 @@ Boolean ssh_dlp_unified_diffie_hellman_final(const void *public_key,
   const SshDLPrivateKey *prv_key = private_key;
   const SshDLPublicKey *pub_key = public_key;
   SshInt v, w, k;
+  SshMpScratchFrame frame;
   unsigned int len = ssh_mp_byte_size(&prv_key->param->p);
 
   if (exchange_length < len)
     return FALSE;
   if (secret_length < len)
     return FALSE;
+
+  ssh_mp_scratch_begin(&prv_key->param->scratch, &frame,
+                       &prv_key->param->p);
   
   ssh_mp_init(&v);
   ssh_mp_init(&k);
@@ -1650,6 +1684,8 @@ Boolean ssh_dlp_unified_diffie_hellman_final(const void *public_key,
                                             &k) != TRUE)
     {
       ssh_mp_clear(&v);
+      ssh_mp_clear(&k);
+      ssh_mp_scratch_end(&frame);
       return FALSE;
     }
 
@@ -1670,6 +1706,8 @@ Boolean ssh_dlp_unified_diffie_hellman_final(const void *public_key,
 
   ssh_mp_clear(&v);
   ssh_mp_clear(&w);
+
+  ssh_mp_scratch_end(&frame);
   
   return TRUE;
 }
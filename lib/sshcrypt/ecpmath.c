@@ -0,0 +1,608 @@
+/*
+
+  ecpmath.c
+
+  Copyright (c) 1999 SSH Communications Security, Finland
+  All rights reserved.
+
+  Elliptic curve arithmetic over prime fields.
+
+  The point operations are done in Jacobian coordinates, where the
+  projective point (X, Y, Z) corresponds to the affine point
+  (X/Z^2, Y/Z^3), and all field elements are kept in Montgomery
+  representation. Thus the only inversion is in the conversion back to
+  affine coordinates.
+
+  */
+
+#include "sshincludes.h"
+#include "sshmp.h"
+#include "sshmpaux.h"
+#include "ecpmath.h"
+
+/* A point in Jacobian coordinates, Z = 0 denotes the point at
+   infinity. */
+typedef struct
+{
+  SshIntModQ x, y, z;
+} SshECPProjectivePoint;
+
+/* Temporary variables for the point operations, allocated once per
+   scalar multiplication. */
+#define SSH_ECP_TEMPS 9
+
+typedef struct
+{
+  SshIntModQ t[SSH_ECP_TEMPS];
+} SshECPTemp;
+
+/* Named curves. */
+typedef struct
+{
+  const char *name;
+  const char *q, *a, *b, *c, *gx, *gy;
+} SshECPNamedCurve;
+
+static const SshECPNamedCurve ssh_ecp_named_curves[] =
+{
+  { "nistp256",
+    "FFFFFFFF00000001000000000000000000000000FFFFFFFFFFFFFFFFFFFFFFFF",
+    "FFFFFFFF00000001000000000000000000000000FFFFFFFFFFFFFFFFFFFFFFFC",
+    "5AC635D8AA3A93E7B3EBBD55769886BC651D06B0CC53B0F63BCE3C3E27D2604B",
+    "FFFFFFFF00000000FFFFFFFFFFFFFFFFBCE6FAADA7179E84F3B9CAC2FC632551",
+    "6B17D1F2E12C4247F8BCE6E563A440F277037D812DEB33A0F4A13945D898C296",
+    "4FE342E2FE1A7F9B8EE7EB4A7C0F9E162BCE33576B315ECECBB6406837BF51F5" },
+  { NULL }
+};
+
+/* The curve. */
+
+Boolean ssh_ecp_set_curve(SshECPCurve *E, const SshInt *q,
+                          const SshInt *a, const SshInt *b,
+                          const SshInt *c)
+{
+  SshInt t;
+  Boolean rv;
+
+  ssh_mp_init(&t);
+  ssh_mp_init(&E->q);
+  ssh_mp_init(&E->a);
+  ssh_mp_init(&E->b);
+  ssh_mp_init(&E->c);
+  ssh_mp_set(&E->q, q);
+  ssh_mp_set(&E->a, a);
+  ssh_mp_set(&E->b, b);
+  ssh_mp_set(&E->c, c);
+
+  /* The Montgomery representation needs an odd modulus, and we want
+     the coefficients reduced. */
+  rv = ssh_mpm_init_m(&E->m, q);
+  if (rv == FALSE)
+    {
+      /* Keep the curve clearable. */
+      ssh_mp_set_ui(&t, 3);
+      ssh_mpm_init_m(&E->m, &t);
+    }
+  if (ssh_mp_cmp_ui(a, 0) < 0 || ssh_mp_cmp(a, q) >= 0 ||
+      ssh_mp_cmp_ui(b, 0) < 0 || ssh_mp_cmp(b, q) >= 0)
+    rv = FALSE;
+
+  ssh_mpm_init(&E->a_m, &E->m);
+  if (rv)
+    ssh_mpm_set_mp(&E->a_m, a);
+
+  ssh_mp_add_ui(&t, a, 3);
+  E->a_is_minus3 = (rv && ssh_mp_cmp(&t, q) == 0);
+  ssh_mp_clear(&t);
+
+  return rv;
+}
+
+void ssh_ecp_clear_curve(SshECPCurve *E)
+{
+  ssh_mpm_clear(&E->a_m);
+  ssh_mpm_clear_m(&E->m);
+  ssh_mp_clear(&E->q);
+  ssh_mp_clear(&E->a);
+  ssh_mp_clear(&E->b);
+  ssh_mp_clear(&E->c);
+}
+
+Boolean ssh_ecp_set_named_curve(SshECPCurve *E, SshECPPoint *G,
+                                const char *name)
+{
+  const SshECPNamedCurve *nc;
+  SshInt q, a, b, c, x, y;
+  Boolean rv;
+
+  for (nc = ssh_ecp_named_curves; nc->name; nc++)
+    if (strcmp(nc->name, name) == 0)
+      break;
+  if (nc->name == NULL)
+    return FALSE;
+
+  ssh_mp_init(&q);
+  ssh_mp_init(&a);
+  ssh_mp_init(&b);
+  ssh_mp_init(&c);
+  ssh_mp_init(&x);
+  ssh_mp_init(&y);
+
+  ssh_mp_set_str(&q, nc->q, 16);
+  ssh_mp_set_str(&a, nc->a, 16);
+  ssh_mp_set_str(&b, nc->b, 16);
+  ssh_mp_set_str(&c, nc->c, 16);
+  ssh_mp_set_str(&x, nc->gx, 16);
+  ssh_mp_set_str(&y, nc->gy, 16);
+
+  rv = ssh_ecp_set_curve(E, &q, &a, &b, &c);
+  ssh_ecp_init_point(G);
+  ssh_ecp_set_point_xy(G, &x, &y);
+
+  ssh_mp_clear(&q);
+  ssh_mp_clear(&a);
+  ssh_mp_clear(&b);
+  ssh_mp_clear(&c);
+  ssh_mp_clear(&x);
+  ssh_mp_clear(&y);
+
+  if (rv == FALSE || ssh_ecp_verify_point(G, E) == FALSE)
+    ssh_fatal("ssh_ecp_set_named_curve: curve %s is invalid.", name);
+  return TRUE;
+}
+
+/* Affine points. */
+
+void ssh_ecp_init_point(SshECPPoint *P)
+{
+  ssh_mp_init(&P->x);
+  ssh_mp_init(&P->y);
+  P->z = 0;
+}
+
+void ssh_ecp_clear_point(SshECPPoint *P)
+{
+  ssh_mp_clear(&P->x);
+  ssh_mp_clear(&P->y);
+  P->z = 0;
+}
+
+void ssh_ecp_set_identity(SshECPPoint *P)
+{
+  ssh_mp_set_ui(&P->x, 0);
+  ssh_mp_set_ui(&P->y, 0);
+  P->z = 0;
+}
+
+void ssh_ecp_set_point(SshECPPoint *R, const SshECPPoint *P)
+{
+  ssh_mp_set(&R->x, &P->x);
+  ssh_mp_set(&R->y, &P->y);
+  R->z = P->z;
+}
+
+void ssh_ecp_set_point_xy(SshECPPoint *R, const SshInt *x, const SshInt *y)
+{
+  ssh_mp_set(&R->x, x);
+  ssh_mp_set(&R->y, y);
+  R->z = 1;
+}
+
+int ssh_ecp_compare_points(const SshECPPoint *P, const SshECPPoint *Q)
+{
+  if (P->z != Q->z)
+    return 1;
+  if (P->z == 0)
+    return 0;
+  if (ssh_mp_cmp(&P->x, &Q->x) != 0 || ssh_mp_cmp(&P->y, &Q->y) != 0)
+    return 1;
+  return 0;
+}
+
+Boolean ssh_ecp_verify_point(const SshECPPoint *P, const SshECPCurve *E)
+{
+  SshIntModQ x, y, t, u;
+  Boolean rv;
+
+  if (P->z == 0)
+    return FALSE;
+  if (ssh_mp_cmp_ui(&P->x, 0) < 0 || ssh_mp_cmp(&P->x, &E->q) >= 0 ||
+      ssh_mp_cmp_ui(&P->y, 0) < 0 || ssh_mp_cmp(&P->y, &E->q) >= 0)
+    return FALSE;
+
+  ssh_mpm_init(&x, &E->m);
+  ssh_mpm_init(&y, &E->m);
+  ssh_mpm_init(&t, &E->m);
+  ssh_mpm_init(&u, &E->m);
+
+  ssh_mpm_set_mp(&x, &P->x);
+  ssh_mpm_set_mp(&y, &P->y);
+
+  /* t = x^3 + ax + b, u = y^2 */
+  ssh_mpm_square(&t, &x);
+  ssh_mpm_add(&t, &t, &E->a_m);
+  ssh_mpm_mul(&t, &t, &x);
+  ssh_mpm_set_mp(&u, &E->b);
+  ssh_mpm_add(&t, &t, &u);
+  ssh_mpm_square(&u, &y);
+
+  rv = (ssh_mpm_cmp(&t, &u) == 0);
+
+  ssh_mpm_clear(&x);
+  ssh_mpm_clear(&y);
+  ssh_mpm_clear(&t);
+  ssh_mpm_clear(&u);
+  return rv;
+}
+
+void ssh_ecp_negate_point(SshECPPoint *R, const SshECPPoint *P,
+                          const SshECPCurve *E)
+{
+  ssh_ecp_set_point(R, P);
+  if (R->z && ssh_mp_cmp_ui(&R->y, 0) != 0)
+    ssh_mp_sub(&R->y, &E->q, &R->y);
+}
+
+/* Projective points. */
+
+static void ssh_ecp_init_projective(SshECPProjectivePoint *P,
+                                    const SshECPCurve *E)
+{
+  ssh_mpm_init(&P->x, &E->m);
+  ssh_mpm_init(&P->y, &E->m);
+  ssh_mpm_init(&P->z, &E->m);
+}
+
+static void ssh_ecp_clear_projective(SshECPProjectivePoint *P)
+{
+  ssh_mpm_clear(&P->x);
+  ssh_mpm_clear(&P->y);
+  ssh_mpm_clear(&P->z);
+}
+
+static void ssh_ecp_set_projective(SshECPProjectivePoint *R,
+                                   const SshECPProjectivePoint *P)
+{
+  ssh_mpm_set(&R->x, &P->x);
+  ssh_mpm_set(&R->y, &P->y);
+  ssh_mpm_set(&R->z, &P->z);
+}
+
+/* Convert from affine to Jacobian coordinates, Z = 1. */
+static void ssh_ecp_affine_to_projective(SshECPProjectivePoint *R,
+                                         const SshECPPoint *P)
+{
+  SshInt t;
+
+  ssh_mp_init(&t);
+  ssh_mp_set_ui(&t, P->z ? 1 : 0);
+  ssh_mpm_set_mp(&R->z, &t);
+  ssh_mp_clear(&t);
+
+  ssh_mpm_set_mp(&R->x, &P->x);
+  ssh_mpm_set_mp(&R->y, &P->y);
+}
+
+/* Convert back to affine coordinates, this needs one inversion. */
+static void ssh_ecp_projective_to_affine(SshECPPoint *R,
+                                         const SshECPProjectivePoint *P,
+                                         SshECPTemp *T)
+{
+  SshIntModQ *zi = &T->t[0], *zi2 = &T->t[1], *t = &T->t[2];
+
+  if (P->z.n == 0)
+    {
+      ssh_ecp_set_identity(R);
+      return;
+    }
+
+  ssh_mpm_invert(zi, &P->z);
+  ssh_mpm_square(zi2, zi);
+  ssh_mpm_mul(t, &P->x, zi2);
+  ssh_mp_set_mpm(&R->x, t);
+  ssh_mpm_mul(zi2, zi2, zi);
+  ssh_mpm_mul(t, &P->y, zi2);
+  ssh_mp_set_mpm(&R->y, t);
+  R->z = 1;
+}
+
+/* R = 2P, R and P may be the same. */
+static void ssh_ecp_projective_double(SshECPProjectivePoint *R,
+                                      const SshECPProjectivePoint *P,
+                                      const SshECPCurve *E,
+                                      SshECPTemp *T)
+{
+  SshIntModQ *m = &T->t[0], *s = &T->t[1], *u = &T->t[2],
+    *v = &T->t[3];
+
+  /* The point at infinity, or a point of order two. */
+  if (P->z.n == 0 || P->y.n == 0)
+    {
+      R->z.n = 0;
+      return;
+    }
+
+  /* m = 3x^2 + az^4 */
+  if (E->a_is_minus3)
+    {
+      /* m = 3(x - z^2)(x + z^2) */
+      ssh_mpm_square(u, &P->z);
+      ssh_mpm_sub(v, &P->x, u);
+      ssh_mpm_add(u, &P->x, u);
+      ssh_mpm_mul(m, u, v);
+      ssh_mpm_mul_ui(m, m, 3);
+    }
+  else
+    {
+      ssh_mpm_square(u, &P->x);
+      ssh_mpm_mul_ui(m, u, 3);
+      ssh_mpm_square(u, &P->z);
+      ssh_mpm_square(u, u);
+      ssh_mpm_mul(u, u, &E->a_m);
+      ssh_mpm_add(m, m, u);
+    }
+
+  /* z' = 2yz */
+  ssh_mpm_mul(&R->z, &P->y, &P->z);
+  ssh_mpm_mul_2exp(&R->z, &R->z, 1);
+
+  /* s = 4xy^2, v = 8y^4 */
+  ssh_mpm_square(u, &P->y);
+  ssh_mpm_mul(s, &P->x, u);
+  ssh_mpm_mul_2exp(s, s, 2);
+  ssh_mpm_square(v, u);
+  ssh_mpm_mul_2exp(v, v, 3);
+
+  /* x' = m^2 - 2s */
+  ssh_mpm_square(u, m);
+  ssh_mpm_sub(u, u, s);
+  ssh_mpm_sub(&R->x, u, s);
+
+  /* y' = m(s - x') - 8y^4 */
+  ssh_mpm_sub(u, s, &R->x);
+  ssh_mpm_mul(u, u, m);
+  ssh_mpm_sub(&R->y, u, v);
+}
+
+/* R = P + Q, R may be the same as either of P and Q. */
+static void ssh_ecp_projective_add(SshECPProjectivePoint *R,
+                                   const SshECPProjectivePoint *P,
+                                   const SshECPProjectivePoint *Q,
+                                   const SshECPCurve *E,
+                                   SshECPTemp *T)
+{
+  SshIntModQ *u1 = &T->t[4], *u2 = &T->t[5], *s1 = &T->t[6],
+    *s2 = &T->t[7], *h = &T->t[8], *h2 = &T->t[0], *h3 = &T->t[1],
+    *v = &T->t[2];
+
+  if (P->z.n == 0)
+    {
+      ssh_ecp_set_projective(R, Q);
+      return;
+    }
+  if (Q->z.n == 0)
+    {
+      ssh_ecp_set_projective(R, P);
+      return;
+    }
+
+  /* u1 = x1 z2^2, s1 = y1 z2^3 */
+  ssh_mpm_square(h, &Q->z);
+  ssh_mpm_mul(u1, &P->x, h);
+  ssh_mpm_mul(h, h, &Q->z);
+  ssh_mpm_mul(s1, &P->y, h);
+
+  /* u2 = x2 z1^2, s2 = y2 z1^3 */
+  ssh_mpm_square(h, &P->z);
+  ssh_mpm_mul(u2, &Q->x, h);
+  ssh_mpm_mul(h, h, &P->z);
+  ssh_mpm_mul(s2, &Q->y, h);
+
+  /* h = u2 - u1, s2 = r = s2 - s1 */
+  ssh_mpm_sub(h, u2, u1);
+  ssh_mpm_sub(s2, s2, s1);
+
+  if (h->n == 0)
+    {
+      /* Same x, thus P = Q or P = -Q. */
+      if (s2->n == 0)
+        ssh_ecp_projective_double(R, P, E, T);
+      else
+        R->z.n = 0;
+      return;
+    }
+
+  /* z3 = z1 z2 h */
+  ssh_mpm_mul(&R->z, &P->z, &Q->z);
+  ssh_mpm_mul(&R->z, &R->z, h);
+
+  /* x3 = r^2 - h^3 - 2 u1 h^2 */
+  ssh_mpm_square(h2, h);
+  ssh_mpm_mul(h3, h2, h);
+  ssh_mpm_mul(v, u1, h2);
+  ssh_mpm_square(u2, s2);
+  ssh_mpm_sub(u2, u2, h3);
+  ssh_mpm_sub(u2, u2, v);
+  ssh_mpm_sub(&R->x, u2, v);
+
+  /* y3 = r(u1 h^2 - x3) - s1 h^3 */
+  ssh_mpm_sub(v, v, &R->x);
+  ssh_mpm_mul(v, v, s2);
+  ssh_mpm_mul(h3, h3, s1);
+  ssh_mpm_sub(&R->y, v, h3);
+}
+
+static void ssh_ecp_init_temp(SshECPTemp *T, const SshECPCurve *E)
+{
+  int i;
+
+  for (i = 0; i < SSH_ECP_TEMPS; i++)
+    ssh_mpm_init(&T->t[i], &E->m);
+}
+
+static void ssh_ecp_clear_temp(SshECPTemp *T)
+{
+  int i;
+
+  for (i = 0; i < SSH_ECP_TEMPS; i++)
+    ssh_mpm_clear(&T->t[i]);
+}
+
+void ssh_ecp_add(SshECPPoint *R, const SshECPPoint *P,
+                 const SshECPPoint *Q, const SshECPCurve *E)
+{
+  SshECPProjectivePoint a, b;
+  SshECPTemp T;
+
+  ssh_ecp_init_temp(&T, E);
+  ssh_ecp_init_projective(&a, E);
+  ssh_ecp_init_projective(&b, E);
+
+  ssh_ecp_affine_to_projective(&a, P);
+  ssh_ecp_affine_to_projective(&b, Q);
+  ssh_ecp_projective_add(&a, &a, &b, E, &T);
+  ssh_ecp_projective_to_affine(R, &a, &T);
+
+  ssh_ecp_clear_projective(&a);
+  ssh_ecp_clear_projective(&b);
+  ssh_ecp_clear_temp(&T);
+}
+
+/* Scalar multiplication with a sliding window over the bits of k. The
+   odd multiples P, 3P, ..., (2^w - 1)P are precomputed, which gives one
+   addition per about w + 1 bits of k. */
+void ssh_ecp_mul(SshECPPoint *R, const SshECPPoint *P, const SshInt *k,
+                 const SshECPCurve *E)
+{
+  SshECPProjectivePoint *table, acc, twice;
+  SshECPTemp T;
+  unsigned int table_bits, table_size, bits, i, j, mask, end_double;
+  Boolean first;
+
+  bits = ssh_mp_bit_size(k);
+  if (P->z == 0 || bits == 0 || ssh_mp_cmp_ui(k, 0) < 0)
+    {
+      ssh_ecp_set_identity(R);
+      return;
+    }
+
+  /* Window sizes minimizing the number of additions. */
+  if (bits < 24)
+    table_bits = 2;
+  else if (bits < 80)
+    table_bits = 3;
+  else if (bits < 240)
+    table_bits = 4;
+  else if (bits < 680)
+    table_bits = 5;
+  else
+    table_bits = 6;
+  table_size = 1 << (table_bits - 1);
+
+  ssh_ecp_init_temp(&T, E);
+  ssh_ecp_init_projective(&acc, E);
+  ssh_ecp_init_projective(&twice, E);
+
+  /* table[i] = (2i + 1)P */
+  table = ssh_xmalloc(sizeof(*table) * table_size);
+  ssh_ecp_init_projective(&table[0], E);
+  ssh_ecp_affine_to_projective(&table[0], P);
+  ssh_ecp_projective_double(&twice, &table[0], E, &T);
+  for (i = 1; i < table_size; i++)
+    {
+      ssh_ecp_init_projective(&table[i], E);
+      ssh_ecp_projective_add(&table[i], &table[i - 1], &twice, E, &T);
+    }
+
+  /* The same loop as in the modular exponentiation. */
+  for (first = TRUE, i = bits; i;)
+    {
+      for (j = 0, mask = 0; j < table_bits && i; j++, i--)
+        {
+          mask <<= 1;
+          mask |= ssh_mp_get_bit(k, i - 1);
+        }
+
+      for (end_double = 0; (mask & 0x1) == 0;)
+        {
+          mask >>= 1;
+          end_double++;
+        }
+
+      if (!first)
+        {
+          for (j = mask; j; j >>= 1)
+            ssh_ecp_projective_double(&acc, &acc, E, &T);
+          ssh_ecp_projective_add(&acc, &acc, &table[(mask - 1)/2], E, &T);
+        }
+      else
+        {
+          ssh_ecp_set_projective(&acc, &table[(mask - 1)/2]);
+          first = FALSE;
+        }
+
+      while (end_double)
+        {
+          ssh_ecp_projective_double(&acc, &acc, E, &T);
+          end_double--;
+        }
+
+      while (i && ssh_mp_get_bit(k, i - 1) == 0)
+        {
+          ssh_ecp_projective_double(&acc, &acc, E, &T);
+          i--;
+        }
+    }
+
+  ssh_ecp_projective_to_affine(R, &acc, &T);
+
+  for (i = 0; i < table_size; i++)
+    ssh_ecp_clear_projective(&table[i]);
+  ssh_xfree(table);
+  ssh_ecp_clear_projective(&acc);
+  ssh_ecp_clear_projective(&twice);
+  ssh_ecp_clear_temp(&T);
+}
+
+/* Encoding. */
+
+size_t ssh_ecp_point_to_buf(unsigned char *buf, size_t buf_len,
+                            const SshECPPoint *P, const SshECPCurve *E)
+{
+  size_t len = ssh_mp_byte_size(&E->q);
+
+  if (P->z == 0)
+    {
+      if (buf == NULL)
+        return 1;
+      if (buf_len < 1)
+        return 0;
+      buf[0] = 0x00;
+      return 1;
+    }
+
+  if (buf == NULL)
+    return 1 + 2 * len;
+  if (buf_len < 1 + 2 * len)
+    return 0;
+
+  buf[0] = 0x04;
+  ssh_mp_to_buf(buf + 1, len, &P->x);
+  ssh_mp_to_buf(buf + 1 + len, len, &P->y);
+  return 1 + 2 * len;
+}
+
+Boolean ssh_ecp_buf_to_point(SshECPPoint *P, const unsigned char *buf,
+                             size_t buf_len, const SshECPCurve *E)
+{
+  size_t len = ssh_mp_byte_size(&E->q);
+
+  if (buf_len != 1 + 2 * len || buf[0] != 0x04)
+    return FALSE;
+
+  ssh_buf_to_mp(&P->x, buf + 1, len);
+  ssh_buf_to_mp(&P->y, buf + 1 + len, len);
+  P->z = 1;
+
+  return ssh_ecp_verify_point(P, E);
+}
@@ -0,0 +1,101 @@
+/*
+
+  ecpmath.h
+
+  Copyright (c) 1999 SSH Communications Security, Finland
+  All rights reserved.
+
+  Elliptic curve arithmetic over prime fields, that is with curves of
+  form
+
+    y^2 = x^3 + ax + b (mod q),
+
+  where q is an odd prime. The arithmetic is built on the Montgomery
+  representation of the sshmath library. Points are kept in affine
+  coordinates outside this module, internally the computations are
+  done in Jacobian projective coordinates, and the scalar
+  multiplication uses a sliding window of precomputed odd multiples.
+
+  */
+
+#ifndef ECPMATH_H
+#define ECPMATH_H
+
+#include "sshmp.h"
+
+/* The curve. */
+typedef struct SshECPCurveRec
+{
+  /* The field modulus, the curve coefficients, and the order of the
+     base point (cardinality, if prime). */
+  SshInt q, a, b, c;
+
+  /* The field modulus in Montgomery representation, and the curve
+     coefficient a as a value modulo q. */
+  SshIntModuli m;
+  SshIntModQ a_m;
+
+  /* TRUE if a = -3 (mod q), which allows a faster doubling. */
+  Boolean a_is_minus3;
+} SshECPCurve;
+
+/* A point in affine coordinates. The point at infinity has z = 0,
+   otherwise z = 1. */
+typedef struct SshECPPointRec
+{
+  SshInt x, y;
+  int z;
+} SshECPPoint;
+
+/* Initialize a curve. Returns FALSE if q is not odd or a, b are not
+   reduced modulo q. The curve must be cleared with ssh_ecp_clear_curve
+   in either case. */
+Boolean ssh_ecp_set_curve(SshECPCurve *E, const SshInt *q,
+                          const SshInt *a, const SshInt *b,
+                          const SshInt *c);
+void ssh_ecp_clear_curve(SshECPCurve *E);
+
+/* Initialize a named curve and its base point. Currently "nistp256" is
+   known (the 256-bit prime curve recommended by NIST in July 1999).
+   Returns FALSE if the name is unknown, in which case nothing needs to be
+   cleared. */
+Boolean ssh_ecp_set_named_curve(SshECPCurve *E, SshECPPoint *G,
+                                const char *name);
+
+/* Points. */
+void ssh_ecp_init_point(SshECPPoint *P);
+void ssh_ecp_clear_point(SshECPPoint *P);
+void ssh_ecp_set_identity(SshECPPoint *P);
+void ssh_ecp_set_point(SshECPPoint *R, const SshECPPoint *P);
+void ssh_ecp_set_point_xy(SshECPPoint *R, const SshInt *x, const SshInt *y);
+int ssh_ecp_compare_points(const SshECPPoint *P, const SshECPPoint *Q);
+
+/* Returns TRUE if the point is not the point at infinity, its
+   coordinates are reduced and it satisfies the curve equation. */
+Boolean ssh_ecp_verify_point(const SshECPPoint *P, const SshECPCurve *E);
+
+/* R = -P. */
+void ssh_ecp_negate_point(SshECPPoint *R, const SshECPPoint *P,
+                          const SshECPCurve *E);
+
+/* R = P + Q. */
+void ssh_ecp_add(SshECPPoint *R, const SshECPPoint *P,
+                 const SshECPPoint *Q, const SshECPCurve *E);
+
+/* R = kP, with k >= 0. */
+void ssh_ecp_mul(SshECPPoint *R, const SshECPPoint *P, const SshInt *k,
+                 const SshECPCurve *E);
+
+/* Encode the point as an uncompressed octet string 0x04 || x || y with
+   both coordinates of the length of q in octets. The point at infinity
+   is the single octet 0x00. Returns the length of the encoding, or 0 if
+   buf_len is too small; with buf NULL returns the space needed. */
+size_t ssh_ecp_point_to_buf(unsigned char *buf, size_t buf_len,
+                            const SshECPPoint *P, const SshECPCurve *E);
+
+/* Decode a point encoded as above. Returns FALSE if the encoding is
+   invalid or the point is not on the curve. */
+Boolean ssh_ecp_buf_to_point(SshECPPoint *P, const unsigned char *buf,
+                             size_t buf_len, const SshECPCurve *E);
+
+#endif /* ECPMATH_H */
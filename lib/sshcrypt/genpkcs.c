@@ -55,6 +55,7 @@
 #include "sha.h"
 #include "sshgetput.h"
 #include "dlglue.h"
+#include "rsaglue.h"
 #include "sshencode.h"
 #include "namelist.h"
 
@@ -745,6 +746,36 @@ const SshPkDiffieHellman ssh_dl_modp_diffie_hellman_schemes[] =
 };
 
 
+/* Table of all supported signature schemes for if-modn keys. */
+
+const SshPkSignature ssh_if_modn_signature_schemes[] =
+{
+  { "rsa-pkcs1-sha1",
+    NULL,
+    &ssh_hash_sha_def,
+    ssh_rsa_private_key_max_signature_input_len,
+    ssh_rsa_private_key_max_signature_output_len,
+    ssh_rsa_pkcs1_public_key_verify,
+    ssh_rsa_pkcs1_private_key_sign
+  },
+  { NULL }
+};
+
+/* Table of all supported encryption schemes for if-modn keys. */
+
+const SshPkEncryption ssh_if_modn_encryption_schemes[] =
+{
+  { "rsa-pkcs1-none",
+    NULL,
+    NULL,
+    ssh_rsa_private_key_max_decrypt_input_len,
+    ssh_rsa_private_key_max_decrypt_output_len,
+    ssh_rsa_pkcs1_private_key_decrypt,
+    ssh_rsa_public_key_max_encrypt_input_len,
+    ssh_rsa_public_key_max_encrypt_output_len,
+    ssh_rsa_pkcs1_public_key_encrypt },
+  { NULL }
+};
 
 /* Action lists. These lists contain most information about generation of
    private keys, and parameters. */
@@ -966,6 +997,108 @@ const SshPkAction ssh_pk_dl_modp_actions[] =
 };
 
 
+/* RSA special actions. There are no groups. */
+
+const SshPkAction ssh_pk_if_modn_actions[] =
+{
+  /* key type */
+  { SSH_PKF_KEY_TYPE, NULL,
+    SSH_PK_FLAG_KEY_TYPE | SSH_PK_FLAG_PRIVATE_KEY |
+    SSH_PK_FLAG_PUBLIC_KEY,
+    SSH_PK_SCHEME_NONE, 0, NULL },
+
+  /* Schemes */
+  { SSH_PKF_SIGN, "sign",
+    SSH_PK_FLAG_SCHEME | SSH_PK_FLAG_PRIVATE_KEY | SSH_PK_FLAG_PUBLIC_KEY,
+    SSH_PK_SCHEME_SIGN,
+    sizeof(SshPkSignature),
+    ssh_if_modn_signature_schemes, NULL },
+
+  { SSH_PKF_ENCRYPT, "encrypt",
+    SSH_PK_FLAG_SCHEME | SSH_PK_FLAG_PRIVATE_KEY | SSH_PK_FLAG_PUBLIC_KEY,
+    SSH_PK_SCHEME_ENCRYPT,
+    sizeof(SshPkEncryption),
+    ssh_if_modn_encryption_schemes, NULL },
+
+  /* Handling of keys. */
+
+  /* size (private_key, public_key) */
+  { SSH_PKF_SIZE, NULL,
+    SSH_PK_FLAG_SPECIAL | SSH_PK_FLAG_PRIVATE_KEY,
+    SSH_PK_SCHEME_NONE, 0,
+    NULL,
+    ssh_rsa_action_private_key_put,
+    ssh_rsa_action_private_key_get },
+
+  { SSH_PKF_SIZE, NULL,
+    SSH_PK_FLAG_SPECIAL | SSH_PK_FLAG_PUBLIC_KEY | SSH_PK_FLAG_LIST,
+    SSH_PK_SCHEME_NONE, 0,
+    NULL,
+    ssh_rsa_action_public_key_put,
+    ssh_rsa_action_public_key_get },
+
+  /* modulo-n (private_key, public_key) */
+  { SSH_PKF_MODULO_N, NULL,
+    SSH_PK_FLAG_SPECIAL | SSH_PK_FLAG_PRIVATE_KEY,
+    SSH_PK_SCHEME_NONE, 0,
+    NULL,
+    ssh_rsa_action_private_key_put,
+    ssh_rsa_action_private_key_get },
+
+  { SSH_PKF_MODULO_N, NULL,
+    SSH_PK_FLAG_SPECIAL | SSH_PK_FLAG_PUBLIC_KEY | SSH_PK_FLAG_LIST,
+    SSH_PK_SCHEME_NONE, 0,
+    NULL,
+    ssh_rsa_action_public_key_put,
+    ssh_rsa_action_public_key_get },
+
+  /* public-e (private_key, public_key) */
+  { SSH_PKF_PUBLIC_E, NULL,
+    SSH_PK_FLAG_SPECIAL | SSH_PK_FLAG_PRIVATE_KEY,
+    SSH_PK_SCHEME_NONE, 0,
+    NULL,
+    ssh_rsa_action_private_key_put,
+    ssh_rsa_action_private_key_get },
+
+  { SSH_PKF_PUBLIC_E, NULL,
+    SSH_PK_FLAG_SPECIAL | SSH_PK_FLAG_PUBLIC_KEY | SSH_PK_FLAG_LIST,
+    SSH_PK_SCHEME_NONE, 0,
+    NULL,
+    ssh_rsa_action_public_key_put,
+    ssh_rsa_action_public_key_get },
+
+  /* secret-d, prime-p, prime-q, inverse-u (private_key) */
+  { SSH_PKF_SECRET_D, NULL,
+    SSH_PK_FLAG_SPECIAL | SSH_PK_FLAG_PRIVATE_KEY,
+    SSH_PK_SCHEME_NONE, 0,
+    NULL,
+    ssh_rsa_action_private_key_put,
+    ssh_rsa_action_private_key_get },
+
+  { SSH_PKF_PRIME_P, NULL,
+    SSH_PK_FLAG_SPECIAL | SSH_PK_FLAG_PRIVATE_KEY,
+    SSH_PK_SCHEME_NONE, 0,
+    NULL,
+    ssh_rsa_action_private_key_put,
+    ssh_rsa_action_private_key_get },
+
+  { SSH_PKF_PRIME_Q, NULL,
+    SSH_PK_FLAG_SPECIAL | SSH_PK_FLAG_PRIVATE_KEY,
+    SSH_PK_SCHEME_NONE, 0,
+    NULL,
+    ssh_rsa_action_private_key_put,
+    ssh_rsa_action_private_key_get },
+
+  { SSH_PKF_INVERSE_U, NULL,
+    SSH_PK_FLAG_SPECIAL | SSH_PK_FLAG_PRIVATE_KEY,
+    SSH_PK_SCHEME_NONE, 0,
+    NULL,
+    ssh_rsa_action_private_key_put,
+    ssh_rsa_action_private_key_get },
+
+  /* End of list. */
+  { SSH_PKF_END }
+};
 
 /* more actions to come... */
 
@@ -1017,6 +1150,39 @@ const SshPkType ssh_key_types[] =
     ssh_dlp_private_key_copy,
     ssh_dlp_private_key_derive_param
   },    
+
+  /* Key type for integer factorization based systems. */
+  { "if-modn",
+    ssh_pk_if_modn_actions,
+
+    /* No groups, thus neither randomizers. */
+    NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL,
+
+    /* Public key operations. */
+    ssh_rsa_action_public_key_init,
+    ssh_rsa_public_key_action_make,
+    ssh_rsa_action_free,
+
+    ssh_rsa_public_key_import,
+    ssh_rsa_public_key_export,
+    ssh_rsa_public_key_free,
+    ssh_rsa_public_key_copy,
+    NULL,
+
+    /* Private key operations. */
+    ssh_rsa_action_init,
+    ssh_rsa_private_key_action_make,
+    ssh_rsa_action_free,
+
+    ssh_rsa_private_key_import,
+    ssh_rsa_private_key_export,
+    ssh_rsa_private_key_free,
+    ssh_rsa_private_key_derive_public_key,
+    ssh_rsa_private_key_copy,
+    NULL
+  },
   { NULL }
 };
 
@@ -1442,6 +1608,10 @@ ssh_public_key_get_predefined_groups(const char *key_type)
     {
       if (strcmp(ssh_key_types[i].name, tmp) == 0)
         {
+          /* Key types without groups (such as if-modn) have no
+             predefined groups either. */
+          if (ssh_key_types[i].pk_group_get_predefined_groups == NULL)
+            return NULL;
           return (*ssh_key_types[i].pk_group_get_predefined_groups)();
         }
     }
@@ -1490,6 +1660,9 @@ ssh_pk_group_generate(SshRandomState state,
   
   for (i = 0; ssh_key_types[i].name; i++)
     {
+      /* Key types without group operations cannot be used here. */
+      if (ssh_key_types[i].pk_group_action_init == NULL)
+        continue;
       if (strcmp(ssh_key_types[i].name, tmp) == 0)
         {
           /* Free allocated name. */
@@ -2020,6 +2193,8 @@ ssh_pk_group_import(unsigned char *buf, size_t buf_length,
 
   for (i = 0, pk_group = NULL; ssh_key_types[i].name; i++)
     {
+      if (ssh_key_types[i].pk_group_import == NULL)
+        continue;
       if (strcmp(ssh_key_types[i].name, name) == 0)
         {
           /* Allocate */
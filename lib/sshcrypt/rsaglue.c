@@ -0,0 +1,1023 @@
+/*
+
+  rsaglue.c
+
+  Copyright (C) 1999 SSH Communications Security Oy, Espoo, Finland
+  All rights reserved.
+
+  Integer factorization based public key routines. RSA with the
+  PKCS #1 version 1.5 paddings, signing with the Chinese remainder
+  theorem.
+
+  */
+
+#include "sshincludes.h"
+#include "sshmp.h"
+#include "sshcrypt.h"
+#include "sshcrypti.h"
+#include "genmp.h"
+#include "sshmpaux.h"
+#include "rsaglue.h"
+#include "sshencode.h"
+
+/* The public exponent used when the application does not give one. The
+   small exponent makes verification and encryption cheap, the private
+   key operation costs the same with any exponent. */
+#define SSH_RSA_DEFAULT_E 65537
+
+/* PKCS #1 wants at least eight bytes of padding. */
+#define SSH_RSA_PKCS1_MIN_PAD 8
+
+/********************** RSA keys ************************/
+
+/* Public key:
+
+   n - modulus (pq)
+   e - public exponent
+   */
+
+typedef struct SshRSAPublicKeyRec
+{
+  SshInt n;
+  SshInt e;
+} SshRSAPublicKey;
+
+/* Private key:
+
+   n, e - as in the public key
+   d    - secret exponent
+   p, q - primes, n = pq
+   u    - p^-1 (mod q)
+   dp   - d (mod p - 1)
+   dq   - d (mod q - 1)
+
+   The three last are redundant, they are kept for the Chinese remainder
+   theorem which makes the private key operation about three times
+   faster. */
+
+typedef struct SshRSAPrivateKeyRec
+{
+  SshInt n, e, d;
+  SshInt p, q, u;
+  SshInt dp, dq;
+
+  /* Scratch arena for the private key operations. */
+  SshMpScratch scratch;
+} SshRSAPrivateKey;
+
+void ssh_rsa_init_public_key(SshRSAPublicKey *pub_key)
+{
+  ssh_mp_init(&pub_key->n);
+  ssh_mp_init(&pub_key->e);
+}
+
+void ssh_rsa_clear_public_key(SshRSAPublicKey *pub_key)
+{
+  ssh_mp_clear(&pub_key->n);
+  ssh_mp_clear(&pub_key->e);
+}
+
+void ssh_rsa_init_private_key(SshRSAPrivateKey *prv_key)
+{
+  ssh_mp_init(&prv_key->n);
+  ssh_mp_init(&prv_key->e);
+  ssh_mp_init(&prv_key->d);
+  ssh_mp_init(&prv_key->p);
+  ssh_mp_init(&prv_key->q);
+  ssh_mp_init(&prv_key->u);
+  ssh_mp_init(&prv_key->dp);
+  ssh_mp_init(&prv_key->dq);
+  ssh_mp_scratch_init(&prv_key->scratch);
+}
+
+void ssh_rsa_clear_private_key(SshRSAPrivateKey *prv_key)
+{
+  ssh_mp_clear(&prv_key->n);
+  ssh_mp_clear(&prv_key->e);
+  ssh_mp_clear(&prv_key->d);
+  ssh_mp_clear(&prv_key->p);
+  ssh_mp_clear(&prv_key->q);
+  ssh_mp_clear(&prv_key->u);
+  ssh_mp_clear(&prv_key->dp);
+  ssh_mp_clear(&prv_key->dq);
+  ssh_mp_scratch_clear(&prv_key->scratch);
+}
+
+/* Compute the values used by the Chinese remainder theorem from p, q
+   and d. Returns FALSE if p and q are not coprime. */
+Boolean ssh_rsa_private_key_precompute(SshRSAPrivateKey *prv_key)
+{
+  SshInt t;
+  Boolean rv;
+
+  /* Keep p < q, then u is always well defined and the result of the
+     recombination needs no final reduction. */
+  if (ssh_mp_cmp(&prv_key->p, &prv_key->q) > 0)
+    {
+      ssh_mp_init_set(&t, &prv_key->p);
+      ssh_mp_set(&prv_key->p, &prv_key->q);
+      ssh_mp_set(&prv_key->q, &t);
+      ssh_mp_clear(&t);
+    }
+
+  ssh_mp_init(&t);
+  ssh_mp_sub_ui(&t, &prv_key->p, 1);
+  ssh_mp_mod(&prv_key->dp, &prv_key->d, &t);
+  ssh_mp_sub_ui(&t, &prv_key->q, 1);
+  ssh_mp_mod(&prv_key->dq, &prv_key->d, &t);
+  ssh_mp_clear(&t);
+
+  rv = ssh_mp_invert(&prv_key->u, &prv_key->p, &prv_key->q);
+  return rv;
+}
+
+/* Public key primitives. */
+
+Boolean ssh_rsa_public_key_import(const unsigned char *buf,
+                                  size_t len,
+                                  void **public_key)
+{
+  SshRSAPublicKey *pub_key = ssh_xmalloc(sizeof(*pub_key));
+
+  ssh_rsa_init_public_key(pub_key);
+  if (ssh_decode_array(buf, len,
+                       SSH_FORMAT_MP_INT, &pub_key->e,
+                       SSH_FORMAT_MP_INT, &pub_key->n,
+                       SSH_FORMAT_END) == 0)
+    {
+      ssh_rsa_clear_public_key(pub_key);
+      ssh_xfree(pub_key);
+      return FALSE;
+    }
+
+  *public_key = (void *)pub_key;
+  return TRUE;
+}
+
+Boolean ssh_rsa_public_key_export(const void *public_key,
+                                  unsigned char **buf,
+                                  size_t *length_return)
+{
+  const SshRSAPublicKey *pub_key = public_key;
+
+  *length_return =
+    ssh_encode_alloc(buf,
+                     SSH_FORMAT_MP_INT, &pub_key->e,
+                     SSH_FORMAT_MP_INT, &pub_key->n,
+                     SSH_FORMAT_END);
+  return TRUE;
+}
+
+void ssh_rsa_public_key_free(void *public_key)
+{
+  ssh_rsa_clear_public_key((SshRSAPublicKey *)public_key);
+  ssh_xfree(public_key);
+}
+
+void ssh_rsa_public_key_copy(void *public_key_src, void **public_key_dest)
+{
+  SshRSAPublicKey *pub_src = public_key_src;
+  SshRSAPublicKey *pub_dest = ssh_xmalloc(sizeof(*pub_dest));
+
+  ssh_rsa_init_public_key(pub_dest);
+  ssh_mp_set(&pub_dest->n, &pub_src->n);
+  ssh_mp_set(&pub_dest->e, &pub_src->e);
+
+  *public_key_dest = (void *)pub_dest;
+}
+
+/* Private key primitives. */
+
+Boolean ssh_rsa_private_key_import(const unsigned char *buf,
+                                   size_t len,
+                                   void **private_key)
+{
+  SshRSAPrivateKey *prv_key = ssh_xmalloc(sizeof(*prv_key));
+
+  ssh_rsa_init_private_key(prv_key);
+  if (ssh_decode_array(buf, len,
+                       SSH_FORMAT_MP_INT, &prv_key->e,
+                       SSH_FORMAT_MP_INT, &prv_key->d,
+                       SSH_FORMAT_MP_INT, &prv_key->n,
+                       SSH_FORMAT_MP_INT, &prv_key->u,
+                       SSH_FORMAT_MP_INT, &prv_key->p,
+                       SSH_FORMAT_MP_INT, &prv_key->q,
+                       SSH_FORMAT_END) == 0 ||
+      ssh_rsa_private_key_precompute(prv_key) == FALSE)
+    {
+      ssh_rsa_clear_private_key(prv_key);
+      ssh_xfree(prv_key);
+      return FALSE;
+    }
+
+  *private_key = (void *)prv_key;
+  return TRUE;
+}
+
+Boolean ssh_rsa_private_key_export(const void *private_key,
+                                   unsigned char **buf,
+                                   size_t *length_return)
+{
+  const SshRSAPrivateKey *prv_key = private_key;
+
+  *length_return =
+    ssh_encode_alloc(buf,
+                     SSH_FORMAT_MP_INT, &prv_key->e,
+                     SSH_FORMAT_MP_INT, &prv_key->d,
+                     SSH_FORMAT_MP_INT, &prv_key->n,
+                     SSH_FORMAT_MP_INT, &prv_key->u,
+                     SSH_FORMAT_MP_INT, &prv_key->p,
+                     SSH_FORMAT_MP_INT, &prv_key->q,
+                     SSH_FORMAT_END);
+  return TRUE;
+}
+
+void ssh_rsa_private_key_free(void *private_key)
+{
+  ssh_rsa_clear_private_key((SshRSAPrivateKey *)private_key);
+  ssh_xfree(private_key);
+}
+
+void ssh_rsa_private_key_copy(void *private_key_src, void **private_key_dest)
+{
+  SshRSAPrivateKey *prv_src = private_key_src;
+  SshRSAPrivateKey *prv_dest = ssh_xmalloc(sizeof(*prv_dest));
+
+  ssh_rsa_init_private_key(prv_dest);
+  ssh_mp_set(&prv_dest->n, &prv_src->n);
+  ssh_mp_set(&prv_dest->e, &prv_src->e);
+  ssh_mp_set(&prv_dest->d, &prv_src->d);
+  ssh_mp_set(&prv_dest->p, &prv_src->p);
+  ssh_mp_set(&prv_dest->q, &prv_src->q);
+  ssh_mp_set(&prv_dest->u, &prv_src->u);
+  ssh_mp_set(&prv_dest->dp, &prv_src->dp);
+  ssh_mp_set(&prv_dest->dq, &prv_src->dq);
+
+  *private_key_dest = (void *)prv_dest;
+}
+
+void ssh_rsa_private_key_derive_public_key(const void *private_key,
+                                           void **public_key)
+{
+  SshRSAPublicKey *pub_key = ssh_xmalloc(sizeof(*pub_key));
+  const SshRSAPrivateKey *prv_key = private_key;
+
+  ssh_rsa_init_public_key(pub_key);
+  ssh_mp_set(&pub_key->n, &prv_key->n);
+  ssh_mp_set(&pub_key->e, &prv_key->e);
+
+  *public_key = (void *)pub_key;
+}
+
+/********************** Actions ************************/
+
+typedef struct SshRSAInitCtxRec
+{
+  SshRandomState state;
+  SshInt n, e, d, p, q, u;
+  unsigned int size;
+} SshRSAInitCtx;
+
+void *ssh_rsa_action_init(SshRandomState state)
+{
+  SshRSAInitCtx *ctx = ssh_xmalloc(sizeof(*ctx));
+  ctx->state = state;
+  ctx->size = 0;
+
+  ssh_mp_init_set_ui(&ctx->n, 0);
+  ssh_mp_init_set_ui(&ctx->e, 0);
+  ssh_mp_init_set_ui(&ctx->d, 0);
+  ssh_mp_init_set_ui(&ctx->p, 0);
+  ssh_mp_init_set_ui(&ctx->q, 0);
+  ssh_mp_init_set_ui(&ctx->u, 0);
+
+  return (void *)ctx;
+}
+
+void *ssh_rsa_action_public_key_init(void)
+{
+  return ssh_rsa_action_init(NULL);
+}
+
+void ssh_rsa_action_free(void *context)
+{
+  SshRSAInitCtx *ctx = context;
+  ssh_mp_clear(&ctx->n);
+  ssh_mp_clear(&ctx->e);
+  ssh_mp_clear(&ctx->d);
+  ssh_mp_clear(&ctx->p);
+  ssh_mp_clear(&ctx->q);
+  ssh_mp_clear(&ctx->u);
+  ssh_xfree(ctx);
+}
+
+unsigned int ssh_rsa_action_put(void *context, va_list *ap,
+                                SshCryptoType type,
+                                SshPkFormat format)
+{
+  SshRSAInitCtx *ctx = context;
+  SshInt *temp;
+
+  switch (format)
+    {
+    case SSH_PKF_SIZE:
+      if (type & SSH_CRYPTO_TYPE_PUBLIC_KEY)
+        return 0;
+      ctx->size = va_arg(*ap, unsigned int);
+      break;
+    case SSH_PKF_MODULO_N:
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(&ctx->n, temp);
+      break;
+    case SSH_PKF_PUBLIC_E:
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(&ctx->e, temp);
+      break;
+    case SSH_PKF_SECRET_D:
+      if (type & SSH_CRYPTO_TYPE_PUBLIC_KEY)
+        return 0;
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(&ctx->d, temp);
+      break;
+    case SSH_PKF_PRIME_P:
+      if (type & SSH_CRYPTO_TYPE_PUBLIC_KEY)
+        return 0;
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(&ctx->p, temp);
+      break;
+    case SSH_PKF_PRIME_Q:
+      if (type & SSH_CRYPTO_TYPE_PUBLIC_KEY)
+        return 0;
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(&ctx->q, temp);
+      break;
+    case SSH_PKF_INVERSE_U:
+      if (type & SSH_CRYPTO_TYPE_PUBLIC_KEY)
+        return 0;
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(&ctx->u, temp);
+      break;
+    default:
+      return 0;
+      break;
+    }
+  return 1;
+}
+
+unsigned int ssh_rsa_action_private_key_put(void *context, va_list *ap,
+                                            void *input_context,
+                                            SshPkFormat format)
+{
+  return ssh_rsa_action_put(context, ap,
+                            SSH_CRYPTO_TYPE_PRIVATE_KEY,
+                            format);
+}
+
+unsigned int ssh_rsa_action_private_key_get(void *context, va_list *ap,
+                                            void **output_context,
+                                            SshPkFormat format)
+{
+  SshRSAPrivateKey *prv = context;
+  SshInt *temp;
+  unsigned int *size;
+
+  switch (format)
+    {
+    case SSH_PKF_SIZE:
+      size = va_arg(*ap, unsigned int *);
+      *size = ssh_mp_bit_size(&prv->n);
+      break;
+    case SSH_PKF_MODULO_N:
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(temp, &prv->n);
+      break;
+    case SSH_PKF_PUBLIC_E:
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(temp, &prv->e);
+      break;
+    case SSH_PKF_SECRET_D:
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(temp, &prv->d);
+      break;
+    case SSH_PKF_PRIME_P:
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(temp, &prv->p);
+      break;
+    case SSH_PKF_PRIME_Q:
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(temp, &prv->q);
+      break;
+    case SSH_PKF_INVERSE_U:
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(temp, &prv->u);
+      break;
+    default:
+      return 0;
+      break;
+    }
+  return 1;
+}
+
+unsigned int ssh_rsa_action_public_key_put(void *context, va_list *ap,
+                                           void *input_context,
+                                           SshPkFormat format)
+{
+  return ssh_rsa_action_put(context, ap,
+                            SSH_CRYPTO_TYPE_PUBLIC_KEY,
+                            format);
+}
+
+unsigned int ssh_rsa_action_public_key_get(void *context, va_list *ap,
+                                           void **output_context,
+                                           SshPkFormat format)
+{
+  SshRSAPublicKey *pub = context;
+  SshInt *temp;
+  unsigned int *size;
+
+  switch (format)
+    {
+    case SSH_PKF_SIZE:
+      size = va_arg(*ap, unsigned int *);
+      *size = ssh_mp_bit_size(&pub->n);
+      break;
+    case SSH_PKF_MODULO_N:
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(temp, &pub->n);
+      break;
+    case SSH_PKF_PUBLIC_E:
+      temp = va_arg(*ap, SshInt *);
+      ssh_mp_set(temp, &pub->e);
+      break;
+    default:
+      return 0;
+      break;
+    }
+  return 1;
+}
+
+/* Generate a prime p of the given size such that gcd(e, p - 1) = 1. */
+void ssh_rsa_generate_prime(SshInt *p, const SshInt *e, unsigned int bits,
+                            SshRandomState state)
+{
+  SshInt t;
+
+  ssh_mp_init(&t);
+  do
+    {
+      ssh_mp_random_prime(p, state, bits);
+      ssh_mp_sub_ui(&t, p, 1);
+      ssh_mp_gcd(&t, &t, e);
+    }
+  while (ssh_mp_cmp_ui(&t, 1) != 0);
+  ssh_mp_clear(&t);
+}
+
+/* Generate a new key of ctx->size bits into prv_key. The exponent is
+   taken from the context, if given, and else the default is used. */
+Boolean ssh_rsa_generate_private_key(SshRSAInitCtx *ctx,
+                                     SshRSAPrivateKey *prv_key)
+{
+  SshInt phi, t;
+  unsigned int p_bits, q_bits;
+
+  if (ctx->size < 2 * 16 || ctx->state == NULL)
+    return FALSE;
+
+  /* The exponent must be odd, we take the next larger if it is not. */
+  if (ssh_mp_cmp_ui(&ctx->e, 0) == 0)
+    ssh_mp_set_ui(&prv_key->e, SSH_RSA_DEFAULT_E);
+  else
+    ssh_mp_set(&prv_key->e, &ctx->e);
+  if (ssh_mp_cmp_ui(&prv_key->e, 3) < 0)
+    ssh_mp_set_ui(&prv_key->e, 3);
+  if ((ssh_mp_get_ui(&prv_key->e) & 1) == 0)
+    ssh_mp_add_ui(&prv_key->e, &prv_key->e, 1);
+
+  q_bits = ctx->size / 2;
+  p_bits = ctx->size - q_bits;
+
+  ssh_mp_init(&phi);
+  ssh_mp_init(&t);
+
+  ssh_rsa_generate_prime(&prv_key->p, &prv_key->e, p_bits, ctx->state);
+  do
+    {
+      /* The primes have just their highest bit set, thus the product
+         may be one bit short. */
+      ssh_rsa_generate_prime(&prv_key->q, &prv_key->e, q_bits, ctx->state);
+      ssh_mp_mul(&prv_key->n, &prv_key->p, &prv_key->q);
+    }
+  while (ssh_mp_bit_size(&prv_key->n) != ctx->size ||
+         ssh_mp_cmp(&prv_key->p, &prv_key->q) == 0);
+
+  /* d = e^-1 mod (p - 1)(q - 1). */
+  ssh_mp_sub_ui(&phi, &prv_key->p, 1);
+  ssh_mp_sub_ui(&t, &prv_key->q, 1);
+  ssh_mp_mul(&phi, &phi, &t);
+  ssh_mp_invert(&prv_key->d, &prv_key->e, &phi);
+
+  ssh_mp_clear(&phi);
+  ssh_mp_clear(&t);
+
+  return ssh_rsa_private_key_precompute(prv_key);
+}
+
+void *ssh_rsa_private_key_action_make(void *context)
+{
+  SshRSAInitCtx *ctx = context;
+  SshRSAPrivateKey *prv_key;
+  SshInt phi, t;
+
+  prv_key = ssh_xmalloc(sizeof(*prv_key));
+  ssh_rsa_init_private_key(prv_key);
+
+  if (ssh_mp_cmp_ui(&ctx->p, 0) == 0 ||
+      ssh_mp_cmp_ui(&ctx->q, 0) == 0)
+    {
+      /* No key was given, generate one. */
+      if (ssh_rsa_generate_private_key(ctx, prv_key) == FALSE)
+        goto failed;
+      return (void *)prv_key;
+    }
+
+  /* The primes were given, deduce the rest. The secret exponent has
+     priority over the public one. */
+  ssh_mp_set(&prv_key->p, &ctx->p);
+  ssh_mp_set(&prv_key->q, &ctx->q);
+  ssh_mp_mul(&prv_key->n, &prv_key->p, &prv_key->q);
+  if (ssh_mp_cmp_ui(&ctx->n, 0) != 0 &&
+      ssh_mp_cmp(&ctx->n, &prv_key->n) != 0)
+    goto failed;
+
+  ssh_mp_init(&phi);
+  ssh_mp_init(&t);
+  ssh_mp_sub_ui(&phi, &prv_key->p, 1);
+  ssh_mp_sub_ui(&t, &prv_key->q, 1);
+  ssh_mp_mul(&phi, &phi, &t);
+  if (ssh_mp_cmp_ui(&ctx->d, 0) != 0)
+    {
+      ssh_mp_set(&prv_key->d, &ctx->d);
+      if (ssh_mp_cmp_ui(&ctx->e, 0) != 0)
+        ssh_mp_set(&prv_key->e, &ctx->e);
+      else if (ssh_mp_invert(&prv_key->e, &prv_key->d, &phi) == FALSE)
+        {
+          ssh_mp_clear(&phi);
+          ssh_mp_clear(&t);
+          goto failed;
+        }
+    }
+  else if (ssh_mp_cmp_ui(&ctx->e, 0) != 0)
+    {
+      ssh_mp_set(&prv_key->e, &ctx->e);
+      if (ssh_mp_invert(&prv_key->d, &prv_key->e, &phi) == FALSE)
+        {
+          ssh_mp_clear(&phi);
+          ssh_mp_clear(&t);
+          goto failed;
+        }
+    }
+  else
+    {
+      ssh_mp_clear(&phi);
+      ssh_mp_clear(&t);
+      goto failed;
+    }
+  ssh_mp_clear(&phi);
+  ssh_mp_clear(&t);
+
+  /* The inverse u is always recomputed, the conventions for it differ
+     (and p and q may get swapped). */
+  if (ssh_rsa_private_key_precompute(prv_key) == FALSE)
+    goto failed;
+
+  return (void *)prv_key;
+
+failed:
+  ssh_rsa_clear_private_key(prv_key);
+  ssh_xfree(prv_key);
+  return NULL;
+}
+
+void *ssh_rsa_public_key_action_make(void *context)
+{
+  SshRSAInitCtx *ctx = context;
+  SshRSAPublicKey *pub_key;
+
+  /* Both values must be given. */
+  if (ssh_mp_cmp_ui(&ctx->n, 0) == 0 ||
+      ssh_mp_cmp_ui(&ctx->e, 0) == 0)
+    return NULL;
+
+  pub_key = ssh_xmalloc(sizeof(*pub_key));
+  ssh_rsa_init_public_key(pub_key);
+  ssh_mp_set(&pub_key->n, &ctx->n);
+  ssh_mp_set(&pub_key->e, &ctx->e);
+
+  return (void *)pub_key;
+}
+
+/********************** RSA operations ************************/
+
+/* Public key operation, ret = m^e (mod n). */
+void ssh_rsa_public(SshInt *ret, const SshInt *m,
+                    const SshInt *e, const SshInt *n)
+{
+  ssh_mp_powm(ret, m, e, n);
+}
+
+/* Private key operation, ret = c^d (mod n), with the Chinese remainder
+   theorem. Two exponentiations of half the size replace the full one,
+   each being about one eighth of the work of the full exponentiation.
+   The result is checked with the public exponent; a fault in the
+   computation of one half would otherwise reveal the factorization. */
+Boolean ssh_rsa_private(SshInt *ret, const SshInt *c,
+                        const SshRSAPrivateKey *prv_key)
+{
+  SshInt m1, m2, h;
+  SshMpScratchFrame frame;
+  Boolean rv;
+
+  ssh_mp_scratch_begin((SshMpScratch *)&prv_key->scratch, &frame,
+                       &prv_key->n);
+
+  ssh_mp_init(&m1);
+  ssh_mp_init(&m2);
+  ssh_mp_init(&h);
+
+  /* m1 = c^dp (mod p), m2 = c^dq (mod q). */
+  ssh_mp_mod(&h, c, &prv_key->p);
+  ssh_mp_powm(&m1, &h, &prv_key->dp, &prv_key->p);
+  ssh_mp_mod(&h, c, &prv_key->q);
+  ssh_mp_powm(&m2, &h, &prv_key->dq, &prv_key->q);
+
+  /* Garner's recombination, h = u(m2 - m1) (mod q) and
+     ret = m1 + hp. As p < q this is less than n, and adding q keeps
+     the difference positive. */
+  ssh_mp_add(&h, &m2, &prv_key->q);
+  ssh_mp_sub(&h, &h, &m1);
+  ssh_mp_mul(&h, &h, &prv_key->u);
+  ssh_mp_mod(&h, &h, &prv_key->q);
+  ssh_mp_mul(&h, &h, &prv_key->p);
+  ssh_mp_add(ret, &h, &m1);
+
+  /* Verify. */
+  ssh_rsa_public(&h, ret, &prv_key->e, &prv_key->n);
+  ssh_mp_mod(&m1, c, &prv_key->n);
+  rv = (ssh_mp_cmp(&h, &m1) == 0);
+
+  ssh_mp_clear(&m1);
+  ssh_mp_clear(&m2);
+  ssh_mp_clear(&h);
+
+  ssh_mp_scratch_end(&frame);
+
+  return rv;
+}
+
+/********************** Schemes ************************/
+
+/* Write the DER encoding of the DigestInfo structure of PKCS #1,
+
+     SEQUENCE { SEQUENCE { OBJECT IDENTIFIER, NULL }, OCTET STRING }
+
+   without the digest, into buf. The object identifier is taken from the
+   dotted form in the hash definition. Returns the length of the
+   encoding, the digest follows it, or 0 if the hash has no identifier. */
+size_t ssh_rsa_pkcs1_digest_info(unsigned char *buf,
+                                 const SshHashDef *hash_def)
+{
+  unsigned char oid[32];
+  unsigned long arc, first;
+  const char *cp;
+  size_t oid_len, i, n;
+  unsigned int count;
+
+  if (hash_def->asn1_oid == NULL)
+    return 0;
+
+  /* Encode the arcs in base 128. The first two are combined. */
+  oid_len = 0;
+  first = 0;
+  for (cp = hash_def->asn1_oid, count = 0; *cp; count++)
+    {
+      arc = strtoul(cp, (char **)&cp, 10);
+      if (*cp == '.')
+        cp++;
+      if (count == 0)
+        {
+          first = arc;
+          continue;
+        }
+      if (count == 1)
+        arc += 40 * first;
+
+      for (n = 1; (arc >> (7 * n)) != 0; n++)
+        ;
+      if (oid_len + n > sizeof(oid))
+        return 0;
+      for (i = 0; i < n; i++)
+        oid[oid_len + i] = ((arc >> (7 * (n - 1 - i))) & 0x7f) |
+          (i < n - 1 ? 0x80 : 0);
+      oid_len += n;
+    }
+
+  /* The lengths are all short, as the digests are. */
+  i = 0;
+  buf[i++] = 0x30;
+  buf[i++] = (unsigned char)(oid_len + 8 + hash_def->digest_length);
+  buf[i++] = 0x30;
+  buf[i++] = (unsigned char)(oid_len + 4);
+  buf[i++] = 0x06;
+  buf[i++] = (unsigned char)oid_len;
+  memcpy(buf + i, oid, oid_len);
+  i += oid_len;
+  buf[i++] = 0x05;
+  buf[i++] = 0x00;
+  buf[i++] = 0x04;
+  buf[i++] = (unsigned char)hash_def->digest_length;
+  return i;
+}
+
+/* Encode the digest of data as the PKCS #1 block type 1,
+
+     00 01 FF .. FF 00 DigestInfo digest
+
+   of len bytes into buf. Returns FALSE if it does not fit. */
+Boolean ssh_rsa_pkcs1_encode_signature(unsigned char *buf, size_t len,
+                                       Boolean need_hashing,
+                                       const unsigned char *data,
+                                       size_t data_len,
+                                       const SshHashDef *hash_def)
+{
+  unsigned char info[64];
+  size_t info_len, t_len;
+  void *hash_context;
+
+  if (!need_hashing && data_len != hash_def->digest_length)
+    return FALSE;
+
+  info_len = ssh_rsa_pkcs1_digest_info(info, hash_def);
+  if (info_len == 0)
+    return FALSE;
+  t_len = info_len + hash_def->digest_length;
+  if (len < t_len + 3 + SSH_RSA_PKCS1_MIN_PAD)
+    return FALSE;
+
+  buf[0] = 0x00;
+  buf[1] = 0x01;
+  memset(buf + 2, 0xff, len - t_len - 3);
+  buf[len - t_len - 1] = 0x00;
+  memcpy(buf + len - t_len, info, info_len);
+
+  if (need_hashing)
+    {
+      hash_context = ssh_xmalloc((*hash_def->ctxsize)());
+      (*hash_def->reset_context)(hash_context);
+      (*hash_def->update)(hash_context, data, data_len);
+      (*hash_def->final)(hash_context, buf + len - hash_def->digest_length);
+      ssh_xfree(hash_context);
+    }
+  else
+    memcpy(buf + len - hash_def->digest_length, data, data_len);
+
+  return TRUE;
+}
+
+/* RSA signatures with PKCS #1 padding. */
+
+Boolean ssh_rsa_pkcs1_public_key_verify(const void *public_key,
+                                        const unsigned char *signature,
+                                        size_t signature_len,
+                                        Boolean need_hashing,
+                                        const unsigned char *data,
+                                        size_t data_len,
+                                        const SshHashDef *hash_def)
+{
+  const SshRSAPublicKey *pub_key = public_key;
+  size_t len = ssh_mp_byte_size(&pub_key->n);
+  unsigned char *expected, *decrypted;
+  SshInt s, m;
+  Boolean rv = FALSE;
+
+  if (signature_len > len)
+    return FALSE;
+
+  expected = ssh_xmalloc(2 * len);
+  decrypted = expected + len;
+
+  if (ssh_rsa_pkcs1_encode_signature(expected, len, need_hashing,
+                                     data, data_len, hash_def) == FALSE)
+    {
+      ssh_xfree(expected);
+      return FALSE;
+    }
+
+  ssh_mp_init(&s);
+  ssh_mp_init(&m);
+
+  ssh_buf_to_mp(&s, signature, signature_len);
+  if (ssh_mp_cmp(&s, &pub_key->n) < 0)
+    {
+      ssh_rsa_public(&m, &s, &pub_key->e, &pub_key->n);
+      ssh_mp_to_buf(decrypted, len, &m);
+      if (memcmp(decrypted, expected, len) == 0)
+        rv = TRUE;
+    }
+
+  ssh_mp_clear(&s);
+  ssh_mp_clear(&m);
+  memset(expected, 0, 2 * len);
+  ssh_xfree(expected);
+
+  return rv;
+}
+
+size_t
+ssh_rsa_private_key_max_signature_input_len(const void *private_key)
+{
+  return (size_t)-1;
+}
+
+size_t
+ssh_rsa_private_key_max_signature_output_len(const void *private_key)
+{
+  const SshRSAPrivateKey *prv_key = private_key;
+  return ssh_mp_byte_size(&prv_key->n);
+}
+
+Boolean ssh_rsa_pkcs1_private_key_sign(const void *private_key,
+                                       Boolean need_hashing,
+                                       const unsigned char *data,
+                                       size_t data_len,
+                                       unsigned char *signature_buffer,
+                                       size_t ssh_buffer_len,
+                                       size_t *signature_length_return,
+                                       SshRandomState state,
+                                       const SshHashDef *hash_def)
+{
+  const SshRSAPrivateKey *prv_key = private_key;
+  size_t len = ssh_mp_byte_size(&prv_key->n);
+  unsigned char *encoded;
+  SshInt m, s;
+  Boolean rv;
+
+  if (ssh_buffer_len < len)
+    return FALSE;
+
+  encoded = ssh_xmalloc(len);
+  if (ssh_rsa_pkcs1_encode_signature(encoded, len, need_hashing,
+                                     data, data_len, hash_def) == FALSE)
+    {
+      ssh_xfree(encoded);
+      return FALSE;
+    }
+
+  ssh_mp_init(&m);
+  ssh_mp_init(&s);
+
+  ssh_buf_to_mp(&m, encoded, len);
+  rv = ssh_rsa_private(&s, &m, prv_key);
+  if (rv)
+    {
+      /* The signature is always of the length of the modulus. */
+      ssh_mp_to_buf(signature_buffer, len, &s);
+      *signature_length_return = len;
+    }
+
+  ssh_mp_clear(&m);
+  ssh_mp_clear(&s);
+  ssh_xfree(encoded);
+
+  return rv;
+}
+
+/* RSA encryption with PKCS #1 block type 2 padding,
+
+     00 02 <nonzero random bytes> 00 data
+
+   this is what the ssh1 challenges use. */
+
+size_t
+ssh_rsa_private_key_max_decrypt_input_len(const void *private_key)
+{
+  const SshRSAPrivateKey *prv_key = private_key;
+  return ssh_mp_byte_size(&prv_key->n);
+}
+
+size_t
+ssh_rsa_private_key_max_decrypt_output_len(const void *private_key)
+{
+  const SshRSAPrivateKey *prv_key = private_key;
+  return ssh_mp_byte_size(&prv_key->n) - 3 - SSH_RSA_PKCS1_MIN_PAD;
+}
+
+Boolean ssh_rsa_pkcs1_private_key_decrypt(const void *private_key,
+                                          const unsigned char *ciphertext,
+                                          size_t ciphertext_len,
+                                          unsigned char *plaintext_buffer,
+                                          size_t ssh_buffer_len,
+                                          size_t *plaintext_length_return,
+                                          const SshHashDef *hash_def)
+{
+  const SshRSAPrivateKey *prv_key = private_key;
+  size_t len = ssh_mp_byte_size(&prv_key->n);
+  unsigned char *decrypted;
+  SshInt c, m;
+  size_t i;
+  Boolean rv = FALSE;
+
+  if (ciphertext_len > len)
+    return FALSE;
+
+  ssh_mp_init(&c);
+  ssh_mp_init(&m);
+  decrypted = ssh_xmalloc(len);
+
+  ssh_buf_to_mp(&c, ciphertext, ciphertext_len);
+  if (ssh_mp_cmp(&c, &prv_key->n) >= 0 ||
+      ssh_rsa_private(&m, &c, prv_key) == FALSE)
+    goto failed;
+  ssh_mp_to_buf(decrypted, len, &m);
+
+  if (decrypted[0] != 0x00 || decrypted[1] != 0x02)
+    goto failed;
+  for (i = 2; i < len && decrypted[i] != 0x00; i++)
+    ;
+  if (i == len || i < 2 + SSH_RSA_PKCS1_MIN_PAD)
+    goto failed;
+  i++;
+  if (len - i > ssh_buffer_len)
+    goto failed;
+
+  memcpy(plaintext_buffer, decrypted + i, len - i);
+  *plaintext_length_return = len - i;
+  rv = TRUE;
+
+failed:
+  ssh_mp_clear(&c);
+  ssh_mp_clear(&m);
+  memset(decrypted, 0, len);
+  ssh_xfree(decrypted);
+  return rv;
+}
+
+size_t
+ssh_rsa_public_key_max_encrypt_input_len(const void *public_key)
+{
+  const SshRSAPublicKey *pub_key = public_key;
+  return ssh_mp_byte_size(&pub_key->n) - 3 - SSH_RSA_PKCS1_MIN_PAD;
+}
+
+size_t
+ssh_rsa_public_key_max_encrypt_output_len(const void *public_key)
+{
+  const SshRSAPublicKey *pub_key = public_key;
+  return ssh_mp_byte_size(&pub_key->n);
+}
+
+Boolean ssh_rsa_pkcs1_public_key_encrypt(const void *public_key,
+                                         const unsigned char *plaintext,
+                                         size_t plaintext_len,
+                                         unsigned char *ciphertext_buffer,
+                                         size_t ssh_buffer_len,
+                                         size_t *ciphertext_len_return,
+                                         SshRandomState state,
+                                         const SshHashDef *hash_def)
+{
+  const SshRSAPublicKey *pub_key = public_key;
+  size_t len = ssh_mp_byte_size(&pub_key->n);
+  unsigned char *encoded;
+  SshInt m, c;
+  size_t i;
+
+  if (ssh_buffer_len < len ||
+      plaintext_len + 3 + SSH_RSA_PKCS1_MIN_PAD > len)
+    return FALSE;
+
+  encoded = ssh_xmalloc(len);
+  encoded[0] = 0x00;
+  encoded[1] = 0x02;
+  for (i = 2; i < len - plaintext_len - 1; i++)
+    {
+      do
+        encoded[i] = ssh_random_get_byte(state);
+      while (encoded[i] == 0x00);
+    }
+  encoded[i++] = 0x00;
+  memcpy(encoded + i, plaintext, plaintext_len);
+
+  ssh_mp_init(&m);
+  ssh_mp_init(&c);
+  ssh_buf_to_mp(&m, encoded, len);
+  ssh_rsa_public(&c, &m, &pub_key->e, &pub_key->n);
+  ssh_mp_to_buf(ciphertext_buffer, len, &c);
+  *ciphertext_len_return = len;
+
+  ssh_mp_clear(&m);
+  ssh_mp_clear(&c);
+  memset(encoded, 0, len);
+  ssh_xfree(encoded);
+
+  return TRUE;
+}
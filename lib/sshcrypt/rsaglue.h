@@ -0,0 +1,114 @@
+/*
+
+  rsaglue.h
+
+  Copyright (C) 1999 SSH Communications Security Oy, Espoo, Finland
+  All rights reserved.
+
+  Integer factorization based public key routines, that is RSA with
+  the PKCS #1 version 1.5 signature and encryption paddings.
+
+  Note: this interface was not deviced to be called directly from
+  applications. One should use the general interface, see dlglue.h.
+
+  */
+
+#ifndef RSAGLUE_H
+#define RSAGLUE_H
+
+/* Action routines. */
+unsigned int ssh_rsa_action_private_key_put(void *context, va_list *ap,
+                                            void *input_context,
+                                            SshPkFormat format);
+unsigned int ssh_rsa_action_private_key_get(void *context, va_list *ap,
+                                            void **output_context,
+                                            SshPkFormat format);
+
+unsigned int ssh_rsa_action_public_key_put(void *context, va_list *ap,
+                                           void *input_context,
+                                           SshPkFormat format);
+unsigned int ssh_rsa_action_public_key_get(void *context, va_list *ap,
+                                           void **output_context,
+                                           SshPkFormat format);
+
+/* Control of the action context. */
+void *ssh_rsa_action_init(SshRandomState state);
+void *ssh_rsa_action_public_key_init(void);
+
+void *ssh_rsa_private_key_action_make(void *context);
+void *ssh_rsa_public_key_action_make(void *context);
+
+void ssh_rsa_action_free(void *context);
+
+/* Basic public key functions. */
+Boolean ssh_rsa_public_key_import(const unsigned char *buf,
+                                  size_t len,
+                                  void **public_key);
+Boolean ssh_rsa_public_key_export(const void *public_key,
+                                  unsigned char **buf,
+                                  size_t *length_return);
+void ssh_rsa_public_key_free(void *public_key);
+void ssh_rsa_public_key_copy(void *key_src, void **key_dest);
+
+/* Basic private key functions. */
+Boolean ssh_rsa_private_key_import(const unsigned char *buf,
+                                   size_t len,
+                                   void **private_key);
+Boolean ssh_rsa_private_key_export(const void *private_key,
+                                   unsigned char **buf,
+                                   size_t *length_return);
+void ssh_rsa_private_key_free(void *private_key);
+void ssh_rsa_private_key_derive_public_key(const void *private_key,
+                                           void **public_key);
+void ssh_rsa_private_key_copy(void *key_src, void **key_dest);
+
+/* Signature methods. */
+
+size_t
+ssh_rsa_private_key_max_signature_input_len(const void *private_key);
+size_t
+ssh_rsa_private_key_max_signature_output_len(const void *private_key);
+Boolean ssh_rsa_pkcs1_private_key_sign(const void *private_key,
+                                       Boolean need_hashing,
+                                       const unsigned char *data,
+                                       size_t data_len,
+                                       unsigned char *signature_buffer,
+                                       size_t ssh_buffer_len,
+                                       size_t *signature_length_return,
+                                       SshRandomState state,
+                                       const SshHashDef *hash_def);
+Boolean ssh_rsa_pkcs1_public_key_verify(const void *public_key,
+                                        const unsigned char *signature,
+                                        size_t signature_len,
+                                        Boolean need_hashing,
+                                        const unsigned char *data,
+                                        size_t data_len,
+                                        const SshHashDef *hash_def);
+
+/* Encryption methods. */
+
+size_t
+ssh_rsa_private_key_max_decrypt_input_len(const void *private_key);
+size_t
+ssh_rsa_private_key_max_decrypt_output_len(const void *private_key);
+Boolean ssh_rsa_pkcs1_private_key_decrypt(const void *private_key,
+                                          const unsigned char *ciphertext,
+                                          size_t ciphertext_len,
+                                          unsigned char *plaintext_buffer,
+                                          size_t ssh_buffer_len,
+                                          size_t *plaintext_length_return,
+                                          const SshHashDef *hash_def);
+size_t
+ssh_rsa_public_key_max_encrypt_input_len(const void *public_key);
+size_t
+ssh_rsa_public_key_max_encrypt_output_len(const void *public_key);
+Boolean ssh_rsa_pkcs1_public_key_encrypt(const void *public_key,
+                                         const unsigned char *plaintext,
+                                         size_t plaintext_len,
+                                         unsigned char *ciphertext_buffer,
+                                         size_t ssh_buffer_len,
+                                         size_t *ciphertext_len_return,
+                                         SshRandomState state,
+                                         const SshHashDef *hash_def);
+
+#endif /* RSAGLUE_H */
@@ -140,7 +140,7 @@ size_t ssh_sha_ctxsize()
 
 static void sha_transform(SshSHAContext *context, const unsigned char *block)
 {
-  static SshUInt32 W[80];
+  SshUInt32 W[80];
   SshUInt32 a, b, c, d, e, f;
 
   a = context->A;
@@ -34,6 +34,7 @@
 size_t ssh_encode_pubkeyblob(SshPublicKey pubkey, unsigned char **blob)
 {
   SshIntC p, q, g, y;  /* DSS public parameters */
+  SshIntC n, e;        /* RSA public parameters */
   SshBuffer *buf;
   size_t len;
   char *keytype;
@@ -112,6 +113,40 @@ size_t ssh_encode_pubkeyblob(SshPublicKey pubkey, unsigned char **blob)
       return len;
     }
 
+  /* -- RSA key type -- */
+
+  if (strstr(keytype, "sign{rsa-pkcs1") != NULL)
+    {
+      ssh_mp_init(n);
+      ssh_mp_init(e);
+
+      if (ssh_public_key_get_info(pubkey,
+                                  SSH_PKF_MODULO_N, n,
+                                  SSH_PKF_PUBLIC_E, e,
+                                  SSH_PKF_END)
+          != SSH_CRYPTO_OK)
+        {
+          ssh_debug("ssh_encode_pubkeyblob: failed to get "
+                    "internal parameters from a RSA public key.");
+          return 0;
+        }
+
+      buf = ssh_buffer_allocate();
+
+      buffer_put_uint32_string(buf, SSH_SSH_RSA, strlen(SSH_SSH_RSA));
+      buffer_put_mp_int_ssh2style(buf, e);
+      buffer_put_mp_int_ssh2style(buf, n);
+
+      ssh_mp_clear(n);
+      ssh_mp_clear(e);
+
+      len = ssh_buffer_len(buf);
+      *blob = ssh_xmalloc(len);
+      memcpy(*blob, ssh_buffer_ptr(buf), len);
+      ssh_buffer_free(buf);
+
+      return len;
+    }
 
   ssh_debug("ssh_encode_pubkeyblob: unrecognized key type %s", keytype);
   return 0;
@@ -125,6 +160,7 @@ SshPublicKey ssh_decode_pubkeyblob(const unsigned char *blob, size_t bloblen)
   unsigned char *keytype;
   SshPublicKey pubkey;
   SshIntC p, q, g, y;  /* DSS public parameters */
+  SshIntC n, e;        /* RSA public parameters */
   SshCryptoStatus code;
   SshBuffer *buf;
 
@@ -193,6 +229,36 @@ SshPublicKey ssh_decode_pubkeyblob(const unsigned char *blob, size_t bloblen)
       return pubkey;
     }
 
+  /* -- RSA key type -- */
+
+  if (strcmp(SSH_SSH_RSA, (char *) keytype) == 0)
+    {
+      ssh_mp_init(n);
+      ssh_mp_init(e);
+
+      buffer_get_mp_int_ssh2style(buf, e);
+      buffer_get_mp_int_ssh2style(buf, n);
+
+      code = ssh_public_key_define(&pubkey,
+                                   SSH_CRYPTO_RSA,
+                                   SSH_PKF_MODULO_N, n,
+                                   SSH_PKF_PUBLIC_E, e,
+                                   SSH_PKF_END);
+
+      ssh_mp_clear(n);
+      ssh_mp_clear(e);
+
+      if (code != SSH_CRYPTO_OK)
+        {
+          ssh_debug("ssh_decode_pubkeyblob: failed to set the "
+                    "parameters of an RSA public key.");
+          goto fail1;
+        }
+
+      ssh_buffer_free(buf);
+      ssh_xfree(keytype);
+      return pubkey;
+    }
 
   /* could not identify key type */
 
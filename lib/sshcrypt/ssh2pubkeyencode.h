@@ -27,7 +27,7 @@
 /* the "ssh-rsa" type" */
 #define SSH_SSH_RSA    "ssh-rsa"
 #define SSH_CRYPTO_RSA \
-        "if-modn{sign{rsa-pkcs1-md5,rsa-pkcs1-none},encrypt{rsa-pkcs1-none}}"
+        "if-modn{sign{rsa-pkcs1-sha1},encrypt{rsa-pkcs1-none}}"
 
 /* Encode a public key into a SSH2 format blob. Return size or 0 on
    failure. */
@@ -0,0 +1,209 @@
+/*
+
+  t-ecp.c
+
+  Copyright (c) 1999 SSH Communications Security, Finland
+  All rights reserved.
+
+  Tests for the elliptic curve arithmetic over prime fields, and a
+  timing comparison of elliptic curve Diffie-Hellman against the
+  1024-bit group used by the diffie-hellman-group1-sha1 key exchange.
+
+  */
+
+#include "sshincludes.h"
+#include "sshmp.h"
+#include "ecpmath.h"
+#include "timeit.h"
+
+/* Known multiple of the nistp256 base point. */
+#define P256_2G_X \
+  "7CF27B188D034F7E8A52380304B51AC3C08969E277F21B35A60B48FC47669978"
+#define P256_2G_Y \
+  "07775510DB8ED040293D9AC69F7430DBBA7DADE63CE982299E04B79D227873D1"
+
+void check(Boolean cond, const char *what)
+{
+  if (!cond)
+    {
+      printf("error: %s.\n", what);
+      exit(1);
+    }
+}
+
+void test_arithmetic(SshECPCurve *E, SshECPPoint *G)
+{
+  SshECPPoint P, Q, R, S;
+  SshInt k, l, t;
+  unsigned char buf[256];
+  size_t len;
+  int i;
+
+  ssh_ecp_init_point(&P);
+  ssh_ecp_init_point(&Q);
+  ssh_ecp_init_point(&R);
+  ssh_ecp_init_point(&S);
+  ssh_mp_init(&k);
+  ssh_mp_init(&l);
+  ssh_mp_init(&t);
+
+  printf(" * known values\n");
+
+  ssh_ecp_add(&P, G, G, E);
+  ssh_mp_set_ui(&k, 2);
+  ssh_ecp_mul(&Q, G, &k, E);
+  check(ssh_ecp_compare_points(&P, &Q) == 0, "G + G != 2G");
+  ssh_mp_set_str(&k, P256_2G_X, 16);
+  ssh_mp_set_str(&l, P256_2G_Y, 16);
+  ssh_ecp_set_point_xy(&R, &k, &l);
+  check(ssh_ecp_compare_points(&P, &R) == 0, "2G differs from known value");
+  check(ssh_ecp_verify_point(&P, E), "2G not on the curve");
+
+  /* The order of the base point. */
+  ssh_ecp_mul(&P, G, &E->c, E);
+  check(P.z == 0, "cG is not the point at infinity");
+  ssh_mp_sub_ui(&k, &E->c, 1);
+  ssh_ecp_mul(&P, G, &k, E);
+  ssh_ecp_negate_point(&Q, G, E);
+  check(ssh_ecp_compare_points(&P, &Q) == 0, "(c - 1)G != -G");
+  ssh_ecp_add(&P, &P, G, E);
+  check(P.z == 0, "-G + G is not the point at infinity");
+
+  printf(" * random values\n");
+
+  for (i = 0; i < 50; i++)
+    {
+      /* Nonzero, so that the points below are finite. */
+      ssh_mp_rand(&k, 256);
+      ssh_mp_add_ui(&k, &k, 1);
+      ssh_mp_rand(&l, 1 + random() % 256);
+      ssh_mp_add_ui(&l, &l, 1);
+
+      /* kG + lG = (k + l)G */
+      ssh_ecp_mul(&P, G, &k, E);
+      ssh_ecp_mul(&Q, G, &l, E);
+      ssh_ecp_add(&R, &P, &Q, E);
+      ssh_mp_add(&t, &k, &l);
+      ssh_ecp_mul(&S, G, &t, E);
+      check(ssh_ecp_compare_points(&R, &S) == 0, "kG + lG != (k + l)G");
+      check(ssh_ecp_verify_point(&R, E), "kG + lG not on the curve");
+
+      /* k(lG) = l(kG), the Diffie-Hellman property. */
+      ssh_ecp_mul(&R, &Q, &k, E);
+      ssh_ecp_mul(&S, &P, &l, E);
+      check(ssh_ecp_compare_points(&R, &S) == 0, "k(lG) != l(kG)");
+
+      /* Encoding. */
+      len = ssh_ecp_point_to_buf(buf, sizeof(buf), &R, E);
+      check(len == ssh_ecp_point_to_buf(NULL, 0, &R, E),
+            "encoded length mismatch");
+      check(ssh_ecp_buf_to_point(&S, buf, len, E), "decoding failed");
+      check(ssh_ecp_compare_points(&R, &S) == 0, "decoding mismatch");
+      buf[len - 1] ^= 1;
+      check(!ssh_ecp_buf_to_point(&S, buf, len, E),
+            "point off the curve accepted");
+    }
+
+  ssh_ecp_clear_point(&P);
+  ssh_ecp_clear_point(&Q);
+  ssh_ecp_clear_point(&R);
+  ssh_ecp_clear_point(&S);
+  ssh_mp_clear(&k);
+  ssh_mp_clear(&l);
+  ssh_mp_clear(&t);
+}
+
+/* Time the per side work of a key exchange: generating the exchange value
+   and computing the shared secret. */
+void test_timing(SshECPCurve *E, SshECPPoint *G)
+{
+  SshECPPoint P, Q;
+  SshInt k, p, g, e, f;
+  TimeIt tmit;
+  double ec, dh;
+  int i, cnt;
+
+  ssh_ecp_init_point(&P);
+  ssh_ecp_init_point(&Q);
+  ssh_mp_init(&k);
+  ssh_mp_init(&p);
+  ssh_mp_init(&g);
+  ssh_mp_init(&e);
+  ssh_mp_init(&f);
+
+  printf(" * timing (per side of a key exchange)\n");
+
+  ssh_mp_rand(&k, 256);
+  ssh_ecp_mul(&Q, G, &k, E);
+  for (cnt = 10;; cnt *= 2)
+    {
+      start_timing(&tmit);
+      for (i = 0; i < cnt; i++)
+        {
+          ssh_mp_rand(&k, 256);
+          ssh_ecp_mul(&P, G, &k, E);
+          ssh_ecp_mul(&P, &Q, &k, E);
+        }
+      check_timing(&tmit);
+      if (tmit.process_secs > 1.0)
+        break;
+    }
+  ec = tmit.process_secs / cnt;
+
+  /* The group1 exchange uses a 1024-bit prime and 192-bit secrets,
+     for timing any odd modulus of the size will do. */
+  ssh_mp_rand(&p, 1024);
+  ssh_mp_set_bit(&p, 1023);
+  ssh_mp_set_bit(&p, 0);
+  ssh_mp_set_ui(&g, 2);
+  ssh_mp_rand(&f, 1023);
+  for (cnt = 10;; cnt *= 2)
+    {
+      start_timing(&tmit);
+      for (i = 0; i < cnt; i++)
+        {
+          ssh_mp_rand(&k, 192);
+          ssh_mp_powm(&e, &g, &k, &p);
+          ssh_mp_powm(&e, &f, &k, &p);
+        }
+      check_timing(&tmit);
+      if (tmit.process_secs > 1.0)
+        break;
+    }
+  dh = tmit.process_secs / cnt;
+
+  printf("   diffie-hellman-group1  %8.2f ms  %8.1f handshakes/s\n",
+         dh * 1000.0, 1.0 / dh);
+  printf("   ecdh nistp256          %8.2f ms  %8.1f handshakes/s\n",
+         ec * 1000.0, 1.0 / ec);
+
+  ssh_ecp_clear_point(&P);
+  ssh_ecp_clear_point(&Q);
+  ssh_mp_clear(&k);
+  ssh_mp_clear(&p);
+  ssh_mp_clear(&g);
+  ssh_mp_clear(&e);
+  ssh_mp_clear(&f);
+}
+
+int main(int ac, char **av)
+{
+  SshECPCurve E;
+  SshECPPoint G;
+
+  srandom(ssh_time());
+
+  printf("Elliptic curves over prime fields\n");
+
+  check(!ssh_ecp_set_named_curve(&E, &G, "no-such-curve"),
+        "unknown curve accepted");
+  check(ssh_ecp_set_named_curve(&E, &G, "nistp256"),
+        "nistp256 unknown");
+
+  test_arithmetic(&E, &G);
+  test_timing(&E, &G);
+
+  ssh_ecp_clear_point(&G);
+  ssh_ecp_clear_curve(&E);
+  return 0;
+}
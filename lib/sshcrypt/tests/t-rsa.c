@@ -0,0 +1,258 @@
+/*
+
+  t-rsa.c
+
+  Copyright (c) 1999 SSH Communications Security, Finland
+  All rights reserved.
+
+  Tests for the if-modn key type (RSA) through the generic public key
+  interface, and a timing comparison of RSA and DSA signatures.
+
+  */
+
+#include "sshincludes.h"
+#include "sshmp.h"
+#include "sshcrypt.h"
+#include "ssh2pubkeyencode.h"
+#include "timeit.h"
+
+void check(Boolean cond, const char *what)
+{
+  if (!cond)
+    {
+      printf("error: %s.\n", what);
+      exit(1);
+    }
+}
+
+void test_key(SshRandomState state, unsigned int bits)
+{
+  SshPrivateKey prv, prv2;
+  SshPublicKey pub, pub2;
+  SshInt n, e, d, p, q, u, t;
+  unsigned char data[100], sig[512], buf[512], *blob;
+  size_t sig_len, len, blob_len;
+  unsigned int size;
+  char *name;
+  int i;
+
+  printf(" * %u bit keys\n", bits);
+
+  ssh_mp_init(&n);
+  ssh_mp_init(&e);
+  ssh_mp_init(&d);
+  ssh_mp_init(&p);
+  ssh_mp_init(&q);
+  ssh_mp_init(&u);
+  ssh_mp_init(&t);
+
+  check(ssh_private_key_generate(state, &prv, SSH_CRYPTO_RSA,
+                                 SSH_PKF_SIZE, bits,
+                                 SSH_PKF_END) == SSH_CRYPTO_OK,
+        "key generation failed");
+  pub = ssh_private_key_derive_public_key(prv);
+  check(pub != NULL, "public key derivation failed");
+
+  name = ssh_public_key_name(pub);
+  check(strcmp(name, SSH_CRYPTO_RSA) == 0, "unexpected key name");
+  ssh_xfree(name);
+
+  /* The components. */
+  check(ssh_private_key_get_info(prv,
+                                 SSH_PKF_SIZE, &size,
+                                 SSH_PKF_MODULO_N, &n,
+                                 SSH_PKF_PUBLIC_E, &e,
+                                 SSH_PKF_SECRET_D, &d,
+                                 SSH_PKF_PRIME_P, &p,
+                                 SSH_PKF_PRIME_Q, &q,
+                                 SSH_PKF_INVERSE_U, &u,
+                                 SSH_PKF_END) == SSH_CRYPTO_OK,
+        "get info failed");
+  check(size == bits, "modulus of wrong size");
+  check(ssh_mp_cmp_ui(&e, 65537) == 0, "unexpected public exponent");
+  ssh_mp_mul(&t, &p, &q);
+  check(ssh_mp_cmp(&t, &n) == 0, "n != pq");
+  ssh_mp_mul(&t, &u, &p);
+  ssh_mp_mod(&t, &t, &q);
+  check(ssh_mp_cmp_ui(&t, 1) == 0, "u is not the inverse of p (mod q)");
+
+  for (i = 0; i < 20; i++)
+    {
+      for (len = 0; len < sizeof(data); len++)
+        data[len] = ssh_random_get_byte(state);
+
+      check(ssh_private_key_sign(prv, data, sizeof(data),
+                                 sig, sizeof(sig), &sig_len,
+                                 state) == SSH_CRYPTO_OK,
+            "signing failed");
+      check(sig_len == (bits + 7) / 8, "signature of wrong length");
+      check(ssh_public_key_verify_signature(pub, sig, sig_len,
+                                            data, sizeof(data)),
+            "valid signature rejected");
+      data[i] ^= 1;
+      check(!ssh_public_key_verify_signature(pub, sig, sig_len,
+                                             data, sizeof(data)),
+            "signature of modified data accepted");
+      data[i] ^= 1;
+      sig[sig_len - 1 - i] ^= 0x10;
+      check(!ssh_public_key_verify_signature(pub, sig, sig_len,
+                                             data, sizeof(data)),
+            "modified signature accepted");
+
+      /* Encryption. */
+      check(ssh_public_key_encrypt(pub, data, 32, buf, sizeof(buf), &len,
+                                   state) == SSH_CRYPTO_OK,
+            "encryption failed");
+      check(ssh_private_key_decrypt(prv, buf, len, sig, sizeof(sig),
+                                    &sig_len) == SSH_CRYPTO_OK,
+            "decryption failed");
+      check(sig_len == 32 && memcmp(sig, data, 32) == 0,
+            "decryption mismatch");
+    }
+
+  /* A key made from the components, p and q swapped and without u as
+     the ssh1 keys are, gives the same signatures. */
+  check(ssh_private_key_generate(state, &prv2, SSH_CRYPTO_RSA,
+                                 SSH_PKF_MODULO_N, &n,
+                                 SSH_PKF_PUBLIC_E, &e,
+                                 SSH_PKF_SECRET_D, &d,
+                                 SSH_PKF_PRIME_P, &q,
+                                 SSH_PKF_PRIME_Q, &p,
+                                 SSH_PKF_END) == SSH_CRYPTO_OK,
+        "key from components failed");
+  check(ssh_private_key_sign(prv, data, sizeof(data), sig, sizeof(sig),
+                             &sig_len, state) == SSH_CRYPTO_OK &&
+        ssh_private_key_sign(prv2, data, sizeof(data), buf, sizeof(buf),
+                             &len, state) == SSH_CRYPTO_OK &&
+        len == sig_len && memcmp(sig, buf, len) == 0,
+        "key from components signs differently");
+  ssh_private_key_free(prv2);
+
+  /* The ssh2 public key blob. */
+  blob_len = ssh_encode_pubkeyblob(pub, &blob);
+  check(blob_len != 0, "blob encoding failed");
+  name = ssh_pubkeyblob_type(blob, blob_len);
+  check(name != NULL && strcmp(name, SSH_SSH_RSA) == 0,
+        "blob of wrong type");
+  ssh_xfree(name);
+  pub2 = ssh_decode_pubkeyblob(blob, blob_len);
+  check(pub2 != NULL, "blob decoding failed");
+  check(ssh_public_key_verify_signature(pub2, sig, sig_len,
+                                        data, sizeof(data)),
+        "decoded key rejects a valid signature");
+  ssh_public_key_free(pub2);
+  ssh_xfree(blob);
+
+  /* Export and import. */
+  check(ssh_private_key_export_with_passphrase(prv, "blowfish-cbc", "test",
+                                               state, &blob, &blob_len)
+        == SSH_CRYPTO_OK, "private key export failed");
+  check(ssh_private_key_import_with_passphrase(blob, blob_len, "test",
+                                               &prv2) == SSH_CRYPTO_OK,
+        "private key import failed");
+  ssh_xfree(blob);
+  check(ssh_private_key_sign(prv2, data, sizeof(data), buf, sizeof(buf),
+                             &len, state) == SSH_CRYPTO_OK &&
+        len == sig_len && memcmp(sig, buf, len) == 0,
+        "imported key signs differently");
+  ssh_private_key_free(prv2);
+
+  check(ssh_public_key_export(pub, &blob, &blob_len) == SSH_CRYPTO_OK,
+        "public key export failed");
+  check(ssh_public_key_import(blob, blob_len, &pub2) == SSH_CRYPTO_OK,
+        "public key import failed");
+  ssh_xfree(blob);
+  check(ssh_public_key_verify_signature(pub2, sig, sig_len,
+                                        data, sizeof(data)),
+        "imported key rejects a valid signature");
+  ssh_public_key_free(pub2);
+
+  ssh_public_key_free(pub);
+  ssh_private_key_free(prv);
+
+  ssh_mp_clear(&n);
+  ssh_mp_clear(&e);
+  ssh_mp_clear(&d);
+  ssh_mp_clear(&p);
+  ssh_mp_clear(&q);
+  ssh_mp_clear(&u);
+  ssh_mp_clear(&t);
+}
+
+/* Time signing and verification, as done with the host key in every
+   key exchange. */
+void time_key(SshRandomState state, const char *name,
+              const char *type, unsigned int bits)
+{
+  SshPrivateKey prv;
+  SshPublicKey pub;
+  unsigned char data[20], sig[512];
+  size_t sig_len;
+  TimeIt tmit;
+  double sign, verify;
+  int i, cnt;
+
+  check(ssh_private_key_generate(state, &prv, type,
+                                 SSH_PKF_SIZE, bits,
+                                 SSH_PKF_END) == SSH_CRYPTO_OK,
+        "key generation failed");
+  pub = ssh_private_key_derive_public_key(prv);
+  memset(data, 0, sizeof(data));
+
+  for (cnt = 10;; cnt *= 2)
+    {
+      start_timing(&tmit);
+      for (i = 0; i < cnt; i++)
+        ssh_private_key_sign(prv, data, sizeof(data),
+                             sig, sizeof(sig), &sig_len, state);
+      check_timing(&tmit);
+      if (tmit.process_secs > 1.0)
+        break;
+    }
+  sign = tmit.process_secs / cnt;
+
+  for (cnt = 10;; cnt *= 2)
+    {
+      start_timing(&tmit);
+      for (i = 0; i < cnt; i++)
+        check(ssh_public_key_verify_signature(pub, sig, sig_len,
+                                              data, sizeof(data)),
+              "verification failed");
+      check_timing(&tmit);
+      if (tmit.process_secs > 1.0)
+        break;
+    }
+  verify = tmit.process_secs / cnt;
+
+  printf("   %-10s %5u  sign %7.2f ms  verify %7.2f ms\n",
+         name, bits, sign * 1000.0, verify * 1000.0);
+
+  ssh_public_key_free(pub);
+  ssh_private_key_free(prv);
+}
+
+int main(int ac, char **av)
+{
+  SshRandomState state;
+  char *names;
+
+  state = ssh_random_allocate();
+
+  printf("RSA through the generic public key interface\n");
+
+  names = ssh_public_key_get_supported();
+  check(strstr(names, SSH_CRYPTO_RSA) != NULL, "if-modn not supported");
+  ssh_xfree(names);
+
+  test_key(state, 512);
+  test_key(state, 768);
+  test_key(state, 1024);
+
+  printf(" * timing\n");
+  time_key(state, "dsa", SSH_CRYPTO_DSS, 1024);
+  time_key(state, "rsa", SSH_CRYPTO_RSA, 1024);
+  time_key(state, "rsa", SSH_CRYPTO_RSA, 2048);
+
+  ssh_random_free(state);
+  return 0;
+}
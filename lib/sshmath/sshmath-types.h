@@ -45,5 +45,17 @@ typedef long          SignedSshWord;
 #define SSH_WORD_HALF_BITS (SSH_WORD_BITS / 2)
 #define SSH_WORD_MASK (~(SshWord)0)
 
+/* Double word type, if the compiler has one. The kernel uses it for
+   computing full word products (see sshmp-kernel.h). Configure checks
+   for unsigned __int128, which GCC and compatible compilers provide on
+   64-bit targets. */
+#if (SSH_WORD_BITS == 64) && defined(HAVE_UINT128)
+typedef unsigned __int128 SshDoubleWord;
+#define SSHMATH_DOUBLE_WORD
+#elif (SSH_WORD_BITS == 32) && (SIZEOF_LONG_LONG == 8)
+typedef unsigned long long SshDoubleWord;
+#define SSHMATH_DOUBLE_WORD
+#endif
+
 #endif /* SSHMATH_TYPES_H */
 
@@ -671,6 +671,10 @@ void ssh_mpk_mul(SshWord *ret,
 #ifdef SSHMATH_ASSEMBLER_SUBROUTINES
       /* Assembler addmul, standard way to doing it. */
       c = ssh_mpk_addmul_n(ret + i, op1[i], op2, op2_n);
+#elif defined(SSHMATH_DOUBLE_WORD)
+      /* Double word accumulation, carries are handled by the compiler. */
+      for (j = 0, c = 0, tmp = ret + i, k = op1[i]; j < op2_n; j++)
+        SSH_MPK_MUL_ADD_STEP(c, tmp[j], k, op2[j]);
 #else /* SSHMATH_ASSEMBLER_SUBROUTINES */
       for (j = 0, c = 0, tmp = ret + i, k = op1[i]; j < op2_n; j++)
         {
@@ -770,6 +774,9 @@ void ssh_mpk_square(SshWord *ret,
        call to assembler routine. This is same what is used in
        multiplication. Makes this interface very nice. */
     c = ssh_mpk_addmul_n(ret + 2*i + 1, op[i], op + i + 1, op_n - i - 1);
+#elif defined(SSHMATH_DOUBLE_WORD)
+      for (j = i + 1, k = op[i], c = 0; j < op_n; j++)
+        SSH_MPK_MUL_ADD_STEP(c, ret[j + i], k, op[j]);
 #else /* SSHMATH_ASSEMBLER_SUBROUTINES */
       for (j = i + 1, k = op[i], c = 0; j < op_n; j++)
         {
@@ -906,18 +913,36 @@ void ssh_mpk_square(SshWord *ret,
    */
 
 /* The thresholds for multiplication and squaring. These can be
-   modified on the runtime.
+   modified on the runtime with ssh_mpk_set_karatsuba_crossovers.
 
-   XXX Implement the modification routine. If the memory allocation
-   for karatsuba is performed before the change everything can
-   fail. Thus these should be changed only by suitable procedure.
-   Actually is this that a good of a idea? 
+   If the memory allocation for karatsuba is performed before the
+   change everything can fail. Thus these should be changed only
+   before any moduli (which keep preallocated work space) exist.
    
    */
 
 SshWord ssh_mpk_karatsuba_mul_words    = SSH_MPK_KARATSUBA_MUL_CROSSOVER;
 SshWord ssh_mpk_karatsuba_square_words = SSH_MPK_KARATSUBA_SQUARE_CROSSOVER;
 
+void ssh_mpk_set_karatsuba_crossovers(unsigned int mul_words,
+                                      unsigned int square_words)
+{
+  if (mul_words < SSH_MPK_KARATSUBA_MIN_CROSSOVER)
+    mul_words = SSH_MPK_KARATSUBA_MIN_CROSSOVER;
+  if (square_words < SSH_MPK_KARATSUBA_MIN_CROSSOVER)
+    square_words = SSH_MPK_KARATSUBA_MIN_CROSSOVER;
+
+  ssh_mpk_karatsuba_mul_words    = mul_words;
+  ssh_mpk_karatsuba_square_words = square_words;
+}
+
+void ssh_mpk_get_karatsuba_crossovers(unsigned int *mul_words,
+                                      unsigned int *square_words)
+{
+  *mul_words    = ssh_mpk_karatsuba_mul_words;
+  *square_words = ssh_mpk_karatsuba_square_words;
+}
+
 #if defined(SSH_MPK_USE_PLUMBS_ALGORITHM)
 
 /* Compute the needed memory for the Karatsuba squaring. */
@@ -2236,7 +2261,10 @@ void ssh_mpmk_reduce(SshWord *ret, unsigned int ret_n,
   SshWord high_carry;
 #ifndef SSHMATH_ASSEMBLER_SUBROUTINES
   unsigned int j;
-  SshWord t, u, a2, a1, c;
+  SshWord t, u, c;
+#ifndef SSHMATH_DOUBLE_WORD
+  SshWord a2, a1;
+#endif /* SSHMATH_DOUBLE_WORD */
 #endif
   
   ssh_mpk_memcopy(ret, op, op_n);
@@ -2246,6 +2274,12 @@ void ssh_mpmk_reduce(SshWord *ret, unsigned int ret_n,
 #ifdef SSHMATH_ASSEMBLER_SUBROUTINES
       high_carry = ssh_mpmk_addmul_n(ret + i, mp, m, m_n, high_carry);
 #else
+#ifdef SSHMATH_DOUBLE_WORD
+      /* Only the low word of ret[i]*mp is needed. */
+      u = ret[i] * mp;
+      for (j = 0, c = 0; j < m_n; j++)
+        SSH_MPK_MUL_ADD_STEP(c, ret[j + i], u, m[j]);
+#else /* SSHMATH_DOUBLE_WORD */
       SSH_MPK_LONG_MUL(t, u, ret[i], mp);
       for (j = 0, c = 0; j < m_n; j++)
         {
@@ -2263,6 +2297,7 @@ void ssh_mpmk_reduce(SshWord *ret, unsigned int ret_n,
             c++;
           ret[j + i] = t;
         }
+#endif /* SSHMATH_DOUBLE_WORD */
       c = c + high_carry;
       if (c < high_carry)
         high_carry = 1;
@@ -2295,6 +2330,64 @@ void ssh_mpmk_reduce(SshWord *ret, unsigned int ret_n,
     ssh_mpk_sub(ret, ret, ret_n, m, m_n);
 }
 
+/* Multiply-accumulate step (c, r) = k*w + r + c. */
+#ifdef SSH_MPK_MUL_ADD_STEP
+#define SSH_MPMK_MAC(c, r, k, w) SSH_MPK_MUL_ADD_STEP(c, r, k, w)
+#else /* SSH_MPK_MUL_ADD_STEP */
+#define SSH_MPMK_MAC(c, r, k, w) \
+{ \
+  SshWord __h, __l; \
+  SSH_MPK_LONG_MUL(__h, __l, k, w); \
+  __l += (c); \
+  __h += (__l < (c)); \
+  __l += (r); \
+  __h += (__l < (r)); \
+  (r) = __l; \
+  (c) = __h; \
+}
+#endif /* SSH_MPK_MUL_ADD_STEP */
+
+/* Montgomery multiplication, the coarsely integrated operand scanning
+   method (CIOS) of Koc, Acar and Kaliski. Each round adds a*b[i] and
+   then a multiple of the moduli which clears the lowest word, and
+   shifts down by a word. */
+void ssh_mpmk_mul_small(SshWord *ret,
+                        const SshWord *a, const SshWord *b,
+                        SshWord mp,
+                        const SshWord *m, unsigned int m_n)
+{
+  unsigned int i, j;
+  SshWord c, t, u;
+
+  ssh_mpk_memzero(ret, m_n + 2);
+  for (i = 0; i < m_n; i++)
+    {
+      for (j = 0, c = 0; j < m_n; j++)
+        SSH_MPMK_MAC(c, ret[j], a[j], b[i]);
+      t = ret[m_n] + c;
+      ret[m_n + 1] = (t < c);
+      ret[m_n] = t;
+
+      u = ret[0] * mp;
+      c = 0;
+      t = ret[0];
+      SSH_MPMK_MAC(c, t, u, m[0]);
+      for (j = 1; j < m_n; j++)
+        {
+          t = ret[j];
+          SSH_MPMK_MAC(c, t, u, m[j]);
+          ret[j - 1] = t;
+        }
+      t = ret[m_n] + c;
+      ret[m_n - 1] = t;
+      ret[m_n] = ret[m_n + 1] + (t < c);
+    }
+
+  /* The result is less than twice the moduli. */
+  if (ret[m_n] || ssh_mpk_cmp(ret, m_n, (SshWord *)m, m_n) >= 0)
+    ssh_mpk_sub(ret, ret, m_n + 1, (SshWord *)m, m_n);
+}
+
 /* Compute x^-1 == a (mod 2^SSH_WORD_BITS). Please, use the Newton
    iteration method. It is fastest and easily proven to be correct. */
 
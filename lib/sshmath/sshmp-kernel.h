@@ -101,7 +101,79 @@ __asm__("divl %4"                  \
 #define SSH_MPK_LONG_SQUARE(w1,w0,a) SSH_MPK_LONG_MUL(w1,w0,a,a)
 #endif /* ! __GNUC__ */
 #endif /* SSHMATH_ALPHA */
-     
+
+/* x86-64 inline macros (GCC and compatible compilers). These are the
+   64-bit counterparts of the i386 macros above. */
+#ifdef SSHMATH_X86_64
+#ifdef __GNUC__
+/* The count is passed through a full word register, because callers
+   use variables of different widths for it. */
+#define SSH_MPK_COUNT_TRAILING_ZEROS(count, x) \
+do { \
+  SshWord __r; \
+  __asm__("bsfq %1,%0" : "=r" (__r) : "rm" ((SshWord)(x))); \
+  count = __r; \
+} while (0)
+
+#define SSH_MPK_COUNT_LEADING_ZEROS(count, x) \
+do { \
+  SshWord __r; \
+  __asm__("bsrq %1,%0; xorq $63, %0" : "=r" (__r) : "rm" ((SshWord)(x))); \
+  count = __r; \
+} while (0)
+
+#define SSH_MPK_LONG_MUL(u, v, a, b) \
+__asm__("mulq %3"                 \
+        : "=a" (v),          \
+          "=d" (u)           \
+        : "%0" ((SshWord)(a)), \
+          "rm" ((SshWord)(b)))
+
+#define SSH_MPK_LONG_SQUARE(u, v, a) \
+  SSH_MPK_LONG_MUL(u, v, a, a)
+
+/* The divq instruction traps if the quotient does not fit into a
+   word, which the preconditions of SSH_MPK_LONG_DIV rule out. */
+#define SSH_MPK_LONG_DIV(q, r, d1, d0, d) \
+__asm__("divq %4"                  \
+        : "=a" (q),           \
+          "=d" (r)            \
+        : "0"  ((SshWord)(d0)), \
+          "1"  ((SshWord)(d1)), \
+          "rm" ((SshWord)(d)))
+#endif /* __GNUC__ */
+#endif /* SSHMATH_X86_64 */
+
+/* AArch64 inline macros. There is no two word by one word division
+   instruction, so the division is left to the C macro below (which
+   uses the hardware 64-bit udiv for its half word steps). */
+#ifdef SSHMATH_AARCH64
+#ifdef __GNUC__
+#define SSH_MPK_COUNT_TRAILING_ZEROS(count, x) \
+do { \
+  SshWord __r; \
+  __asm__("rbit %0, %1" : "=r" (__r) : "r" ((SshWord)(x))); \
+  __asm__("clz %0, %1" : "=r" (__r) : "r" (__r)); \
+  count = __r; \
+} while (0)
+
+#define SSH_MPK_COUNT_LEADING_ZEROS(count, x) \
+do { \
+  SshWord __r; \
+  __asm__("clz %0, %1" : "=r" (__r) : "r" ((SshWord)(x))); \
+  count = __r; \
+} while (0)
+
+#define SSH_MPK_LONG_MUL(w1, w0, n1, n0) \
+{ \
+  SshWord __n1 = (n1), __n0 = (n0); \
+  __asm__("umulh %0, %1, %2" : "=r" (w1) : "r" (__n1), "r" (__n0)); \
+  w0 = __n1 * __n0; \
+}
+#define SSH_MPK_LONG_SQUARE(w1, w0, a) SSH_MPK_LONG_MUL(w1, w0, a, a)
+#endif /* __GNUC__ */
+#endif /* SSHMATH_AARCH64 */
+
 #endif /* SSHMATH_ASSEMBLER_MACROS */
 
 /* The general purpose macros. */
@@ -124,6 +196,36 @@ __asm__("divl %4"                  \
   do { count = ssh_mpk_count_trailing_zeros(x); } while(0)
 #endif /* SSH_MPK_COUNT_TRAILING_ZEROS */
 
+/* Double word arithmetic. When the compiler offers an integer type of
+   twice the word size (see sshmath-types.h) the full product of two
+   words is computed directly, and the compiler emits the native
+   widening multiply (mul on x86, umulh on AArch64 etc.) instead of the
+   four half word products below. */
+#ifdef SSHMATH_DOUBLE_WORD
+#ifndef SSH_MPK_LONG_MUL
+#define SSH_MPK_LONG_MUL(w1, w0, n1, n0) \
+{ \
+  SshDoubleWord __t = (SshDoubleWord)(n1) * (SshDoubleWord)(n0); \
+  (w1) = (SshWord)(__t >> SSH_WORD_BITS); \
+  (w0) = (SshWord)__t; \
+}
+#endif /* SSH_MPK_LONG_MUL */
+#ifndef SSH_MPK_LONG_SQUARE
+#define SSH_MPK_LONG_SQUARE(w1, w0, a) SSH_MPK_LONG_MUL(w1, w0, a, a)
+#endif /* SSH_MPK_LONG_SQUARE */
+
+/* Multiply and accumulate one word, (c, r) = k*w + r + c. This cannot
+   overflow the double word as (2^n - 1)^2 + 2*(2^n - 1) = 2^2n - 1.
+   This is the inner step of the multiplication, squaring and Montgomery
+   reduction loops. */
+#define SSH_MPK_MUL_ADD_STEP(c, r, k, w) \
+{ \
+  SshDoubleWord __t = (SshDoubleWord)(k) * (SshDoubleWord)(w) + (r) + (c); \
+  (r) = (SshWord)__t; \
+  (c) = (SshWord)(__t >> SSH_WORD_BITS); \
+}
+#endif /* SSHMATH_DOUBLE_WORD */
+
 #ifndef SSH_MPK_LONG_MUL
 /* Determine the macro to use. If multiplication is very fast relative to
    addition then use the method implemented by Huima. However, it has
@@ -545,6 +647,12 @@ c=n/a;g=((n%a)<<SSH_WORD_HALF_BITS)|(extr(n0))
    is used. (Often fast algorithms have overhead that makes school method
    faster with short inputs.) */
 
+/* "make mp-tune" measures the crossovers on the build host and writes
+   them to sshmp-tune.h (see tests/t-mptune.c). */
+#ifdef HAVE_SSHMP_TUNE_H
+#include "sshmp-tune.h"
+#endif /* HAVE_SSHMP_TUNE_H */
+
 #ifndef SSH_MPK_KARATSUBA_MUL_CROSSOVER
 /* This choice seems good for 32-bit architectures. */
 #define SSH_MPK_KARATSUBA_MUL_CROSSOVER    28
@@ -554,6 +662,9 @@ c=n/a;g=((n%a)<<SSH_WORD_HALF_BITS)|(extr(n0))
 #define SSH_MPK_KARATSUBA_SQUARE_CROSSOVER 20
 #endif /* SSH_MPK_KARATSUBA_SQUARE_CROSSOVER */
 
+/* The smallest crossover for which the Karatsuba recursion terminates. */
+#define SSH_MPK_KARATSUBA_MIN_CROSSOVER    4
+
 /* The kernel level C functions. These functions implement the elementary
    functionality for arithmetic functions. */
 
@@ -622,6 +733,17 @@ void ssh_mpk_mul_ui(SshWord *ret,
 void ssh_mpk_square(SshWord *ret,
                     SshWord *op,  unsigned int op_n);
 
+/* Set the Karatsuba crossovers, in words, at run time. Values below
+   SSH_MPK_KARATSUBA_MIN_CROSSOVER are raised to it. This must not be
+   called while any SshIntModuli is in use, because their work spaces
+   were sized for the crossovers in effect at initialization. */
+void ssh_mpk_set_karatsuba_crossovers(unsigned int mul_words,
+                                      unsigned int square_words);
+
+/* Get the current Karatsuba crossovers. */
+void ssh_mpk_get_karatsuba_crossovers(unsigned int *mul_words,
+                                      unsigned int *square_words);
+
 /* Karatsuba squaring algorithm. */
 
 /* This function computes the number of words needed as work space in
@@ -693,6 +815,17 @@ void ssh_mpmk_reduce(SshWord *ret, unsigned int ret_n,
                      SshWord mp,
                      SshWord *m,   unsigned int m_n);
 
+/* Montgomery multiplication with the reduction interleaved, which for
+   small moduli avoids most of the overhead of separate multiplication
+   and reduction. Both 'a' and 'b' must be less than the moduli and have
+   'm_n' words (padded with zeros), 'ret' must have room for 'm_n' + 2
+   words. The result has 'm_n' words and is less than the moduli. */
+#define SSH_MPMK_MUL_SMALL_MAX 16
+void ssh_mpmk_mul_small(SshWord *ret,
+                        const SshWord *a, const SshWord *b,
+                        SshWord mp,
+                        const SshWord *m, unsigned int m_n);
+
 /* Computation of a^-1 (mod 2^n). Input 'a' must be odd. */
 SshWord ssh_mpmk_small_inv(SshWord a);
 
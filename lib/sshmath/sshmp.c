@@ -223,6 +223,179 @@
 
 /********** Routines for handling variable length integers *****/
 
+/* Scratch arenas.
+
+   While a frame is active the temporary word arrays of this library,
+   and the limbs of integers initialized within the frame, are taken
+   from the arena with a simple stack discipline. Each block is
+   surrounded by its length, the trailing copy also carries the freed
+   flag. Blocks freed out of order are released once everything above
+   them has been freed, or at the latest when the frame ends. */
+
+/* Flag in the trailing length word of a freed block. */
+#define SSH_MP_SCRATCH_FREED  ((SshWord)1 << (SSH_WORD_BITS - 1))
+
+/* Initial arena size, in integers of twice the modulus size. */
+#define SSH_MP_SCRATCH_INTS   32
+
+/* The arena of the innermost active frame, and all arenas with active
+   frames. These are shared by all threads, see sshmp.h. */
+static SshMpScratch *ssh_mp_scratch_active = NULL;
+static SshMpScratch *ssh_mp_scratch_list = NULL;
+
+void ssh_mp_scratch_init(SshMpScratch *scratch)
+{
+  scratch->v = NULL;
+  scratch->size = 0;
+  scratch->top = 0;
+  scratch->high = 0;
+  scratch->wanted = 0;
+  scratch->int_n = 0;
+  scratch->depth = 0;
+  scratch->next = NULL;
+}
+
+void ssh_mp_scratch_clear(SshMpScratch *scratch)
+{
+  if (scratch->v)
+    memset(scratch->v, 0, sizeof(SshWord) * scratch->size);
+  ssh_xfree(scratch->v);
+  ssh_mp_scratch_init(scratch);
+}
+
+void ssh_mp_scratch_begin(SshMpScratch *scratch, SshMpScratchFrame *frame,
+                          const SshInt *modulus)
+{
+  unsigned int int_n;
+
+  if (scratch->depth++ == 0)
+    {
+      /* Size the arena for the modulus, or resize it to what was
+         needed the last time. */
+      if (modulus)
+        {
+          int_n = modulus->n * 2 + 2;
+          if (int_n > scratch->int_n)
+            scratch->int_n = int_n;
+        }
+      if (scratch->wanted < scratch->int_n * SSH_MP_SCRATCH_INTS)
+        scratch->wanted = scratch->int_n * SSH_MP_SCRATCH_INTS;
+      if (scratch->wanted > scratch->size)
+        {
+          /* Leave some slack, the need depends slightly on the
+             values. */
+          if (scratch->v)
+            {
+              memset(scratch->v, 0, sizeof(SshWord) * scratch->size);
+              scratch->wanted += scratch->wanted / 4;
+            }
+          ssh_xfree(scratch->v);
+          scratch->v = ssh_xmalloc(sizeof(SshWord) * scratch->wanted);
+          scratch->size = scratch->wanted;
+        }
+
+      scratch->next = ssh_mp_scratch_list;
+      ssh_mp_scratch_list = scratch;
+    }
+
+  frame->scratch = scratch;
+  frame->prev = ssh_mp_scratch_active;
+  frame->top = scratch->top;
+  ssh_mp_scratch_active = scratch;
+}
+
+void ssh_mp_scratch_end(SshMpScratchFrame *frame)
+{
+  SshMpScratch *scratch = frame->scratch, **s;
+
+  /* Everything allocated within the frame is released. */
+  if (scratch->top > frame->top)
+    scratch->top = frame->top;
+  ssh_mp_scratch_active = frame->prev;
+
+  if (--scratch->depth == 0)
+    {
+      /* Don't leave secrets lying around. */
+      if (scratch->high)
+        memset(scratch->v, 0, sizeof(SshWord) * scratch->high);
+      scratch->high = 0;
+
+      for (s = &ssh_mp_scratch_list; *s; s = &(*s)->next)
+        if (*s == scratch)
+          {
+            *s = scratch->next;
+            break;
+          }
+      scratch->next = NULL;
+    }
+}
+
+/* Allocate n words, from the given arena if there is room. */
+static SshWord *ssh_mp_scratch_alloc_from(SshMpScratch *scratch,
+                                          unsigned int n)
+{
+  SshWord *v;
+
+  if (scratch)
+    {
+      if (scratch->top + n + 2 <= scratch->size)
+        {
+          v = scratch->v + scratch->top;
+          v[0] = n;
+          v[n + 1] = n;
+          scratch->top += n + 2;
+          if (scratch->top > scratch->high)
+            scratch->high = scratch->top;
+          return v + 1;
+        }
+
+      /* Remember for the next frame how much would have been needed. */
+      if (scratch->top + n + 2 > scratch->wanted)
+        scratch->wanted = scratch->top + n + 2;
+    }
+  return ssh_xmalloc(sizeof(SshWord) * n);
+}
+
+/* Allocate n words, from the active arena if there is room. */
+SshWord *ssh_mp_scratch_alloc(unsigned int n)
+{
+  return ssh_mp_scratch_alloc_from(ssh_mp_scratch_active, n);
+}
+
+/* Return the arena which owns v, or NULL if v is on the heap. */
+static SshMpScratch *ssh_mp_scratch_owner(const SshWord *v)
+{
+  SshMpScratch *scratch;
+
+  if (v == NULL)
+    return NULL;
+  for (scratch = ssh_mp_scratch_list; scratch; scratch = scratch->next)
+    if (v > scratch->v && v <= scratch->v + scratch->size)
+      return scratch;
+  return NULL;
+}
+
+void ssh_mp_scratch_free(SshWord *v)
+{
+  SshMpScratch *scratch;
+  SshWord n;
+
+  if ((scratch = ssh_mp_scratch_owner(v)) == NULL)
+    {
+      ssh_xfree(v);
+      return;
+    }
+
+  /* Mark freed, and pop all the freed blocks from the top. */
+  v[v[-1]] |= SSH_MP_SCRATCH_FREED;
+  while (scratch->top &&
+         (scratch->v[scratch->top - 1] & SSH_MP_SCRATCH_FREED))
+    {
+      n = scratch->v[scratch->top - 1] & ~SSH_MP_SCRATCH_FREED;
+      scratch->top -= n + 2;
+    }
+}
+
 /* Routines for allocating and expanding SshInt's. */
 
 SshInt *ssh_mp_malloc(void)
@@ -240,7 +413,7 @@ SshInt *ssh_mp_malloc(void)
 
 void ssh_mp_free(SshInt *op)
 {
-  ssh_xfree(op->v);
+  ssh_mp_scratch_free(op->v);
   ssh_xfree(op);
 }
 
@@ -248,14 +421,20 @@ void ssh_mp_realloc(SshInt *op, unsigned int new_size)
 {
   if (new_size > op->m)
     {
+      SshMpScratch *scratch;
       SshWord *nv;
 
-      /* Allocate, copy and clear the rest. */
-      nv = ssh_xmalloc((size_t)new_size * sizeof(SshWord));
+      /* Allocate, copy and clear the rest. Integers living in a scratch
+         arena stay in the same arena, even if a frame on another one is
+         active, as that one is reset when its frame ends. */
+      if ((scratch = ssh_mp_scratch_owner(op->v)) != NULL)
+        nv = ssh_mp_scratch_alloc_from(scratch, new_size);
+      else
+        nv = ssh_xmalloc((size_t)new_size * sizeof(SshWord));
       ssh_mpk_memcopy(nv, op->v, op->n);
 
       /* Free the old one. */
-      ssh_xfree(op->v);
+      ssh_mp_scratch_free(op->v);
 
       /* Set the new one. */
       op->v = nv;
@@ -282,13 +461,20 @@ void ssh_mp_init(SshInt *op)
   op->n = 0; 
   op->sign = 0;
   op->v = NULL;
+
+  /* Within a frame take room for a product of two residues. */
+  if (ssh_mp_scratch_active && ssh_mp_scratch_active->int_n)
+    {
+      op->v = ssh_mp_scratch_alloc(ssh_mp_scratch_active->int_n);
+      op->m = ssh_mp_scratch_active->int_n;
+    }
 }
 
 /* Clear the integer up, free the space occupied, but don't free the
    integer context. */
 void ssh_mp_clear(SshInt *op)
 {
-  ssh_xfree(op->v);
+  ssh_mp_scratch_free(op->v);
   op->n = 0;
   op->m = 0;
   op->sign = 0;
@@ -924,7 +1110,7 @@ void ssh_mp_mul(SshInt *ret, const SshInt *op1, const SshInt *op2)
   ssh_mp_realloc(ret, temp_n);
 
   if (op1->v == ret->v || op2->v == ret->v)
-    temp = ssh_xmalloc(temp_n * sizeof(SshWord));
+    temp = ssh_mp_scratch_alloc(temp_n);
   else
     temp = ret->v;
 
@@ -946,7 +1132,7 @@ void ssh_mp_mul(SshInt *ret, const SshInt *op1, const SshInt *op2)
   if (ret->v != temp)
     {
       ssh_mpk_memcopy(ret->v, temp, temp_n);
-      ssh_xfree(temp);
+      ssh_mp_scratch_free(temp);
     }
   
   ret->n = temp_n;
@@ -971,7 +1157,7 @@ void ssh_mp_square(SshInt *ret, const SshInt *op)
   ssh_mp_realloc(ret, temp_n);
 
   if (op->v == ret->v)
-    temp = ssh_xmalloc(temp_n * sizeof(SshWord));
+    temp = ssh_mp_scratch_alloc(temp_n);
   else
     temp = ret->v;
 
@@ -993,7 +1179,7 @@ void ssh_mp_square(SshInt *ret, const SshInt *op)
   if (ret->v != temp)
     {
       ssh_mpk_memcopy(ret->v, temp, temp_n);
-      ssh_xfree(temp);
+      ssh_mp_scratch_free(temp);
     }
   
   ret->n = temp_n;
@@ -1032,7 +1218,7 @@ void ssh_mp_div(SshInt *q, SshInt *r, const SshInt *op1, const SshInt *op2)
   ssh_mp_realloc(r, op2->n);
 
   /* Allocate temporary space. */
-  rem  = ssh_xmalloc(sizeof(SshWord) * (rem_n + quot_n + op2->n));
+  rem  = ssh_mp_scratch_alloc(rem_n + quot_n + op2->n);
   quot = rem + rem_n;
   div  = quot + quot_n; 
 
@@ -1090,7 +1276,7 @@ void ssh_mp_div(SshInt *q, SshInt *r, const SshInt *op1, const SshInt *op2)
     SSH_MP_NO_SIGN(q);
 
   /* Free temporary storage. */
-  ssh_xfree(rem);
+  ssh_mp_scratch_free(rem);
 }
 
 /* Compute the remainder i.e. op1 (mod op2). */
@@ -1138,7 +1324,7 @@ void ssh_mp_mod(SshInt *r, const SshInt *op1, const SshInt *op2)
   ssh_mp_realloc(r, op2->n);
 
   /* Allocate temporary space. */
-  rem  = ssh_xmalloc(sizeof(SshWord) * (rem_n + div_n));
+  rem  = ssh_mp_scratch_alloc(rem_n + div_n);
   div  = rem + rem_n; 
 
   /* Clear and copy. */
@@ -1182,7 +1368,7 @@ void ssh_mp_mod(SshInt *r, const SshInt *op1, const SshInt *op2)
   /* Set the remainder. */
   r->n = rem_n;
   ssh_mpk_memcopy(r->v, rem, rem_n);
-  ssh_xfree(rem);
+  ssh_mp_scratch_free(rem);
 
   /* Remainder has no sign (it is always positive). */
   SSH_MP_NO_SIGN(r);
@@ -1207,7 +1393,7 @@ void ssh_mp_mul_ui(SshInt *ret, const SshInt *op, SshWord u)
   if (op->v != ret->v)
     temp = ret->v;
   else
-    temp = ssh_xmalloc(sizeof(SshWord) * temp_n);
+    temp = ssh_mp_scratch_alloc(temp_n);
 
   ssh_mpk_memzero(temp, temp_n);
 
@@ -1218,7 +1404,7 @@ void ssh_mp_mul_ui(SshInt *ret, const SshInt *op, SshWord u)
   if (temp != ret->v)
     {
       ssh_mpk_memcopy(ret->v, temp, temp_n);
-      ssh_xfree(temp);
+      ssh_mp_scratch_free(temp);
     }
 
   ret->n = temp_n;
@@ -1265,10 +1451,10 @@ SshWord ssh_mp_div_ui(SshInt *q, const SshInt *op, SshWord u)
   if (q->v != op->v)
     temp = q->v;
   else
-    temp = ssh_xmalloc(sizeof(SshWord) * temp_n);
+    temp = ssh_mp_scratch_alloc(temp_n);
 
   /* Normalize. */
-  norm = ssh_xmalloc(sizeof(SshWord) * (op->n + 1));
+  norm = ssh_mp_scratch_alloc(op->n + 1);
   ssh_mpk_memcopy(norm, op->v, op->n);
   norm[op->n] = 0;
   
@@ -1276,7 +1462,7 @@ SshWord ssh_mp_div_ui(SshInt *q, const SshInt *op, SshWord u)
   
   rem = ssh_mpk_div_ui(temp, temp_n, norm, op->n + 1, t);
 
-  ssh_xfree(norm);
+  ssh_mp_scratch_free(norm);
   
   /* Correct remainder. */
   rem >>= r;
@@ -1285,7 +1471,7 @@ SshWord ssh_mp_div_ui(SshInt *q, const SshInt *op, SshWord u)
   if (temp != q->v)
     {
       ssh_mpk_memcopy(q->v, temp, temp_n);
-      ssh_xfree(temp);
+      ssh_mp_scratch_free(temp);
     }
 
   /* Set the size. */
@@ -1318,13 +1504,13 @@ SshWord ssh_mp_mod_ui(const SshInt *op, SshWord u)
   t <<= r;
 
   /* Allocate and normalize. */
-  norm = ssh_xmalloc(sizeof(SshWord) * (op->n + 1));
+  norm = ssh_mp_scratch_alloc(op->n + 1);
   ssh_mpk_memcopy(norm, op->v, op->n);
   norm[op->n] = 0;
   
   ssh_mpk_shift_up_bits(norm, op->n + 1, r);
   rem = ssh_mpk_mod_ui(norm, op->n + 1, t);
-  ssh_xfree(norm);
+  ssh_mp_scratch_free(norm);
   
   /* Correct remainder. */
   rem >>= r;
@@ -2293,7 +2479,7 @@ Boolean ssh_mpm_init_m(SshIntModuli *m, const SshInt *op)
   m->mp = (~ssh_mpmk_small_inv(op->v[0])) + 1;
 
   /* Set the modulus up, also in normalized form. */
-  m->m = ssh_xmalloc(sizeof(SshWord) * (op->n + op->n));
+  m->m = ssh_mp_scratch_alloc(op->n + op->n);
   m->d = m->m + op->n;
   m->m_n = op->n;
   ssh_mpk_memcopy(m->m, op->v, m->m_n);
@@ -2312,8 +2498,8 @@ Boolean ssh_mpm_init_m(SshIntModuli *m, const SshInt *op)
     m->karatsuba_work_space_n = temp_n;
   /* Note that it is still possible that no extra memory is needed! */
   if (m->karatsuba_work_space_n)
-    m->karatsuba_work_space = ssh_xmalloc(sizeof(SshWord) *
-                                          m->karatsuba_work_space_n);
+    m->karatsuba_work_space =
+      ssh_mp_scratch_alloc(m->karatsuba_work_space_n);
   else
     m->karatsuba_work_space = NULL;
   
@@ -2321,7 +2507,7 @@ Boolean ssh_mpm_init_m(SshIntModuli *m, const SshInt *op)
 
   /* The amount of memory for multiplication and squaring! */
   m->work_space_n = (m->m_n * 2 + 1) * 2;
-  m->work_space   = ssh_xmalloc(sizeof(SshWord) * m->work_space_n);
+  m->work_space   = ssh_mp_scratch_alloc(m->work_space_n);
 #else /* SSHMATH_USE_WORKSPACE */
   m->karatsuba_work_space   = NULL;
   m->karatsuba_work_space_n = 0;
@@ -2336,9 +2522,9 @@ Boolean ssh_mpm_init_m(SshIntModuli *m, const SshInt *op)
 void ssh_mpm_clear_m(SshIntModuli *m)
 {
   /* Free. */
-  ssh_xfree(m->m);
-  ssh_xfree(m->karatsuba_work_space);
-  ssh_xfree(m->work_space);
+  ssh_mp_scratch_free(m->m);
+  ssh_mp_scratch_free(m->karatsuba_work_space);
+  ssh_mp_scratch_free(m->work_space);
 
   /* Clean. */
   m->mp = 0;
@@ -2362,13 +2548,13 @@ void ssh_mp_set_m(SshInt *ret, const SshIntModuli *m)
 void ssh_mpm_init(SshIntModQ *op, const SshIntModuli *m)
 {
   op->n = 0;
-  op->v = ssh_xmalloc(sizeof(SshWord) * (m->m_n + 1));
+  op->v = ssh_mp_scratch_alloc(m->m_n + 1);
   op->m = m;
 }
 
 void ssh_mpm_clear(SshIntModQ *op)
 {
-  ssh_xfree(op->v);
+  ssh_mp_scratch_free(op->v);
   op->n = 0;
   op->m = NULL;
 }
@@ -2407,7 +2593,7 @@ void ssh_mpm_set_mp(SshIntModQ *ret, const SshInt *op)
   /* Compute R*op = ret (mod m) */
 
   /* Allocate some temporary space. */
-  t = ssh_xmalloc(sizeof(SshWord) * (op->n + 1 + ret->m->m_n));
+  t = ssh_mp_scratch_alloc(op->n + 1 + ret->m->m_n);
   
   /* Multiply by R the remainder. */
   ssh_mpk_memzero(t, ret->m->m_n);
@@ -2445,7 +2631,7 @@ void ssh_mpm_set_mp(SshIntModQ *ret, const SshInt *op)
   printf("\n");
 #endif
   
-  ssh_xfree(t);
+  ssh_mp_scratch_free(t);
 }
 
 void ssh_mp_set_mpm(SshInt *ret, const SshIntModQ *op)
@@ -2455,7 +2641,7 @@ void ssh_mp_set_mpm(SshInt *ret, const SshIntModQ *op)
   
   /* Allocate enough space for reduction to happen. */
   t_n = op->m->m_n * 2 + 1;
-  t = ssh_xmalloc(sizeof(SshWord) * t_n);
+  t = ssh_mp_scratch_alloc(t_n);
   ssh_mpk_memzero(t, t_n);
 
   /* Reduce. */
@@ -2475,7 +2661,7 @@ void ssh_mp_set_mpm(SshInt *ret, const SshIntModQ *op)
   ret->n = t_n;
 
   /* Free temporary storage. */
-  ssh_xfree(t);
+  ssh_mp_scratch_free(t);
   
   SSH_MP_NO_SIGN(ret);
 }
@@ -2545,6 +2731,40 @@ void ssh_mpm_sub(SshIntModQ *ret, const SshIntModQ *op1,
     }
 }
 
+/* Multiplication with small moduli, the operands are padded to the
+   size of the moduli in stack when necessary. */
+static void ssh_mpm_mul_small(SshIntModQ *ret, const SshIntModQ *op1,
+                              const SshIntModQ *op2)
+{
+  SshWord a[SSH_MPMK_MUL_SMALL_MAX], b[SSH_MPMK_MUL_SMALL_MAX];
+  SshWord r[SSH_MPMK_MUL_SMALL_MAX + 2];
+  const SshWord *av = op1->v, *bv = op2->v;
+  unsigned int m_n = ret->m->m_n, r_n;
+
+  if (op1->n < m_n)
+    {
+      ssh_mpk_memcopy(a, op1->v, op1->n);
+      ssh_mpk_memzero(a + op1->n, m_n - op1->n);
+      av = a;
+    }
+  if (op2 == op1)
+    bv = av;
+  else if (op2->n < m_n)
+    {
+      ssh_mpk_memcopy(b, op2->v, op2->n);
+      ssh_mpk_memzero(b + op2->n, m_n - op2->n);
+      bv = b;
+    }
+
+  ssh_mpmk_mul_small(r, av, bv, ret->m->mp, ret->m->m, m_n);
+
+  r_n = m_n;
+  while (r_n && r[r_n - 1] == 0)
+    r_n--;
+  ssh_mpk_memcopy(ret->v, r, r_n);
+  ret->n = r_n;
+}
+
 void ssh_mpm_mul(SshIntModQ *ret, const SshIntModQ *op1,
                  const SshIntModQ *op2)
 {
@@ -2556,12 +2776,18 @@ void ssh_mpm_mul(SshIntModQ *ret, const SshIntModQ *op1,
       ret->n = 0;
       return;
     }
+
+  if (ret->m->m_n <= SSH_MPMK_MUL_SMALL_MAX)
+    {
+      ssh_mpm_mul_small(ret, op1, op2);
+      return;
+    }
   
   /* Allocate some temporary space. */
   t_n = op1->n + op2->n + 1;
   r_n = ret->m->m_n*2 + 1;
   if (ret->m->work_space == NULL)
-    t = ssh_xmalloc(sizeof(SshWord) * (t_n + r_n));
+    t = ssh_mp_scratch_alloc(t_n + r_n);
   else
     t = ret->m->work_space;
   r = t + t_n;
@@ -2594,7 +2820,7 @@ void ssh_mpm_mul(SshIntModQ *ret, const SshIntModQ *op1,
 
   /* Free temporary storage. */
   if (ret->m->work_space == NULL)
-    ssh_xfree(t);
+    ssh_mp_scratch_free(t);
 }
 
 /* This should work, because op = x*R (mod N) and we can just
@@ -2622,7 +2848,7 @@ void ssh_mpm_mul_ui(SshIntModQ *ret, const SshIntModQ *op, SshWord u)
   /* Multiply first. */
   t_n = op->n + 2;
   if (ret->m->work_space == NULL)
-    t = ssh_xmalloc(sizeof(SshWord) * t_n);
+    t = ssh_mp_scratch_alloc(t_n);
   else
     t = ret->m->work_space;
   ssh_mpk_memzero(t, t_n);
@@ -2664,7 +2890,7 @@ void ssh_mpm_mul_ui(SshIntModQ *ret, const SshIntModQ *op, SshWord u)
 
   /* Free if necessary. */
   if (ret->m->work_space == NULL)
-    ssh_xfree(t);
+    ssh_mp_scratch_free(t);
 }
 
 void ssh_mpm_square(SshIntModQ *ret, const SshIntModQ *op)
@@ -2677,12 +2903,18 @@ void ssh_mpm_square(SshIntModQ *ret, const SshIntModQ *op)
       ret->n = 0;
       return;
     }
+
+  if (ret->m->m_n <= SSH_MPMK_MUL_SMALL_MAX)
+    {
+      ssh_mpm_mul_small(ret, op, op);
+      return;
+    }
   
   /* Allocate some temporary space. */
   t_n = op->n * 2 + 1;
   r_n = ret->m->m_n*2 + 1;
   if (ret->m->work_space == NULL)
-    t = ssh_xmalloc(sizeof(SshWord) * (t_n + r_n));
+    t = ssh_mp_scratch_alloc(t_n + r_n);
   else
     t = ret->m->work_space;
   r = t + t_n;
@@ -2715,7 +2947,7 @@ void ssh_mpm_square(SshIntModQ *ret, const SshIntModQ *op)
 
   /* Free temporary storage. */
   if (ret->m->work_space == NULL)
-    ssh_xfree(t);  
+    ssh_mp_scratch_free(t);  
 }
 
 void ssh_mpm_mul_2exp(SshIntModQ *ret, const SshIntModQ *op,
@@ -2781,7 +3013,7 @@ void ssh_mpm_mul_2exp(SshIntModQ *ret, const SshIntModQ *op,
 
   /* Allocate new space. */
   t_n = k + 2 + op->n;
-  t = ssh_xmalloc(sizeof(SshWord) * t_n);
+  t = ssh_mp_scratch_alloc(t_n);
   
   /* Move from op to ret. */
   ssh_mpk_memzero(t, t_n);
@@ -2804,7 +3036,7 @@ void ssh_mpm_mul_2exp(SshIntModQ *ret, const SshIntModQ *op,
   /* Now copy to the ret. */
   ssh_mpk_memcopy(ret->v, t, t_n);
   ret->n = t_n;
-  ssh_xfree(t);
+  ssh_mp_scratch_free(t);
 }
 
 void ssh_mpm_div_2exp(SshIntModQ *ret, const SshIntModQ *op,
@@ -3161,7 +3393,9 @@ void ssh_mp_powm_bsw_mont(SshInt *ret, const SshInt *g,
   ssh_mp_table_size = ((SshWord)1 << (ssh_mp_table_bits - 1));
 
   /* Allocate the table. */
-  table = ssh_xmalloc(sizeof(SshIntModQ) * ssh_mp_table_size);
+  table = (SshIntModQ *)
+    ssh_mp_scratch_alloc((sizeof(SshIntModQ) * ssh_mp_table_size +
+                          sizeof(SshWord) - 1) / sizeof(SshWord));
 
   /* Start computing the table. */
   ssh_mpm_init(&table[0], &mod);
@@ -3223,7 +3457,7 @@ void ssh_mp_powm_bsw_mont(SshInt *ret, const SshInt *g,
   /* Clear and free the table. */
   for (i = 0; i < ssh_mp_table_size; i++)
     ssh_mpm_clear(&table[i]);
-  ssh_xfree(table);
+  ssh_mp_scratch_free((SshWord *)table);
   
   ssh_mp_set_mpm(ret, &temp);
   ssh_mpm_clear(&temp);
@@ -3244,11 +3478,18 @@ void ssh_mp_powm_with_base_init(SshInt *g, SshInt *m,
   unsigned int bits, i;
   unsigned int tab[] =
   { 24, 88, 277, 798, 2173, 5678, 14373, 0 };
+  SshMpScratch *scratch;
+
+  /* The base outlives any scratch frame the caller might have active,
+     thus allocate it from the heap. */
+  scratch = ssh_mp_scratch_active;
+  ssh_mp_scratch_active = NULL;
   
   if (ssh_mpm_init_m(&base->mod, m) == FALSE)
     {
       /* Error, not defined. */
       base->defined = FALSE;
+      ssh_mp_scratch_active = scratch;
       return;
     }
 
@@ -3302,6 +3543,8 @@ void ssh_mp_powm_with_base_init(SshInt *g, SshInt *m,
 
   ssh_mpm_clear(&temp);
   ssh_mpm_clear(&x);
+
+  ssh_mp_scratch_active = scratch;
   
   /* Finished. */
 }
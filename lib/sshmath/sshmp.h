@@ -91,6 +91,32 @@ typedef struct SshIntModQRec
   const SshIntModuli *m;
 } SshIntModQ;
 
+/* Scratch arena for the temporaries of a computation. The arena is
+   kept with the object that does the computations (e.g. the key
+   parameters), and after the first few uses it has grown to size such
+   that no heap allocations are done by this library within a frame. */
+typedef struct SshMpScratchRec
+{
+  SshWord *v;
+  /* Size of the arena, words in use, and the high water mark of the
+     current outermost frame. */
+  unsigned int size, top, high;
+  /* Size wanted for the next outermost frame. */
+  unsigned int wanted;
+  /* Default size of the integers initialized within a frame. */
+  unsigned int int_n;
+  /* Number of active frames, and the list of arenas in use. */
+  unsigned int depth;
+  struct SshMpScratchRec *next;
+} SshMpScratch;
+
+/* A frame, kept in the stack of the caller. */
+typedef struct SshMpScratchFrameRec
+{
+  SshMpScratch *scratch, *prev;
+  unsigned int top;
+} SshMpScratchFrame;
+
 /* Some memory management. */
 
 SshInt *ssh_mp_malloc(void);
@@ -106,6 +132,37 @@ void ssh_mp_free(SshInt *op);
    */
 void ssh_mp_realloc(SshInt *op, unsigned int new_size);
 
+/* Scratch arenas. Initialize an empty arena, and free it. */
+void ssh_mp_scratch_init(SshMpScratch *scratch);
+void ssh_mp_scratch_clear(SshMpScratch *scratch);
+
+/* Begin a frame. Until the matching ssh_mp_scratch_end all temporary
+   memory of the library, and the integers initialized with ssh_mp_init,
+   are taken from the arena. When given, the modulus of the computation
+   determines the initial sizes. Frames may be nested, also in different
+   arenas.
+
+   Integers initialized within a frame must be cleared before the frame
+   ends, and SshIntModuli or SshIntModQ values cannot outlive the frame
+   they were initialized in (ssh_mp_powm_with_base_init is an exception,
+   it always uses the heap). Integers initialized outside the frame
+   still use the heap, thus results can be written to them. An integer
+   that grows stays in the arena it was initialized in, also within a
+   nested frame of another arena.
+
+   The arenas are not thread-safe. The active frame is kept for the
+   whole process, and while it lasts every call of this library takes
+   its temporaries from the arena, in whatever thread. Thus with
+   frames in use this library must only be called from one thread. */
+void ssh_mp_scratch_begin(SshMpScratch *scratch, SshMpScratchFrame *frame,
+                          const SshInt *modulus);
+void ssh_mp_scratch_end(SshMpScratchFrame *frame);
+
+/* Allocate and free temporary words, from the arena of the active frame
+   if there is one. Free accepts also memory from the heap. */
+SshWord *ssh_mp_scratch_alloc(unsigned int n);
+void ssh_mp_scratch_free(SshWord *v);
+
 /* The basic integer manipulation functions. */
 
 /* Following routine initializes a multiple precision integer. This function
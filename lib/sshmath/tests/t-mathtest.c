@@ -28,6 +28,7 @@
 
 #include "sshincludes.h"
 #include "sshmp.h"
+#include "sshmp-kernel.h"
 #include "timeit.h"
 #include "sieve.h"
 
@@ -87,6 +88,113 @@ void true_rand(SshInt *op, int bits)
     ssh_mp_neg(op, op);
 }
 
+/* Random word, with some bias towards the extreme values which are
+   the interesting ones for the carry handling. */
+SshWord random_word(void)
+{
+  SshWord w;
+  int i;
+
+  switch (random() % 8)
+    {
+    case 0:
+      return SSH_WORD_MASK;
+    case 1:
+      return ((SshWord)1 << (SSH_WORD_BITS - 1)) | (random() & 0x1);
+    default:
+      for (i = 0, w = 0; i < SSH_WORD_BITS; i += 16)
+        w = (w << 16) ^ (random() & 0xffff);
+      return w;
+    }
+}
+
+/* Reference multiplication of two words with half word products. */
+void word_mul(SshWord *h, SshWord *l, SshWord a, SshWord b)
+{
+  SshWord t0, t1, t2, t3, mid;
+
+  t0 = SSH_MPK_LOW_PART(a)  * SSH_MPK_LOW_PART(b);
+  t1 = SSH_MPK_LOW_PART(a)  * SSH_MPK_HIGH_PART(b);
+  t2 = SSH_MPK_HIGH_PART(a) * SSH_MPK_LOW_PART(b);
+  t3 = SSH_MPK_HIGH_PART(a) * SSH_MPK_HIGH_PART(b);
+
+  mid = SSH_MPK_HIGH_PART(t0) + SSH_MPK_LOW_PART(t1) + SSH_MPK_LOW_PART(t2);
+  *l = SSH_MPK_LOW_PART(t0) | (mid << SSH_WORD_HALF_BITS);
+  *h = t3 + SSH_MPK_HIGH_PART(t1) + SSH_MPK_HIGH_PART(t2) +
+    SSH_MPK_HIGH_PART(mid);
+}
+
+/* Check the word level macros of the kernel. These may be implemented
+   with inline assembler or double word types, depending on the
+   platform. */
+void test_kernel(void)
+{
+  SshWord a, b, h, l, rh, rl, q, r;
+  unsigned int c;
+  int j;
+
+  printf(" * kernel word arithmetic test\n");
+  for (j = 0; j < 100000; j++)
+    {
+      a = random_word();
+      b = random_word();
+
+      SSH_MPK_LONG_MUL(h, l, a, b);
+      word_mul(&rh, &rl, a, b);
+      if (h != rh || l != rl)
+        {
+          printf("error: long multiplication failed.\n");
+          printf("%08lx * %08lx = %08lx %08lx (expected %08lx %08lx)\n",
+                 a, b, h, l, rh, rl);
+          exit(1);
+        }
+
+      SSH_MPK_LONG_SQUARE(h, l, a);
+      word_mul(&rh, &rl, a, a);
+      if (h != rh || l != rl)
+        {
+          printf("error: long squaring failed.\n");
+          printf("%08lx^2 = %08lx %08lx (expected %08lx %08lx)\n",
+                 a, h, l, rh, rl);
+          exit(1);
+        }
+
+      /* Divide (a*b + r) by the normalized b, with r < b. */
+      b |= (SshWord)1 << (SSH_WORD_BITS - 1);
+      r = random_word() % b;
+      word_mul(&h, &l, a, b);
+      l += r;
+      if (l < r)
+        h++;
+      SSH_MPK_LONG_DIV(q, rl, h, l, b);
+      if (q != a || rl != r)
+        {
+          printf("error: long division failed.\n");
+          printf("%08lx %08lx / %08lx = %08lx, %08lx "
+                 "(expected %08lx, %08lx)\n",
+                 h, l, b, q, rl, a, r);
+          exit(1);
+        }
+
+      if (a == 0)
+        continue;
+      c = 0;
+      SSH_MPK_COUNT_LEADING_ZEROS(c, a);
+      if (c != ssh_mpk_count_leading_zeros(a))
+        {
+          printf("error: leading zero count of %08lx failed (%u).\n", a, c);
+          exit(1);
+        }
+      c = 0;
+      SSH_MPK_COUNT_TRAILING_ZEROS(c, a);
+      if (c != ssh_mpk_count_trailing_zeros(a))
+        {
+          printf("error: trailing zero count of %08lx failed (%u).\n", a, c);
+          exit(1);
+        }
+    }
+}
+
 void test_int(int flag, int bits)
 {
   SshInt a, b, c, d, e, f;
@@ -808,6 +916,106 @@ void test_mod(int flag, int bits)
 
 /* Speed tests of some sort. */
 
+/* Compute in and out of a scratch frame and compare. */
+void test_scratch(int bits)
+{
+  SshInt a, b, m, r1, r2, t;
+  SshMpScratch scratch, other;
+  SshMpScratchFrame frame, inner;
+  unsigned int size, grown;
+  int i;
+
+  printf(" * scratch arena test\n");
+
+  ssh_mp_init(&a);
+  ssh_mp_init(&b);
+  ssh_mp_init(&m);
+  ssh_mp_init(&r1);
+  ssh_mp_init(&r2);
+  ssh_mp_scratch_init(&scratch);
+  ssh_mp_scratch_init(&other);
+
+  ssh_mp_rand(&m, bits);
+  ssh_mp_set_bit(&m, bits - 1);
+  ssh_mp_set_bit(&m, 0);
+
+  for (size = 0, grown = 0, i = 0; i < 100; i++)
+    {
+      ssh_mp_rand(&a, bits);
+      ssh_mp_rand(&b, bits);
+
+      ssh_mp_powm(&r1, &a, &b, &m);
+      ssh_mp_mul(&r1, &r1, &a);
+      ssh_mp_mod(&r1, &r1, &m);
+      ssh_mp_mul(&r1, &r1, &b);
+      ssh_mp_mul(&r1, &r1, &b);
+      ssh_mp_mod(&r1, &r1, &m);
+      ssh_mp_invert(&r1, &r1, &m);
+
+      ssh_mp_scratch_begin(&scratch, &frame, &m);
+      ssh_mp_init(&t);
+      ssh_mp_powm(&t, &a, &b, &m);
+
+      /* Nested frames release their memory on end. */
+      ssh_mp_scratch_begin(&scratch, &inner, NULL);
+      ssh_mp_mul(&t, &t, &a);
+      ssh_mp_scratch_end(&inner);
+      ssh_mp_mod(&t, &t, &m);
+
+      /* An integer growing past its initial size in a frame of another
+         arena stays in its own, and survives when the other arena is
+         used again. */
+      ssh_mp_scratch_begin(&other, &inner, NULL);
+      ssh_mp_mul(&t, &t, &b);
+      ssh_mp_mul(&t, &t, &b);
+      ssh_mp_scratch_end(&inner);
+      ssh_mp_scratch_begin(&other, &inner, NULL);
+      ssh_mp_powm(&r2, &b, &a, &m);
+      ssh_mp_scratch_end(&inner);
+
+      ssh_mp_mod(&t, &t, &m);
+      ssh_mp_invert(&r2, &t, &m);
+      ssh_mp_clear(&t);
+      ssh_mp_scratch_end(&frame);
+
+      if (ssh_mp_cmp(&r1, &r2) != 0)
+        {
+          printf("error: scratch computation mismatch.\n");
+          print_int("r1 = ", &r1);
+          print_int("r2 = ", &r2);
+          exit(1);
+        }
+
+      if (scratch.top != 0 || scratch.depth != 0 ||
+          other.top != 0 || other.depth != 0)
+        {
+          printf("error: scratch arena not released (%u words).\n",
+                 scratch.top);
+          exit(1);
+        }
+
+      /* The arena should reach its final size in a few rounds. */
+      if (scratch.size != size)
+        {
+          size = scratch.size;
+          if (++grown > 3)
+            {
+              printf("error: scratch arena still growing (%u words).\n",
+                     size);
+              exit(1);
+            }
+        }
+    }
+
+  ssh_mp_scratch_clear(&scratch);
+  ssh_mp_scratch_clear(&other);
+  ssh_mp_clear(&a);
+  ssh_mp_clear(&b);
+  ssh_mp_clear(&m);
+  ssh_mp_clear(&r1);
+  ssh_mp_clear(&r2);
+}
+
 void timing_int(int bits)
 {
   SshInt a, b, c, d, e, f[100];
@@ -1222,6 +1430,9 @@ int main(int ac, char *av[])
   if (bits < 10)
     bits = 10;
 
+  if (integer)
+    test_kernel();
+
   for (i = 0; i < itr; i++, bits += bits_advance)
     {
       if (bits < 10)
@@ -1230,6 +1441,7 @@ int main(int ac, char *av[])
       if (integer)
         {
           test_int(all, bits);
+          test_scratch(bits);
           if (timing)
             timing_int(bits);
         }
@@ -0,0 +1,262 @@
+/*
+
+  t-mptune.c
+
+  Copyright (c) 1999 SSH Communications Security, Finland
+  All rights reserved.
+
+  Measures the Karatsuba multiplication and squaring crossovers on
+  the build host and writes them as a header file, which is included
+  by sshmp-kernel.h when the library is built with "make mp-tune".
+
+  For each operand size the school method is timed against one level
+  of Karatsuba (with the halves done by the school method). The
+  crossover is the smallest size from which on Karatsuba wins
+  consistently. The modular exponentiation times with the compiled in
+  and the measured crossovers are reported for comparison.
+
+  */
+
+#include "sshincludes.h"
+#include "sshmath-types.h"
+#include "sshmp.h"
+#include "sshmp-kernel.h"
+#include "timeit.h"
+
+/* Largest operand size to try, in words. */
+#define TUNE_MAX_WORDS   128
+
+/* Karatsuba has to win this many consecutive sizes to be accepted. */
+#define TUNE_WIN_STREAK  3
+
+/* Minimum time for one measurement, in seconds. */
+#define TUNE_MIN_SECS    0.02
+
+/* Each measurement is repeated and the fastest one taken, to filter
+   out the noise from other processes. */
+#define TUNE_REPEAT      3
+
+typedef enum
+{
+  TUNE_SCHOOL_MUL,
+  TUNE_KARATSUBA_MUL,
+  TUNE_SCHOOL_SQUARE,
+  TUNE_KARATSUBA_SQUARE
+} TuneOp;
+
+SshWord *tune_alloc(unsigned int n)
+{
+  SshWord *v;
+  unsigned int i, j;
+
+  v = ssh_xmalloc((n + 1) * sizeof(SshWord));
+  for (i = 0; i < n; i++)
+    for (j = 0, v[i] = 0; j < SSH_WORD_BITS; j += 16)
+      v[i] = (v[i] << 16) ^ (random() & 0xffff);
+  return v;
+}
+
+/* Time one operation on operands of n words, returns microseconds. */
+double tune_time(TuneOp op, unsigned int n)
+{
+  SshWord *a, *b, *r, *work;
+  unsigned int r_n, work_n, i, cnt, k;
+  double best = 0.0;
+  TimeIt tmit;
+
+  a = tune_alloc(n);
+  b = tune_alloc(n);
+  r_n = 2 * n + 2;
+  r = ssh_xmalloc(r_n * sizeof(SshWord));
+
+  if (op == TUNE_KARATSUBA_MUL)
+    work_n = ssh_mpk_mul_karatsuba_needed_memory(n, n);
+  else if (op == TUNE_KARATSUBA_SQUARE)
+    work_n = ssh_mpk_square_karatsuba_needed_memory(n);
+  else
+    work_n = 0;
+  work = work_n ? ssh_xmalloc(work_n * sizeof(SshWord)) : NULL;
+
+  for (k = 0, cnt = 16; k < TUNE_REPEAT; cnt *= 2)
+    {
+      start_timing(&tmit);
+      for (i = 0; i < cnt; i++)
+        {
+          ssh_mpk_memzero(r, r_n);
+          switch (op)
+            {
+            case TUNE_SCHOOL_MUL:
+              ssh_mpk_mul(r, a, n, b, n);
+              break;
+            case TUNE_KARATSUBA_MUL:
+              ssh_mpk_mul_karatsuba(r, r_n, a, n, b, n, work, work_n);
+              break;
+            case TUNE_SCHOOL_SQUARE:
+              ssh_mpk_square(r, a, n);
+              break;
+            case TUNE_KARATSUBA_SQUARE:
+              ssh_mpk_square_karatsuba(r, r_n, a, n, work, work_n);
+              break;
+            }
+        }
+      check_timing(&tmit);
+      if (tmit.process_secs < TUNE_MIN_SECS)
+        continue;
+
+      /* Long enough, keep the count and take the best of the runs. */
+      if (k++ == 0 || tmit.process_secs / cnt < best)
+        best = tmit.process_secs / cnt;
+      cnt /= 2;
+    }
+
+  ssh_xfree(a);
+  ssh_xfree(b);
+  ssh_xfree(r);
+  ssh_xfree(work);
+
+  return best * 1000000.0;
+}
+
+/* Find the crossover between the school method and Karatsuba. */
+unsigned int tune_crossover(TuneOp school, TuneOp karatsuba,
+                            const char *name)
+{
+  unsigned int n, streak, mul_words, square_words, crossover;
+  double ts, tk;
+
+  ssh_mpk_get_karatsuba_crossovers(&mul_words, &square_words);
+
+  printf("Tuning %s crossover...", name);
+  fflush(stdout);
+
+  crossover = TUNE_MAX_WORDS;
+  for (n = SSH_MPK_KARATSUBA_MIN_CROSSOVER, streak = 0;
+       n <= TUNE_MAX_WORDS; n++)
+    {
+      /* With the crossover at n exactly one level of Karatsuba is
+         done, the halves are below the crossover. */
+      if (karatsuba == TUNE_KARATSUBA_MUL)
+        ssh_mpk_set_karatsuba_crossovers(n, square_words);
+      else
+        ssh_mpk_set_karatsuba_crossovers(mul_words, n);
+
+      ts = tune_time(school, n);
+      tk = tune_time(karatsuba, n);
+
+      if (tk < ts)
+        {
+          if (++streak == TUNE_WIN_STREAK)
+            {
+              crossover = n - (TUNE_WIN_STREAK - 1);
+              break;
+            }
+        }
+      else
+        streak = 0;
+    }
+
+  ssh_mpk_set_karatsuba_crossovers(mul_words, square_words);
+  printf(" %u words\n", crossover);
+  return crossover;
+}
+
+/* Time modular exponentiation with full size exponent, in milliseconds. */
+double tune_powm(int bits)
+{
+  SshInt g, e, m, r;
+  TimeIt tmit;
+  unsigned int i, cnt, k;
+  double best = 0.0;
+
+  ssh_mp_init(&g);
+  ssh_mp_init(&e);
+  ssh_mp_init(&m);
+  ssh_mp_init(&r);
+
+  ssh_mp_rand(&m, bits);
+  ssh_mp_set_bit(&m, bits - 1);
+  ssh_mp_set_bit(&m, 0);
+  ssh_mp_rand(&e, bits);
+  ssh_mp_rand(&g, bits);
+  ssh_mp_mod(&g, &g, &m);
+
+  for (k = 0, cnt = 1; k < TUNE_REPEAT; cnt *= 2)
+    {
+      start_timing(&tmit);
+      for (i = 0; i < cnt; i++)
+        ssh_mp_powm(&r, &g, &e, &m);
+      check_timing(&tmit);
+      if (tmit.process_secs < 0.5)
+        continue;
+
+      if (k++ == 0 || tmit.process_secs / cnt < best)
+        best = tmit.process_secs / cnt;
+      cnt /= 2;
+    }
+
+  ssh_mp_clear(&g);
+  ssh_mp_clear(&e);
+  ssh_mp_clear(&m);
+  ssh_mp_clear(&r);
+
+  return best * 1000.0;
+}
+
+void usage(void)
+{
+  printf("usage: t-mptune [header-file]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  static const int sizes[] = { 1024, 2048, 4096, 0 };
+  double before[3];
+  unsigned int mul_default, square_default, mul, square;
+  const char *file = "sshmp-tune.h";
+  FILE *fp;
+  int i;
+
+  srandom(ssh_time());
+
+  if (argc == 2)
+    file = argv[1];
+  else if (argc != 1)
+    usage();
+
+  ssh_mpk_get_karatsuba_crossovers(&mul_default, &square_default);
+
+  for (i = 0; sizes[i]; i++)
+    before[i] = tune_powm(sizes[i]);
+
+  mul = tune_crossover(TUNE_SCHOOL_MUL, TUNE_KARATSUBA_MUL,
+                       "multiplication");
+  square = tune_crossover(TUNE_SCHOOL_SQUARE, TUNE_KARATSUBA_SQUARE,
+                          "squaring");
+
+  if ((fp = fopen(file, "w")) == NULL)
+    {
+      printf("error: cannot write %s.\n", file);
+      exit(1);
+    }
+  fprintf(fp,
+          "/* %s -- generated by t-mptune, do not edit.\n"
+          "   Run \"make mp-tune\" in lib/sshmath to regenerate. */\n"
+          "\n"
+          "#define SSH_MPK_KARATSUBA_MUL_CROSSOVER    %u\n"
+          "#define SSH_MPK_KARATSUBA_SQUARE_CROSSOVER %u\n",
+          file, mul, square);
+  fclose(fp);
+
+  ssh_mpk_set_karatsuba_crossovers(mul, square);
+
+  printf("\nCrossovers (words)    compiled in    tuned\n");
+  printf("  multiplication       %8u    %8u\n", mul_default, mul);
+  printf("  squaring             %8u    %8u\n", square_default, square);
+  printf("\nModexp (ms)           compiled in    tuned\n");
+  for (i = 0; sizes[i]; i++)
+    printf("  %4d bits            %11.2f    %8.2f\n",
+           sizes[i], before[i], tune_powm(sizes[i]));
+
+  return 0;
+}
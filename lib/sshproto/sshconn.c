@@ -19,12 +19,44 @@ SSH Connection Protocol.
 #include "sshmsgs.h"
 #include "sshencode.h"
 #include "sshconn.h"
+#include "sshtimeouts.h"
+#include "sshtimemeasure.h"
 
-/* Maximum number of simultaneously open channels. */
-#define MAX_OPEN_CHANNELS       1000
+/* Maximum number of simultaneously open channels.  The channel table
+   starts small and is doubled as needed up to this. */
+#define MAX_OPEN_CHANNELS       65536
+#define INITIAL_CHANNEL_TABLE   16
 #define MAX_EXTENDED_TYPES      10
 #define MAX_WINDOW_SIZE         (16*1024*1024)
 
+/* Largest window the auto-tuning will grow a channel to.  The other side
+   refuses a window adjust that takes it past MAX_WINDOW_SIZE. */
+#define MAX_TUNED_WINDOW_SIZE   (MAX_WINDOW_SIZE / 2)
+
+/* A channel that has received nothing for this many seconds gives back the
+   memory that the auto-tuning grew its window with. */
+#define WINDOW_IDLE_TIMEOUT     10
+
+/* Global request sent once authenticated, to find out whether the other
+   side copes with windows larger than it asked for.  Versions up to
+   ssh-2.0.13 may stop sending for good when a window grows, and they
+   refuse the request as unknown. */
+#define WINDOW_GROWTH_REQUEST   "window-growth@ssh.com"
+
+/* Number of priority classes, the bytes each class may send per round of
+   the deficit round robin, and the amount of bulk data that may be
+   buffered below us.  Interactive data may fill the rest of the buffer, so
+   it never waits for more than BULK_QUEUE_LIMIT bytes of bulk data. */
+#define SSH_CONN_PRIORITIES     2
+#define INTERACTIVE_QUANTUM     16384
+#define BULK_QUANTUM            4096
+#define BULK_QUEUE_LIMIT        8192
+
+/* Size of the chunks that received channel data is buffered in, and the
+   number of free chunks a connection keeps for reuse. */
+#define CHUNK_SIZE              8192
+#define MAX_FREE_CHUNKS         32
+
 #define SSH_DEBUG_MODULE "SshConnection"
 
 /* Define this if you wish to have the ssh_conn_channel_callback to be
@@ -32,6 +64,16 @@ SSH Connection Protocol.
    breaks things in others) */
 /* #define CALL_CHANNEL_CALLBACKS_IMMEDIATELY */
 
+/* A chunk of received channel data that could not yet be written to the
+   channel stream.  The data is at data[start...end-1]. */
+
+typedef struct SshConnChunkRec
+{
+  struct SshConnChunkRec *next;
+  size_t start, end;
+  unsigned char data[CHUNK_SIZE];
+} *SshConnChunk;
+
 typedef struct SshChannelRec
 {
   /* Back-link to the controlling SshConn protocol. */
@@ -71,15 +113,13 @@ typedef struct SshChannelRec
     /* EOF has been received from the channel. */
     Boolean eof_received;
     
-    /* SshBuffer for incoming data of this type.  This is allocated with
-       ssh_xmalloc; its size is incoming_window_size.  This is used in a
-       ring-buffer fashion. */
-    unsigned char *buf;
-
-    /* Offset of the first byte in the buffer. */
-    size_t start;
+    /* Incoming data of this type that the stream has not yet taken, as
+       a list of chunks.  Chunks are taken from the connection's pool only
+       when the stream cannot take data, and returned as soon as they have
+       been written. */
+    SshConnChunk first, last;
 
-    /* Total number of bytes in the buffer. */
+    /* Total number of bytes in the chunks. */
     size_t inbuf;
   } extended[MAX_EXTENDED_TYPES];
   
@@ -99,6 +139,10 @@ typedef struct SshChannelRec
   /* TRUE if SSH_MSG_CHANNEL_CLOSE has already been sent for this channel. */
   Boolean close_sent;
 
+  /* TRUE if SSH_MSG_CHANNEL_CLOSE has been received.  The channel is
+     only kept until the data buffered for its streams has been written. */
+  Boolean close_received;
+
   /* TRUE if SSH_MSG_CHANNEL_EOF has been sent for the channel. */
   Boolean eof_sent;
 
@@ -118,6 +162,37 @@ typedef struct SshChannelRec
      window adjust. */
   size_t incoming_window_size;
 
+  /* The window the channel was opened with.  The auto-tuning never goes
+     below this. */
+  size_t initial_window_size;
+
+  /* Bytes of buffer space beyond the initial window that this channel has
+     been charged for in conn->window_memory. */
+  size_t window_memory;
+
+  /* Total number of bytes received on the channel. */
+  SshUInt64 total_received;
+
+  /* Round trip measurement.  When a window adjust is sent, ``rtt_mark''
+     is the byte count at which the old window ended; data beyond it can
+     only arrive after the other side has seen the adjust.  Times are in
+     microseconds from conn->timer. */
+  Boolean rtt_pending;
+  SshUInt64 rtt_mark;
+  SshUInt64 rtt_sent;
+
+  /* Round trip time estimate, or zero if there is none yet. */
+  SshUInt64 rtt;
+
+  /* Start time and byte count of the current delivery rate measurement. */
+  SshUInt64 round_start;
+  SshUInt64 round_received;
+
+  /* TRUE if the idle timeout is registered, and the byte count when it
+     was. */
+  Boolean idle_timeout_set;
+  SshUInt64 idle_received;
+
   /* Maximum size of outgoing data packet, independent of window size.
      This can be used to send smaller packets for interactive connections
      than for bulk data transfer. */
@@ -145,6 +220,14 @@ typedef struct SshChannelRec
 
   /* Context argument to pass to the request callback. */
   void *request_context;
+
+  /* Priority class of the channel. */
+  SshConnPriority priority;
+
+  /* TRUE if the channel is in the ready queue of its priority class, and
+     its neighbours there. */
+  Boolean ready;
+  struct SshChannelRec *ready_next, *ready_prev;
 } *SshChannel;
 
 struct SshConnRec
@@ -159,16 +242,34 @@ struct SshConnRec
   
   /* Data for each channel.  This is indexed by the local channel number;
      each entry is either NULL (the channel does not exist) or a pointer
-     to a SshChannel structure. */
-  SshChannel channels[MAX_OPEN_CHANNELS];
-
-  /* The maximum channel number that has ever been used. */
-  unsigned int highest_channel;
+     to a SshChannel structure.  The table has ``num_channels'' slots. */
+  SshChannel *channels;
+  unsigned int num_channels;
+
+  /* Stack of the local channel numbers not in use.  The most recently
+     freed number is on top; numbers added by growing the table are
+     pushed highest first, so they are used lowest first. */
+  unsigned int *free_ids;
+  unsigned int num_free_ids;
+
+  /* Queues of channels that may have data to send, one for each priority
+     class: their streams have signalled input or their window has opened
+     since they last ran out.  The classes take turns by deficit round
+     robin; ``deficit'' is what the class may still send in its turn and
+     ``next_priority'' is the class whose turn it is.  Within a class data
+     is sent from each channel in turn, and a channel that still has data
+     when the main tunnel blocks or the turn ends goes to the end of the
+     queue.  This guarantees fairness when the tunnel cannot transmit data
+     as fast as it is available from the channels. */
+  struct {
+    SshChannel first, last;
+    long deficit;
+  } ready[SSH_CONN_PRIORITIES];
+  unsigned int next_priority;
 
-  /* Next channel number to send data from.  Data is sent from each channel
-     in turn, to guarantee fairness when the main tunnel cannot transmit
-     data as far as it is available from the channels. */
-  unsigned int next_channel;
+  /* TRUE if BULK_QUEUE_LIMIT bytes are buffered below us, and bulk
+     channels must wait for the can_send callback. */
+  Boolean bulk_blocked;
 
   /* The service name that we are going to accept.  We only accept this
      name. */
@@ -201,8 +302,57 @@ struct SshConnRec
 
   /* This is set to TRUE when SSH_CROSS_AUTHENTICATED has been received. */
   Boolean authenticated;
+
+  /* Running timer for the round trip and delivery rate measurements. */
+  SshTimeMeasure timer;
+
+  /* Buffer space the auto-tuning has added to the channel windows, and
+     the limit for it.  A zero limit keeps the windows at their initial
+     sizes. */
+  size_t window_memory;
+  size_t window_memory_limit;
+
+  /* TRUE while our WINDOW_GROWTH_REQUEST is waiting for its reply, and
+     TRUE once the other side has accepted it.  Windows are not grown
+     before that. */
+  Boolean window_growth_pending;
+  Boolean window_growth_ok;
+
+  /* Free chunks for buffering received channel data. */
+  SshConnChunk free_chunks;
+  unsigned int num_free_chunks;
 };
 
+/* Grows the channel table, and adds the new local ids to the free ids.
+   Returns FALSE if the table is already at its maximum size. */
+
+Boolean ssh_conn_grow_channels(SshConn conn)
+{
+  unsigned int size, id;
+
+  if (conn->num_channels >= MAX_OPEN_CHANNELS)
+    return FALSE;
+
+  size = conn->num_channels * 2;
+  if (size < INITIAL_CHANNEL_TABLE)
+    size = INITIAL_CHANNEL_TABLE;
+  if (size > MAX_OPEN_CHANNELS)
+    size = MAX_OPEN_CHANNELS;
+
+  conn->channels = ssh_xrealloc(conn->channels, size * sizeof(SshChannel));
+  conn->free_ids = ssh_xrealloc(conn->free_ids,
+                                size * sizeof(unsigned int));
+
+  /* Push the new ids highest first, so that the lowest gets used first. */
+  for (id = size; id > conn->num_channels; id--)
+    {
+      conn->channels[id - 1] = NULL;
+      conn->free_ids[conn->num_free_ids++] = id - 1;
+    }
+  conn->num_channels = size;
+  return TRUE;
+}
+
 /* Allocates a new channel data structure, and allocates a local id for it.
    Initializes the ``conn'' and ``local_id'' fields to the appropriate
    values.  This may return NULL if too many channels have already been
@@ -213,18 +363,10 @@ SshChannel ssh_conn_channel_allocate(SshConn conn)
   unsigned int local_id;
   SshChannel channel;
 
-  /* Find a free local id. */
-  for (local_id = 0; local_id < MAX_OPEN_CHANNELS; local_id++)
-    if (conn->channels[local_id] == NULL)
-      break;
-
-  /* If too many channels, return NULL. */
-  if (local_id >= MAX_OPEN_CHANNELS)
+  /* Take a free local id, growing the table if there are none. */
+  if (conn->num_free_ids == 0 && !ssh_conn_grow_channels(conn))
     return NULL;
-
-  /* Update the highest channel id if appropriate. */
-  if (local_id > conn->highest_channel)
-    conn->highest_channel = local_id;
+  local_id = conn->free_ids[--conn->num_free_ids];
   
   /* Allocate and initialize the channel data structure.  Store it in the
      appropriate slot in the channels array. */
@@ -238,6 +380,7 @@ SshChannel ssh_conn_channel_allocate(SshConn conn)
   channel->highest_type = 0;
   channel->destroy = NULL;
   channel->eof_callback = NULL;
+  channel->priority = SSH_CONN_PRIORITY_BULK;
 
   /* Store the new channel in the channels array. */
   conn->channels[local_id] = channel;
@@ -245,6 +388,319 @@ SshChannel ssh_conn_channel_allocate(SshConn conn)
   return channel;
 }
 
+/* Puts the channel at the end of the ready queue of its priority class,
+   unless it is already in the queue.  This should be called whenever the
+   channel may have become able to send: input is available from one of
+   its streams, or its window has opened.  A channel in the queue that
+   turns out to have nothing to send is simply dropped from it. */
+
+void ssh_conn_channel_ready(SshConn conn, SshChannel channel)
+{
+  unsigned int p = channel->priority;
+
+  if (channel->ready)
+    return;
+
+  channel->ready = TRUE;
+  channel->ready_next = NULL;
+  channel->ready_prev = conn->ready[p].last;
+  if (conn->ready[p].last)
+    conn->ready[p].last->ready_next = channel;
+  else
+    conn->ready[p].first = channel;
+  conn->ready[p].last = channel;
+}
+
+/* Removes the channel from the ready queue if it is there. */
+
+void ssh_conn_channel_unready(SshConn conn, SshChannel channel)
+{
+  unsigned int p = channel->priority;
+
+  if (!channel->ready)
+    return;
+
+  if (channel->ready_prev)
+    channel->ready_prev->ready_next = channel->ready_next;
+  else
+    conn->ready[p].first = channel->ready_next;
+  if (channel->ready_next)
+    channel->ready_next->ready_prev = channel->ready_prev;
+  else
+    conn->ready[p].last = channel->ready_prev;
+  channel->ready = FALSE;
+  channel->ready_next = channel->ready_prev = NULL;
+}
+
+/* Returns the current time in microseconds from the connection's timer. */
+
+SshUInt64 ssh_conn_time(SshConn conn)
+{
+  return ssh_time_measure_stamp(conn->timer,
+                                SSH_TIME_GRANULARITY_MICROSECOND);
+}
+
+/* Returns the number of streams the channel buffers received data for,
+   i.e. the number of copies of the window it may have to keep in
+   memory. */
+
+unsigned int ssh_conn_channel_buffers(SshChannel channel)
+{
+  unsigned int i, n;
+
+  for (i = 0, n = 0; i <= channel->highest_type; i++)
+    if (channel->extended[i].stream != NULL)
+      n++;
+  return n;
+}
+
+/* Takes a chunk from the pool of the connection, or allocates one. */
+
+SshConnChunk ssh_conn_chunk_get(SshConn conn)
+{
+  SshConnChunk chunk;
+
+  if (conn->free_chunks != NULL)
+    {
+      chunk = conn->free_chunks;
+      conn->free_chunks = chunk->next;
+      conn->num_free_chunks--;
+    }
+  else
+    chunk = ssh_xmalloc(sizeof(*chunk));
+
+  chunk->next = NULL;
+  chunk->start = chunk->end = 0;
+  return chunk;
+}
+
+/* Returns a chunk to the pool of the connection.  Beyond MAX_FREE_CHUNKS
+   chunks are freed. */
+
+void ssh_conn_chunk_release(SshConn conn, SshConnChunk chunk)
+{
+  if (conn->num_free_chunks >= MAX_FREE_CHUNKS)
+    {
+      ssh_xfree(chunk);
+      return;
+    }
+  chunk->next = conn->free_chunks;
+  conn->free_chunks = chunk;
+  conn->num_free_chunks++;
+}
+
+/* Appends received data to the chunks of the given extended type. */
+
+void ssh_conn_channel_buffer_data(SshConn conn, SshChannel channel,
+                                  int type, const unsigned char *data,
+                                  size_t len)
+{
+  SshConnChunk chunk;
+  size_t n;
+
+  while (len > 0)
+    {
+      chunk = channel->extended[type].last;
+      if (chunk == NULL || chunk->end == CHUNK_SIZE)
+        {
+          chunk = ssh_conn_chunk_get(conn);
+          if (channel->extended[type].last != NULL)
+            channel->extended[type].last->next = chunk;
+          else
+            channel->extended[type].first = chunk;
+          channel->extended[type].last = chunk;
+        }
+
+      n = CHUNK_SIZE - chunk->end;
+      if (n > len)
+        n = len;
+      memcpy(chunk->data + chunk->end, data, n);
+      chunk->end += n;
+      channel->extended[type].inbuf += n;
+      data += n;
+      len -= n;
+    }
+}
+
+/* Returns all chunks of the given extended type to the pool. */
+
+void ssh_conn_channel_free_data(SshConn conn, SshChannel channel, int type)
+{
+  SshConnChunk chunk;
+
+  while ((chunk = channel->extended[type].first) != NULL)
+    {
+      channel->extended[type].first = chunk->next;
+      ssh_conn_chunk_release(conn, chunk);
+    }
+  channel->extended[type].last = NULL;
+  channel->extended[type].inbuf = 0;
+}
+
+/* Recomputes how much window memory the channel uses beyond its initial
+   window, and updates the total of the connection. */
+
+void ssh_conn_channel_charge(SshConn conn, SshChannel channel)
+{
+  conn->window_memory -= channel->window_memory;
+  channel->window_memory =
+    (channel->incoming_window_size - channel->initial_window_size) *
+    ssh_conn_channel_buffers(channel);
+  conn->window_memory += channel->window_memory;
+}
+
+/* Makes ``ws'' the new window size of the channel.  The caller must make
+   sure that the data in the buffers and the data the other side may still
+   send fit in the new size. */
+
+void ssh_conn_channel_resize_window(SshConn conn, SshChannel channel,
+                                    size_t ws)
+{
+  int i;
+
+  for (i = 0; i <= channel->highest_type; i++)
+    assert(channel->extended[i].inbuf <= ws);
+
+  channel->incoming_window_size = ws;
+  ssh_conn_channel_charge(conn, channel);
+}
+
+/* Called when a channel whose window has been grown has received nothing
+   for WINDOW_IDLE_TIMEOUT seconds.  The window is shrunk back towards its
+   initial size.  What the other side has already been granted cannot be
+   taken back, so the window only shrinks down to that. */
+
+void ssh_conn_channel_idle_timeout(void *context)
+{
+  SshChannel channel = (SshChannel)context;
+  SshConn conn = channel->conn;
+  size_t ws, largest_inbuf, still_coming;
+  int i;
+
+  channel->idle_timeout_set = FALSE;
+
+  /* If data has arrived since the timeout was set, check again later. */
+  if (channel->total_received != channel->idle_received)
+    {
+      channel->idle_received = channel->total_received;
+      channel->idle_timeout_set = TRUE;
+      ssh_register_timeout((long)WINDOW_IDLE_TIMEOUT, 0L,
+                           ssh_conn_channel_idle_timeout, (void *)channel);
+      return;
+    }
+
+  largest_inbuf = 0;
+  for (i = 0; i <= channel->highest_type; i++)
+    if (channel->extended[i].inbuf > largest_inbuf)
+      largest_inbuf = channel->extended[i].inbuf;
+
+  ws = channel->incoming_window_size;
+  still_coming = ws - channel->incoming_window_received;
+  if (ws > still_coming + largest_inbuf &&
+      ws > channel->initial_window_size)
+    {
+      if (still_coming + largest_inbuf > channel->initial_window_size)
+        ws = still_coming + largest_inbuf;
+      else
+        ws = channel->initial_window_size;
+
+      SSH_DEBUG(4, ("channel %ld idle, window %ld -> %ld",
+                    channel->local_id,
+                    (long)channel->incoming_window_size, (long)ws));
+
+      /* The part we no longer grant comes off the amount we owe. */
+      channel->incoming_window_received -= channel->incoming_window_size - ws;
+      ssh_conn_channel_resize_window(conn, channel, ws);
+    }
+
+  /* Start measuring afresh when data comes in again. */
+  channel->rtt_pending = FALSE;
+  channel->round_start = ssh_conn_time(conn);
+  channel->round_received = channel->total_received;
+}
+
+/* Called when channel data has been received.  Once per round trip,
+   compares the delivery rate to the window.  If the other side delivered
+   more than half the window in one round trip it is limited by the window
+   rather than by the network, and the window is grown to twice the
+   measured bandwidth-delay product, at most doubling it at a time. */
+
+void ssh_conn_channel_tune_window(SshConn conn, SshChannel channel)
+{
+  SshUInt64 now, sample, elapsed, target;
+  size_t ws, room;
+  unsigned int buffers;
+
+  /* Set the idle timeout if the window is larger than initially. */
+  if (channel->incoming_window_size > channel->initial_window_size &&
+      !channel->idle_timeout_set)
+    {
+      channel->idle_received = channel->total_received;
+      channel->idle_timeout_set = TRUE;
+      ssh_register_timeout((long)WINDOW_IDLE_TIMEOUT, 0L,
+                           ssh_conn_channel_idle_timeout, (void *)channel);
+    }
+
+  if (!channel->rtt_pending || channel->total_received <= channel->rtt_mark)
+    return;
+
+  /* The other side has seen our last window adjust.  Update the round
+     trip time estimate.  Samples are inflated when the other side had no
+     data to send, so a lower sample is taken as is and a higher one only
+     slowly. */
+  now = ssh_conn_time(conn);
+  sample = now - channel->rtt_sent;
+  channel->rtt_pending = FALSE;
+  if (channel->rtt == 0 || sample < channel->rtt)
+    channel->rtt = sample;
+  else
+    channel->rtt += (sample - channel->rtt) / 8;
+
+  /* The delivery rate since the last sample. */
+  elapsed = now - channel->round_start;
+  target = channel->total_received - channel->round_received;
+  channel->round_start = now;
+  channel->round_received = channel->total_received;
+  if (elapsed == 0 || conn->window_memory_limit == 0 ||
+      !conn->window_growth_ok)
+    return;
+
+  /* Twice the bandwidth-delay product, as the window is adjusted only
+     after half of it has been used. */
+  target = 2 * target * channel->rtt / elapsed;
+
+  ws = channel->incoming_window_size;
+  if (target <= ws || ws >= MAX_TUNED_WINDOW_SIZE)
+    return;
+  if (target > 2 * ws)
+    target = 2 * ws;
+  if (target > MAX_TUNED_WINDOW_SIZE)
+    target = MAX_TUNED_WINDOW_SIZE;
+
+  /* Stay within the memory limit of the connection. */
+  buffers = ssh_conn_channel_buffers(channel);
+  if (buffers == 0)
+    return;
+  room = 0;
+  if (conn->window_memory_limit > conn->window_memory)
+    room = (conn->window_memory_limit - conn->window_memory) / buffers;
+  if (target > ws + room)
+    target = ws + room;
+
+  /* Not worth growing for less. */
+  if (target < ws + ws / 4)
+    return;
+
+  SSH_DEBUG(4, ("channel %ld rtt %ld us, window %ld -> %ld",
+                channel->local_id, (long)channel->rtt,
+                (long)ws, (long)target));
+
+  /* The added space is granted to the other side with the next window
+     adjust. */
+  ssh_conn_channel_resize_window(conn, channel, (size_t)target);
+  channel->incoming_window_received += (size_t)target - ws;
+}
+
 /* Closes and destroys the given channel, and immediately frees any
    data structures associated with it. */
 
@@ -259,6 +715,17 @@ void ssh_conn_channel_free(SshConn conn, SshChannel channel)
      connection protocol, we don't enter a recursive call to the same
      destroy function. */
   conn->channels[channel->local_id] = NULL;
+  conn->free_ids[conn->num_free_ids++] = channel->local_id;
+  ssh_conn_channel_unready(conn, channel);
+
+  /* Give back the window memory, cancel the idle timeout, and free the
+     buffered data.  This must be done before the destroy callback, as
+     it may destroy the connection. */
+  conn->window_memory -= channel->window_memory;
+  if (channel->idle_timeout_set)
+    ssh_cancel_timeouts(ssh_conn_channel_idle_timeout, (void *)channel);
+  for (i = 0; i <= channel->highest_type; i++)
+    ssh_conn_channel_free_data(conn, channel, i);
   
   /* Call the channel's destroy callback if set. */
   if (channel->destroy)
@@ -277,10 +744,6 @@ void ssh_conn_channel_free(SshConn conn, SshChannel channel)
           channel->extended[i].stream != NULL &&
           channel->extended[i].stream != SSH_CONN_POSTPONE_STREAM)
         ssh_stream_destroy(channel->extended[i].stream);
-
-      /* Free the buffer. */
-      if (channel->extended[i].buf != NULL)
-        ssh_xfree(channel->extended[i].buf);
     }
 
   /* Fill with known value to ease debugging. */
@@ -290,10 +753,13 @@ void ssh_conn_channel_free(SshConn conn, SshChannel channel)
 
 /* Sends data from the channel down the connection.  This only processes
    data from a single channel, and a single extended type within the channel.
-   This sends as much data of the given type as is available. */
+   This sends as much data of the given type as is available, or until
+   ``*budget'' bytes have been sent; the bytes sent are subtracted from
+   ``*budget''.  This returns TRUE if it stopped because no more may be
+   sent now, and FALSE if the stream has no more data or window. */
 
 Boolean ssh_conn_send_channel_data_type(SshConn conn, SshChannel channel,
-                                        int i)
+                                        int i, long *budget)
 {
   int len;
   unsigned char buf[4096];
@@ -316,6 +782,18 @@ Boolean ssh_conn_send_channel_data_type(SshConn conn, SshChannel channel,
           return TRUE;
         }
 
+      /* Bulk data may only fill a part of the buffer. */
+      if (channel->priority == SSH_CONN_PRIORITY_BULK &&
+          !ssh_cross_down_can_send_below(conn->down, BULK_QUEUE_LIMIT))
+        {
+          conn->bulk_blocked = TRUE;
+          return TRUE;
+        }
+
+      /* Stop if the turn of the channel is over. */
+      if (*budget <= 0)
+        return TRUE;
+
       /* We cannot send any data if there is no window space. */
       if (channel->outgoing_window_remaining == 0)
         return FALSE;
@@ -405,18 +883,26 @@ Boolean ssh_conn_send_channel_data_type(SshConn conn, SshChannel channel,
                                      SSH_FORMAT_END);
         }
 
+      /* Interactive data should not wait for the rest of the pass of the
+         event loop. */
+      if (channel->priority == SSH_CONN_PRIORITY_INTERACTIVE)
+        ssh_cross_down_send(conn->down, SSH_CROSS_FLUSH, NULL, 0);
+
       /* Adjust the window size. */
       channel->outgoing_window_remaining -= len;
+      *budget -= len;
     }
 }
 
 /* Sends data from the given channel to the downward connection.
    This only sends until either there is no more space available in the
-   channel's outgoing window, or no more packets can be sent.
-   This returns TRUE if this returns because no more packets can be sent;
-   otherwise this returns FALSE. */
+   channel's outgoing window, or no more packets can be sent, or ``*budget''
+   bytes have been sent.
+   This returns TRUE if this returns because no more packets can be sent
+   or the budget ran out; otherwise this returns FALSE. */
 
-Boolean ssh_conn_send_channel_data(SshConn conn, SshChannel channel)
+Boolean ssh_conn_send_channel_data(SshConn conn, SshChannel channel,
+                                   long *budget)
 {
   int i;
 
@@ -428,13 +914,13 @@ Boolean ssh_conn_send_channel_data(SshConn conn, SshChannel channel)
      the central channel blocks and data is always available from a stream,
      fairness is always guaranteed.  */
   for (i = channel->next_type; i <= channel->highest_type; i++)
-    if (ssh_conn_send_channel_data_type(conn, channel, i))
+    if (ssh_conn_send_channel_data_type(conn, channel, i, budget))
       {
         channel->next_type = i + 1;
         return TRUE;
       }
   for (i = 0; i < channel->next_type; i++)
-    if (ssh_conn_send_channel_data_type(conn, channel, i))
+    if (ssh_conn_send_channel_data_type(conn, channel, i, budget))
       {
         channel->next_type = i + 1;
         return TRUE;
@@ -450,53 +936,88 @@ Boolean ssh_conn_send_channel_data(SshConn conn, SshChannel channel)
 
 void ssh_conn_send_some_data(SshConn conn)
 {
-  unsigned int i;
+  SshChannel channel;
+  unsigned int p, idle;
   
   /* If write has failed, we'll eventually get a callback saying we can
      send again, and will retry then. */
   if (conn->send_blocked)
     return;
 
-  /* We iterate over the channels in such a way that even if write to
-     the central channel blocks, fairness is always gauaranteed.
-     (We'll continue with the next channel the next time we are called.)
-     conn->next_channel is the next channel we should try reading data
-     from. */
-  for (i = conn->next_channel; i <= conn->highest_channel; i++)
-    if (conn->channels[i] &&
-        ssh_conn_send_channel_data(conn, conn->channels[i]))
-      {
-        /* Cannot send more data now.  Record that we'll continue with
-           the next channel. */
-        conn->next_channel = i + 1;
-        return;
-      }
-  for (i = 0; i < conn->next_channel; i++)
-    if (conn->channels[i] &&
-        ssh_conn_send_channel_data(conn, conn->channels[i]))
-      {
-        conn->next_channel = i + 1;
-        return;
-      }
+  /* The priority classes take turns.  In its turn a class gets its quantum
+     added to its deficit, and sends from its channels until the deficit
+     is used up.  We stop when no class has anything it can send. */
+  for (idle = 0; idle < SSH_CONN_PRIORITIES; )
+    {
+      p = conn->next_priority;
+      if (conn->ready[p].first == NULL ||
+          (p == SSH_CONN_PRIORITY_BULK && conn->bulk_blocked))
+        {
+          /* An empty class does not save up its turns. */
+          if (conn->ready[p].first == NULL)
+            conn->ready[p].deficit = 0;
+          conn->next_priority = (p + 1) % SSH_CONN_PRIORITIES;
+          idle++;
+          continue;
+        }
+      idle = 0;
+
+      if (conn->ready[p].deficit <= 0)
+        conn->ready[p].deficit += (p == SSH_CONN_PRIORITY_INTERACTIVE ?
+                                   INTERACTIVE_QUANTUM : BULK_QUANTUM);
+
+      /* We take the channels from the ready queue in such a way that even
+         if write to the central channel blocks, fairness is always
+         guaranteed.  A channel that had nothing more to send leaves the
+         queue until it becomes ready again. */
+      while (conn->ready[p].deficit > 0 &&
+             (channel = conn->ready[p].first) != NULL)
+        {
+          ssh_conn_channel_unready(conn, channel);
+          if (ssh_conn_send_channel_data(conn, channel,
+                                         &conn->ready[p].deficit))
+            {
+              /* The channel may still have data, and continues after the
+                 others the next time. */
+              ssh_conn_channel_ready(conn, channel);
+            }
 
-  /* Writing didn't block.  Start from the first channel the next time. */
-  conn->next_channel = 0;
+          /* If cannot send more data now, the class keeps its turn. */
+          if (conn->send_blocked)
+            return;
+          if (p == SSH_CONN_PRIORITY_BULK && conn->bulk_blocked)
+            break;
+        }
+
+      conn->next_priority = (p + 1) % SSH_CONN_PRIORITIES;
+    }
 }
 
 /* Checks whether we should send a window adjust message.  This should be
    called whenever more data is received or data has been consumed from the
-   incoming buffer. */
+   incoming buffer.  ``unwritten'' bytes of just received data of extended
+   type ``type'' that are not in the buffers yet are counted as if they
+   were. */
 
-void ssh_conn_channel_check_adjust(SshConn conn, SshChannel channel)
+void ssh_conn_channel_check_adjust(SshConn conn, SshChannel channel,
+                                   int type, size_t unwritten)
 {
   int i;
-  size_t largest_inbuf, ws, still_coming;
+  size_t largest_inbuf, inbuf, ws, still_coming, threshold;
   long adjust;
 
   ws = channel->incoming_window_size;
   
-  /* We only adjust after we have received at least half the window. */
-  if (channel->incoming_window_received < ws / 2 ||
+  /* We only adjust after we have received at least half the window.  A
+     window grown by the auto-tuning is still adjusted after half of the
+     initial window, so that the other side keeps hearing from us as
+     often as before; a sender that uses Nagle's algorithm would
+     otherwise wait for a delayed ack whenever one adjust covered two of
+     its packets. */
+  threshold = ws / 2;
+  if (threshold > channel->initial_window_size / 2)
+    threshold = channel->initial_window_size / 2;
+  if (channel->incoming_window_received < threshold ||
       channel->eof_received || channel->close_sent)
     return;
 
@@ -504,8 +1025,13 @@ void ssh_conn_channel_check_adjust(SshConn conn, SshChannel channel)
      available. */
   largest_inbuf = 0;
   for (i = 0; i <= channel->highest_type; i++)
-    if (channel->extended[i].inbuf > largest_inbuf)
-      largest_inbuf = channel->extended[i].inbuf;
+    {
+      inbuf = channel->extended[i].inbuf;
+      if (i == type)
+        inbuf += unwritten;
+      if (inbuf > largest_inbuf)
+        largest_inbuf = inbuf;
+    }
 
   /* Return if cannot adjust by at least half the window size. */
   if (largest_inbuf > ws / 2)
@@ -516,6 +1042,14 @@ void ssh_conn_channel_check_adjust(SshConn conn, SshChannel channel)
   assert(ws >= largest_inbuf + still_coming);
   adjust = ws - largest_inbuf - still_coming;
 
+  /* Time the round trip of this adjust, unless one is already out. */
+  if (!channel->rtt_pending)
+    {
+      channel->rtt_pending = TRUE;
+      channel->rtt_mark = channel->total_received + still_coming;
+      channel->rtt_sent = ssh_conn_time(conn);
+    }
+
   /* Send an adjust message to the other side. */
   ssh_cross_down_send_encode(conn->down, SSH_CROSS_PACKET,
                              SSH_FORMAT_CHAR,
@@ -532,16 +1066,16 @@ void ssh_conn_channel_check_adjust(SshConn conn, SshChannel channel)
 void ssh_conn_channel_write(SshConn conn, SshChannel channel)
 {
   Boolean did_something;
+  SshConnChunk chunk;
   int len, i;
-  size_t ws;
 
-  /* If we have sent close to the channel, don't write to it */
+  /* If we have sent close to the channel, don't write to it, unless
+     it is only waiting for the buffered data to be written. */
   
-  if (channel->close_sent)
+  if (channel->close_sent && !channel->close_received)
     return;
   
   did_something = FALSE;
-  ws = channel->incoming_window_size;
 
   /* Try writing data to all streams from their respective buffers. */
   for (i = 0; i <= channel->highest_type; i++)
@@ -559,15 +1093,11 @@ void ssh_conn_channel_write(SshConn conn, SshChannel channel)
               break;
             }
 
-          /* Truncate length to end of ring buffer. */
-          if (len > ws - channel->extended[i].start)
-            len = ws - channel->extended[i].start;
-
-          /* Try to write data to the stream. */
+          /* Try to write the data of the first chunk to the stream. */
+          chunk = channel->extended[i].first;
           len = ssh_stream_write(channel->extended[i].stream,
-                                 channel->extended[i].buf +
-                                 channel->extended[i].start,
-                                 len);
+                                 chunk->data + chunk->start,
+                                 chunk->end - chunk->start);
           /* If error (or EOF on write), continue with the next stream. */
           if (len < 0)
             break;
@@ -577,6 +1107,13 @@ void ssh_conn_channel_write(SshConn conn, SshChannel channel)
               SSH_DEBUG(2, ("EOF received on write from channel 0x%lx, extended "\
                             "stream %d.", channel, i));
 
+              /* Nobody will take the rest after a close. */
+              if (channel->close_received)
+                {
+                  ssh_conn_channel_free_data(conn, channel, i);
+                  break;
+                }
+
               /* EOF received from one of the streams. */
               if (i != 0 || channel->close_sent)
                 break; /* We only process EOF from the main stream. */
@@ -602,19 +1139,34 @@ void ssh_conn_channel_write(SshConn conn, SshChannel channel)
           /* Mark that we actually did something. */
           did_something = TRUE;
 
-          /* Update the ring buffer to consume the already written data. */
-          channel->extended[i].start += len;
-          assert(channel->extended[i].start <= ws);
-          if (channel->extended[i].start == ws)
-            channel->extended[i].start = 0;
+          /* Consume the written data, and give back the chunk once it
+             has all been written. */
+          chunk->start += len;
           channel->extended[i].inbuf -= len;
+          if (chunk->start == chunk->end)
+            {
+              channel->extended[i].first = chunk->next;
+              if (chunk->next == NULL)
+                channel->extended[i].last = NULL;
+              ssh_conn_chunk_release(conn, chunk);
+            }
           /* We loop again to process any remaining data in the buffer. */
         }
     }
 
+  /* After a close, the channel goes once everything has been written. */
+  if (channel->close_received)
+    {
+      for (i = 0; i <= channel->highest_type; i++)
+        if (channel->extended[i].inbuf > 0)
+          return;
+      ssh_conn_channel_free(conn, channel);
+      return;
+    }
+
   /* If we did something, check whether we should adjust the window. */
   if (did_something)
-    ssh_conn_channel_check_adjust(conn, channel);
+    ssh_conn_channel_check_adjust(conn, channel, 0, 0);
 }
       
 
@@ -631,6 +1183,7 @@ void ssh_conn_channel_callback(SshStreamNotification op, void *context)
     case SSH_STREAM_INPUT_AVAILABLE:
       for (i = 0; i <= channel->highest_type; i++)
         channel->extended[i].read_has_failed = FALSE;
+      ssh_conn_channel_ready(channel->conn, channel);
       ssh_conn_send_some_data(channel->conn);
       break;
 
@@ -677,6 +1230,18 @@ void ssh_conn_process_global_request(SshConn conn,
       return;
     }
 
+  /* We cope with grown windows. */
+  if (strcmp(request_type, WINDOW_GROWTH_REQUEST) == 0)
+    {
+      if (want_reply)
+        ssh_cross_down_send_encode(conn->down, SSH_CROSS_PACKET,
+                                   SSH_FORMAT_CHAR,
+                                     (unsigned int) SSH_MSG_REQUEST_SUCCESS,
+                                   SSH_FORMAT_END);
+      ssh_xfree(request_type);
+      return;
+    }
+
   /* If no supported requests, fail. */
   if (conn->request_types == NULL)
     goto fail;
@@ -729,6 +1294,17 @@ void ssh_conn_process_global_reply(SshConn conn, unsigned int packet_type,
       return;
     }
 
+  /* Our WINDOW_GROWTH_REQUEST was sent before any other, so the first
+     reply is to it. */
+  if (conn->window_growth_pending)
+    {
+      conn->window_growth_pending = FALSE;
+      conn->window_growth_ok = (packet_type == SSH_MSG_REQUEST_SUCCESS);
+      SSH_DEBUG(4, ("other side %s grown windows",
+                    conn->window_growth_ok ? "copes with" : "refuses"));
+      return;
+    }
+
   /* If we are waiting for a global reply, call and clear the callback.
      Otherwise, this is a protocol error. */
   cb = conn->global_request_send_callback;
@@ -801,9 +1377,11 @@ void ssh_conn_channel_open_completion(int result,
   channel->extended[0].write_only = FALSE;
   channel->extended[0].auto_close = auto_close;
   channel->extended[0].read_has_failed = FALSE;
-  channel->extended[0].buf = ssh_xmalloc(window_size);
+  ssh_conn_channel_ready(conn, channel);
   channel->close_on_eof = close_on_eof;
   channel->incoming_window_size = window_size;
+  channel->initial_window_size = window_size;
+  channel->round_start = ssh_conn_time(conn);
   channel->request = request;
   channel->destroy = destroy;
   channel->callback_context = callback_context;
@@ -893,8 +1471,7 @@ void ssh_conn_process_channel_open(SshConn conn,
         channel->ephemeral = TRUE;
         channel->remote_id = remote_channel;
         channel->extended[0].stream = NULL;
-        channel->extended[0].buf = NULL;
-        channel->extended[0].start = 0;
+        channel->extended[0].first = channel->extended[0].last = NULL;
         channel->extended[0].inbuf = 0;
         channel->next_type = 0;
         channel->highest_type = 0;
@@ -958,7 +1535,7 @@ void ssh_conn_process_channel_open_confirmation(SshConn conn,
     }
 
   /* Check validity of the received channel number. */
-  if (local_id < 0 || local_id > conn->highest_channel ||
+  if (local_id < 0 || local_id >= conn->num_channels ||
       conn->channels[local_id] == NULL ||
       !conn->channels[local_id]->ephemeral)
     {
@@ -975,8 +1552,9 @@ void ssh_conn_process_channel_open_confirmation(SshConn conn,
   channel->remote_id = remote_id;
   channel->outgoing_window_remaining = initial_window_size;
   channel->max_outgoing_packet_size = max_packet_size;
-  channel->extended[0].buf = ssh_xmalloc(channel->incoming_window_size);
   channel->extended[0].read_has_failed = FALSE;
+  channel->round_start = ssh_conn_time(conn);
+  ssh_conn_channel_ready(conn, channel);
 
   /* Set callbacks for the channel data stream. */
   ssh_stream_set_callback(channel->extended[0].stream,
@@ -1023,7 +1601,7 @@ void ssh_conn_process_channel_open_failure(SshConn conn,
     }
 
   /* Check validity of the received channel number. */
-  if (local_id < 0 || local_id > conn->highest_channel ||
+  if (local_id < 0 || local_id >= conn->num_channels ||
       conn->channels[local_id] == NULL ||
       !conn->channels[local_id]->ephemeral)
     {
@@ -1069,7 +1647,7 @@ void ssh_conn_process_channel_window_adjust(SshConn conn,
     }
 
   /* Check validity of the received channel number. */
-  if (local_id < 0 || local_id > conn->highest_channel ||
+  if (local_id < 0 || local_id >= conn->num_channels ||
       conn->channels[local_id] == NULL ||
       conn->channels[local_id]->ephemeral)
     {
@@ -1095,6 +1673,7 @@ void ssh_conn_process_channel_window_adjust(SshConn conn,
   channel->outgoing_window_remaining += bytes_to_add;
 
   /* Try to send some more data.  This will wake up sending. */
+  ssh_conn_channel_ready(conn, channel);
   ssh_conn_send_some_data(conn);
 }
 
@@ -1107,10 +1686,11 @@ void ssh_conn_process_channel_data_common(SshConn conn,
                                           size_t len)
 {
   SshChannel channel;
-  size_t offset, ws;
+  size_t ws;
+  int n;
   
   /* Check validity of the received channel number. */
-  if (local_id < 0 || local_id > conn->highest_channel ||
+  if (local_id < 0 || local_id >= conn->num_channels ||
       conn->channels[local_id] == NULL ||
       conn->channels[local_id]->ephemeral ||
       conn->channels[local_id]->eof_received)
@@ -1152,25 +1732,29 @@ void ssh_conn_process_channel_data_common(SshConn conn,
   if (len + channel->extended[type].inbuf > ws)
     ssh_fatal("ssh_conn_process_channel_data_common: buffer overflow");
 
-  /* Copy the received data in the buffer.  Note that the buffer is used
-     in a ring-buffer fashion, and the data may need to be split in two. */
-  offset = channel->extended[type].start + channel->extended[type].inbuf;
-  if (offset > ws)
-    offset -= ws;
-  if (len < ws - offset)
-    memcpy(channel->extended[type].buf + offset, data, len);
-  else
+  /* Update the count of bytes received with this window. */
+  channel->incoming_window_received += len;
+  channel->total_received += len;
+
+  /* Check if the window should grow, and if we should send a window
+     adjust.  This is done before the data is written, so the adjust does
+     not include the packet just received.  Once half the initial window
+     is in use the other side then hears from us after each packet. */
+  ssh_conn_channel_tune_window(conn, channel);
+  ssh_conn_channel_check_adjust(conn, channel, type, len);
+
+  /* If nothing is buffered, give the data straight to the stream.  Only
+     what it does not take is buffered. */
+  if (channel->extended[type].inbuf == 0 && !channel->close_sent)
     {
-      memcpy(channel->extended[type].buf + offset, data, ws - offset);
-      memcpy(channel->extended[type].buf, data + ws - offset,
-             len - (ws - offset));
+      n = ssh_stream_write(channel->extended[type].stream, data, len);
+      if (n > 0)
+        {
+          data += n;
+          len -= n;
+        }
     }
-  channel->extended[type].inbuf += len;
-
-  /* Update the count of bytes received with this window.  Check if
-     we should send a window adjust. */
-  channel->incoming_window_received += len;
-  ssh_conn_channel_check_adjust(conn, channel);
+  ssh_conn_channel_buffer_data(conn, channel, type, data, len);
 
   /* Try to write data from the channel to the streams. */
   ssh_conn_channel_write(conn, channel);
@@ -1253,7 +1837,7 @@ void ssh_conn_process_channel_eof(SshConn conn,
     }
 
   /* Check validity of the received channel number. */
-  if (local_id < 0 || local_id > conn->highest_channel ||
+  if (local_id < 0 || local_id >= conn->num_channels ||
       conn->channels[local_id] == NULL ||
       conn->channels[local_id]->ephemeral)
     {
@@ -1317,7 +1901,7 @@ void ssh_conn_process_channel_close(SshConn conn,
     }
 
   /* Check validity of the received channel number. */
-  if (local_id < 0 || local_id > conn->highest_channel ||
+  if (local_id < 0 || local_id >= conn->num_channels ||
       conn->channels[local_id] == NULL ||
       conn->channels[local_id]->ephemeral)
     {
@@ -1329,18 +1913,27 @@ void ssh_conn_process_channel_close(SshConn conn,
 
   channel = conn->channels[local_id];
 
-  /* Send back a channel close message unless we have already sent one. */
-  if (!channel->close_sent)
-    ssh_cross_down_send_encode(conn->down, SSH_CROSS_PACKET,
-                               SSH_FORMAT_CHAR,
-                               (unsigned int) SSH_MSG_CHANNEL_CLOSE,
-                               SSH_FORMAT_UINT32,
-                               (SshUInt32) channel->remote_id,
-                               SSH_FORMAT_END);
+  /* If this is the reply to our close, free the channel now. */
+  if (channel->close_sent)
+    {
+      ssh_conn_channel_free(conn, channel);
+      return;
+    }
+
+  /* Send back a channel close message. */
+  ssh_cross_down_send_encode(conn->down, SSH_CROSS_PACKET,
+                             SSH_FORMAT_CHAR,
+                             (unsigned int) SSH_MSG_CHANNEL_CLOSE,
+                             SSH_FORMAT_UINT32,
+                             (SshUInt32) channel->remote_id,
+                             SSH_FORMAT_END);
+  channel->close_sent = TRUE;
       
-  /* Free the channel now. */
-  ssh_conn_channel_free(conn, channel);
-  
+  /* Free the channel once the data the other side sent before closing
+     has been written to our streams.  A slow stream may still be
+     holding some of it back. */
+  channel->close_received = TRUE;
+  ssh_conn_channel_write(conn, channel);
 }
 
 /* Processes a channel request message. */
@@ -1370,7 +1963,7 @@ void ssh_conn_process_channel_request(SshConn conn,
     }
 
   /* Check validity of the received channel number. */
-  if (local_id < 0 || local_id > conn->highest_channel ||
+  if (local_id < 0 || local_id >= conn->num_channels ||
       conn->channels[local_id] == NULL ||
       conn->channels[local_id]->ephemeral)
     {
@@ -1423,7 +2016,7 @@ void ssh_conn_process_channel_reply(SshConn conn, unsigned int packet_type,
                            SSH_FORMAT_END);
 
   /* Check validity of the received channel number. */
-  if (bytes == 0 || local_id < 0 || local_id > conn->highest_channel ||
+  if (bytes == 0 || local_id < 0 || local_id >= conn->num_channels ||
       conn->channels[local_id] == NULL ||
       conn->channels[local_id]->ephemeral)
     {
@@ -1643,7 +2236,21 @@ void ssh_conn_received_packet(SshCrossPacketType type,
                                          service);
         }
       else
-        conn->authenticated = TRUE;
+        {
+          conn->authenticated = TRUE;
+
+          /* Ask whether the other side copes with grown windows.  This
+             goes out before anything the application sends. */
+          conn->window_growth_pending = TRUE;
+          ssh_cross_down_send_encode(conn->down, SSH_CROSS_PACKET,
+                                     SSH_FORMAT_CHAR,
+                                       (unsigned int) SSH_MSG_GLOBAL_REQUEST,
+                                     SSH_FORMAT_UINT32_STR,
+                                       WINDOW_GROWTH_REQUEST,
+                                       strlen(WINDOW_GROWTH_REQUEST),
+                                     SSH_FORMAT_BOOLEAN, TRUE,
+                                     SSH_FORMAT_END);
+        }
 
       /* Pass the packet to the special callback. */
       if (conn->special)
@@ -1651,6 +2258,11 @@ void ssh_conn_received_packet(SshCrossPacketType type,
 
       ssh_xfree(service);
       break;
+
+    case SSH_CROSS_FLUSH:
+      /* Only meant for the transport layer, but seen when two connection
+         protocol objects are connected directly, as in the tests. */
+      break;
       
       /* fall to next case */
     case SSH_CROSS_STARTUP:
@@ -1687,6 +2299,7 @@ void ssh_conn_can_send(void *context)
   
   /* Mark that sends are not blocked. */
   conn->send_blocked = FALSE;
+  conn->bulk_blocked = FALSE;
 
   /* Process data going down the connection. */
   ssh_conn_send_some_data(conn);
@@ -1733,10 +2346,19 @@ SshConn ssh_conn_wrap(SshStream auth_stream,
 
   /* Initialize remaining fields. */
   conn->send_blocked = FALSE;
-  for (i = 0; i < MAX_OPEN_CHANNELS; i++)
-    conn->channels[i] = NULL;
-  conn->highest_channel = 0;
-  conn->next_channel = 0;
+  conn->channels = NULL;
+  conn->num_channels = 0;
+  conn->free_ids = NULL;
+  conn->num_free_ids = 0;
+  for (i = 0; i < SSH_CONN_PRIORITIES; i++)
+    {
+      conn->ready[i].first = conn->ready[i].last = NULL;
+      conn->ready[i].deficit = 0;
+    }
+  conn->next_priority = SSH_CONN_PRIORITY_INTERACTIVE;
+  conn->bulk_blocked = FALSE;
+  conn->free_chunks = NULL;
+  conn->num_free_chunks = 0;
   conn->service_name = ssh_xstrdup(service_name);
   conn->request_types = requests;
   conn->open_types = opens;
@@ -1747,6 +2369,12 @@ SshConn ssh_conn_wrap(SshStream auth_stream,
   conn->global_request_send_callback = NULL;
   conn->global_request_send_context = NULL;
   conn->authenticated = FALSE;
+  conn->timer = ssh_time_measure_allocate();
+  ssh_time_measure_start(conn->timer);
+  conn->window_memory = 0;
+  conn->window_memory_limit = SSH_CONN_DEFAULT_WINDOW_MEMORY;
+  conn->window_growth_pending = FALSE;
+  conn->window_growth_ok = FALSE;
 
   /* Enable receiving packets from the down stream. */
   ssh_cross_down_can_receive(conn->down, TRUE);
@@ -1762,16 +2390,25 @@ SshConn ssh_conn_wrap(SshStream auth_stream,
 
 void ssh_conn_destroy(SshConn conn)
 {
-  int i;
+  unsigned int i;
+  SshConnChunk chunk;
 
 #ifdef DEBUG
   ssh_debug("ssh_conn_destroy");
 #endif
   
   /* Free all channels. */
-  for (i = 0; i < MAX_OPEN_CHANNELS; i++)
+  for (i = 0; i < conn->num_channels; i++)
     if (conn->channels[i] != NULL)
       ssh_conn_channel_free(conn, conn->channels[i]);
+  ssh_xfree(conn->channels);
+  ssh_xfree(conn->free_ids);
+  while (conn->free_chunks != NULL)
+    {
+      chunk = conn->free_chunks;
+      conn->free_chunks = chunk->next;
+      ssh_xfree(chunk);
+    }
 
   /* Destroy the downward cross-layer protocol object.  Note that buffers
      will be drained before it actually closes. */
@@ -1780,12 +2417,26 @@ void ssh_conn_destroy(SshConn conn)
   /* Free the service name. */
   if (conn->service_name)
     ssh_xfree(conn->service_name);
+
+  ssh_time_measure_free(conn->timer);
   
   /* Fill the context with a garbage value (to ease debugging) and free. */
   memset(conn, 'F', sizeof(*conn));
   ssh_xfree(conn);
 }
 
+/* Sets the limit for the memory that the window auto-tuning may add to the
+   receive buffers of the channels.  Zero keeps every channel at the window
+   it was opened with.  Windows that are already larger are not shrunk
+   until their channels go idle.
+     `conn'      the connection protocol object
+     `limit'     limit in bytes */
+
+void ssh_conn_set_window_memory(SshConn conn, size_t limit)
+{
+  conn->window_memory_limit = limit;
+}
+
 /* Sends a disconnect message to the stream, but does not close or destroy
    it.  ssh_conn_destroy should be called for the stream after this call.
      `conn'      the connection protocol object
@@ -1904,6 +2555,7 @@ void ssh_conn_send_channel_open(SshConn conn,
   channel->extended[0].auto_close = auto_close;
   channel->close_on_eof = close_on_eof;
   channel->incoming_window_size = window_size;
+  channel->initial_window_size = window_size;
   channel->max_outgoing_packet_size = max_packet_size;
   channel->request = request;
   channel->destroy = destroy;
@@ -1951,7 +2603,7 @@ void ssh_conn_send_channel_request(SshConn conn,
   Boolean want_reply;
 
   /* Check that ``channel_id'' is valid. */
-  if (channel_id < 0 || channel_id > conn->highest_channel ||
+  if (channel_id < 0 || channel_id >= conn->num_channels ||
       conn->channels[channel_id] == NULL ||
       conn->channels[channel_id]->ephemeral ||
       conn->channels[channel_id]->close_sent)
@@ -1999,7 +2651,7 @@ void ssh_conn_channel_register_extended(SshConn conn,
   SshChannel channel;
   
   /* Check that ``channel_id'' is valid. */
-  if (channel_id < 0 || channel_id > conn->highest_channel ||
+  if (channel_id < 0 || channel_id >= conn->num_channels ||
       conn->channels[channel_id] == NULL ||
       conn->channels[channel_id]->close_sent)
     ssh_fatal("ssh_conn_channel_register_extended: bad channel_id %d.",
@@ -2027,11 +2679,12 @@ void ssh_conn_channel_register_extended(SshConn conn,
   channel->extended[extended_type].write_only = write_only;
   channel->extended[extended_type].auto_close = auto_close;
   channel->extended[extended_type].read_has_failed = FALSE;
+  ssh_conn_channel_ready(conn, channel);
   channel->extended[extended_type].eof_received = FALSE;
-  channel->extended[extended_type].buf =
-    ssh_xmalloc(channel->incoming_window_size);
-  channel->extended[extended_type].start = 0;
+  channel->extended[extended_type].first = NULL;
+  channel->extended[extended_type].last = NULL;
   channel->extended[extended_type].inbuf = 0;
+  ssh_conn_channel_charge(conn, channel);
 
   /* Set stream callback for the stream. */
   if (!channel->ephemeral)
@@ -2055,7 +2708,7 @@ void ssh_conn_channel_register_eof_callback(SshConn conn,
   SshChannel channel;
   
   /* Check that ``channel_id'' is valid. */
-  if (channel_id < 0 || channel_id > conn->highest_channel ||
+  if (channel_id < 0 || channel_id >= conn->num_channels ||
       conn->channels[channel_id] == NULL ||
       conn->channels[channel_id]->close_sent)
     ssh_fatal("ssh_conn_channel_register_eof_callback: bad channel_id %d.",
@@ -2069,6 +2722,29 @@ void ssh_conn_channel_register_eof_callback(SshConn conn,
   channel->eof_context = context;
 }
 
+/* Sets the priority class of the channel. */
+
+void ssh_conn_channel_set_priority(SshConn conn, int channel_id,
+                                   SshConnPriority priority)
+{
+  SshChannel channel;
+  Boolean ready;
+
+  /* Check that ``channel_id'' is valid. */
+  if (channel_id < 0 || channel_id >= conn->num_channels ||
+      conn->channels[channel_id] == NULL)
+    ssh_fatal("ssh_conn_channel_set_priority: bad channel_id %d.",
+              channel_id);
+
+  /* Move the channel to the queue of its new class. */
+  channel = conn->channels[channel_id];
+  ready = channel->ready;
+  ssh_conn_channel_unready(conn, channel);
+  channel->priority = priority;
+  if (ready)
+    ssh_conn_channel_ready(conn, channel);
+}
+
 /* Closes the channel.  The channel will be destroyed (and the destroy
    callback called) when we receive a response from the remote side.
      `conn'        the connection protocol object
@@ -2079,7 +2755,7 @@ void ssh_conn_channel_close(SshConn conn, int channel_id)
   SshChannel channel;
   
   /* Check that ``channel_id'' is valid. */
-  if (channel_id < 0 || channel_id > conn->highest_channel ||
+  if (channel_id < 0 || channel_id >= conn->num_channels ||
       conn->channels[channel_id] == NULL ||
       conn->channels[channel_id]->ephemeral ||
       conn->channels[channel_id]->close_sent)
@@ -24,12 +24,26 @@ SSH Connection Protocol.
 /* The normal service name for the SSH connection protocol. */
 #define SSH_CONNECTION_SERVICE  "ssh-connection"
 
+/* Default limit for the memory the channel window auto-tuning may use on
+   one connection; see ssh_conn_set_window_memory. */
+#define SSH_CONN_DEFAULT_WINDOW_MEMORY  (8 * 1024 * 1024)
+
 /* An invalid stream that can be passed to SshConnChannelOpenProc completion
    callback as the stream.  This indicates that we don't want to supply
    a stream yet, and receiving data is a protocol error.  We'll set up
    the stream later using ssh_conn_channel_register_extended for type 0. */
 #define SSH_CONN_POSTPONE_STREAM  (SshStream)1
 
+/* Priority classes for sending channel data.  When several channels have
+   data to send, interactive channels get the larger share of the tunnel,
+   and bulk channels may only keep a small amount of data queued ahead of
+   them.  New channels are bulk. */
+typedef enum
+{
+  SSH_CONN_PRIORITY_INTERACTIVE = 0,
+  SSH_CONN_PRIORITY_BULK = 1
+} SshConnPriority;
+
 /* Callback function for global requests.  A function of this type is
    registered for each for each supported global request type.  The function
    is called when request of the given type is received.  ``data'' will contain
@@ -214,6 +228,16 @@ SshConn ssh_conn_wrap(SshStream auth_stream,
    callbacks will be called after this has returned. */
 void ssh_conn_destroy(SshConn conn);
 
+/* Sets the limit for the memory that the window auto-tuning may add to the
+   receive buffers of the channels.  The connection measures the round trip
+   time of its window adjusts and the delivery rate of each channel, and
+   grows the window of a channel that keeps its window full up to twice the
+   bandwidth-delay product.  Zero keeps every channel at the window it was
+   opened with.
+     `conn'      the connection protocol object
+     `limit'     limit in bytes */
+void ssh_conn_set_window_memory(SshConn conn, size_t limit);
+
 /* Sends a disconnect message to the stream, but does not close or destroy
    it.  ssh_conn_destroy should be called for the stream after this call.
      `conn'      the connection protocol object
@@ -363,6 +387,14 @@ void ssh_conn_channel_register_eof_callback(SshConn conn,
 					    void (*callback)(void *context),
 					    void *context);
 
+/* Sets the priority class of the channel.  Sessions with a pty should be
+   interactive; forwarded connections and file transfers are bulk.
+     `conn'           the connection protocol object
+     `channel_id'     identifies the channel
+     `priority'       the new priority class */
+void ssh_conn_channel_set_priority(SshConn conn, int channel_id,
+                                   SshConnPriority priority);
+
 /* Closes the channel.  The channel will be destroyed (and the destroy
    callback called) when we receive a response from the remote side.
      `conn'        the connection protocol object
@@ -133,9 +133,12 @@ Boolean ssh_cross_down_output(SshCrossDown down)
       return_value = TRUE;
     }
 
-  /* All output has drained.  There is no more buffered data. */
+  /* All output has drained.  There is no more buffered data.  The flag
+     is cleared before the callback, as the callback may fill the buffer
+     and block again, in which case it must get called again. */
   if (down->send_blocked)
     {
+      down->send_blocked = FALSE;
       down->cannot_destroy = TRUE;
       if (down->can_send)
         (*down->can_send)(down->context);
@@ -145,7 +148,6 @@ Boolean ssh_cross_down_output(SshCrossDown down)
           ssh_cross_down_destroy(down);
           return FALSE;
         }
-      down->send_blocked = FALSE;
     }
   
   /* If we should send EOF after output has drained, do it now. */
@@ -456,6 +458,20 @@ Boolean ssh_cross_down_can_send(SshCrossDown down)
 
   return status;
 }
+
+/* Like ssh_cross_down_can_send, but with a lower limit for the buffered
+   data. */
+
+Boolean ssh_cross_down_can_send_below(SshCrossDown down, size_t limit)
+{
+  if (ssh_buffer_len(&down->outgoing) >= limit)
+    {
+      down->send_blocked = TRUE;
+      return FALSE;
+    }
+
+  return ssh_cross_down_can_send(down);
+}
   
 
 /* Encodes and sends a packet as specified for ssh_encode_cross_packet. */
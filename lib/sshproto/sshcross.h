@@ -140,7 +140,15 @@ typedef enum {
 
   /* The server should send this packet if it accepts the requested
      service.  Otherwise, it should send a disconnect. */
-  SSH_CROSS_SERVICE_ACCEPT
+  SSH_CROSS_SERVICE_ACCEPT,
+
+  /* This packet is only sent by higher layers to lower layers.  The
+     transport layer normally collects the packets it gets during one
+     pass of the event loop, and writes them to the connection together
+     from the bottom of the loop.  This asks it to write what it has
+     right away; it is sent after packets that should not wait, such as
+     keystrokes.  There is no payload. */
+  SSH_CROSS_FLUSH
   
 } SshCrossPacketType;
 
@@ -318,6 +326,12 @@ void ssh_cross_down_send_eof(SshCrossDown down);
    avoid checks in disconnect and debug messages). */
 Boolean ssh_cross_down_can_send(SshCrossDown down);
 
+/* Like ssh_cross_down_can_send, but returns FALSE already when ``limit''
+   bytes or more are buffered.  The can_send callback is called when the
+   buffer has drained.  This is used to keep less urgent data from filling
+   the buffer ahead of urgent data. */
+Boolean ssh_cross_down_can_send_below(SshCrossDown down, size_t limit);
+
 /* Sends the given packet down.  The packet may actually get buffered. */
 void ssh_cross_down_send(SshCrossDown down, SshCrossPacketType type,
 			 const unsigned char *data, size_t len);
@@ -33,6 +33,7 @@ encryption, integrity, server host authentication, and compression.
 #define DEFAULT_MACS            "hmac-sha,hmac-md5,sha-8,md5-8,sha,none"
 #define DEFAULT_COMPRESSIONS    "none,zlib"
 #define DEFAULT_KEXS            "diffie-hellman-group1-sha1,"\
+                                "ecdh-nistp256-sha1@ssh.com,"\
                                 "double-encrypting-sha1"
 
 /* Creates default transport protocol parameter structure.  This structure
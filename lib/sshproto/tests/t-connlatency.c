@@ -0,0 +1,380 @@
+/*
+
+t-connlatency.c
+
+Copyright (c) 1999 SSH Communications Security, Finland
+                   All rights reserved
+
+Measures the latency of an interactive channel while a bulk channel keeps
+the connection busy.  The two connection protocol objects talk over a
+simulated link of limited bandwidth.  The test is run first with both
+channels in the bulk class, then with the interactive channel in the
+interactive class.
+
+*/
+
+#include "sshincludes.h"
+#include "sshstreampair.h"
+#include "sshbuffer.h"
+#include "sshconn.h"
+#include "sshencode.h"
+#include "sshmsgs.h"
+#include "sshgetput.h"
+#include "sshtimeouts.h"
+#include "sshtimemeasure.h"
+#include "sshunixeloop.h"
+
+/* Bandwidth of the simulated link in bytes per second, and how often it
+   moves data (in microseconds). */
+#define LINK_RATE       (1024 * 1024)
+#define LINK_TICK       10000
+#define LINK_CHUNK      (LINK_RATE / (1000000 / LINK_TICK))
+
+/* The bulk channel runs alone for WARMUP microseconds, and after that a
+   ping is sent on the interactive channel every PING_INTERVAL
+   microseconds until PINGS pings have arrived. */
+#define WARMUP          500000
+#define PING_INTERVAL   50000
+#define PINGS           40
+
+/* Limits for the average and the maximum latency of the interactive
+   class, in microseconds. */
+#define MAX_AVERAGE_LATENCY     30000
+#define MAX_LATENCY             50000
+
+/* One direction of the simulated link. */
+typedef struct
+{
+  SshStream from, to;
+  SshBuffer buffer;
+} LinkDirection;
+
+LinkDirection link_up, link_down;
+SshConn test_c1, test_c2;
+SshTimeMeasure timer;
+SshStream bulk_source, ping_source, ping_target;
+SshBuffer ping_received;
+Boolean interactive;
+int channels_open;
+int ping_channel_id;
+int pings_sent, pings_received;
+SshUInt64 latency_total, latency_max;
+size_t bulk_bytes;
+unsigned char bulk_data[4096];
+
+SshUInt64 now(void)
+{
+  return ssh_time_measure_stamp(timer, SSH_TIME_GRANULARITY_MICROSECOND);
+}
+
+/* Moves at most LINK_CHUNK bytes from one end of the link to the other. */
+
+void link_move(LinkDirection *dir)
+{
+  unsigned char buf[LINK_CHUNK];
+  int len;
+
+  if (ssh_buffer_len(&dir->buffer) == 0)
+    {
+      len = ssh_stream_read(dir->from, buf, sizeof(buf));
+      if (len > 0)
+        ssh_buffer_append(&dir->buffer, buf, len);
+    }
+
+  while (ssh_buffer_len(&dir->buffer) > 0)
+    {
+      len = ssh_stream_write(dir->to, ssh_buffer_ptr(&dir->buffer),
+                             ssh_buffer_len(&dir->buffer));
+      if (len <= 0)
+        break;
+      ssh_buffer_consume(&dir->buffer, len);
+    }
+}
+
+void link_tick(void *context)
+{
+  link_move(&link_up);
+  link_move(&link_down);
+  ssh_register_timeout(0L, (long)LINK_TICK, link_tick, NULL);
+}
+
+/* Keeps the bulk channel full. */
+
+void bulk_source_callback(SshStreamNotification op, void *context)
+{
+  if (op != SSH_STREAM_CAN_OUTPUT)
+    return;
+
+  while (ssh_stream_write(bulk_source, bulk_data, sizeof(bulk_data)) > 0)
+    ;
+}
+
+/* Discards whatever arrives on the bulk channel. */
+
+void bulk_target_callback(SshStreamNotification op, void *context)
+{
+  SshStream stream = (SshStream)context;
+  unsigned char buf[8192];
+  int len;
+
+  if (op != SSH_STREAM_INPUT_AVAILABLE)
+    return;
+
+  while ((len = ssh_stream_read(stream, buf, sizeof(buf))) > 0)
+    bulk_bytes += len;
+}
+
+/* Sends the current time on the interactive channel. */
+
+void ping_send(void *context)
+{
+  unsigned char buf[8];
+  SshUInt64 t = now();
+
+  SSH_PUT_32BIT(buf, (SshUInt32)(t >> 32));
+  SSH_PUT_32BIT(buf + 4, (SshUInt32)t);
+  if (ssh_stream_write(ping_source, buf, sizeof(buf)) != sizeof(buf))
+    ssh_fatal("ping_send: write to the interactive channel failed");
+  pings_sent++;
+
+  ssh_register_timeout(0L, (long)PING_INTERVAL, ping_send, NULL);
+}
+
+/* Records the latency of the pings that arrive. */
+
+void ping_target_callback(SshStreamNotification op, void *context)
+{
+  unsigned char buf[256], *p;
+  SshUInt64 t, latency;
+  int len;
+
+  if (op != SSH_STREAM_INPUT_AVAILABLE)
+    return;
+
+  while ((len = ssh_stream_read(ping_target, buf, sizeof(buf))) > 0)
+    ssh_buffer_append(&ping_received, buf, len);
+
+  while (ssh_buffer_len(&ping_received) >= 8)
+    {
+      p = ssh_buffer_ptr(&ping_received);
+      t = ((SshUInt64)SSH_GET_32BIT(p) << 32) | SSH_GET_32BIT(p + 4);
+      ssh_buffer_consume(&ping_received, 8);
+
+      latency = now() - t;
+      latency_total += latency;
+      if (latency > latency_max)
+        latency_max = latency;
+      if (++pings_received == PINGS)
+        ssh_event_loop_abort();
+    }
+}
+
+void test_disconnect(int reason, const char *msg, void *context)
+{
+  ssh_fatal("test_disconnect: unexpected disconnect: %s", msg);
+}
+
+void test_debug(int type, const char *msg, void *context)
+{
+}
+
+void test_special(SshCrossPacketType type,
+                  const unsigned char *data, size_t len,
+                  void *context)
+{
+  if (type != SSH_CROSS_AUTHENTICATED)
+    ssh_fatal("test_special: packet not AUTHENTICATED");
+}
+
+Boolean test_channel_request(const char *type, const unsigned char *data,
+                             size_t len, void *context)
+{
+  return FALSE;
+}
+
+void test_channel_destroy(void *context)
+{
+}
+
+/* Accepts the channels on c2. */
+
+void test_channel_open(const char *type, int channel_id,
+                       const unsigned char *data, size_t len,
+                       SshConnOpenCompletionProc completion,
+                       void *completion_context,
+                       void *context)
+{
+  SshStream s1, s2;
+
+  ssh_stream_pair_create(&s1, &s2);
+  if (strcmp(type, "bulk") == 0)
+    ssh_stream_set_callback(s2, bulk_target_callback, (void *)s2);
+  else
+    {
+      ping_target = s2;
+      ssh_stream_set_callback(s2, ping_target_callback, NULL);
+    }
+  (*completion)(SSH_OPEN_OK, s1, TRUE, FALSE, 100000, NULL, 0,
+                test_channel_request, test_channel_destroy, NULL,
+                completion_context);
+}
+
+SshConnGlobalRequest test_requests[] =
+{
+  { NULL, NULL }
+};
+
+SshConnChannelOpen test_opens[] =
+{
+  { "bulk", test_channel_open },
+  { "ping", test_channel_open },
+  { NULL, NULL }
+};
+
+/* Creates the two connection protocol objects and the link between
+   them. */
+
+void conn_create(void)
+{
+  SshStream s1, s2, l1, l2;
+  SshBuffer buffer;
+  const char *user = "foo", *service = SSH_CONNECTION_SERVICE;
+
+  ssh_stream_pair_create(&s1, &l1);
+  ssh_stream_pair_create(&s2, &l2);
+  link_up.from = l1;
+  link_up.to = l2;
+  link_down.from = l2;
+  link_down.to = l1;
+  ssh_buffer_init(&link_up.buffer);
+  ssh_buffer_init(&link_down.buffer);
+
+  /* Both sides start in the authenticated state, as in t-conn. */
+  ssh_buffer_init(&buffer);
+  ssh_cross_encode_packet(&buffer, SSH_CROSS_AUTHENTICATED,
+                          SSH_FORMAT_UINT32_STR, user, strlen(user),
+                          SSH_FORMAT_UINT32_STR, service, strlen(service),
+                          SSH_FORMAT_END);
+  if (ssh_stream_write(l1, ssh_buffer_ptr(&buffer), ssh_buffer_len(&buffer))
+      != ssh_buffer_len(&buffer) ||
+      ssh_stream_write(l2, ssh_buffer_ptr(&buffer), ssh_buffer_len(&buffer))
+      != ssh_buffer_len(&buffer))
+    ssh_fatal("conn_create: pipe write kludge failed");
+  ssh_buffer_uninit(&buffer);
+
+  test_c1 = ssh_conn_wrap(s1, service, test_requests, test_opens,
+                          test_disconnect, test_debug, test_special,
+                          (void *)0);
+  test_c2 = ssh_conn_wrap(s2, service, test_requests, test_opens,
+                          test_disconnect, test_debug, test_special,
+                          (void *)1);
+}
+
+void start_pings(void *context)
+{
+  ssh_register_timeout(0L, 0L, ping_send, NULL);
+}
+
+void open_callback(int result, int channel_id,
+                   const unsigned char *data, size_t len,
+                   void *context)
+{
+  if (result != SSH_OPEN_OK)
+    ssh_fatal("open_callback: channel open failed");
+
+  if (context == (void *)1)
+    {
+      ping_channel_id = channel_id;
+      if (interactive)
+        ssh_conn_channel_set_priority(test_c1, channel_id,
+                                      SSH_CONN_PRIORITY_INTERACTIVE);
+    }
+
+  if (++channels_open == 2)
+    ssh_register_timeout(0L, (long)WARMUP, start_pings, NULL);
+}
+
+/* Runs the test once, and returns the average latency in
+   microseconds. */
+
+SshUInt64 run(Boolean interactive_class)
+{
+  SshStream s1, s2;
+  SshUInt64 average;
+
+  interactive = interactive_class;
+  channels_open = 0;
+  pings_sent = pings_received = 0;
+  latency_total = latency_max = 0;
+  bulk_bytes = 0;
+  ssh_buffer_init(&ping_received);
+
+  conn_create();
+
+  ssh_stream_pair_create(&s1, &s2);
+  bulk_source = s1;
+  ssh_stream_set_callback(bulk_source, bulk_source_callback, NULL);
+  ssh_conn_send_channel_open(test_c1, "bulk", s2, TRUE, FALSE, 10000,
+                             32768, NULL, 0, test_channel_request,
+                             test_channel_destroy, NULL,
+                             open_callback, (void *)0);
+
+  ssh_stream_pair_create(&s1, &s2);
+  ping_source = s1;
+  ssh_conn_send_channel_open(test_c1, "ping", s2, TRUE, FALSE, 10000,
+                             32768, NULL, 0, test_channel_request,
+                             test_channel_destroy, NULL,
+                             open_callback, (void *)1);
+
+  ssh_register_timeout(0L, (long)LINK_TICK, link_tick, NULL);
+  ssh_event_loop_run();
+
+  ssh_cancel_timeouts(SSH_ALL_CALLBACKS, SSH_ALL_CONTEXTS);
+  ssh_conn_destroy(test_c1);
+  ssh_conn_destroy(test_c2);
+  ssh_stream_destroy(bulk_source);
+  ssh_stream_destroy(ping_source);
+  ssh_stream_destroy(ping_target);
+  ssh_stream_destroy(link_up.from);
+  ssh_stream_destroy(link_down.from);
+  ssh_buffer_uninit(&link_up.buffer);
+  ssh_buffer_uninit(&link_down.buffer);
+  ssh_buffer_uninit(&ping_received);
+
+  average = latency_total / PINGS;
+  printf("  %-12s latency avg %5.1f ms  max %5.1f ms  bulk %.2f MB/s\n",
+         interactive_class ? "interactive" : "bulk",
+         average / 1000.0, latency_max / 1000.0,
+         bulk_bytes / (double)(WARMUP + PINGS * PING_INTERVAL));
+  return average;
+}
+
+int main()
+{
+  SshUInt64 bulk, inter;
+
+  ssh_event_loop_initialize();
+  timer = ssh_time_measure_allocate();
+  ssh_time_measure_start(timer);
+  memset(bulk_data, 'b', sizeof(bulk_data));
+
+  printf("Interactive channel latency under a bulk transfer, %d kB/s link\n",
+         LINK_RATE / 1024);
+  bulk = run(FALSE);
+  inter = run(TRUE);
+
+  /* The stream pairs and the link hold some 40 kB, or about 20 ms on
+     average at this rate.  Before the connection limited its own bulk
+     buffering it added as much again, and the pings waited their turn
+     behind the bulk channel. */
+  if (inter > bulk + 2000 || inter > MAX_AVERAGE_LATENCY ||
+      latency_max > MAX_LATENCY)
+    {
+      printf("error: interactive channel latency too high.\n");
+      exit(1);
+    }
+
+  ssh_time_measure_free(timer);
+  ssh_event_loop_uninitialize();
+  return 0;
+}
@@ -37,6 +37,7 @@ trcommon.c
 
 void ssh_tr_process_output(SshTransportCommon tr);
 void ssh_tr_process_input(SshTransportCommon tr);
+void ssh_tr_encode_queued_data(SshTransportCommon tr, Boolean all);
 
 /* Define this to dump packet contents. */
 #undef DUMP_PACKETS
@@ -108,6 +109,7 @@ void ssh_tr_destroy_now(SshTransportCommon tr)
   if (tr->params)
     ssh_transport_destroy_params(tr->params);
   ssh_buffer_uninit(&tr->outgoing);
+  ssh_buffer_uninit(&tr->queued_data);
   if (tr->incoming_packet)
     ssh_buffer_free(tr->incoming_packet);
   assert(tr->up_stream == NULL);  /* Should be... */
@@ -167,6 +169,11 @@ void ssh_tr_destroy_now(SshTransportCommon tr)
   ssh_mp_clear(tr->dh_f);
   ssh_mp_clear(tr->dh_k);
   ssh_mp_clear(tr->dh_secret);
+  ssh_mp_scratch_clear(&tr->dh_scratch);
+  if (tr->ecdh_q_c)
+    ssh_xfree(tr->ecdh_q_c);
+  if (tr->ecdh_q_s)
+    ssh_xfree(tr->ecdh_q_s);
 
   /* Fill with garbage for debugging. */
   memset(tr, 'F', sizeof(*tr));
@@ -266,6 +273,10 @@ Boolean ssh_tr_output_outgoing(SshTransportCommon tr)
   int len;
   SSH_DEBUG(7, ("ssh_tr_output_outgoing"));
 
+  /* Channel data is encrypted as the buffer runs low. */
+  if (tr->sent_state == SENT_INTERACTIVE)
+    ssh_tr_encode_queued_data(tr, FALSE);
+
   while (ssh_buffer_len(&tr->outgoing) > 0)
     {
       len = ssh_buffer_len(&tr->outgoing);
@@ -288,6 +299,8 @@ Boolean ssh_tr_output_outgoing(SshTransportCommon tr)
           return FALSE;
         }
       ssh_buffer_consume(&tr->outgoing, len);
+      if (tr->sent_state == SENT_INTERACTIVE)
+        ssh_tr_encode_queued_data(tr, FALSE);
     }
 
   /* Send an eof to the connection if requested. */
@@ -305,7 +318,8 @@ Boolean ssh_tr_output_outgoing(SshTransportCommon tr)
   if (tr->up_write_blocked &&
       ssh_buffer_len(&tr->up_outgoing) <
       XMALLOC_MAX_SIZE - SSH_MAX_TOTAL_PACKET_LENGTH - SSH_CONTROL_RESERVE &&
-      ssh_buffer_len(&tr->outgoing) < SSH_BUFFERING_LIMIT)
+      ssh_buffer_len(&tr->outgoing) + ssh_buffer_len(&tr->queued_data) <
+      SSH_UP_BUFFERING_LIMIT)
     {
       SSH_DEBUG(6, ("ssh_tr_output_outgoing: waking up application output"));
       tr->up_write_blocked = FALSE;
@@ -316,24 +330,25 @@ Boolean ssh_tr_output_outgoing(SshTransportCommon tr)
   return TRUE;
 }
 
-/* Wraps the packet structure around the payload in the buffer,
-   and sends it out. */
+/* Wraps the packet structure around the payload, and appends the
+   encrypted packet to the outgoing buffer.  This assigns the packet its
+   sequence number. */
 
-void ssh_tr_send_packet(SshTransportCommon tr,
-                        const unsigned char *payload,
-                        size_t payload_length)
+void ssh_tr_encode_packet(SshTransportCommon tr,
+                          const unsigned char *payload,
+                          size_t payload_length)
 {
   size_t block_size, length, padding_length, mac_length;
   int i;
   unsigned char *start;
   unsigned char seq_buf[4];
 
-  SSH_DEBUG(6, ("ssh_tr_send_packet %d", payload[0]));
+  SSH_DEBUG(6, ("ssh_tr_encode_packet %d", payload[0]));
 
   if (tr->outgoing_eof)
     {
       /* Trying to send after we have sent EOF??? */
-      ssh_debug("ssh_tr_send_packet: trying to send after EOF.");
+      ssh_debug("ssh_tr_encode_packet: trying to send after EOF.");
       return;
     }
   
@@ -365,7 +380,7 @@ void ssh_tr_send_packet(SshTransportCommon tr,
   
   length += padding_length;  /* now everything but the mac */
 
-  SSH_DEBUG(6, ("ssh_tr_send_packet: length %d pad %d payload %d mac %d",
+  SSH_DEBUG(6, ("ssh_tr_encode_packet: length %d pad %d payload %d mac %d",
             length, padding_length, payload_length, mac_length));
 
   /* Store the plaintext packet in the buffer. */
@@ -403,7 +418,7 @@ void ssh_tr_send_packet(SshTransportCommon tr,
       ssh_mac_final(tr->outgoing_mac, start + length);
       break;
     default:
-      ssh_fatal("ssh_tr_send_packet: Whoah! How can a Boolean value be"
+      ssh_fatal("ssh_tr_encode_packet: Whoah! How can a Boolean value be"
                 " something else than TRUE or FALSE?");
     }
   
@@ -417,11 +432,79 @@ void ssh_tr_send_packet(SshTransportCommon tr,
   ssh_debug("-- encrypted --");
   buffer_dump(&tr->outgoing);
 #endif /* DUMP_PACKETS */
-  
+}
+
+/* Wraps the packet structure around the payload in the buffer,
+   and sends it out. */
+
+void ssh_tr_send_packet(SshTransportCommon tr,
+                        const unsigned char *payload,
+                        size_t payload_length)
+{
+  ssh_tr_encode_packet(tr, payload, payload_length);
+
   /* Start writing if not already active. */
   ssh_tr_output_outgoing(tr);
 }
 
+/* Called from the bottom of the event loop, writes out the packets
+   collected from up during the pass. */
+
+void ssh_tr_flush_proc(void *context)
+{
+  SshTransportCommon tr = context;
+
+  SSH_DEBUG(7, ("ssh_tr_flush_proc"));
+
+  tr->flush_scheduled = FALSE;
+  ssh_tr_output_outgoing(tr);
+}
+
+/* Arranges for the outgoing buffer to be written from the bottom of the
+   event loop.  Packets from up are collected this way, so that the
+   packets of one pass go to the connection in one write instead of a
+   small segment each. */
+
+void ssh_tr_schedule_flush(SshTransportCommon tr)
+{
+  if (tr->flush_scheduled)
+    return;
+
+  tr->flush_scheduled = TRUE;
+  ssh_register_timeout(0L, 0L, ssh_tr_flush_proc, (void *)tr);
+}
+
+/* Encrypts channel data queued from up into the outgoing buffer.  Unless
+   ``all'' is TRUE, this only fills the buffer up to
+   SSH_OUTGOING_DATA_LIMIT bytes, so that control packets sent later get
+   ahead of the rest. */
+
+void ssh_tr_encode_queued_data(SshTransportCommon tr, Boolean all)
+{
+  size_t len;
+
+  while (ssh_buffer_len(&tr->queued_data) > 0 &&
+         (all || ssh_buffer_len(&tr->outgoing) < SSH_OUTGOING_DATA_LIMIT))
+    {
+      len = SSH_GET_32BIT(ssh_buffer_ptr(&tr->queued_data));
+      ssh_tr_encode_packet(tr, ssh_buffer_ptr(&tr->queued_data) + 4, len);
+      ssh_buffer_consume(&tr->queued_data, 4 + len);
+    }
+}
+
+/* Returns TRUE if data for the given recipient channel is queued. */
+
+Boolean ssh_tr_data_queued_for(SshTransportCommon tr, SshUInt32 channel)
+{
+  unsigned char *ucp = ssh_buffer_ptr(&tr->queued_data);
+  size_t offset, len = ssh_buffer_len(&tr->queued_data);
+
+  for (offset = 0; offset < len; offset += 4 + SSH_GET_32BIT(ucp + offset))
+    if (SSH_GET_32BIT(ucp + offset + 5) == channel)
+      return TRUE;
+  return FALSE;
+}
+
 /* Terminates the protocol, and sends a disconnect message up. */
 
 void ssh_tr_up_disconnect(SshTransportCommon tr,
@@ -450,6 +533,9 @@ void ssh_tr_up_disconnect(SshTransportCommon tr,
   
   SSH_DEBUG(5, ("ssh_tr_up_disconnect %d '%.200s'", (int)reason, message));
 
+  /* Data queued from up goes out before the disconnect. */
+  ssh_tr_encode_queued_data(tr, TRUE);
+
   /* If appropriate, send the disconnect to the other side. */
   if (send_to_other_side)
     {
@@ -780,6 +866,7 @@ Boolean ssh_tr_negotiate(SshTransportCommon tr,
   char *client_kex, *server_kex, *common_kex, *kex;
   char *client_server_host_key, *server_server_host_key, *common_host_key;
   char *chosen_kex = NULL, *chosen_host_key = NULL;
+  char *client_first_kex, *client_first_host_key;
   char *chosen_c_to_s_cipher = NULL, *chosen_s_to_c_cipher = NULL;
   char *chosen_c_to_s_mac = NULL, *chosen_s_to_c_mac = NULL;
   char *chosen_c_to_s_compression = NULL, *chosen_s_to_c_compression = NULL;
@@ -821,6 +908,12 @@ Boolean ssh_tr_negotiate(SshTransportCommon tr,
       return FALSE;
     }
 
+  /* The guessed kex1 packet, if any, is sent by the client for its own
+     first choice.  Both sides must agree on whether it was right, so the
+     guess is judged against the client's list and not our own. */
+  client_first_kex = ssh_name_list_get_name(client_kex);
+  client_first_host_key = ssh_name_list_get_name(client_server_host_key);
+
   /* The kex method will have to be supported by both. */
   common_kex = ssh_name_list_intersection(client_kex, server_kex);
   ssh_xfree(client_kex);
@@ -830,10 +923,24 @@ Boolean ssh_tr_negotiate(SshTransportCommon tr,
   common_host_key = ssh_name_list_intersection(client_server_host_key,
                                                server_server_host_key);
 
-  tr->host_key_names = ssh_xstrdup(common_host_key);
-
   ssh_xfree(client_server_host_key);
   ssh_xfree(server_server_host_key);
+
+  /* The lists may well have nothing in common now that the server only
+     offers the type of its own host key. */
+  if (common_kex == NULL || common_host_key == NULL ||
+      *common_kex == '\0' || *common_host_key == '\0')
+    {
+      ssh_xfree(common_kex);
+      ssh_xfree(common_host_key);
+      ssh_xfree(client_first_kex);
+      ssh_xfree(client_first_host_key);
+      ssh_buffer_free(client_kexinit);
+      ssh_buffer_free(server_kexinit);
+      return FALSE;
+    }
+
+  tr->host_key_names = ssh_xstrdup(common_host_key);
   
   /* Loop over the common kex methods. */
   chosen_host_key = NULL;
@@ -860,6 +967,8 @@ Boolean ssh_tr_negotiate(SshTransportCommon tr,
   if (chosen_kex == NULL)
     {
       /* Failed to find acceptable kex method. */
+      ssh_xfree(client_first_kex);
+      ssh_xfree(client_first_host_key);
       ssh_buffer_free(client_kexinit);
       ssh_buffer_free(server_kexinit);
       return FALSE;
@@ -901,12 +1010,18 @@ Boolean ssh_tr_negotiate(SshTransportCommon tr,
       ssh_xfree(chosen_c_to_s_compression);
       ssh_xfree(chosen_kex);
       ssh_xfree(chosen_host_key);
+      ssh_xfree(client_first_kex);
+      ssh_xfree(client_first_host_key);
       return FALSE;
     }
 
   /* Determine whether the guessed algorithm was wrong. */
-  *guess_was_wrong = (strcmp(chosen_kex, tr->guessed_kex) != 0 ||
-                      strcmp(chosen_host_key, tr->guessed_host_key) != 0);
+  *guess_was_wrong = (client_first_kex == NULL ||
+                      client_first_host_key == NULL ||
+                      strcmp(chosen_kex, client_first_kex) != 0 ||
+                      strcmp(chosen_host_key, client_first_host_key) != 0);
+  ssh_xfree(client_first_kex);
+  ssh_xfree(client_first_host_key);
 
   /* Set the selected algorithms. */
   ssh_tr_set_string(&tr->kex_name, chosen_kex);
@@ -1894,6 +2009,10 @@ void ssh_tr_output_kexinit_explicit(SshTransportCommon tr,
   char *cp, *cp2;
 
   SSH_DEBUG(5, ("ssh_tr_output_kexinit"));
+
+  /* No data may be sent after KEXINIT until the new keys are in use, so
+     data queued from up goes out now, with the old keys. */
+  ssh_tr_encode_queued_data(tr, TRUE);
   
   /* Construct our kex1 packet so that we know whether we are supposed to
      send it as a guessed packet for our default method. */
@@ -2418,7 +2537,7 @@ void ssh_tr_process_up_incoming_packet(SshTransportCommon tr,
   unsigned int tr_packet_type;
   char *ciphers_c_to_s, *ciphers_s_to_c, *macs_c_to_s, *macs_s_to_c,
     *compressions_c_to_s, *compressions_s_to_c, *host_key_algorithms;
-  unsigned char *msg, *msg_lang;
+  unsigned char *msg, *msg_lang, *ucp;
   SshUInt32 reason_code;
 
   SSH_DEBUG(5, ("ssh_tr_process_up_incoming_packet %d", packet_type));
@@ -2454,8 +2573,35 @@ void ssh_tr_process_up_incoming_packet(SshTransportCommon tr,
           return;
         }
       
-      /* Send the packet to the connection. */
-      ssh_tr_send_packet(tr, payload, payload_len);
+      /* Channel data is queued, and only encrypted as the connection
+         takes it, so that window adjusts and other control packets are
+         sent ahead of it.  A control packet must not overtake data of its
+         own channel, though; then the queued data goes first. */
+      if ((tr_packet_type == SSH_MSG_CHANNEL_DATA ||
+           tr_packet_type == SSH_MSG_CHANNEL_EXTENDED_DATA) &&
+          payload_len >= 5)
+        {
+          ssh_buffer_append_space(&tr->queued_data, &ucp, 4 + payload_len);
+          SSH_PUT_32BIT(ucp, payload_len);
+          memcpy(ucp + 4, payload, payload_len);
+          ssh_tr_schedule_flush(tr);
+          break;
+        }
+      if (tr_packet_type >= SSH_MSG_CHANNEL_EOF &&
+          tr_packet_type <= SSH_MSG_CHANNEL_FAILURE &&
+          (payload_len < 5 ||
+           ssh_tr_data_queued_for(tr, SSH_GET_32BIT(payload + 1))))
+        ssh_tr_encode_queued_data(tr, TRUE);
+
+      /* Add the packet to those going to the connection at the bottom of
+         the event loop. */
+      ssh_tr_encode_packet(tr, payload, payload_len);
+      ssh_tr_schedule_flush(tr);
+      break;
+
+    case SSH_CROSS_FLUSH:
+      /* Write what we have without waiting for the end of the pass. */
+      ssh_tr_output_outgoing(tr);
       break;
 
     case SSH_CROSS_DISCONNECT:
@@ -2475,7 +2621,9 @@ void ssh_tr_process_up_incoming_packet(SshTransportCommon tr,
       ssh_tr_up_send(tr, SSH_CROSS_DISCONNECT,
                      payload, payload_len);
 
-      /* Send the disconnect packet to the connection. */
+      /* Send the disconnect packet to the connection, after any data
+         queued from up. */
+      ssh_tr_encode_queued_data(tr, TRUE);
       ssh_buffer_init(&buffer);
       ssh_encode_buffer(&buffer,
                         SSH_FORMAT_CHAR, (unsigned int) SSH_MSG_DISCONNECT,
@@ -2648,9 +2796,13 @@ int ssh_tr_up_write(void *context, const unsigned char *buf, size_t size)
   
 normal:
 
+  /* Only a limited amount of data from up is queued ahead of the
+     connection, so that the connection protocol's priorities decide what
+     goes out first. */
   while (ssh_buffer_len(&tr->outgoing) <
          XMALLOC_MAX_SIZE - SSH_MAX_TOTAL_PACKET_LENGTH - SSH_CONTROL_RESERVE
-         && ssh_buffer_len(&tr->outgoing) < SSH_BUFFERING_LIMIT)
+         && ssh_buffer_len(&tr->outgoing) + ssh_buffer_len(&tr->queued_data)
+         < SSH_UP_BUFFERING_LIMIT)
     {
       /* We only accept data from up in interactive state, and not after having
          already scheduled eof to connection. */
@@ -2727,6 +2879,7 @@ void ssh_tr_up_output_eof(void *context)
   if (tr->outgoing_eof)
     return;
   
+  ssh_tr_encode_queued_data(tr, TRUE);
   tr->outgoing_eof = TRUE;
   ssh_tr_output_outgoing(tr);
 }
@@ -2759,6 +2912,9 @@ void ssh_tr_up_destroy(void *context)
   SshTransportCommon tr = context;
 
   SSH_DEBUG(5, ("ssh_tr_up_destroy"));
+
+  /* Data queued from up still goes out. */
+  ssh_tr_encode_queued_data(tr, TRUE);
   
   tr->up_stream = NULL;
   tr->up_callback = NULL;
@@ -2815,9 +2971,11 @@ SshTransportCommon ssh_tr_create(SshStream connection,
   tr->outgoing_sequence_number = 0;
 
   tr->outgoing_eof = FALSE;
+  tr->flush_scheduled = FALSE;
   
   /* Initialize incoming/outgoing buffers. */
   ssh_buffer_init(&tr->outgoing);
+  ssh_buffer_init(&tr->queued_data);
   tr->incoming_packet = NULL;
   ssh_buffer_init(&tr->up_outgoing);
   ssh_buffer_init(&tr->up_incoming);
@@ -2899,6 +3057,7 @@ SshTransportCommon ssh_tr_create(SshStream connection,
   ssh_mp_init(tr->dh_f);
   ssh_mp_init(tr->dh_k);
   ssh_mp_init(tr->dh_secret);
+  ssh_mp_scratch_init(&tr->dh_scratch);
 
   return tr;
 }
@@ -38,6 +38,8 @@ Common (client+server) internal definitions for the transport layer protocol.
 #define SSH_MAX_PAYLOAD_LENGTH          32768
 #define SSH_CONTROL_RESERVE             5000  /* reserve for control packets */
 #define SSH_BUFFERING_LIMIT             50000
+#define SSH_UP_BUFFERING_LIMIT          16384 /* data from up, queued */
+#define SSH_OUTGOING_DATA_LIMIT         8192  /* channel data encrypted ahead */
 
 typedef enum
 {
@@ -90,6 +92,8 @@ typedef struct
   /* State for data going out to the connection. */
   SshBuffer outgoing;               /* Pending outgoing data. */
   Boolean outgoing_eof;             /* Send EOF when buffer empty. */
+  SshBuffer queued_data;            /* Channel data not yet encrypted. */
+  Boolean flush_scheduled;          /* Output from the bottom of the loop. */
 
   /* State for packets coming from the connection. */
   SshBuffer *incoming_packet;       /* Received packet. */
@@ -210,6 +214,16 @@ typedef struct
   SshIntC dh_k;
   SshIntC dh_secret;
 
+  /* For ecdh methods: the encoded exchange points. The secret scalar and
+     the shared secret are kept in dh_secret and dh_k. */
+  unsigned char *ecdh_q_c;
+  size_t ecdh_q_c_len;
+  unsigned char *ecdh_q_s;
+  size_t ecdh_q_s_len;
+
+  /* Scratch arena for the exponentiations, kept over rekeys. */
+  SshMpScratch dh_scratch;
+
   /* Compatibility with older ssh-2 versions.  Variables in this section
      are set to defaults in ssh_tr_create and filled in properly in
      ssh_tr_input_version. */
@@ -31,6 +31,8 @@ Key exchange methods.
 #include "ssh2pubkeyencode.h"
 #include "sshcipherlist.h"
 #include "sshdebug.h"
+#include "sshmpaux.h"
+#include "ecpmath.h"
 
 /* forward definitions */
 
@@ -108,6 +110,7 @@ SshCryptoStatus ssh_kexdh_make_group(SshTransportCommon tr,
                                      const char *group_name)
 {
   int i;
+  SshMpScratchFrame frame;
 
   /* group1's p, lifted from draft-ietf-ipsec-oakley-02.txt
      "E.2. Well-Known Group 2:  a 1024 bit prime" */
@@ -154,40 +157,21 @@ SshCryptoStatus ssh_kexdh_make_group(SshTransportCommon tr,
                  ssh_random_get_byte(tr->random_state));
     }
   
+  ssh_mp_scratch_begin(&tr->dh_scratch, &frame, tr->dh_p);
   ssh_mp_powm(tr->server ? tr->dh_f : tr->dh_e, 
            tr->dh_g, tr->dh_secret, tr->dh_p);
+  ssh_mp_scratch_end(&frame);
 
   return SSH_CRYPTO_OK;
 }
 
-/* Compute the shared secret and the exchange hash. Return TRUE on failure */
+/* Start the exchange hash buffer with the part common to all methods:
+   the version strings, the KEXINIT payloads and the host key. */
 
-Boolean ssh_kexdh_compute_h(SshTransportCommon tr)
+SshBuffer *ssh_kex_exchange_hash_start(SshTransportCommon tr)
 {
-  SshIntC t;
   SshBuffer *buf;
-  
-  /* check that the public value is within the range */
-
-  if (ssh_mp_cmp_ui(tr->server ? tr->dh_e : tr->dh_f, 2) <= 0)
-    return TRUE;
-
-  ssh_mp_init(t);
-  ssh_mp_sub_ui(t, tr->dh_p, 2);
-  if (ssh_mp_cmp(tr->dh_e, t) >= 0)
-    {
-      ssh_mp_clear(t);
-      return TRUE;
-    }
-  ssh_mp_clear(t);
-
-  /* compute the shared secret */
 
-  ssh_mp_powm(tr->dh_k, tr->server ? tr->dh_e : tr->dh_f, 
-           tr->dh_secret, tr->dh_p);
-
-  /* ok, compute the exchange hash */
-  
   buf = ssh_buffer_allocate();
 
   if (tr->server)
@@ -220,10 +204,14 @@ Boolean ssh_kexdh_compute_h(SshTransportCommon tr)
                       ssh_buffer_ptr(tr->public_host_key_blob),
                       ssh_buffer_len(tr->public_host_key_blob),
                     SSH_FORMAT_END);
-  buffer_put_mp_int_ssh2style(buf, tr->dh_e);
-  buffer_put_mp_int_ssh2style(buf, tr->dh_f);
-  buffer_put_mp_int_ssh2style(buf, tr->dh_k);
+  return buf;
+}
+
+/* Hash the buffer to the exchange hash, set the session identifier on
+   the first key exchange, and free the buffer. */
 
+void ssh_kex_exchange_hash_finish(SshTransportCommon tr, SshBuffer *buf)
+{
   ssh_hash_reset(tr->hash);
   ssh_hash_update(tr->hash, ssh_buffer_ptr(buf), ssh_buffer_len(buf));
   ssh_hash_final(tr->hash, tr->exchange_hash);
@@ -237,7 +225,47 @@ Boolean ssh_kexdh_compute_h(SshTransportCommon tr)
       tr->session_identifier_len = tr->exchange_hash_len;
     }
 
+  ssh_buffer_free(buf);
+}
+
+/* Compute the shared secret and the exchange hash. Return TRUE on failure */
+
+Boolean ssh_kexdh_compute_h(SshTransportCommon tr)
+{
+  SshIntC t;
+  SshBuffer *buf;
+  SshMpScratchFrame frame;
+  
+  /* check that the public value is within the range */
+
+  if (ssh_mp_cmp_ui(tr->server ? tr->dh_e : tr->dh_f, 2) <= 0)
+    return TRUE;
+
+  ssh_mp_scratch_begin(&tr->dh_scratch, &frame, tr->dh_p);
+
+  ssh_mp_init(t);
+  ssh_mp_sub_ui(t, tr->dh_p, 2);
+  if (ssh_mp_cmp(tr->dh_e, t) >= 0)
+    {
+      ssh_mp_clear(t);
+      ssh_mp_scratch_end(&frame);
+      return TRUE;
+    }
+  ssh_mp_clear(t);
+
+  /* compute the shared secret */
+
+  ssh_mp_powm(tr->dh_k, tr->server ? tr->dh_e : tr->dh_f, 
+           tr->dh_secret, tr->dh_p);
+
+  ssh_mp_scratch_end(&frame);
 
+  /* ok, compute the exchange hash */
+  
+  buf = ssh_kex_exchange_hash_start(tr);
+  buffer_put_mp_int_ssh2style(buf, tr->dh_e);
+  buffer_put_mp_int_ssh2style(buf, tr->dh_f);
+  buffer_put_mp_int_ssh2style(buf, tr->dh_k);
 
 #if 0
   ssh_debug("ssh_kexdh_compute_h (%s)", tr->server ? "server" : "client");
@@ -263,7 +291,7 @@ Boolean ssh_kexdh_compute_h(SshTransportCommon tr)
   printf("\n");
 #endif
 
-  ssh_buffer_free(buf);
+  ssh_kex_exchange_hash_finish(tr, buf);
 
   return FALSE;
 }
@@ -315,19 +343,15 @@ Boolean ssh_kexdh_server_input_kex1(SshTransportCommon tr, SshBuffer *input)
   return TRUE;
 }
 
-/* server creates a SSH_MSG_KEXDH_REPLY (kex2) */
+/* Sign the exchange hash with the host key. Returns the signature, which
+   the caller must free, or NULL on failure. */
 
-SshBuffer *ssh_kexdh_server_make_kex2(SshTransportCommon tr)
+unsigned char *ssh_kex_sign_exchange_hash(SshTransportCommon tr,
+                                          size_t *sig_len_return)
 {
-  SshBuffer *packet;
   unsigned char *signature;
   size_t sig_len;
 
-  /* compute the exchange hash H */
-
-  if (ssh_kexdh_compute_h(tr))
-    return NULL;
-
   sig_len = ssh_private_key_max_signature_output_len(tr->private_host_key);
   signature = ssh_xmalloc(sig_len);
 
@@ -337,6 +361,29 @@ SshBuffer *ssh_kexdh_server_make_kex2(SshTransportCommon tr)
                            tr->exchange_hash, tr->exchange_hash_len,
                            signature, sig_len, &sig_len,
                            tr->random_state) != SSH_CRYPTO_OK)
+    {
+      ssh_xfree(signature);
+      return NULL;
+    }
+
+  *sig_len_return = sig_len;
+  return signature;
+}
+
+/* server creates a SSH_MSG_KEXDH_REPLY (kex2) */
+
+SshBuffer *ssh_kexdh_server_make_kex2(SshTransportCommon tr)
+{
+  SshBuffer *packet;
+  unsigned char *signature;
+  size_t sig_len;
+
+  /* compute the exchange hash H */
+
+  if (ssh_kexdh_compute_h(tr))
+    return NULL;
+
+  if ((signature = ssh_kex_sign_exchange_hash(tr, &sig_len)) == NULL)
     return NULL;
 
   /* construct the packet */
@@ -360,9 +407,13 @@ SshBuffer *ssh_kexdh_server_make_kex2(SshTransportCommon tr)
   return packet;
 }
 
-
 /* A simple callback for the key check function */
 
+/* Reads the server's exchange value from the reply and computes the
+   shared secret and the exchange hash. Returns TRUE on failure. */
+typedef Boolean (*SshKexInputReplyProc)(SshTransportCommon tr,
+                                        SshBuffer *input);
+
 /* Internal struct for the callback, and the calling function. */
 typedef struct SshKex2KeyCheckCallbackContextRec
 {
@@ -372,6 +423,7 @@ typedef struct SshKex2KeyCheckCallbackContextRec
   size_t sig_len;
   unsigned char *signature;
   SshKex2CompletionProc completion;
+  SshKexInputReplyProc input_reply;
   
 } *SshKex2KeyCheckCallbackContext;
 
@@ -401,25 +453,21 @@ void ssh_kex_keycheck_callback(Boolean result, void *ctx)
                         callback_context->pubkey_len);
       ssh_xfree(callback_context->pubkey);
 
-      buffer_get_mp_int_ssh2style(callback_context->input, tr->dh_f);  
+      if ((*callback_context->input_reply)(tr, callback_context->input))
+        tr->key_check_result = FALSE;
+
       callback_context->signature =
         buffer_get_uint32_string(callback_context->input,
                                  &(callback_context->sig_len));
 
       /* ok, verify the signature */
 
-      if (ssh_kexdh_compute_h(tr))
-        tr->key_check_result = FALSE;
-
       if (ssh_public_key_verify_signature(tr->public_host_key,
                                           callback_context->signature,
                                           callback_context->sig_len,
                                           tr->exchange_hash, 
                                           tr->exchange_hash_len) == FALSE)
-        {
-          ssh_xfree(callback_context->signature);
-          tr->key_check_result = FALSE;
-        }
+        tr->key_check_result = FALSE;
 
       memset(callback_context->signature, 0, callback_context->sig_len);
       ssh_xfree(callback_context->signature);
@@ -434,10 +482,13 @@ void ssh_kex_keycheck_callback(Boolean result, void *ctx)
   ssh_xfree(callback_context);
 }
 
-/* client parses the server's SSH_MSG_KEXDH_REPLY (kex2) */
+/* client parses the server's SSH_MSG_KEXDH_REPLY (kex2). The host key
+   is checked first, the exchange value and the signature are processed by
+   ssh_kex_keycheck_callback with the method specific input_reply. */
 
-void ssh_kexdh_client_input_kex2(SshTransportCommon tr, SshBuffer *input,
-                                 SshKex2CompletionProc finalize_callback)
+void ssh_kex_client_input_reply(SshTransportCommon tr, SshBuffer *input,
+                                SshKex2CompletionProc finalize_callback,
+                                SshKexInputReplyProc input_reply)
 {
   unsigned int code;
   unsigned char *pubkey;  
@@ -447,7 +498,7 @@ void ssh_kexdh_client_input_kex2(SshTransportCommon tr, SshBuffer *input,
   
   if ((code = buffer_get_char(input)) != SSH_MSG_KEXDH_REPLY)
     {
-      ssh_debug("ssh_kexdh_client_input_kex2: received illegal packet %d",
+      ssh_debug("ssh_kex_client_input_reply: received illegal packet %d",
                 code);
       return;
     }
@@ -457,7 +508,7 @@ void ssh_kexdh_client_input_kex2(SshTransportCommon tr, SshBuffer *input,
   if (ssh_decode_buffer(input, SSH_FORMAT_UINT32_STR, &pubkey, &pubkey_len,
                         SSH_FORMAT_END) == 0)
     {
-      ssh_debug("ssh_kexdh_client_input_kex2: failed to parse the pubkey "
+      ssh_debug("ssh_kex_client_input_reply: failed to parse the pubkey "
                 "and certificates.");
       return;
     }
@@ -479,7 +530,7 @@ void ssh_kexdh_client_input_kex2(SshTransportCommon tr, SshBuffer *input,
 
   if (tr->public_host_key == NULL)
     {
-      ssh_debug("ssh_kexdh_client_input_kex2: invalid host key.");
+      ssh_debug("ssh_kex_client_input_reply: invalid host key.");
       return;
     }
 
@@ -498,6 +549,7 @@ void ssh_kexdh_client_input_kex2(SshTransportCommon tr, SshBuffer *input,
       callback_context->signature = NULL;
       callback_context->sig_len = 0;
       callback_context->completion = finalize_callback;
+      callback_context->input_reply = input_reply;
       callback_context->input = input;
 
       (*tr->key_check)(tr->server_host_name, pubkey, pubkey_len,
@@ -507,6 +559,253 @@ void ssh_kexdh_client_input_kex2(SshTransportCommon tr, SshBuffer *input,
   /* Rest is done in ssh_kex_keycheck_callback(). */
 }
 
+/* Reads f from the SSH_MSG_KEXDH_REPLY. */
+
+Boolean ssh_kexdh_client_input_reply(SshTransportCommon tr, SshBuffer *input)
+{
+  buffer_get_mp_int_ssh2style(input, tr->dh_f);  
+  return ssh_kexdh_compute_h(tr);
+}
+
+void ssh_kexdh_client_input_kex2(SshTransportCommon tr, SshBuffer *input,
+                                 SshKex2CompletionProc finalize_callback)
+{
+  ssh_kex_client_input_reply(tr, input, finalize_callback,
+                             ssh_kexdh_client_input_reply);
+}
+
+/* Elliptic curve Diffie-Hellman over the nistp256 curve. The messages
+   are those of diffie-hellman-group1-sha1, with the exchange values
+   being the encoded points Q_C and Q_S as strings instead of e and f:
+
+     SSH_MSG_KEXDH_INIT    string Q_C
+     SSH_MSG_KEXDH_REPLY   string K_S, string Q_S, string signature of H
+
+   The exchange hash is computed over V_C, V_S, I_C, I_S, K_S, Q_C, Q_S
+   and K, where K is the x coordinate of the shared point as an mpint.
+   K is kept in dh_k and the secret scalar in dh_secret, so the keys are
+   derived as with the other methods. */
+
+static SshECPCurve ssh_kexecdh_curve;
+static SshECPPoint ssh_kexecdh_generator;
+static Boolean ssh_kexecdh_curve_initialized = FALSE;
+
+/* Returns the curve, initializing it on the first use. The curve is
+   shared by all transports and never freed. */
+
+SshECPCurve *ssh_kexecdh_get_curve(SshECPPoint **generator)
+{
+  if (!ssh_kexecdh_curve_initialized)
+    {
+      if (!ssh_ecp_set_named_curve(&ssh_kexecdh_curve,
+                                   &ssh_kexecdh_generator, "nistp256"))
+        ssh_fatal("ssh_kexecdh_get_curve: nistp256 not supported");
+      ssh_kexecdh_curve_initialized = TRUE;
+    }
+  *generator = &ssh_kexecdh_generator;
+  return &ssh_kexecdh_curve;
+}
+
+/* Generate the secret scalar and our exchange point, which is stored
+   encoded in ecdh_q_s for the server and ecdh_q_c for the client. */
+
+void ssh_kexecdh_make_point(SshTransportCommon tr)
+{
+  SshECPCurve *E;
+  SshECPPoint *G, Q;
+  SshIntC t;
+  SshMpScratchFrame frame;
+  unsigned char *buf;
+  size_t len, i;
+
+  E = ssh_kexecdh_get_curve(&G);
+
+  /* The secret is from 1 to c - 1. Take 64 bits more than the order
+     has, so that the bias from the reduction is negligible. */
+
+  ssh_mp_set_ui(tr->dh_secret, 0);
+  for (i = 0; i < ssh_mp_byte_size(&E->c) + 8; i++)
+    {
+      ssh_mp_mul_2exp(tr->dh_secret, tr->dh_secret, 8);
+      ssh_mp_add_ui(tr->dh_secret, tr->dh_secret,
+                    ssh_random_get_byte(tr->random_state));
+    }
+  ssh_mp_init(t);
+  ssh_mp_sub_ui(t, &E->c, 1);
+  ssh_mp_mod(tr->dh_secret, tr->dh_secret, t);
+  ssh_mp_add_ui(tr->dh_secret, tr->dh_secret, 1);
+  ssh_mp_clear(t);
+
+  ssh_ecp_init_point(&Q);
+  ssh_mp_scratch_begin(&tr->dh_scratch, &frame, &E->q);
+  ssh_ecp_mul(&Q, G, tr->dh_secret, E);
+  ssh_mp_scratch_end(&frame);
+
+  len = ssh_ecp_point_to_buf(NULL, 0, &Q, E);
+  buf = ssh_xmalloc(len);
+  ssh_ecp_point_to_buf(buf, len, &Q, E);
+  ssh_ecp_clear_point(&Q);
+
+  if (tr->server)
+    {
+      if (tr->ecdh_q_s)
+        ssh_xfree(tr->ecdh_q_s);
+      tr->ecdh_q_s = buf;
+      tr->ecdh_q_s_len = len;
+    }
+  else
+    {
+      if (tr->ecdh_q_c)
+        ssh_xfree(tr->ecdh_q_c);
+      tr->ecdh_q_c = buf;
+      tr->ecdh_q_c_len = len;
+    }
+}
+
+/* Compute the shared secret and the exchange hash. Return TRUE on
+   failure, that is if the other side's point is not on the curve or the
+   shared point is the point at infinity. */
+
+Boolean ssh_kexecdh_compute_h(SshTransportCommon tr)
+{
+  SshECPCurve *E;
+  SshECPPoint *G, P;
+  SshBuffer *buf;
+  SshMpScratchFrame frame;
+  Boolean failed;
+
+  E = ssh_kexecdh_get_curve(&G);
+
+  if (tr->ecdh_q_c == NULL || tr->ecdh_q_s == NULL)
+    return TRUE;
+
+  ssh_ecp_init_point(&P);
+  if (tr->server)
+    failed = !ssh_ecp_buf_to_point(&P, tr->ecdh_q_c, tr->ecdh_q_c_len, E);
+  else
+    failed = !ssh_ecp_buf_to_point(&P, tr->ecdh_q_s, tr->ecdh_q_s_len, E);
+
+  if (!failed)
+    {
+      /* compute the shared secret */
+
+      ssh_mp_scratch_begin(&tr->dh_scratch, &frame, &E->q);
+      ssh_ecp_mul(&P, &P, tr->dh_secret, E);
+      ssh_mp_scratch_end(&frame);
+
+      if (P.z == 0)
+        failed = TRUE;
+      else
+        ssh_mp_set(tr->dh_k, &P.x);
+    }
+  ssh_ecp_clear_point(&P);
+
+  if (failed)
+    return TRUE;
+
+  /* ok, compute the exchange hash */
+
+  buf = ssh_kex_exchange_hash_start(tr);
+  buffer_put_uint32_string(buf, tr->ecdh_q_c, tr->ecdh_q_c_len);
+  buffer_put_uint32_string(buf, tr->ecdh_q_s, tr->ecdh_q_s_len);
+  buffer_put_mp_int_ssh2style(buf, tr->dh_k);
+  ssh_kex_exchange_hash_finish(tr, buf);
+
+  return FALSE;
+}
+
+/* client makes the SSH_MSG_KEXDH_INIT with Q_C */
+
+SshBuffer *ssh_kexecdh_client_make_kex1(SshTransportCommon tr)
+{
+  SshBuffer *packet;
+
+  ssh_kexecdh_make_point(tr);
+
+  packet = ssh_buffer_allocate();  
+  buffer_put_char(packet, SSH_MSG_KEXDH_INIT);
+  buffer_put_uint32_string(packet, tr->ecdh_q_c, tr->ecdh_q_c_len);
+
+  return packet;
+}
+
+/* server recieves the SSH_MSG_KEXDH_INIT and makes its point */
+
+Boolean ssh_kexecdh_server_input_kex1(SshTransportCommon tr, SshBuffer *input)
+{
+  unsigned char code;
+
+  code = buffer_get_char(input);
+
+  if (code != SSH_MSG_KEXDH_INIT)
+    {
+      ssh_debug("ssh_kexecdh_server_input_kex1: expected SSH_MSG_KEXDH_INIT"
+                ", got %d", (int) code);
+      ssh_buffer_free(input);
+      return FALSE;
+    }
+
+  if (tr->ecdh_q_c)
+    ssh_xfree(tr->ecdh_q_c);
+  tr->ecdh_q_c = buffer_get_uint32_string(input, &tr->ecdh_q_c_len);
+
+  ssh_kexecdh_make_point(tr);
+
+  return TRUE;
+}
+
+/* server creates the SSH_MSG_KEXDH_REPLY with Q_S */
+
+SshBuffer *ssh_kexecdh_server_make_kex2(SshTransportCommon tr)
+{
+  SshBuffer *packet;
+  unsigned char *signature;
+  size_t sig_len;
+
+  if (ssh_kexecdh_compute_h(tr))
+    return NULL;
+
+  if ((signature = ssh_kex_sign_exchange_hash(tr, &sig_len)) == NULL)
+    return NULL;
+
+  packet = ssh_buffer_allocate();
+  ssh_encode_buffer(packet, 
+                    SSH_FORMAT_CHAR, (unsigned int) SSH_MSG_KEXDH_REPLY,
+                    SSH_FORMAT_UINT32_STR, 
+                      ssh_buffer_ptr(tr->public_host_key_blob),
+                      ssh_buffer_len(tr->public_host_key_blob),
+                    SSH_FORMAT_UINT32_STR,
+                      tr->ecdh_q_s, tr->ecdh_q_s_len,
+                    SSH_FORMAT_UINT32_STR, signature, sig_len,
+                    SSH_FORMAT_END);
+
+  memset(signature, 0, sig_len);
+  ssh_xfree(signature);
+
+  /* we're ready to derive the keys */
+  ssh_kex_derive_keys(tr);
+
+  return packet;
+}
+
+/* Reads Q_S from the SSH_MSG_KEXDH_REPLY. */
+
+Boolean ssh_kexecdh_client_input_reply(SshTransportCommon tr,
+                                       SshBuffer *input)
+{
+  if (tr->ecdh_q_s)
+    ssh_xfree(tr->ecdh_q_s);
+  tr->ecdh_q_s = buffer_get_uint32_string(input, &tr->ecdh_q_s_len);
+  return ssh_kexecdh_compute_h(tr);
+}
+
+void ssh_kexecdh_client_input_kex2(SshTransportCommon tr, SshBuffer *input,
+                                   SshKex2CompletionProc finalize_callback)
+{
+  ssh_kex_client_input_reply(tr, input, finalize_callback,
+                             ssh_kexecdh_client_input_reply);
+}
+
 /* derive one key */
 
 void ssh_kex_derive_key(SshTransportCommon tr,
@@ -600,6 +899,13 @@ SshBuffer *ssh_kex_return_no_packet(SshTransportCommon tr)
 
 const struct SshKexTypeRec ssh_kex_algorithms[] =
 {
+  { "ecdh-nistp256-sha1@ssh.com", "sha1",
+    FALSE, TRUE,
+    ssh_kexecdh_client_make_kex1, ssh_kex_return_no_packet,
+    ssh_kex_return_no_packet, ssh_kexecdh_server_make_kex2,
+    NULL, ssh_kexecdh_server_input_kex1,
+    ssh_kexecdh_client_input_kex2, NULL },
+
   { "diffie-hellman-group1-sha1", "sha1",
     FALSE, TRUE,
     ssh_kexdh_client_make_kex1, ssh_kex_return_no_packet,
@@ -140,6 +140,43 @@ SshUInt32 crc32_buffer_altered(const unsigned char *s, size_t len)
   return crc32val;
 }
 
+/* Continue computing a 32-bit CRC over more data. */
+
+SshUInt32 crc32_buffer_continue(SshUInt32 crc32val,
+                                const unsigned char *s, size_t len)
+{
+  size_t i;
+  
+  for (i = 0;  i < len;  i ++)
+    {
+      crc32val =
+        crc32_tab[(crc32val ^ s[i]) & 0xff] ^
+          (crc32val >> 8);
+    }
+  return crc32val;
+}
+
+/* Generates the table for rolling a CRC over a window of the given
+   length: the CRC of each byte value followed by the window of
+   zeroes. */
+
+void crc32_roll_table(SshUInt32 *table, size_t window_len)
+{
+  unsigned int i;
+
+  for (i = 0; i < 256; i++)
+    table[i] = crc32_extend(crc32_tab[i], window_len);
+}
+
+/* Moves the window of a rolling CRC forward by one byte. */
+
+SshUInt32 crc32_roll(const SshUInt32 *table, SshUInt32 crc32val,
+                     unsigned int out, unsigned int in)
+{
+  return crc32_tab[(crc32val ^ in) & 0xff] ^ (crc32val >> 8) ^
+    table[out & 0xff];
+}
+
 /* Generates feedback terms table for crc32. Useful if table must be
    recreated later. */
 
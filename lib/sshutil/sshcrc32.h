@@ -58,6 +58,35 @@ SshUInt32 crc32_buffer(const unsigned char *buf, size_t len);
 
 SshUInt32 crc32_buffer_altered(const unsigned char *buf, size_t len);
 
+/* Continues computing a CRC with crc32_buffer: returns the CRC of the
+   data whose CRC was `crc32val', followed by the data in the buffer.
+   Calling this with `crc32val' zero is the same as crc32_buffer. */
+
+SshUInt32 crc32_buffer_continue(SshUInt32 crc32val,
+                                const unsigned char *buf, size_t len);
+
+/* A CRC of a window of `window_len' bytes that slides over a buffer a
+   byte at a time, such as when looking for blocks of known CRC at any
+   offset.  Moving the window only costs a few table lookups, instead
+   of computing the CRC of the whole window again.
+
+   crc32_roll_table fills the 256 entries of `table' for the length
+   of the window.  crc32_roll then returns the CRC of the window moved
+   forward by one byte, given the CRC of the window (as computed by
+   crc32_buffer), the byte leaving the window and the byte entering
+   it.
+
+   This works because a CRC without an initial value is linear, and
+   is not changed by leading zero bytes: the CRC of the window with a
+   byte appended is that of the byte followed by `window_len' zero
+   bytes, which is what the table holds, plus that of the moved
+   window. */
+
+void crc32_roll_table(SshUInt32 *table, size_t window_len);
+
+SshUInt32 crc32_roll(const SshUInt32 *table, SshUInt32 crc32val,
+                     unsigned int out, unsigned int in);
+
 /* Once in a while one has to compute CRC's of very long buffers.
    Indeed, of so long that one doesn't even want to do that very
    often, but for some reason needs to do. Thus it would be nice to
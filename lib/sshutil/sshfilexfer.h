@@ -141,6 +141,14 @@ SshFileClient ssh_file_client_wrap(SshStream stream);
    terminated without calling their callbacks. */
 void ssh_file_client_destroy(SshFileClient client);
 
+/* Returns TRUE if the server supports the protocol extension `name'
+   (for example "copy-data@ssh.com").  If `data' is not NULL, it is set to the
+   data the server gave for the extension.  This only knows the
+   extensions once the server has replied to the initialization, which
+   is always the case once any request has been replied to. */
+Boolean ssh_file_client_extension(SshFileClient client, const char *name,
+                                  const char **data);
+
 /* Sends a request to open a file, and calls the given callback when
    complete.  The callback will be called either during this call or
    any time later.  Attributes may be NULL to use default values. */
@@ -168,6 +176,76 @@ void ssh_file_client_write(SshFileHandle handle,
                            SshFileStatusCallback callback,
                            void *context);
 
+/* Sends a request to copy `len' bytes at `src_offset' in the file
+   `src_handle' to `dst_offset' in the file `dst_handle', and calls the
+   given callback when complete.  The data is copied by the server and
+   does not pass through the client.  Both handles must have been
+   opened through the same client, and the server must support the
+   "copy-data@ssh.com" extension; otherwise the callback gets
+   SSH_FX_FAILURE, as it does if `len' is over 64 MB.  SSH_FX_EOF
+   means the source file ended before all of the data was copied.  The
+   callback will be called either during this call or any time
+   later. */
+void ssh_file_client_copy_data(SshFileHandle src_handle,
+                               off_t src_offset,
+                               off_t len,
+                               SshFileHandle dst_handle,
+                               off_t dst_offset,
+                               SshFileStatusCallback callback,
+                               void *context);
+
+/* Sends a request to hash `len' bytes at `offset' in the file `handle'
+   with the hash function `hash_name', in blocks of `block_size'
+   bytes, and calls the given callback with the digests of the blocks
+   concatenated.  The last block may be short, and the file is only
+   hashed up to its end.  The server may return the digests of fewer
+   blocks than were asked for; the rest should be asked for again.
+   The callback gets SSH_FX_EOF if `offset' is at or past the end of
+   the file, and SSH_FX_FAILURE if the server does not support the
+   "block-hash@ssh.com" extension or the hash function, or if
+   `block_size' is over 64 MB; the extension data lists the hash
+   functions the server supports.  The callback will be called either
+   during this call or any time later. */
+void ssh_file_client_block_hash(SshFileHandle handle,
+                                const char *hash_name,
+                                off_t offset,
+                                off_t len,
+                                size_t block_size,
+                                SshFileDataCallback callback,
+                                void *context);
+
+/* Like ssh_file_client_block_hash, but uses the
+   "block-signatures@ssh.com" extension, which precedes the digest of
+   each block with the CRC-32 of the block (as computed by
+   crc32_buffer) in four bytes, most significant byte first.  The CRCs
+   can be rolled along another file with crc32_roll to find the blocks
+   in it cheaply. */
+void ssh_file_client_block_signatures(SshFileHandle handle,
+                                      const char *hash_name,
+                                      off_t offset,
+                                      off_t len,
+                                      size_t block_size,
+                                      SshFileDataCallback callback,
+                                      void *context);
+
+/* Sends a request to find which parts of `len' bytes at `offset' in
+   the file `handle' hold data, so that the holes of a sparse file
+   need not be read.  The callback gets an eight byte offset up to
+   which the answer is complete, followed by the offset and length of
+   each data extent in eight bytes each, all most significant byte
+   first (see SSH_GET_64BIT).  The rest of the file before that offset
+   reads as zeros; it may be less than `offset' + `len', in which case
+   the rest should be asked for again.  The callback gets SSH_FX_EOF
+   if `offset' is at or past the end of the file, and SSH_FX_FAILURE
+   if the server does not support the "data-extents@ssh.com"
+   extension.  The callback will be called either during this call or
+   any time later. */
+void ssh_file_client_data_extents(SshFileHandle handle,
+                                  off_t offset,
+                                  off_t len,
+                                  SshFileDataCallback callback,
+                                  void *context);
+
 /* Sends a close request, and calls the given callback when complete.  The
    callback will be called either during this call or any time later. */
 void ssh_file_client_close(SshFileHandle handle,
@@ -272,6 +350,17 @@ typedef struct SshFileServerRec *SshFileServer;
    The server is automatically destroyed when the connection is closed. */
 SshFileServer ssh_file_server_wrap(SshStream stream);
 
+/* Lets the server run up to `max_requests' requests at a time, each in
+   a worker thread of its own, so that a request that blocks on a slow
+   disk does not hold up the others.  The replies are then sent as the
+   requests complete, which may be in a different order than the
+   requests came in; requests on a handle being closed are all done
+   before the reply to the close.  This must be called right after
+   ssh_file_server_wrap.  Without a call, or if threads or pread and
+   pwrite are not available, the requests are processed one at a time
+   as they are received. */
+void ssh_file_server_set_concurrency(SshFileServer server, int max_requests);
+
 
 /* Internal definitions */
 
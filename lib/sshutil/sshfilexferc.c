@@ -16,6 +16,15 @@ Generic file transfer module, client side.
 #include "sshpacketstream.h"
 #include "sshfilexfer.h"
 #include "sshfilexferi.h"
+#include "sshmapping.h"
+
+/* Number of READDIR requests kept outstanding while a directory is
+   being read. */
+#define SSH_FILE_CLIENT_READDIR_AHEAD      4
+
+/* No more READDIR requests are sent while this many names are waiting
+   to be returned. */
+#define SSH_FILE_CLIENT_READDIR_MAX_NAMES  1024
 
 /* Enumerated type for indicating what kind of a reply we are
    expecting for a server. */
@@ -34,7 +43,11 @@ typedef enum {
   SSH_FILEXFER_NAME_REPLY,
 
   /* Expecting SSH_FXP_ATTRS or SSH_FXP_STATUS reply. */
-  SSH_FILEXFER_ATTRS_REPLY
+  SSH_FILEXFER_ATTRS_REPLY,
+
+  /* Expecting SSH_FXP_EXTENDED_REPLY or SSH_FXP_STATUS reply.  The
+     data of the reply is passed to the data callback. */
+  SSH_FILEXFER_EXTENDED_REPLY
 } SshFileClientExpect;
 
 /* Internal data structure for a file handle.  File handles are essentially
@@ -52,12 +65,33 @@ struct SshFileHandleRec
   /* Back-pointer to the client object. */
   SshFileClient client;
   
-  /* An array of cached names during readdir. */
+  /* An array of cached names during readdir.  Names before `next_name'
+     have already been returned, and have been freed. */
   unsigned int num_names;
   unsigned int next_name;
   char **names;
   char **long_names;
   SshFileAttributes *attrs;
+
+  /* Number of READDIR requests sent and not yet replied to.  Several
+     are kept outstanding so that the names arrive while the previous
+     ones are being processed. */
+  unsigned int readdir_outstanding;
+
+  /* TRUE when the server has returned an end of directory or an error
+     for a READDIR request; `readdir_error' is then returned after the
+     cached names. */
+  Boolean readdir_done;
+  SshFileClientError readdir_error;
+
+  /* Callback of a ssh_file_client_readdir call that is waiting for
+     names from the server, or NULL. */
+  SshFileNameCallback readdir_callback;
+  void *readdir_context;
+
+  /* TRUE if the handle has been closed while READDIR requests were
+     outstanding.  It is freed when the last of them is replied to. */
+  Boolean closed;
 };
 
 /* Data structure for an outstanding request.  Some requests have already been
@@ -125,6 +159,12 @@ struct SshFileClientRec
      after version_received has been set. */
   SshUInt32 version;
 
+  /* The extensions listed by the server in its version message, and
+     the data given for each. */
+  unsigned int num_extensions;
+  char **extension_names;
+  char **extension_data;
+
   /* The next unused request id.  This is used to generate request identifiers,
      and is incremented by one every time a new identifier is allocated.
      There is currently no check for this wrapping around; it is simply
@@ -132,14 +172,17 @@ struct SshFileClientRec
      completed by then. */
   SshUInt32 next_id;
 
-  /* Linked list of requests that have been sent but for which no answer
-     has been received yet. */
-  SshFileClientRequest sent_requests;
+  /* Requests that have been sent but for which no answer has been
+     received yet, indexed by their identifiers. */
+  SshMapping sent_requests;
 
   /* Linked list of requests that have been issued but that have not yet been
      sent for one reason or another (typically because the link is saturated
-     and cannot receive more requests at this time). */
+     and cannot receive more requests at this time).  New requests are
+     added at the tail and sent from the head, so that they go out in the
+     order they were made. */
   SshFileClientRequest queued_requests;
+  SshFileClientRequest queued_requests_tail;
 
   /* Flag indicating that EOF has been received from the other end.  When this
      happens, all outstanding requests are immediately completed with an
@@ -157,6 +200,36 @@ void ssh_file_client_free_request(SshFileClientRequest request)
   ssh_xfree(request);
 }
 
+/* Adds the request to the table of sent requests. */
+
+void ssh_file_client_add_sent(SshFileClient client,
+                              SshFileClientRequest request)
+{
+  unsigned long key = request->id;
+
+  request->next = NULL;
+  ssh_mapping_put(client->sent_requests, &key, (void *)request);
+}
+
+/* Removes all requests from the table of sent requests, and returns
+   them as a list. */
+
+SshFileClientRequest ssh_file_client_take_sent(SshFileClient client)
+{
+  SshFileClientRequest request, list;
+  unsigned long key;
+
+  list = NULL;
+  ssh_mapping_reset_index(client->sent_requests);
+  while (ssh_mapping_get_next(client->sent_requests, &key, &request))
+    {
+      request->next = list;
+      list = request;
+    }
+  ssh_mapping_clear(client->sent_requests);
+  return list;
+}
+
 /* Tries to send queued requests to the server. */
 
 void ssh_file_client_try_send(SshFileClient client)
@@ -181,58 +254,40 @@ void ssh_file_client_try_send(SshFileClient client)
       /* Take a request from the queue. */
       request = client->queued_requests;
       client->queued_requests = request->next;
+      if (client->queued_requests == NULL)
+        client->queued_requests_tail = NULL;
 
       /* Send the request to the other side. */
       ssh_packet_wrapper_send(client->conn, request->packet_type,
                               request->request, request->request_len);
 
-      /* Put the request in the waiting queue. */
-      request->next = client->sent_requests;
-      client->sent_requests = request;
+      /* Put the request among those waiting for a reply. */
+      ssh_file_client_add_sent(client, request);
     }
 }
 
-/* Looks up a request with the specified id from the client's sent_requests
-   list.  Removes the request from the list and returns it. */
+/* Looks up a request with the specified id from the client's sent
+   requests.  Removes the request from them and returns it, or returns
+   NULL if there is no such request. */
 
 SshFileClientRequest ssh_file_client_find_request(SshFileClient client,
                                                   unsigned int id)
 {
-  SshFileClientRequest request, *requestp;
-
-  /* Look for a request with the given id. */
-  for (requestp = &client->sent_requests; *requestp;
-       requestp = &(*requestp)->next)
-    if ((*requestp)->id == id)
-      break;
+  SshFileClientRequest request;
+  unsigned long key = id;
 
-  /* Remove the matching request from the list. */
-  request = *requestp;
-  *requestp = request->next;
+  if (!ssh_mapping_remove(client->sent_requests, &key, &request))
+    return NULL;
 
   return request;
 }
   
-/* Call the callback of the request, returning the specified status.  This
-   is typically used for status replies. */
-  
-void ssh_file_client_return_status(SshFileClient client,
-                                   unsigned int id,
-                                   SshFileClientError error)
-{
-  SshFileClientRequest request;
-
-  /* Look up a matching request. */
-  request = ssh_file_client_find_request(client, id);
+/* Call the callback of the request, returning the specified status,
+   and free the request. */
 
-  /* Check if a request was found. */
-  if (request == NULL)
-    {
-      ssh_warning("ssh_file_client_return_status: id %d not found, error %d",
-                  id, (int)error);
-      return;
-    }
-  
+void ssh_file_client_complete_request(SshFileClientRequest request,
+                                      SshFileClientError error)
+{
   /* Call the callback with the appropriate status. */
   switch (request->expected_reply)
     {
@@ -247,6 +302,7 @@ void ssh_file_client_return_status(SshFileClient client,
       break;
       
     case SSH_FILEXFER_DATA_REPLY:
+    case SSH_FILEXFER_EXTENDED_REPLY:
       if (request->data_callback)
         (*request->data_callback)(error, NULL, (size_t)0, request->context);
       break;
@@ -270,6 +326,29 @@ void ssh_file_client_return_status(SshFileClient client,
   ssh_file_client_free_request(request);
 }
 
+/* Call the callback of the request with the given id, returning the
+   specified status.  This is typically used for status replies. */
+  
+void ssh_file_client_return_status(SshFileClient client,
+                                   unsigned int id,
+                                   SshFileClientError error)
+{
+  SshFileClientRequest request;
+
+  /* Look up a matching request. */
+  request = ssh_file_client_find_request(client, id);
+
+  /* Check if a request was found. */
+  if (request == NULL)
+    {
+      ssh_warning("ssh_file_client_return_status: id %d not found, error %d",
+                  id, (int)error);
+      return;
+    }
+
+  ssh_file_client_complete_request(request, error);
+}
+
 /* Creates a file handle out of the specified value.  The value is made
    part of the handle, and will be freed automatically when the handle
    is freed. */
@@ -290,6 +369,12 @@ SshFileHandle ssh_file_client_make_handle(SshFileClient client,
   handle->names = NULL;
   handle->long_names = NULL;
   handle->attrs = NULL;
+  handle->readdir_outstanding = 0;
+  handle->readdir_done = FALSE;
+  handle->readdir_error = SSH_FX_EOF;
+  handle->readdir_callback = NULL;
+  handle->readdir_context = NULL;
+  handle->closed = FALSE;
   return handle;
 }
 
@@ -300,7 +385,7 @@ void ssh_file_client_free_handle(SshFileHandle handle)
   unsigned int i;
   
   ssh_xfree(handle->value);
-  for (i = 0; i < handle->num_names; i++)
+  for (i = handle->next_name; i < handle->num_names; i++)
     {
       ssh_xfree(handle->names[i]);
       ssh_xfree(handle->long_names[i]);
@@ -346,9 +431,13 @@ SshFileClientRequest ssh_file_request(SshFileClient client,
   /* Free the buffer. */
   ssh_buffer_uninit(&buffer);
 
-  /* Add the request to the list of queued requests. */
-  request->next = client->queued_requests;
-  client->queued_requests = request;
+  /* Add the request to the end of the list of queued requests. */
+  request->next = NULL;
+  if (client->queued_requests_tail == NULL)
+    client->queued_requests = request;
+  else
+    client->queued_requests_tail->next = request;
+  client->queued_requests_tail = request;
   
   /* Try to send the request.  If we must wait, the request is left in
      a queue. */
@@ -480,6 +569,155 @@ void ssh_file_client_write(SshFileHandle handle,
   request->context = context;
 }
 
+/* Sends a copy-data request. */
+
+void ssh_file_client_copy_data(SshFileHandle src_handle,
+                               off_t src_offset,
+                               off_t len,
+                               SshFileHandle dst_handle,
+                               off_t dst_offset,
+                               SshFileStatusCallback callback,
+                               void *context)
+{
+  SshFileClientRequest request;
+
+  SSH_PRECOND(src_handle->client == dst_handle->client);
+
+  if (src_handle->client->eof_received)
+    {
+      (*callback)(SSH_FX_CONNECTION_LOST, context);
+      return;
+    }
+
+  if (!ssh_file_client_extension(src_handle->client, SSH_FXE_COPY_DATA,
+                                 NULL))
+    {
+      (*callback)(SSH_FX_FAILURE, context);
+      return;
+    }
+
+  request = ssh_file_request(src_handle->client, SSH_FXP_EXTENDED,
+                             SSH_FILEXFER_STATUS_REPLY,
+                             SSH_FORMAT_UINT32_STR, 
+                               SSH_FXE_COPY_DATA, strlen(SSH_FXE_COPY_DATA),
+                             SSH_FORMAT_UINT32_STR, 
+                               src_handle->value, src_handle->len,
+                             SSH_FORMAT_UINT64, (SshUInt64)src_offset,
+                             SSH_FORMAT_UINT64, (SshUInt64)len,
+                             SSH_FORMAT_UINT32_STR, 
+                               dst_handle->value, dst_handle->len,
+                             SSH_FORMAT_UINT64, (SshUInt64)dst_offset,
+                             SSH_FORMAT_END);
+  request->status_callback = callback;
+  request->context = context;
+}
+
+/* Sends a block-hash or block-signatures request; they take the same
+   arguments. */
+
+void ssh_file_client_block_request(const char *extension,
+                                   SshFileHandle handle,
+                                   const char *hash_name,
+                                   off_t offset,
+                                   off_t len,
+                                   size_t block_size,
+                                   SshFileDataCallback callback,
+                                   void *context)
+{
+  SshFileClientRequest request;
+
+  if (handle->client->eof_received)
+    {
+      (*callback)(SSH_FX_CONNECTION_LOST, NULL, (size_t)0, context);
+      return;
+    }
+
+  if (!ssh_file_client_extension(handle->client, extension, NULL))
+    {
+      (*callback)(SSH_FX_FAILURE, NULL, (size_t)0, context);
+      return;
+    }
+
+  request = ssh_file_request(handle->client, SSH_FXP_EXTENDED,
+                             SSH_FILEXFER_EXTENDED_REPLY,
+                             SSH_FORMAT_UINT32_STR, 
+                               extension, strlen(extension),
+                             SSH_FORMAT_UINT32_STR, 
+                               handle->value, handle->len,
+                             SSH_FORMAT_UINT32_STR, 
+                               hash_name, strlen(hash_name),
+                             SSH_FORMAT_UINT64, (SshUInt64)offset,
+                             SSH_FORMAT_UINT64, (SshUInt64)len,
+                             SSH_FORMAT_UINT32, (SshUInt32)block_size,
+                             SSH_FORMAT_END);
+  request->data_callback = callback;
+  request->context = context;
+}
+
+/* Sends a block-hash request. */
+
+void ssh_file_client_block_hash(SshFileHandle handle,
+                                const char *hash_name,
+                                off_t offset,
+                                off_t len,
+                                size_t block_size,
+                                SshFileDataCallback callback,
+                                void *context)
+{
+  ssh_file_client_block_request(SSH_FXE_BLOCK_HASH, handle, hash_name,
+                                offset, len, block_size, callback, context);
+}
+
+/* Sends a block-signatures request. */
+
+void ssh_file_client_block_signatures(SshFileHandle handle,
+                                      const char *hash_name,
+                                      off_t offset,
+                                      off_t len,
+                                      size_t block_size,
+                                      SshFileDataCallback callback,
+                                      void *context)
+{
+  ssh_file_client_block_request(SSH_FXE_BLOCK_SIGNATURES, handle, hash_name,
+                                offset, len, block_size, callback, context);
+}
+
+/* Sends a data-extents request. */
+
+void ssh_file_client_data_extents(SshFileHandle handle,
+                                  off_t offset,
+                                  off_t len,
+                                  SshFileDataCallback callback,
+                                  void *context)
+{
+  SshFileClientRequest request;
+
+  if (handle->client->eof_received)
+    {
+      (*callback)(SSH_FX_CONNECTION_LOST, NULL, (size_t)0, context);
+      return;
+    }
+
+  if (!ssh_file_client_extension(handle->client, SSH_FXE_DATA_EXTENTS, NULL))
+    {
+      (*callback)(SSH_FX_FAILURE, NULL, (size_t)0, context);
+      return;
+    }
+
+  request = ssh_file_request(handle->client, SSH_FXP_EXTENDED,
+                             SSH_FILEXFER_EXTENDED_REPLY,
+                             SSH_FORMAT_UINT32_STR, 
+                               SSH_FXE_DATA_EXTENTS,
+                               strlen(SSH_FXE_DATA_EXTENTS),
+                             SSH_FORMAT_UINT32_STR, 
+                               handle->value, handle->len,
+                             SSH_FORMAT_UINT64, (SshUInt64)offset,
+                             SSH_FORMAT_UINT64, (SshUInt64)len,
+                             SSH_FORMAT_END);
+  request->data_callback = callback;
+  request->context = context;
+}
+
 /* Sends a close request. */
 
 void ssh_file_client_close(SshFileHandle handle,
@@ -503,8 +741,12 @@ void ssh_file_client_close(SshFileHandle handle,
   request->status_callback = callback;
   request->context = context;
 
-  /* Free the file handle. */
-  ssh_file_client_free_handle(handle);
+  /* Free the file handle, or let the last outstanding READDIR reply
+     free it. */
+  if (handle->readdir_outstanding > 0)
+    handle->closed = TRUE;
+  else
+    ssh_file_client_free_handle(handle);
 }
 
 /* Sends a stat request. */
@@ -665,43 +907,139 @@ void ssh_file_client_opendir(SshFileClient client,
   request->context = context;
 }
 
-/* Read the next directory entry. */
+/* Returns the next cached name of the directory to `callback', or
+   the end of directory or error if there are no more names coming.
+   Returns FALSE if names must still be waited for. */
 
-void ssh_file_client_readdir(SshFileHandle handle,
-                             SshFileNameCallback callback,
-                             void *context)
+Boolean ssh_file_client_readdir_return(SshFileHandle handle,
+                                       SshFileNameCallback callback,
+                                       void *context)
 {
-  SshFileClientRequest request;
+  char *name, *long_name;
+  SshFileAttributes attrs;
   unsigned int a;
-  
-  /* If we already have a cached name, return it immediately. */
+
   if (handle->next_name < handle->num_names)
     {
       a = handle->next_name++;
-      (*callback)(SSH_FX_OK, 
-                  handle->names[a], 
-                  handle->long_names[a], 
-                  handle->attrs[a],               
-                  context);
-      return;
+      name = handle->names[a];
+      long_name = handle->long_names[a];
+      attrs = handle->attrs[a];
+
+      /* The callback may close the handle, so nothing in it is used
+         after the call. */
+      (*callback)(SSH_FX_OK, name, long_name, attrs, context);
+      ssh_xfree(name);
+      ssh_xfree(long_name);
+      ssh_xfree(attrs);
+      return TRUE;
     }
 
-  /* If we have received EOF, fail immediately. */
-  if (handle->client->eof_received)
+  if (handle->readdir_done && handle->readdir_outstanding == 0)
+    {
+      (*callback)(handle->readdir_error, NULL, NULL, NULL, context);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Called when a READDIR request has been replied to.  Frees the handle
+   if it has been closed, and otherwise returns a name to a waiting
+   readdir call.  Returns FALSE if the handle was freed. */
+
+Boolean ssh_file_client_readdir_reply(SshFileHandle handle)
+{
+  SshFileNameCallback callback;
+
+  handle->readdir_outstanding--;
+  if (handle->closed)
+    {
+      if (handle->readdir_outstanding == 0)
+        ssh_file_client_free_handle(handle);
+      return FALSE;
+    }
+
+  callback = handle->readdir_callback;
+  if (callback)
+    {
+      handle->readdir_callback = NULL;
+      if (!ssh_file_client_readdir_return(handle, callback,
+                                          handle->readdir_context))
+        handle->readdir_callback = callback;
+    }
+  return TRUE;
+}
+
+/* Called when a READDIR request gets a status reply: the end of the
+   directory, or an error. */
+
+void ssh_file_client_readdir_status(SshFileClientError error,
+                                    const char *name,
+                                    const char *long_name,
+                                    SshFileAttributes attrs,
+                                    void *context)
+{
+  SshFileHandle handle = (SshFileHandle)context;
+
+  /* Keep the first error; later requests are likely to just get an
+     end of directory. */
+  if (!handle->readdir_done || handle->readdir_error == SSH_FX_EOF)
+    handle->readdir_error = error;
+  handle->readdir_done = TRUE;
+  ssh_file_client_readdir_reply(handle);
+}
+
+/* Sends READDIR requests until enough of them are outstanding, or
+   enough names are cached. */
+
+void ssh_file_client_readdir_ahead(SshFileHandle handle)
+{
+  SshFileClientRequest request;
+
+  while (!handle->readdir_done && !handle->client->eof_received &&
+         handle->readdir_outstanding < SSH_FILE_CLIENT_READDIR_AHEAD &&
+         handle->num_names - handle->next_name <
+           SSH_FILE_CLIENT_READDIR_MAX_NAMES)
+    {
+      request = ssh_file_request(handle->client, SSH_FXP_READDIR,
+                                 SSH_FILEXFER_NAME_REPLY,
+                                 SSH_FORMAT_UINT32_STR, 
+                                   handle->value, handle->len,
+                                 SSH_FORMAT_END);
+      request->name_callback = ssh_file_client_readdir_status;
+      request->context = (void *)handle;
+      request->handle = handle;
+      handle->readdir_outstanding++;
+    }
+}
+
+/* Read the next directory entry.  The names are requested from the
+   server ahead of the calls, and cached in the handle. */
+
+void ssh_file_client_readdir(SshFileHandle handle,
+                             SshFileNameCallback callback,
+                             void *context)
+{
+  SSH_PRECOND(handle->readdir_callback == NULL);
+
+  /* Request more names before returning a cached one, as the callback
+     may close the handle. */
+  ssh_file_client_readdir_ahead(handle);
+
+  if (ssh_file_client_readdir_return(handle, callback, context))
+    return;
+
+  /* If we have received EOF, no more names can come. */
+  if (handle->readdir_outstanding == 0)
     {
       (*callback)(SSH_FX_CONNECTION_LOST, NULL, NULL, NULL, context);
       return;
     }
   
-  /* Otherwise, request more names from the server. */
-  request = ssh_file_request(handle->client, SSH_FXP_READDIR,
-                             SSH_FILEXFER_NAME_REPLY,
-                             SSH_FORMAT_UINT32_STR, 
-                               handle->value, handle->len,
-                             SSH_FORMAT_END);
-  request->name_callback = callback;
-  request->context = context;
-  request->handle = handle;
+  /* Otherwise, wait for the names from the server. */
+  handle->readdir_callback = callback;
+  handle->readdir_context = context;
 }
 
 /* Remove a file */
@@ -822,21 +1160,47 @@ void ssh_file_client_receive_proc(SshPacketType type,
   SshFileHandle handle;
   size_t bytes, slen, offset;
   SshUInt32 u, id;
-  unsigned int i, a;
+  unsigned int i, n;
   unsigned char *s, *name, *long_name;
   SshFileAttributes attrs;
   
   switch (type)
     {
     case SSH_FXP_VERSION:
-      if (ssh_decode_array(data, len,
-                           SSH_FORMAT_UINT32, &u,
-                           SSH_FORMAT_END) != len)
+      bytes = ssh_decode_array(data, len,
+                               SSH_FORMAT_UINT32, &u,
+                               SSH_FORMAT_END);
+      if (bytes == 0 || (u < 1 && bytes != len))
         {
           ssh_warning("ssh_file_client_receive_proc: bad VERSION");
           return;
         }
       client->version = (u < SSH_FILEXFER_VERSION) ? u : SSH_FILEXFER_VERSION;
+
+      /* From version 1 on, the rest of the message lists the extensions
+         the server supports. */
+      for (offset = bytes; offset < len; offset += bytes)
+        {
+          bytes = ssh_decode_array(data + offset, len - offset,
+                                   SSH_FORMAT_UINT32_STR, &name, NULL,
+                                   SSH_FORMAT_UINT32_STR, &long_name, NULL,
+                                   SSH_FORMAT_END);
+          if (bytes == 0)
+            {
+              ssh_warning("ssh_file_client_receive_proc: bad VERSION "
+                          "extension");
+              break;
+            }
+          client->extension_names =
+            ssh_xrealloc(client->extension_names,
+                         (client->num_extensions + 1) * sizeof(char *));
+          client->extension_data =
+            ssh_xrealloc(client->extension_data,
+                         (client->num_extensions + 1) * sizeof(char *));
+          client->extension_names[client->num_extensions] = (char *)name;
+          client->extension_data[client->num_extensions] = (char *)long_name;
+          client->num_extensions++;
+        }
       client->version_received = TRUE;
       ssh_file_client_try_send(client);
       break;
@@ -991,87 +1355,67 @@ void ssh_file_client_receive_proc(SshPacketType type,
           return;
         }
       
-      /* Sanity check: should not have any unprocessed names left. */
-      if (handle->next_name < handle->num_names)
-        ssh_warning("ssh_file_client_receive_proc: names still left");
-
-      /* Free any previous names. */
-      for (i = 0; i < handle->num_names; i++)
+      /* Move the names not yet returned to the start of the arrays,
+         and make room for the new ones after them. */
+      n = handle->num_names - handle->next_name;
+      if (handle->next_name > 0)
         {
-          ssh_xfree(handle->names[i]);
-          ssh_xfree(handle->long_names[i]);
-          ssh_xfree(handle->attrs[i]);
+          memmove(handle->names, handle->names + handle->next_name,
+                  n * sizeof(handle->names[0]));
+          memmove(handle->long_names,
+                  handle->long_names + handle->next_name,
+                  n * sizeof(handle->long_names[0]));
+          memmove(handle->attrs, handle->attrs + handle->next_name,
+                  n * sizeof(handle->attrs[0]));
+          handle->next_name = 0;
+          handle->num_names = n;
         }
-      ssh_xfree(handle->names);
-      ssh_xfree(handle->long_names);
-      ssh_xfree(handle->attrs);
-      
+      if (n + u > 0)
+        {
+          handle->names = ssh_xrealloc(handle->names,
+                                       (n + u) * sizeof(handle->names[0]));
+          handle->long_names =
+            ssh_xrealloc(handle->long_names,
+                         (n + u) * sizeof(handle->long_names[0]));
+          handle->attrs = ssh_xrealloc(handle->attrs,
+                                       (n + u) * sizeof(handle->attrs[0]));
+        }
+
       /* Parse the names from the message. */
-      handle->names = ssh_xcalloc(u, sizeof(handle->names[0]));
-      handle->long_names = ssh_xcalloc(u, sizeof(handle->long_names[0]));
-      handle->attrs = ssh_xcalloc(u, sizeof(handle->attrs[0]));
       offset = bytes;
-
       for (i = 0; i < u; i++)
         {
           bytes = ssh_decode_array(data + offset, len - offset,
                                    SSH_FORMAT_UINT32_STR,
-                                     &handle->names[i], NULL,
+                                     &handle->names[n + i], NULL,
                                    SSH_FORMAT_UINT32_STR,
-                                     &handle->long_names[i], NULL,
+                                     &handle->long_names[n + i], NULL,
                                    SSH_FORMAT_EXTENDED, 
                                      ssh_file_attrs_decoder, 
-                                     &handle->attrs[i],
+                                     &handle->attrs[n + i],
                                    SSH_FORMAT_END);
           if (bytes == 0)
-            {
-              ssh_warning("ssh_file_client_receive_proc: bad NAME %d", i);
-              for (; i > 0; i--)
-                {
-                  ssh_xfree(handle->names[i - 1]);
-                  ssh_xfree(handle->long_names[i - 1]);
-                  ssh_xfree(handle->attrs[i - 1]);
-                }
-              ssh_xfree(handle->names);
-              ssh_xfree(handle->long_names);
-              ssh_xfree(handle->attrs);       
-              handle->names = NULL;
-              handle->long_names = NULL;
-              handle->attrs = NULL;
-              handle->num_names = 0;
-              handle->next_name = 0;
-              return;
-            }
+            break;
 
           /* Move to next name. */
           offset += bytes;
         }
-      handle->num_names = u;
-      handle->next_name = 0;
+      handle->num_names = n + i;
 
-      /* Should have consumed all data. */
-      if (offset != len)
+      /* Should have consumed all data.  A bad reply ends the
+         directory. */
+      if (i < u || offset != len)
         {
           ssh_warning("ssh_file_client_receive_proc: bad NAME %d", i);
-          return;
+          ssh_file_client_readdir_status(SSH_FX_BAD_MESSAGE, NULL, NULL, NULL,
+                                         (void *)handle);
+          break;
         }
 
-      /* Call the callback.  If none was supplied, free the handle. */
-      if (request->name_callback)
-        {
-          if (handle->next_name < handle->num_names)
-            {
-              a = handle->next_name++;        
-              (*request->name_callback)(SSH_FX_OK,
-                                        handle->names[a],
-                                        handle->long_names[a],
-                                        handle->attrs[a],
-                                        request->context);
-            }
-          else
-            (*request->name_callback)(SSH_FX_EOF, NULL, NULL, NULL,
-                                      request->context);
-        }
+      /* Return a name if one is waited for, and keep the next names
+         coming. */
+      if (ssh_file_client_readdir_reply(handle))
+        ssh_file_client_readdir_ahead(handle);
       break;
 
     case SSH_FXP_ATTRS:
@@ -1107,6 +1451,40 @@ void ssh_file_client_receive_proc(SshPacketType type,
       ssh_xfree(attrs);
       break;
 
+    case SSH_FXP_EXTENDED_REPLY:
+      bytes = ssh_decode_array(data, len,
+                               SSH_FORMAT_UINT32, &id,
+                               SSH_FORMAT_END);
+      if (bytes == 0)
+        {
+          ssh_warning("ssh_file_client_receive_proc: bad EXTENDED_REPLY");
+          return;
+        }
+
+      /* Try to find a matching request. */
+      request = ssh_file_client_find_request(client, id);
+      if (!request)
+        {
+          /* No such request found. */
+          ssh_warning("ssh_file_client_receive_proc: unknown "
+                      "EXTENDED_REPLY");
+          return;
+        }
+
+      /* Check that the request really expects a reply of this type. */
+      if (request->expected_reply != SSH_FILEXFER_EXTENDED_REPLY)
+        {
+          ssh_warning("ssh_file_client_receive_proc: unexpected "
+                      "EXTENDED_REPLY");
+          return;
+        }
+
+      /* The rest of the reply is specific to the extension. */
+      if (request->data_callback)
+        (*request->data_callback)(SSH_FX_OK, data + bytes, len - bytes,
+                                  request->context);
+      break;
+
     default:
       ssh_warning("ssh_file_client_receive_proc: unexpected packet %d",
                   (int)type);
@@ -1118,23 +1496,27 @@ void ssh_file_client_receive_proc(SshPacketType type,
 void ssh_file_client_eof_proc(void *context)
 {
   SshFileClient client = (SshFileClient)context;
+  SshFileClientRequest request, next_request;
 
   /* Mark that we have received EOF. */
   client->eof_received = TRUE;
 
   /* Complete all sent requests with an error. */
-  while (client->sent_requests)
-    ssh_file_client_return_status(client, client->sent_requests->id,
-                                  SSH_FX_CONNECTION_LOST);
-
-  /* Fake sending of queued requests. */
-  client->sent_requests = client->queued_requests;
-  client->queued_requests = NULL;
+  for (request = ssh_file_client_take_sent(client); request;
+       request = next_request)
+    {
+      next_request = request->next;
+      ssh_file_client_complete_request(request, SSH_FX_CONNECTION_LOST);
+    }
 
-  /* Then complete them all with an error. */
-  while (client->sent_requests)
-    ssh_file_client_return_status(client, client->sent_requests->id,
-                                  SSH_FX_CONNECTION_LOST);
+  /* Then complete the queued requests with an error. */
+  while ((request = client->queued_requests) != NULL)
+    {
+      client->queued_requests = request->next;
+      if (client->queued_requests == NULL)
+        client->queued_requests_tail = NULL;
+      ssh_file_client_complete_request(request, SSH_FX_CONNECTION_LOST);
+    }
 }
 
 /* This function is called whenever we can send again after can_send
@@ -1159,8 +1541,11 @@ SshFileClient ssh_file_client_wrap(SshStream stream)
   client = ssh_xmalloc(sizeof(*client));
   memset(client, 0, sizeof(*client));
   client->next_id = 0;
-  client->sent_requests = NULL;
+  client->sent_requests =
+    ssh_mapping_allocate(SSH_MAPPING_TYPE_INTEGER_POINTER,
+                         sizeof(unsigned long), sizeof(SshFileClientRequest));
   client->queued_requests = NULL;
+  client->queued_requests_tail = NULL;
   client->version_received = FALSE;
   client->eof_received = FALSE;
 
@@ -1173,7 +1558,8 @@ SshFileClient ssh_file_client_wrap(SshStream stream)
 
   /* Send initialization packet. */
   ssh_packet_wrapper_send_encode(client->conn, SSH_FXP_INIT,
-                                 SSH_FORMAT_UINT32, (SshUInt32) 0,
+                                 SSH_FORMAT_UINT32,
+                                   (SshUInt32) SSH_FILEXFER_VERSION,
                                  SSH_FORMAT_END);
 
   return client;
@@ -1185,21 +1571,48 @@ SshFileClient ssh_file_client_wrap(SshStream stream)
 void ssh_file_client_destroy(SshFileClient client)
 {
   SshFileClientRequest request, next_request;
+  unsigned int i;
 
   ssh_packet_wrapper_destroy(client->conn);
-  for (request = client->sent_requests; request; request = next_request)
+  for (request = ssh_file_client_take_sent(client); request;
+       request = next_request)
     {
       next_request = request->next;
       ssh_file_client_free_request(request);
     }
+  ssh_mapping_free(client->sent_requests);
   for (request = client->queued_requests; request; request = next_request)
     {
       next_request = request->next;
       ssh_file_client_free_request(request);
     }
+  for (i = 0; i < client->num_extensions; i++)
+    {
+      ssh_xfree(client->extension_names[i]);
+      ssh_xfree(client->extension_data[i]);
+    }
+  ssh_xfree(client->extension_names);
+  ssh_xfree(client->extension_data);
   memset(client, 'F', sizeof(*client));
   ssh_xfree(client);
 }
 
+/* Returns TRUE if the server supports the extension `name'. */
+
+Boolean ssh_file_client_extension(SshFileClient client, const char *name,
+                                  const char **data)
+{
+  unsigned int i;
+
+  for (i = 0; i < client->num_extensions; i++)
+    if (strcmp(client->extension_names[i], name) == 0)
+      {
+        if (data)
+          *data = client->extension_data[i];
+        return TRUE;
+      }
+  return FALSE;
+}
+
 /* XXX should we handle timeouts here? */
 /* XXX check sending requests before version number received. */
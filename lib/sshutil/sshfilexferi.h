@@ -25,6 +25,12 @@ Protocol:
   server:
     SSH_FXP_VERSION
       uint32   version
+      [ from version 1 on, repeated until the end of the message: ]
+        string   extension_name
+        string   extension_data
+
+  The client may only send SSH_FXP_EXTENDED requests for extensions
+  the server has listed in its SSH_FXP_VERSION message.
 
   client:
     SSH_FXP_OPEN -> STATUS / HANDLE
@@ -81,6 +87,65 @@ Protocol:
     SSH_FXP_STAT -> STATUS / ATTRS
       uint32   id
       string   name
+    SSH_FXP_EXTENDED -> STATUS / EXTENDED_REPLY
+      uint32   id
+      string   extension_name
+      ...      data specific to the extension
+
+  extensions:
+    "copy-data@ssh.com" -> STATUS
+      string   handle_from
+      uint64   offset_from
+      uint64   length
+      string   handle_to
+      uint64   offset_to
+      Copies `length' bytes from one open file to another on the server
+      (or to another place in the same file).  Both handles must belong
+      to the same connection.  Returns SSH_FX_EOF if the source file
+      ends before `length' bytes have been copied.  A `length' of 0
+      copies nothing.  The server may refuse lengths over 64 MB with
+      SSH_FX_FAILURE.
+    "block-hash@ssh.com" -> STATUS / EXTENDED_REPLY
+      string   handle
+      string   hash_name
+      uint64   offset
+      uint64   length
+      uint32   block_size
+      Hashes `length' bytes of the open file starting at `offset', in
+      blocks of `block_size' bytes, and returns the digests of the
+      blocks concatenated in the EXTENDED_REPLY.  The last block may
+      be shorter than `block_size'; hashing stops at the end of the
+      file, and SSH_FX_EOF is returned if `offset' is at or past it.
+      The extension data in the VERSION message is a comma-separated
+      list of the hash functions supported.  The server may return
+      fewer blocks than were asked for; the client should ask for the
+      rest again.  The server refuses blocks over 64 MB with
+      SSH_FX_FAILURE.
+    "block-signatures@ssh.com" -> STATUS / EXTENDED_REPLY
+      string   handle
+      string   hash_name
+      uint64   offset
+      uint64   length
+      uint32   block_size
+      As block-hash@ssh.com, but each digest is preceded by the CRC-32 of the
+      block as a uint32.  The client uses these to find blocks of the
+      file that it already has elsewhere (see crc32_roll).
+    "data-extents@ssh.com" -> STATUS / EXTENDED_REPLY
+      string   handle
+      uint64   offset
+      uint64   length
+      Finds the parts of `length' bytes of the open file starting at
+      `offset' that hold data.  The EXTENDED_REPLY contains
+        uint64   end
+        [ repeated: ]
+          uint64   offset
+          uint64   length
+      with the data extents in order.  Everything else before `end' is
+      a hole, and reads as zeros.  `end' may be less than was asked
+      for; the client should ask for the rest again.  SSH_FX_EOF is
+      returned if `offset' is at or past the end of the file.  Where
+      the file system cannot tell, the server reads the file and
+      reports aligned blocks of zeros as holes.
    
   server:
     SSH_FXP_STATUS
@@ -102,6 +167,9 @@ Protocol:
     SSH_FXP_ATTRS
       uint32   id
       ATTRS    attrs
+    SSH_FXP_EXTENDED_REPLY
+      uint32   id
+      ...      data specific to the extension
       
 */
 
@@ -110,7 +178,7 @@ Protocol:
 
 
 /* Current protocol version. */
-#define SSH_FILEXFER_VERSION    0
+#define SSH_FILEXFER_VERSION    1
 
 /* Packet types. */
 #define SSH_FXP_INIT            1
@@ -135,6 +203,14 @@ Protocol:
 #define SSH_FXP_DATA           103
 #define SSH_FXP_NAME           104
 #define SSH_FXP_ATTRS          105
+#define SSH_FXP_EXTENDED       200
+#define SSH_FXP_EXTENDED_REPLY 201
+
+/* Names of the extensions. */
+#define SSH_FXE_COPY_DATA       "copy-data@ssh.com"
+#define SSH_FXE_BLOCK_HASH      "block-hash@ssh.com"
+#define SSH_FXE_BLOCK_SIGNATURES "block-signatures@ssh.com"
+#define SSH_FXE_DATA_EXTENTS    "data-extents@ssh.com"
 
 /* Portable versions of O_RDONLY etc. */
 #define SSH_FXF_READ            0x0001
@@ -11,19 +11,45 @@
 
 */
 
+/* Required to get SEEK_DATA and SEEK_HOLE in glibc. */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "sshincludes.h"
 #include "sshencode.h"
+#include "sshgetput.h"
 #include "sshpacketstream.h"
 #include "sshfilexfer.h"
 #include "sshfilexferi.h"
+#include "sshthreadpool.h"
+#include "sshcrypt.h"
+#include "sshcrc32.h"
+
+/* Converts an errno value to a file transfer protocol error code. */
+
+int ssh_file_server_errno_to_error(int errno_value)
+{
+  switch (errno_value)
+    {
+    case ENOENT:
+      return SSH_FX_NO_SUCH_FILE;
+    case EPERM:
+      return SSH_FX_PERMISSION_DENIED;
+    case EACCES:
+      return SSH_FX_PERMISSION_DENIED;
+    default:
+      return SSH_FX_FAILURE;
+    }
+}
 
 /* Data structure for a server-side file handle.  This definition is
    private to the implementation. */
 
 typedef struct SshServerHandleRec
 {
-  /* Pointer to next handle for this server. */
-  struct SshServerHandleRec *next;
+  /* Index of the handle in the handle table of the server. */
+  SshUInt32 slot;
 
   /* Value of the file handle when passed to the client.  This value identifies
      the handle uniquely among handles for this server. */
@@ -45,8 +71,73 @@ typedef struct SshServerHandleRec
   /* If the handle refers to a directory, this is a directory pointer for
      the directory as returned by opendir. */
   DIR *dir;
+
+  /* Serializes reads of the directory. */
+  SshMutex lock;
+
+  /* Number of requests using the handle. */
+  int refs;
+
+  /* The CLOSE request for the handle, once it has been received.  The
+     handle is then no longer on the list of the server, and the last
+     request using it closes it. */
+  struct SshFileServerRequestRec *close_request;
+  SshUInt32 close_id;
 } *SshServerHandle;
 
+/* A request being processed. */
+
+typedef struct SshFileServerRequestRec
+{
+  /* Next request on the free list. */
+  struct SshFileServerRequestRec *next;
+
+  SshFileServer server;
+
+  /* The request packet.  When the request is run in a worker thread,
+     the packet is copied to `packet'. */
+  SshPacketType type;
+  const unsigned char *data;
+  size_t len;
+  SshBuffer packet;
+
+  /* If TRUE, replies are sent as soon as they are made.  Otherwise the
+     reply is kept in `reply' until the request is done; a reply_type
+     of zero means there is none. */
+  Boolean send_now;
+  SshPacketType reply_type;
+  SshBuffer reply;
+  size_t reply_reserved;
+
+  /* The handles the request uses, if any.  Only copy-data uses two. */
+  SshServerHandle handle;
+  SshServerHandle other_handle;
+
+  /* The number of things to wait for before the request is done: the
+     request itself, and the close of its handle if it is a CLOSE that
+     other requests still keep from completing. */
+  int holds;
+
+  /* A CLOSE request to finish after this one. */
+  struct SshFileServerRequestRec *then;
+} *SshFileServerRequest;
+
+/* Number of bytes of names put in one reply to READDIR.  The reply may
+   go over this by one name. */
+#define SSH_FILE_SERVER_READDIR_BYTES   32768
+
+/* Number of user and group names cached for long names. */
+#define SSH_FILE_SERVER_NAME_CACHE_SIZE 64
+
+/* A cached user or group name. */
+
+typedef struct SshFileServerNameRec
+{
+  Boolean valid;
+  unsigned long id;
+  char name[32];
+} *SshFileServerName;
+
 /* Data structure for the file transfer server. */
 
 struct SshFileServerRec
@@ -54,11 +145,90 @@ struct SshFileServerRec
   /* Connection to the client. */
   SshPacketWrapper conn;
 
-  /* List of open file handles. */
-  SshServerHandle handles;
+  /* Table of open file handles, indexed by the slot number in the
+     handle values.  Unused slots are NULL, and their numbers are kept
+     in `free_slots' from the highest down, so that the lowest is taken
+     from the end. */
+  SshServerHandle *handles;
+  SshUInt32 handles_size;
+  SshUInt32 *free_slots;
+  SshUInt32 num_free_slots;
+
+  /* Serial number for the next handle.  It is part of the handle
+     value, so that a stale handle does not match a new handle that
+     reuses its slot. */
+  SshUInt32 handle_serial;
+
+  /* Worker threads running the requests, or NULL if each request is
+     run to completion as it is received. */
+  SshThreadPool pool;
+
+  /* Protects the table of handles and their reference counts. */
+  SshMutex lock;
+
+  /* Number of requests run at a time, and the number now running. */
+  int max_requests;
+  int requests_running;
+
+  /* Requests that are done, but whose replies are waiting for the
+     connection to accept them, in order. */
+  SshFileServerRequest unsent;
+  SshFileServerRequest unsent_tail;
+
+  /* Requests for reuse. */
+  SshFileServerRequest free_requests;
+
+  /* TRUE if receives are enabled on the connection. */
+  Boolean receiving;
+
+  /* Caches for making the long names in READDIR replies: user and group
+     names, indexed by the id modulo the cache size, and the local date
+     at the start of the day the last file was modified on.  These are
+     protected by the libc lock. */
+  struct SshFileServerNameRec user_names[SSH_FILE_SERVER_NAME_CACHE_SIZE];
+  struct SshFileServerNameRec group_names[SSH_FILE_SERVER_NAME_CACHE_SIZE];
+  Boolean day_valid;
+  SshTime day_start;
+  struct SshCalendarTimeRec day;
+
+  /* TRUE if EOF has been received; the server is destroyed when the
+     requests still running are done. */
+  Boolean eof_received;
 };
 
-/* Create a new file handle and add it to the list of handles.  This
+/* Protects the functions of the C library that return static data
+   (getpwuid, getgrgid and localtime), which are shared by all the
+   servers in the process. */
+static SshMutex ssh_file_server_libc_lock = NULL;
+
+/* Length of the handle values made by the server: the slot of the
+   handle and its serial number. */
+#define SSH_FILE_SERVER_HANDLE_LEN      8
+
+/* Number of slots in the handle table when it is first allocated. */
+#define SSH_FILE_SERVER_HANDLES_INITIAL 16
+
+/* Size of the buffer used by copy-data, and the most it copies for
+   one request. */
+#define SSH_FILE_SERVER_COPY_BUFFER     65536
+#define SSH_FILE_SERVER_COPY_MAX_BYTES  0x4000000
+
+/* Size of the reads done by block-hash, and the most it hashes for
+   one request, in bytes and in blocks.  The client asks again for the
+   rest.  Larger blocks are refused. */
+#define SSH_FILE_SERVER_HASH_BUFFER     262144
+#define SSH_FILE_SERVER_HASH_MAX_BYTES  0x4000000
+#define SSH_FILE_SERVER_HASH_MAX_BLOCKS 1024
+
+/* The most extents returned for one data-extents request, and the
+   most bytes read looking for zeros when the system cannot tell where
+   the holes are.  Runs of zeros shorter than SSH_FILE_SERVER_ZERO_BLOCK,
+   or not aligned to it, are counted as data. */
+#define SSH_FILE_SERVER_EXTENTS_MAX     1024
+#define SSH_FILE_SERVER_EXTENTS_SCAN    0x4000000
+#define SSH_FILE_SERVER_ZERO_BLOCK      4096
+
+/* Create a new file handle and add it to the table of handles.  This
    returns the new handle. */
 
 SshServerHandle ssh_file_server_new_handle(SshFileServer server,
@@ -69,19 +239,15 @@ SshServerHandle ssh_file_server_new_handle(SshFileServer server,
   SshServerHandle handle;
 
   /* Allocate space for the handle structure. */
-  handle = ssh_xmalloc(sizeof(*handle));
-
-  /* Create a string that is used as the handle.  We include the memory
-     address of the handle object and the file descriptor. */
-  handle->len = ssh_encode_alloc(&handle->value,
-                                 SSH_FORMAT_UINT32, (SshUInt32) handle,
-                                 SSH_FORMAT_UINT32, (SshUInt32) fd,
-                                 SSH_FORMAT_END);
+  handle = ssh_xcalloc(1, sizeof(*handle));
 
   /* Set up other fields of the handle structure. */
   handle->is_directory = is_directory;
   if (is_directory)
-    handle->dir = (DIR *)fd;
+    {
+      handle->dir = (DIR *)fd;
+      handle->lock = ssh_mutex_create();
+    }
   else
     handle->fd = (int)fd;
 
@@ -90,29 +256,81 @@ SshServerHandle ssh_file_server_new_handle(SshFileServer server,
   else
     handle->name = ssh_xstrdup(name);
   
-  /* Add to the list of open file handles. */
-  handle->next = server->handles;
-  server->handles = handle;
+  ssh_mutex_lock(server->lock);
+
+  /* Grow the table if it is full.  The new slots are all higher than
+     the old ones, so they go on the free list highest first. */
+  if (server->num_free_slots == 0)
+    {
+      SshUInt32 i, old_size = server->handles_size;
+
+      if (old_size == 0)
+        server->handles_size = SSH_FILE_SERVER_HANDLES_INITIAL;
+      else
+        server->handles_size = 2 * old_size;
+      server->handles = ssh_xrealloc(server->handles,
+                                     server->handles_size *
+                                     sizeof(server->handles[0]));
+      server->free_slots = ssh_xrealloc(server->free_slots,
+                                        server->handles_size *
+                                        sizeof(server->free_slots[0]));
+      for (i = server->handles_size; i > old_size; i--)
+        {
+          server->handles[i - 1] = NULL;
+          server->free_slots[server->num_free_slots++] = i - 1;
+        }
+    }
+
+  /* Put the handle in a free slot.  The string used as the handle
+     tells the slot, so that the handle is found without a search. */
+  handle->slot = server->free_slots[--server->num_free_slots];
+  server->handles[handle->slot] = handle;
+  handle->len = ssh_encode_alloc(&handle->value,
+                                 SSH_FORMAT_UINT32, handle->slot,
+                                 SSH_FORMAT_UINT32, server->handle_serial++,
+                                 SSH_FORMAT_END);
+  SSH_ASSERT(handle->len == SSH_FILE_SERVER_HANDLE_LEN);
+
+  ssh_mutex_unlock(server->lock);
 
   /* Return the handle. */
   return handle;
 }
 
-/* Looks up the file handle with the given value.  Returns the handle,
-   or NULL if no such handle exists. */
+/* Looks up the file handle with the given value for `request'.
+   Returns the handle, or NULL if no such handle exists.  The handle
+   stays open until the request is done. */
 
-SshServerHandle ssh_file_server_find_handle(SshFileServer server,
+SshServerHandle ssh_file_server_find_handle(SshFileServerRequest request,
                                             const unsigned char *value,
                                             size_t len)
 {
+  SshFileServer server = request->server;
   SshServerHandle handle;
+  SshUInt32 slot;
 
-  /* Go over the list of handles, comparing the value in each
-     handle. */
-  for (handle = server->handles; handle; handle = handle->next)
+  SSH_PRECOND(request->other_handle == NULL);
+
+  /* The handle value begins with the slot of the handle; check that
+     the handle there is the one the client means. */
+  if (len == SSH_FILE_SERVER_HANDLE_LEN)
     {
-      if (handle->len == len && memcmp(handle->value, value, len) == 0)
-        return handle; /* Found - return the handle. */
+      slot = SSH_GET_32BIT(value);
+      ssh_mutex_lock(server->lock);
+      if (slot < server->handles_size &&
+          (handle = server->handles[slot]) != NULL &&
+          memcmp(handle->value, value, len) == 0)
+        {
+          /* Found - return the handle. */
+          handle->refs++;
+          if (request->handle == NULL)
+            request->handle = handle;
+          else
+            request->other_handle = handle;
+          ssh_mutex_unlock(server->lock);
+          return handle;
+        }
+      ssh_mutex_unlock(server->lock);
     }
 
   /* No such handle exists. */
@@ -120,83 +338,608 @@ SshServerHandle ssh_file_server_find_handle(SshFileServer server,
   return NULL;
 }
 
-/* Frees the given handle and removes it from the list of handles. */
+/* Removes the given handle from the table of handles.  Must be called
+   with the server locked. */
 
-void ssh_file_server_free_handle(SshFileServer server, SshServerHandle handle)
+void ssh_file_server_unlink_handle(SshFileServer server,
+                                   SshServerHandle handle)
 {
-  SshServerHandle *handlep;
-
-  for (handlep = &server->handles; *handlep; handlep = &(*handlep)->next)
-    if (*handlep == handle)
-      {
-        *handlep = handle->next;
-        ssh_xfree(handle->value);
-        ssh_xfree(handle->name);
-        ssh_xfree(handle);
-        return;
-      }
-          
-  ssh_warning("ssh_file_server_free_handle: handle not found");
+  SshUInt32 i;
+
+  if (server->handles[handle->slot] != handle)
+    {
+      ssh_warning("ssh_file_server_unlink_handle: handle not found");
+      return;
+    }
+
+  server->handles[handle->slot] = NULL;
+
+  /* Keep the free list in order, so that the lowest slot is reused
+     first.  Few handles are open at a time, so the shift is short. */
+  for (i = server->num_free_slots;
+       i > 0 && server->free_slots[i - 1] < handle->slot;
+       i--)
+    server->free_slots[i] = server->free_slots[i - 1];
+  server->free_slots[i] = handle->slot;
+  server->num_free_slots++;
 }
 
-/* Formats and sends a message to the client. */
+/* Closes the file or directory of the handle, and frees the handle.
+   Returns the error code for the close. */
 
-void ssh_file_server_send(SshFileServer server, SshPacketType type, ...)
+SshFileClientError ssh_file_server_close_handle(SshServerHandle handle)
+{
+  int ret;
+
+  /* Close the file descriptor.  Note that the close can meaningfully
+     return an error e.g. on NFS file systems. */
+  if (handle->is_directory)
+    {
+      ret = closedir(handle->dir);
+      ssh_mutex_destroy(handle->lock);
+    }
+  else
+    ret = close(handle->fd);
+
+  ssh_xfree(handle->value);
+  ssh_xfree(handle->name);
+  ssh_xfree(handle);
+
+  if (ret < 0)
+    return ssh_file_server_errno_to_error(errno);
+  else
+    return SSH_FX_OK;
+}
+
+/* Formats a reply to the request.  It is either sent at once or kept
+   until the request is done. */
+
+void ssh_file_server_send(SshFileServerRequest request,
+                          SshPacketType type, ...)
 {
   va_list va;
 
   va_start(va, type);
-  ssh_packet_wrapper_send_encode_va(server->conn, type, va);
+  if (request->send_now)
+    ssh_packet_wrapper_send_encode_va(request->server->conn, type, va);
+  else
+    {
+      ssh_buffer_clear(&request->reply);
+      ssh_encode_va(&request->reply, va);
+      request->reply_type = type;
+    }
   va_end(va);
 }
 
 /* Sends a status message to the client. */
 
-void ssh_file_server_send_status(SshFileServer server, unsigned long id,
+void ssh_file_server_send_status(SshFileServerRequest request,
+                                 unsigned long id,
                                  SshFileClientError error)
 {
-  ssh_file_server_send(server, SSH_FXP_STATUS,
+  ssh_file_server_send(request, SSH_FXP_STATUS,
                        SSH_FORMAT_UINT32, (SshUInt32) id,
                        SSH_FORMAT_UINT32, (SshUInt32) error,
                        SSH_FORMAT_END);
 }
 
-/* Converts an errno value to a file transfer protocol error code. */
+/* Starts a reply of type `type' to request `id', and returns `len'
+   bytes of space at its end for the caller to fill in.  The reply must
+   be finished with ssh_file_server_send_commit or
+   ssh_file_server_send_cancel. */
 
-int ssh_file_server_errno_to_error(int errno_value)
+unsigned char *ssh_file_server_send_reserve(SshFileServerRequest request,
+                                            SshPacketType type,
+                                            SshUInt32 id,
+                                            size_t len)
 {
-  switch (errno_value)
+  unsigned char *p;
+
+  if (request->send_now)
+    return ssh_packet_wrapper_send_reserve(request->server->conn, type, len,
+                                           SSH_FORMAT_UINT32, id,
+                                           SSH_FORMAT_END);
+
+  ssh_buffer_clear(&request->reply);
+  ssh_encode_buffer(&request->reply,
+                    SSH_FORMAT_UINT32, id,
+                    SSH_FORMAT_END);
+  ssh_buffer_append_space(&request->reply, &p, len);
+  request->reply_reserved = len;
+  request->reply_type = type;
+  return p;
+}
+
+/* Finishes the reply, with the first `len' bytes of the reserved
+   space as its last bytes. */
+
+void ssh_file_server_send_commit(SshFileServerRequest request, size_t len)
+{
+  if (request->send_now)
+    ssh_packet_wrapper_send_commit(request->server->conn, len);
+  else
+    ssh_buffer_consume_end(&request->reply, request->reply_reserved - len);
+}
+
+/* Throws away the reply. */
+
+void ssh_file_server_send_cancel(SshFileServerRequest request)
+{
+  if (request->send_now)
+    ssh_packet_wrapper_send_cancel(request->server->conn);
+  else
+    request->reply_type = 0;
+}
+
+/* Called when the request is done with `handle'.  If the handle has
+   been closed by the client and no other request uses it any more, it
+   is closed now and the reply to the CLOSE is made. */
+
+void ssh_file_server_release_one_handle(SshFileServerRequest request,
+                                        SshServerHandle handle)
+{
+  SshFileServer server = request->server;
+  SshFileServerRequest close_request, *then;
+  Boolean last;
+
+  ssh_mutex_lock(server->lock);
+  handle->refs--;
+  close_request = handle->close_request;
+  last = (handle->refs == 0 && close_request != NULL);
+
+  /* A CLOSE that has to wait for other requests is done only when the
+     last of them is. */
+  if (!last && close_request == request)
+    request->holds++;
+  ssh_mutex_unlock(server->lock);
+
+  if (!last)
+    return;
+
+  ssh_file_server_send_status(close_request, handle->close_id,
+                              ssh_file_server_close_handle(handle));
+  if (close_request != request)
     {
-    case ENOENT:
-      return SSH_FX_NO_SUCH_FILE;
-    case EPERM:
-      return SSH_FX_PERMISSION_DENIED;
-    case EACCES:
-      return SSH_FX_PERMISSION_DENIED;
-    default:
-      return SSH_FX_FAILURE;
+      for (then = &request->then; *then; then = &(*then)->then)
+        ;
+      *then = close_request;
     }
 }
 
-/* This callback function is called whenever a packet is received from
-   the client. */
+/* Called when the request is done with its handles. */
 
-void ssh_file_server_receive_proc(SshPacketType type,
-                                  const unsigned char *data, size_t len,
-                                  void *context)
+void ssh_file_server_release_handle(SshFileServerRequest request)
 {
-  SshFileServer server = (SshFileServer)context;
-  size_t valuelen, iodatalen;
-  SshUInt32 version, id, pflags, iolen;
+  SshServerHandle handle;
+
+  if ((handle = request->other_handle) != NULL)
+    {
+      request->other_handle = NULL;
+      ssh_file_server_release_one_handle(request, handle);
+    }
+  if ((handle = request->handle) != NULL)
+    {
+      request->handle = NULL;
+      ssh_file_server_release_one_handle(request, handle);
+    }
+}
+
+/* Copies `length' bytes at `from_offset' in the file `from_fd' to
+   `to_offset' in `to_fd', for copy-data. */
+
+SshFileClientError ssh_file_server_copy_data(int from_fd,
+                                             SshUInt64 from_offset,
+                                             SshUInt64 length,
+                                             int to_fd,
+                                             SshUInt64 to_offset)
+{
+  unsigned char *buf;
+  SshFileClientError error = SSH_FX_OK;
+  size_t len;
+  long ret;
+
+  buf = ssh_xmalloc(SSH_FILE_SERVER_COPY_BUFFER);
+  while (length > 0)
+    {
+      len = (length < SSH_FILE_SERVER_COPY_BUFFER) ? (size_t)length :
+        SSH_FILE_SERVER_COPY_BUFFER;
+#ifdef HAVE_PREAD
+      ret = pread(from_fd, buf, len, (off_t)from_offset);
+#else /* HAVE_PREAD */
+      lseek(from_fd, (off_t)from_offset, SEEK_SET);
+      ret = read(from_fd, buf, len);
+#endif /* HAVE_PREAD */
+      if (ret <= 0)
+        {
+          error = (ret == 0) ? SSH_FX_EOF :
+            ssh_file_server_errno_to_error(errno);
+          break;
+        }
+      len = (size_t)ret;
+
+#ifdef HAVE_PWRITE
+      ret = pwrite(to_fd, buf, len, (off_t)to_offset);
+#else /* HAVE_PWRITE */
+      lseek(to_fd, (off_t)to_offset, SEEK_SET);
+      ret = write(to_fd, buf, len);
+#endif /* HAVE_PWRITE */
+      if (ret != (long)len)
+        {
+          error = (ret < 0) ? ssh_file_server_errno_to_error(errno) :
+            SSH_FX_FAILURE;
+          break;
+        }
+
+      from_offset += len;
+      to_offset += len;
+      length -= len;
+    }
+  ssh_xfree(buf);
+  return error;
+}
+
+/* Hashes `length' bytes at `offset' in the file `fd' in blocks of
+   `block_size' bytes, for block-hash, and stores the digests in
+   `digests'.  If `with_crc' is TRUE, each digest is preceded by the
+   32-bit CRC of the block, for block-signatures.  There must be room
+   for the digests of all the blocks.  The number of bytes stored is
+   returned in `digests_len'; it is less than asked for if the file
+   ends first. */
+
+SshFileClientError ssh_file_server_block_hash(int fd,
+                                              SshHash hash,
+                                              Boolean with_crc,
+                                              SshUInt64 offset,
+                                              SshUInt64 length,
+                                              SshUInt32 block_size,
+                                              unsigned char *digests,
+                                              size_t *digests_len)
+{
+  unsigned char *buf, *p;
+  SshUInt32 in_block = 0, crc = 0;
+  size_t len, n, digest_len;
+  long ret;
+
+  digest_len = ssh_hash_digest_length(hash);
+  *digests_len = 0;
+  ssh_hash_reset(hash);
+
+  /* Read the range in large pieces, whatever the size of the blocks. */
+  buf = ssh_xmalloc(SSH_FILE_SERVER_HASH_BUFFER);
+  while (length > 0)
+    {
+      len = (length < SSH_FILE_SERVER_HASH_BUFFER) ? (size_t)length :
+        SSH_FILE_SERVER_HASH_BUFFER;
+#ifdef HAVE_PREAD
+      ret = pread(fd, buf, len, (off_t)offset);
+#else /* HAVE_PREAD */
+      lseek(fd, (off_t)offset, SEEK_SET);
+      ret = read(fd, buf, len);
+#endif /* HAVE_PREAD */
+      if (ret < 0)
+        {
+          ssh_xfree(buf);
+          return ssh_file_server_errno_to_error(errno);
+        }
+      if (ret == 0)
+        break;
+      offset += ret;
+      length -= ret;
+
+      for (p = buf; ret > 0; p += n, ret -= n)
+        {
+          n = block_size - in_block;
+          if (n > (size_t)ret)
+            n = (size_t)ret;
+          ssh_hash_update(hash, p, n);
+          if (with_crc)
+            crc = crc32_buffer_continue(crc, p, n);
+          in_block += n;
+          if (in_block == block_size)
+            {
+              if (with_crc)
+                {
+                  SSH_PUT_32BIT(digests + *digests_len, crc);
+                  *digests_len += 4;
+                  crc = 0;
+                }
+              ssh_hash_final(hash, digests + *digests_len);
+              *digests_len += digest_len;
+              ssh_hash_reset(hash);
+              in_block = 0;
+            }
+        }
+    }
+  ssh_xfree(buf);
+
+  /* The last block may be short. */
+  if (in_block > 0)
+    {
+      if (with_crc)
+        {
+          SSH_PUT_32BIT(digests + *digests_len, crc);
+          *digests_len += 4;
+        }
+      ssh_hash_final(hash, digests + *digests_len);
+      *digests_len += digest_len;
+    }
+  return (*digests_len == 0) ? SSH_FX_EOF : SSH_FX_OK;
+}
+
+/* Adds the extent of `length' bytes at `offset' to those stored in
+   `extents', joining it to the previous one if they touch.  Returns
+   FALSE if there is no room for it. */
+
+Boolean ssh_file_server_add_extent(unsigned char *extents, size_t *num,
+                                   SshUInt64 offset, SshUInt64 length)
+{
+  unsigned char *p;
+
+  if (*num > 0)
+    {
+      p = extents + 16 * (*num - 1);
+      if (SSH_GET_64BIT(p) + SSH_GET_64BIT(p + 8) == offset)
+        {
+          SSH_PUT_64BIT(p + 8, SSH_GET_64BIT(p + 8) + length);
+          return TRUE;
+        }
+    }
+  if (*num == SSH_FILE_SERVER_EXTENTS_MAX)
+    return FALSE;
+  p = extents + 16 * *num;
+  SSH_PUT_64BIT(p, offset);
+  SSH_PUT_64BIT(p + 8, length);
+  (*num)++;
+  return TRUE;
+}
+
+/* Finds the extents holding data among `length' bytes at `offset' in
+   the file `fd', for data-extents.  `extents' must have room for
+   SSH_FILE_SERVER_EXTENTS_MAX extents of 16 bytes each; the number
+   stored goes to `num_extents', and the offset up to which the answer
+   is complete to `end'.  Uses SEEK_DATA and SEEK_HOLE where the system
+   has them, and otherwise reads the file looking for blocks of
+   zeros. */
+
+SshFileClientError ssh_file_server_data_extents(int fd,
+                                                SshUInt64 offset,
+                                                SshUInt64 length,
+                                                unsigned char *extents,
+                                                size_t *num_extents,
+                                                SshUInt64 *end)
+{
+  struct stat st;
+  unsigned char *buf;
+  SshUInt64 pos, limit;
+  size_t len, i, j;
+  long ret;
+#ifdef SEEK_DATA
+  off_t data, hole;
+#endif /* SEEK_DATA */
+
+  *num_extents = 0;
+  if (fstat(fd, &st) < 0)
+    return ssh_file_server_errno_to_error(errno);
+  if (offset >= (SshUInt64)st.st_size)
+    return SSH_FX_EOF;
+  limit = (SshUInt64)st.st_size - offset;
+  if (length > limit)
+    length = limit;
+  limit = offset + length;
+
+#ifdef SEEK_DATA
+  for (pos = offset; pos < limit; pos = (SshUInt64)hole)
+    {
+      data = lseek(fd, (off_t)pos, SEEK_DATA);
+      if (data < 0 && errno == ENXIO)
+        break;
+      if (data < 0)
+        goto scan;
+      if ((SshUInt64)data >= limit)
+        break;
+      hole = lseek(fd, data, SEEK_HOLE);
+      if (hole < 0)
+        goto scan;
+      if ((SshUInt64)hole > limit)
+        hole = (off_t)limit;
+      if (!ssh_file_server_add_extent(extents, num_extents, (SshUInt64)data,
+                                      (SshUInt64)(hole - data)))
+        {
+          /* Out of room; the client asks again from the next data. */
+          *end = (SshUInt64)data;
+          return SSH_FX_OK;
+        }
+    }
+  *end = limit;
+  return SSH_FX_OK;
+
+ scan:
+  /* The file system does not know; look for the zeros ourselves. */
+  *num_extents = 0;
+#endif /* SEEK_DATA */
+
+  if (length > SSH_FILE_SERVER_EXTENTS_SCAN)
+    limit = offset + SSH_FILE_SERVER_EXTENTS_SCAN;
+  buf = ssh_xmalloc(SSH_FILE_SERVER_HASH_BUFFER);
+  for (pos = offset; pos < limit; pos += len)
+    {
+      len = (limit - pos < SSH_FILE_SERVER_HASH_BUFFER) ?
+        (size_t)(limit - pos) : SSH_FILE_SERVER_HASH_BUFFER;
+#ifdef HAVE_PREAD
+      ret = pread(fd, buf, len, (off_t)pos);
+#else /* HAVE_PREAD */
+      lseek(fd, (off_t)pos, SEEK_SET);
+      ret = read(fd, buf, len);
+#endif /* HAVE_PREAD */
+      if (ret < 0)
+        {
+          ssh_xfree(buf);
+          return ssh_file_server_errno_to_error(errno);
+        }
+      if (ret == 0)
+        {
+          /* The file was truncated under us. */
+          limit = pos;
+          break;
+        }
+      len = (size_t)ret;
+
+      /* Look at the buffer a zero block at a time, keeping the blocks
+         aligned to the start of the file. */
+      for (i = 0; i < len; i += j)
+        {
+          j = SSH_FILE_SERVER_ZERO_BLOCK -
+            (size_t)((pos + i) % SSH_FILE_SERVER_ZERO_BLOCK);
+          if (j > len - i)
+            j = len - i;
+          if (j == SSH_FILE_SERVER_ZERO_BLOCK &&
+              buf[i] == 0 && memcmp(buf + i, buf + i + 1, j - 1) == 0)
+            continue;
+          if (!ssh_file_server_add_extent(extents, num_extents, pos + i, j))
+            {
+              ssh_xfree(buf);
+              *end = pos + i;
+              return SSH_FX_OK;
+            }
+        }
+    }
+  ssh_xfree(buf);
+  *end = limit;
+  return SSH_FX_OK;
+}
+
+#ifndef NO_LONG_NAMES
+
+/* Copies the name of the user `id', or of the group `id' if `group' is
+   TRUE, to `buf'.  The names are cached, as looking them up may mean
+   reading the password file or asking a name service.  Must be called
+   with the libc lock held. */
+
+void ssh_file_server_id_name(SshFileServer server, Boolean group,
+                             unsigned long id, char *buf, size_t buflen)
+{
+  SshFileServerName entry;
+  const char *name = NULL;
+#ifdef HAVE_GETPWUID
+  struct passwd *pw;
+#endif /* HAVE_GETPWUID */
+#ifdef HAVE_GETGRGID
+  struct group *gr;
+#endif /* HAVE_GETGRGID */
+
+  if (group)
+    entry = &server->group_names[id % SSH_FILE_SERVER_NAME_CACHE_SIZE];
+  else
+    entry = &server->user_names[id % SSH_FILE_SERVER_NAME_CACHE_SIZE];
+
+  if (!entry->valid || entry->id != id)
+    {
+      if (group)
+        {
+#ifdef HAVE_GETGRGID
+          if ((gr = getgrgid((gid_t) id)) != NULL)
+            name = gr->gr_name;
+#endif /* HAVE_GETGRGID */
+        }
+      else
+        {
+#ifdef HAVE_GETPWUID
+          if ((pw = getpwuid((uid_t) id)) != NULL)
+            name = pw->pw_name;
+#endif /* HAVE_GETPWUID */
+        }
+
+      if (name == NULL)
+        snprintf(entry->name, sizeof(entry->name), "%d", (int) id);
+      else
+        {
+          strncpy(entry->name, name, sizeof(entry->name));
+          entry->name[sizeof(entry->name) - 1] = '\0';
+        }
+      entry->id = id;
+      entry->valid = TRUE;
+    }
+
+  strncpy(buf, entry->name, buflen);
+  buf[buflen - 1] = '\0';
+}
+
+/* Formats the modification time `t' for a long name into `buf': the
+   time of day if it is in `this_year', and the year otherwise.  Files
+   in a directory tend to be modified on the same few days, so the
+   calendar date of the last day is cached, and times on it are
+   computed without converting them.  Must be called with the libc lock
+   held. */
+
+void ssh_file_server_date_string(SshFileServer server, SshTime t,
+                                 SshInt32 this_year,
+                                 char *buf, size_t buflen)
+{
+  static const char *month_name[12] = 
+  {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", 
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" 
+  };
+  struct SshCalendarTimeRec tm[1], last[1];
+  long offset;
+
+  if (server->day_valid && t >= server->day_start &&
+      t - server->day_start < 86400)
+    {
+      offset = (long)(t - server->day_start);
+      *tm = server->day;
+      tm->hour = offset / 3600;
+      tm->minute = (offset % 3600) / 60;
+    }
+  else
+    {
+      ssh_calendar_time(t, tm, TRUE);
+
+      /* Cache the day, unless the clock is turned on it. */
+      server->day = *tm;
+      server->day_start = t - (tm->hour * 3600 + tm->minute * 60 +
+                               tm->second);
+      ssh_calendar_time(server->day_start + 86399, last, TRUE);
+      server->day_valid = (last->monthday == tm->monthday &&
+                           last->hour == 23 && last->minute == 59 &&
+                           last->second == 59);
+    }
+
+  /* Print time if modified this year, otherwise print year */
+  if (tm->year == this_year)
+    snprintf(buf, buflen, "%3s %2d %2d:%02d",
+             month_name[tm->month % 12], tm->monthday, 
+             tm->hour, tm->minute);
+  else
+    snprintf(buf, buflen, "%3s %2d  %4d", 
+             month_name[tm->month % 12], tm->monthday, 
+             (int) tm->year);           
+}
+
+#endif /* NO_LONG_NAMES */
+
+/* Processes a request from the client.  This is either called directly
+   when the request is received, or in a worker thread. */
+
+void ssh_file_server_process(SshFileServerRequest request)
+{
+  SshFileServer server = request->server;
+  SshPacketType type = request->type;
+  const unsigned char *data = request->data;
+  size_t len = request->len;
+  size_t valuelen, iodatalen, bytes;
+  SshUInt32 version, id, pflags, iolen, blocks;
   unsigned long flags;
-  SshUInt64 offset;
+  SshUInt64 offset, length, to_offset;
+  SshServerHandle to_handle;
+  SshHash hash;
+  Boolean with_crc;
   long ret;
   char *name;  
   unsigned char *value, *iodata;
   SshFileAttributes attrs;
   SshServerHandle handle;
   int fd;
-  SshFileClientError error;
   struct stat st;
   DIR *dir;
   struct dirent *dp;
@@ -213,12 +956,6 @@ void ssh_file_server_receive_proc(SshPacketType type,
 #endif /* HAVE_UTIME && !HAVE_LUTIMES */
 
 #ifndef NO_LONG_NAMES
-#ifdef HAVE_GETPWUID
-  struct passwd *pw;
-#endif /* HAVE_GETPWUID */
-#ifdef HAVE_GETGRGID
-  struct group *gr;
-#endif /* HAVE_GETGRGID */
   struct SshCalendarTimeRec tm[1];
   int    this_year;  
   SshTime tim;
@@ -227,11 +964,6 @@ void ssh_file_server_receive_proc(SshPacketType type,
   char   date_string[32];
   char   name_ext[128];
   char   long_name[256];
-  const char *month_name[12] = 
-  {
-    "Jan", "Feb", "Mar", "Apr", "May", "Jun", 
-    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" 
-  };
 #endif /* NO_LONG_NAMES */
   
   attrs = ssh_xcalloc(1, sizeof(struct SshFileAttributesRec));
@@ -253,10 +985,35 @@ void ssh_file_server_receive_proc(SshPacketType type,
       version = (version < SSH_FILEXFER_VERSION) ? version :
         SSH_FILEXFER_VERSION;
 
-      /* Send a version response message to the client. */
-      ssh_file_server_send(server, SSH_FXP_VERSION,
-                           SSH_FORMAT_UINT32, version,
-                           SSH_FORMAT_END);
+      /* Send a version response message to the client, with the
+         extensions we support if the client understands them. */
+      if (version >= 1)
+        {
+          name = ssh_hash_get_supported();
+          ssh_file_server_send(request, SSH_FXP_VERSION,
+                               SSH_FORMAT_UINT32, version,
+                               SSH_FORMAT_UINT32_STR, 
+                                 SSH_FXE_COPY_DATA, strlen(SSH_FXE_COPY_DATA),
+                               SSH_FORMAT_UINT32_STR, "", (size_t)0,
+                               SSH_FORMAT_UINT32_STR, 
+                                 SSH_FXE_BLOCK_HASH,
+                                 strlen(SSH_FXE_BLOCK_HASH),
+                               SSH_FORMAT_UINT32_STR, name, strlen(name),
+                               SSH_FORMAT_UINT32_STR, 
+                                 SSH_FXE_BLOCK_SIGNATURES,
+                                 strlen(SSH_FXE_BLOCK_SIGNATURES),
+                               SSH_FORMAT_UINT32_STR, name, strlen(name),
+                               SSH_FORMAT_UINT32_STR, 
+                                 SSH_FXE_DATA_EXTENTS,
+                                 strlen(SSH_FXE_DATA_EXTENTS),
+                               SSH_FORMAT_UINT32_STR, "", (size_t)0,
+                               SSH_FORMAT_END);
+          ssh_xfree(name);
+        }
+      else
+        ssh_file_server_send(request, SSH_FXP_VERSION,
+                             SSH_FORMAT_UINT32, version,
+                             SSH_FORMAT_END);
       break;
 
     case SSH_FXP_OPEN:
@@ -279,7 +1036,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
              won't be able to associate the reply with the correct
              request), but the alternative would be causing the client
              to hang. */
-          ssh_file_server_send_status(server, id, SSH_FX_BAD_MESSAGE);
+          ssh_file_server_send_status(request, id, SSH_FX_BAD_MESSAGE);
           break;
         }
 
@@ -317,7 +1074,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
       if (fd < 0)
         {
           /* Open failed.  Compute error code to return to client. */
-          ssh_file_server_send_status(server, id,
+          ssh_file_server_send_status(request, id,
                                       ssh_file_server_errno_to_error(errno));
           ssh_xfree(name);
           break;
@@ -339,7 +1096,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
       ssh_xfree(name);
       
       /* Send a handle message to the client. */
-      ssh_file_server_send(server, SSH_FXP_HANDLE,
+      ssh_file_server_send(request, SSH_FXP_HANDLE,
                            SSH_FORMAT_UINT32, id,
                            SSH_FORMAT_UINT32_STR, handle->value, handle->len,
                            SSH_FORMAT_END);
@@ -357,32 +1114,23 @@ void ssh_file_server_receive_proc(SshPacketType type,
         }
 
       /* Look up the file handle. */
-      handle = ssh_file_server_find_handle(server, value, valuelen);
+      handle = ssh_file_server_find_handle(request, value, valuelen);
 
       /* If the handle was not found, return error. */
       if (!handle)
         {
-          ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+          ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
           break;
         }
 
-      /* Close the file descriptor.  Note that the close can meaningfully
-         return an error e.g. on NFS file systems. */
-      if (handle->is_directory)
-        ret = closedir(handle->dir);
-      else
-        ret = close(handle->fd);
-
-      if (ret < 0)
-        error = ssh_file_server_errno_to_error(errno);
-      else
-        error = SSH_FX_OK;
-
-      /* Free the handle structure (and remove from the server list). */
-      ssh_file_server_free_handle(server, handle);
-
-      /* Send a status message to the client. */
-      ssh_file_server_send_status(server, id, error);
+      /* Take the handle off the list, so that no new requests can use
+         it.  It is closed, and the reply sent, when this request and
+         those still running on the handle are done. */
+      ssh_mutex_lock(server->lock);
+      ssh_file_server_unlink_handle(server, handle);
+      handle->close_request = request;
+      handle->close_id = id;
+      ssh_mutex_unlock(server->lock);
       break;
       
     case SSH_FXP_READ:
@@ -399,46 +1147,43 @@ void ssh_file_server_receive_proc(SshPacketType type,
         }
 
       /* Look up the handle.  If not found, return error status. */
-      handle = ssh_file_server_find_handle(server, value, valuelen);
+      handle = ssh_file_server_find_handle(request, value, valuelen);
       if (!handle || handle->is_directory)
         {
-          ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+          ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
           break;
         }
 
       /* Try to read from the file. */
-      if (iolen > XMALLOC_MAX_SIZE)
-        iolen = XMALLOC_MAX_SIZE;
       if (iolen > 100000)
         iolen = 100000;
 
-      /* Allocate memory for a buffer. */
-      value = ssh_xmalloc(iolen);
-
-      /* Seek to the specified location in the file. */
-      lseek(handle->fd, (off_t)offset, SEEK_SET);
+      /* Read straight into the reply, after the length of the data
+         string; the length is filled in once we know it. */
+      iodata = ssh_file_server_send_reserve(request, SSH_FXP_DATA, id,
+                                            4 + (size_t)iolen);
 
       /* Perform the actual read. */
-      ret = read(handle->fd, value, iolen);
+#ifdef HAVE_PREAD
+      ret = pread(handle->fd, iodata + 4, iolen, (off_t)offset);
+#else /* HAVE_PREAD */
+      lseek(handle->fd, (off_t)offset, SEEK_SET);
+      ret = read(handle->fd, iodata + 4, iolen);
+#endif /* HAVE_PREAD */
 
       /* If read failed, return error. */
       if (ret <= 0)
         {
-          ssh_xfree(value);
-          ssh_file_server_send_status(server, id,
+          ssh_file_server_send_cancel(request);
+          ssh_file_server_send_status(request, id,
                                       (ret == 0 ? SSH_FX_EOF :
                                        SSH_FX_FAILURE));
           break;
         }
 
       /* Send the data to the client. */
-      ssh_file_server_send(server, SSH_FXP_DATA,
-                           SSH_FORMAT_UINT32, id,
-                           SSH_FORMAT_UINT32_STR, value, (size_t)ret,
-                           SSH_FORMAT_END);
-
-      /* Free the allocated buffer. */
-      ssh_xfree(value);
+      SSH_PUT_32BIT(iodata, ret);
+      ssh_file_server_send_commit(request, 4 + (size_t)ret);
       break;
 
     case SSH_FXP_WRITE:
@@ -455,24 +1200,26 @@ void ssh_file_server_receive_proc(SshPacketType type,
         }
 
       /* Look up the handle.  If not found, return error status. */
-      handle = ssh_file_server_find_handle(server, value, valuelen);
+      handle = ssh_file_server_find_handle(request, value, valuelen);
       if (!handle || handle->is_directory)
         {
-          ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+          ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
           break;
         }
 
-      /* Seek to the specified location in the file. */
-      lseek(handle->fd, (off_t)offset, SEEK_SET);
-      
       /* Perform the actual write. */
+#ifdef HAVE_PWRITE
+      ret = pwrite(handle->fd, iodata, iodatalen, (off_t)offset);
+#else /* HAVE_PWRITE */
+      lseek(handle->fd, (off_t)offset, SEEK_SET);
       ret = write(handle->fd, iodata, iodatalen);
+#endif /* HAVE_PWRITE */
 
       /* Report status back to the client. */
       if (ret != iodatalen)
-        ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+        ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
       else
-        ssh_file_server_send_status(server, id, SSH_FX_OK);
+        ssh_file_server_send_status(request, id, SSH_FX_OK);
       break;
 
     case SSH_FXP_STAT:
@@ -490,7 +1237,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
       if (stat(name, &st) < 0)
         {
           /* Stat failed. */
-          ssh_file_server_send_status(server, id,
+          ssh_file_server_send_status(request, id,
                                       ssh_file_server_errno_to_error(errno));
           ssh_xfree(name);
           break;
@@ -508,7 +1255,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
       attrs->permissions = st.st_mode;
       attrs->atime = st.st_atime;
       attrs->mtime = st.st_mtime;
-      ssh_file_server_send(server, SSH_FXP_ATTRS,
+      ssh_file_server_send(request, SSH_FXP_ATTRS,
                            SSH_FORMAT_UINT32, id,
                            SSH_FORMAT_EXTENDED, 
                            ssh_file_attrs_encoder, attrs,
@@ -531,7 +1278,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
       if (lstat(name, &st) < 0)
         {
           /* Stat failed. */
-          ssh_file_server_send_status(server, id,
+          ssh_file_server_send_status(request, id,
                                       ssh_file_server_errno_to_error(errno));
           ssh_xfree(name);
           break;
@@ -544,7 +1291,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
       
 #else /* HAVE_LSTAT */
       ssh_warning("ssh_file_server_receive_proc: no lstat on this platform");
-      ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+      ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
       break;
 #endif /* HAVE_LSTAT */
 
@@ -561,23 +1308,23 @@ void ssh_file_server_receive_proc(SshPacketType type,
         }
 
       /* Look up the handle.  If not found, return error status. */
-      handle = ssh_file_server_find_handle(server, value, valuelen);
+      handle = ssh_file_server_find_handle(request, value, valuelen);
       if (!handle || handle->is_directory)
         {
-          ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+          ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
           break;
         }
 
       if (fstat(handle->fd, &st) < 0)
         {
-          ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+          ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
           break;
         }
       goto return_stat;
 
 #else /* HAVE_FSTAT */
       ssh_warning("ssh_file_server_receive_proc: no fstat on this platform");
-      ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+      ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
       break;
 #endif /* HAVE_FSTAT */
 
@@ -654,7 +1401,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
       if (ret < 0)
         {
           /* The operation failed. */
-          ssh_file_server_send_status(server, id,
+          ssh_file_server_send_status(request, id,
                                       ssh_file_server_errno_to_error(errno));
           ssh_xfree(name);
           break;
@@ -664,7 +1411,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
       ssh_xfree(name);
 
       /* Send success. */
-      ssh_file_server_send_status(server, id, SSH_FX_OK);
+      ssh_file_server_send_status(request, id, SSH_FX_OK);
       break;
       
     case SSH_FXP_FSETSTAT:
@@ -680,10 +1427,10 @@ void ssh_file_server_receive_proc(SshPacketType type,
         }
 
       /* Look up the handle.  If not found, return error status. */
-      handle = ssh_file_server_find_handle(server, value, valuelen);
+      handle = ssh_file_server_find_handle(request, value, valuelen);
       if (!handle || handle->is_directory)
         {
-          ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+          ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
           break;
         }
 
@@ -742,13 +1489,13 @@ void ssh_file_server_receive_proc(SshPacketType type,
       if (ret < 0)
         {
           /* The operation failed. */
-          ssh_file_server_send_status(server, id,
+          ssh_file_server_send_status(request, id,
                                       ssh_file_server_errno_to_error(errno));
           break;
         }
 
       /* Send success. */
-      ssh_file_server_send_status(server, id, SSH_FX_OK);
+      ssh_file_server_send_status(request, id, SSH_FX_OK);
       break;
 
     case SSH_FXP_OPENDIR:
@@ -768,7 +1515,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
       /* Send error to the client if opening the directory failed. */
       if (!dir)
         {
-          ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+          ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
           break;
         }
 
@@ -780,7 +1527,7 @@ void ssh_file_server_receive_proc(SshPacketType type,
       ssh_xfree(name);
       
       /* Send a handle message to the client. */
-      ssh_file_server_send(server, SSH_FXP_HANDLE,
+      ssh_file_server_send(request, SSH_FXP_HANDLE,
                            SSH_FORMAT_UINT32, id,
                            SSH_FORMAT_UINT32_STR, handle->value, handle->len,
                            SSH_FORMAT_END);
@@ -798,10 +1545,10 @@ void ssh_file_server_receive_proc(SshPacketType type,
         }
 
       /* Look up the handle.  If not found, return error status. */
-      handle = ssh_file_server_find_handle(server, value, valuelen);
+      handle = ssh_file_server_find_handle(request, value, valuelen);
       if (!handle || !handle->is_directory)
         {
-          ssh_file_server_send_status(server, id, SSH_FX_FAILURE);
+          ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
           break;
         }
       
@@ -809,13 +1556,17 @@ void ssh_file_server_receive_proc(SshPacketType type,
       /* What year is it ? */
 
       tim = ssh_time();
+      ssh_mutex_lock(ssh_file_server_libc_lock);
       ssh_calendar_time(tim, tm, TRUE);
+      ssh_mutex_unlock(ssh_file_server_libc_lock);
       this_year = tm->year;      
 #endif
       
       /* Prepare a buffer for the message. */
       ssh_buffer_init(&buffer);
-      for (i = 0; i < 100; i++)
+      ssh_mutex_lock(handle->lock);
+      for (i = 0; ssh_buffer_len(&buffer) < SSH_FILE_SERVER_READDIR_BYTES;
+           i++)
         {
           dp = readdir(handle->dir);
           if (!dp)
@@ -823,14 +1574,26 @@ void ssh_file_server_receive_proc(SshPacketType type,
           
 #ifndef NO_LONG_NAMES    
 
+          /* Stat the file relative to the open directory if we can;
+             this saves looking up the directory again for each
+             name. */
+#if !defined(HAVE_DIRFD) || !defined(HAVE_FSTATAT) || \
+    !defined(HAVE_READLINKAT)
           if (handle->name == NULL || strlen(handle->name) == 0)          
             strncpy(long_name, dp->d_name, sizeof(long_name));
           else      
             snprintf(long_name, sizeof(long_name), "%s/%s", 
                      handle->name, dp->d_name);
+#endif /* !HAVE_DIRFD || !HAVE_FSTATAT || !HAVE_READLINKAT */
           
+#if defined(HAVE_DIRFD) && defined(HAVE_FSTATAT)
+          if (fstatat(dirfd(handle->dir), dp->d_name, &st,
+                      AT_SYMLINK_NOFOLLOW))
+            goto no_long_name;
+#else /* HAVE_DIRFD && HAVE_FSTATAT */
           if (lstat(long_name, &st))
             goto no_long_name;
+#endif /* HAVE_DIRFD && HAVE_FSTATAT */
 
           /* Fill in the attrs field */
           
@@ -841,47 +1604,17 @@ void ssh_file_server_receive_proc(SshPacketType type,
           attrs->gid = st.st_gid;
           attrs->permissions = st.st_mode;
                   
-          /* Get user name */
-          
-#ifdef HAVE_GETPWUID
-          if ((pw = getpwuid(st.st_uid)) == NULL)
-            snprintf(user_name, sizeof(user_name), "%d", 
-                     (int) st.st_uid);
-          else
-            strncpy(user_name, pw->pw_name, sizeof(user_name));       
-#else /* HAVE_GETPWUID */
-          snprintf(user_name, sizeof(user_name), "%d", (int) st.st_uid);
-#endif /* HAVE_GETPWUID */
-          
-          /* Get the name of the group */
-          
-#ifdef HAVE_GETGRGID
-          if ((gr = getgrgid(st.st_gid)) == NULL)
-            snprintf(group_name, sizeof(group_name), "%d", 
-                     (int) st.st_gid);
-          else
-            strncpy(group_name, gr->gr_name, sizeof(group_name));
-#else /* HAVE_GETGRGID */
-          snprintf(group_name, sizeof(group_name), "%d", (int) st.st_gid);
-#endif /* HAVE_GETGRGID */
-
-          /*
-           * tm = localtime(&st.st_mtimespec.tv_sec);
-           */
-          ssh_calendar_time(st.st_mtime, tm, TRUE);
-          
-          /* Print time if modified this year, otherwise print year */
+          /* Get the names of the user and the group, and the date. */
           
-          if (tm->year == this_year)
-            snprintf(date_string, sizeof(date_string),
-                     "%3s %2d %2d:%02d",
-                     month_name[tm->month % 12], tm->monthday, 
-                     tm->hour, tm->minute);
-          else
-            snprintf(date_string, sizeof(date_string),
-                     "%3s %2d  %4d", 
-                     month_name[tm->month % 12], tm->monthday, 
-                     tm->year);           
+          ssh_mutex_lock(ssh_file_server_libc_lock);
+          ssh_file_server_id_name(server, FALSE, (unsigned long) st.st_uid,
+                                  user_name, sizeof(user_name));
+          ssh_file_server_id_name(server, TRUE, (unsigned long) st.st_gid,
+                                  group_name, sizeof(group_name));
+          ssh_file_server_date_string(server, (SshTime) st.st_mtime,
+                                      this_year,
+                                      date_string, sizeof(date_string));
+          ssh_mutex_unlock(ssh_file_server_libc_lock);
 
           name_ext[0] = '\0';
           if ((st.st_mode & S_IFMT) == S_IFDIR)
@@ -890,8 +1623,13 @@ void ssh_file_server_receive_proc(SshPacketType type,
           if ((st.st_mode & S_IFMT) == S_IFLNK)
             {
               strncpy(name_ext, " -> ", sizeof(name_ext) - 4);
+#if defined(HAVE_DIRFD) && defined(HAVE_READLINKAT)
+              if (readlinkat(dirfd(handle->dir), dp->d_name, &name_ext[4],
+                             sizeof(name_ext) - 5) == -1)
+#else /* HAVE_DIRFD && HAVE_READLINKAT */
               if (readlink(long_name, &name_ext[4], 
-                           sizeof(name_ext) - 4) == -1)
+                           sizeof(name_ext) - 5) == -1)
+#endif /* HAVE_DIRFD && HAVE_READLINKAT */
                 strncpy(&name_ext[4], "???", sizeof(name_ext) - 4);
             }
                                 
@@ -974,23 +1712,26 @@ void ssh_file_server_receive_proc(SshPacketType type,
                             ssh_file_attrs_encoder, attrs,
                             SSH_FORMAT_END);   
         }
+      ssh_mutex_unlock(handle->lock);
 
 #ifndef NO_LONG_NAMES       
+      ssh_mutex_lock(ssh_file_server_libc_lock);
 # ifdef HAVE_ENDPWENT
       endpwent();
 # endif /* HAVE_ENDPWENT */
 # ifdef HAVE_ENDGRENT
       endgrent();
 # endif /* HAVE_ENDGRENT */
+      ssh_mutex_unlock(ssh_file_server_libc_lock);
 #endif   
            
       /* If we couldn't read any files, we are at end of directory. */
       if (i == 0)
-        ssh_file_server_send_status(server, id, SSH_FX_EOF);
+        ssh_file_server_send_status(request, id, SSH_FX_EOF);
       else
         {
           /* Send the names to the other side. */
-          ssh_file_server_send(server, SSH_FXP_NAME,
+          ssh_file_server_send(request, SSH_FXP_NAME,
                                SSH_FORMAT_UINT32, id,
                                SSH_FORMAT_UINT32, (SshUInt32) i,
                                SSH_FORMAT_DATA, ssh_buffer_ptr(&buffer),
@@ -1014,10 +1755,10 @@ void ssh_file_server_receive_proc(SshPacketType type,
 
       /* Remove the file and send response. */
       if (remove(name) < 0)
-        ssh_file_server_send_status(server, id,
+        ssh_file_server_send_status(request, id,
                                     ssh_file_server_errno_to_error(errno));
       else
-        ssh_file_server_send_status(server, id, SSH_FX_OK);
+        ssh_file_server_send_status(request, id, SSH_FX_OK);
 
       /* Free the file name. */
       ssh_xfree(name);
@@ -1039,10 +1780,10 @@ void ssh_file_server_receive_proc(SshPacketType type,
       if (mkdir(name,
                 (attrs->flags & SSH_FILEXFER_ATTR_PERMISSIONS) ?
                 attrs->permissions : 0777) < 0)
-        ssh_file_server_send_status(server, id,
+        ssh_file_server_send_status(request, id,
                                     ssh_file_server_errno_to_error(errno));
       else
-        ssh_file_server_send_status(server, id, SSH_FX_OK);
+        ssh_file_server_send_status(request, id, SSH_FX_OK);
 
       /* Free the directory name. */
       ssh_xfree(name);
@@ -1061,10 +1802,10 @@ void ssh_file_server_receive_proc(SshPacketType type,
 
       /* Remove the directory and send response. */
       if (rmdir(name) < 0)
-        ssh_file_server_send_status(server, id,
+        ssh_file_server_send_status(request, id,
                                     ssh_file_server_errno_to_error(errno));
       else
-        ssh_file_server_send_status(server, id, SSH_FX_OK);
+        ssh_file_server_send_status(request, id, SSH_FX_OK);
 
       /* Free the file name. */
       ssh_xfree(name);
@@ -1083,14 +1824,14 @@ void ssh_file_server_receive_proc(SshPacketType type,
         }
       
       if (ssh_realpath(name, resolved) == NULL)
-        ssh_file_server_send_status(server, id, 
+        ssh_file_server_send_status(request, id, 
                                     ssh_file_server_errno_to_error(errno));
       
       /* Construct a SSH_FXP_NAME consisting only of one name and
          a dummy attributes value */
       
       attrs->flags = 0;                                       
-      ssh_file_server_send(server, SSH_FXP_NAME,
+      ssh_file_server_send(request, SSH_FXP_NAME,
                            SSH_FORMAT_UINT32, id,
                            SSH_FORMAT_UINT32, (SshUInt32) 1,
                            SSH_FORMAT_UINT32_STR,
@@ -1103,6 +1844,168 @@ void ssh_file_server_receive_proc(SshPacketType type,
       ssh_xfree(name);
       break;
       
+    case SSH_FXP_EXTENDED:
+      /* Parse the name of the extension. */
+      bytes = ssh_decode_array(data, len,
+                               SSH_FORMAT_UINT32, &id,
+                               SSH_FORMAT_UINT32_STR_NOCOPY, &value, &valuelen,
+                               SSH_FORMAT_END);
+      if (bytes == 0)
+        {
+          ssh_warning("ssh_file_server_receive_proc: bad EXTENDED");
+          goto return_bad_status;
+        }
+      data += bytes;
+      len -= bytes;
+
+      if (valuelen == strlen(SSH_FXE_COPY_DATA) &&
+          memcmp(value, SSH_FXE_COPY_DATA, valuelen) == 0)
+        {
+          if (ssh_decode_array(data, len,
+                               SSH_FORMAT_UINT32_STR_NOCOPY, &value, &valuelen,
+                               SSH_FORMAT_UINT64, &offset,
+                               SSH_FORMAT_UINT64, &length,
+                               SSH_FORMAT_UINT32_STR_NOCOPY, 
+                                 &iodata, &iodatalen,
+                               SSH_FORMAT_UINT64, &to_offset,
+                               SSH_FORMAT_END) != len)
+            {
+              ssh_warning("ssh_file_server_receive_proc: bad copy-data");
+              goto return_bad_status;
+            }
+
+          /* Look up both handles.  A long copy would hold up the
+             other requests, so the length is limited. */
+          handle = ssh_file_server_find_handle(request, value, valuelen);
+          if (!handle || handle->is_directory ||
+              length > SSH_FILE_SERVER_COPY_MAX_BYTES)
+            {
+              ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
+              break;
+            }
+          to_handle = ssh_file_server_find_handle(request, iodata, iodatalen);
+          if (!to_handle || to_handle->is_directory)
+            {
+              ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
+              break;
+            }
+
+          ssh_file_server_send_status(request, id,
+                                      ssh_file_server_copy_data(handle->fd,
+                                                                offset,
+                                                                length,
+                                                                to_handle->fd,
+                                                                to_offset));
+          break;
+        }
+
+      /* The two differ only in the CRCs of the blocks. */
+      with_crc = (valuelen == strlen(SSH_FXE_BLOCK_SIGNATURES) &&
+                  memcmp(value, SSH_FXE_BLOCK_SIGNATURES, valuelen) == 0);
+      if (with_crc ||
+          (valuelen == strlen(SSH_FXE_BLOCK_HASH) &&
+           memcmp(value, SSH_FXE_BLOCK_HASH, valuelen) == 0))
+        {
+          if (ssh_decode_array(data, len,
+                               SSH_FORMAT_UINT32_STR_NOCOPY, &value, &valuelen,
+                               SSH_FORMAT_UINT32_STR, &name, NULL,
+                               SSH_FORMAT_UINT64, &offset,
+                               SSH_FORMAT_UINT64, &length,
+                               SSH_FORMAT_UINT32, &iolen,
+                               SSH_FORMAT_END) != len)
+            {
+              ssh_warning("ssh_file_server_receive_proc: bad block-hash");
+              goto return_bad_status;
+            }
+
+          handle = ssh_file_server_find_handle(request, value, valuelen);
+          if (!handle || handle->is_directory || iolen == 0 ||
+              iolen > SSH_FILE_SERVER_HASH_MAX_BYTES ||
+              ssh_hash_allocate(name, &hash) != SSH_CRYPTO_OK)
+            {
+              ssh_xfree(name);
+              ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
+              break;
+            }
+          ssh_xfree(name);
+
+          /* Hash at most a limited amount at a time; the client asks
+             for the rest.  The block is no larger than that amount,
+             so at least one block is hashed. */
+          blocks = SSH_FILE_SERVER_HASH_MAX_BYTES / iolen;
+          if (blocks > SSH_FILE_SERVER_HASH_MAX_BLOCKS)
+            blocks = SSH_FILE_SERVER_HASH_MAX_BLOCKS;
+          if (length / iolen >= blocks)
+            length = (SshUInt64)iolen * blocks;
+          else
+            blocks = (SshUInt32)((length + iolen - 1) / iolen);
+
+          /* Compute the digests straight into the reply. */
+          iodata = ssh_file_server_send_reserve(request,
+                                                SSH_FXP_EXTENDED_REPLY, id,
+                                                blocks *
+                                                (ssh_hash_digest_length(hash) +
+                                                 (with_crc ? 4 : 0)));
+          ret = ssh_file_server_block_hash(handle->fd, hash, with_crc,
+                                           offset, length, iolen,
+                                           iodata, &bytes);
+          ssh_hash_free(hash);
+          if (ret != SSH_FX_OK)
+            {
+              ssh_file_server_send_cancel(request);
+              ssh_file_server_send_status(request, id,
+                                          (SshFileClientError)ret);
+              break;
+            }
+          ssh_file_server_send_commit(request, bytes);
+          break;
+        }
+
+      if (valuelen == strlen(SSH_FXE_DATA_EXTENTS) &&
+          memcmp(value, SSH_FXE_DATA_EXTENTS, valuelen) == 0)
+        {
+          if (ssh_decode_array(data, len,
+                               SSH_FORMAT_UINT32_STR_NOCOPY, &value, &valuelen,
+                               SSH_FORMAT_UINT64, &offset,
+                               SSH_FORMAT_UINT64, &length,
+                               SSH_FORMAT_END) != len)
+            {
+              ssh_warning("ssh_file_server_receive_proc: bad data-extents");
+              goto return_bad_status;
+            }
+
+          handle = ssh_file_server_find_handle(request, value, valuelen);
+          if (!handle || handle->is_directory)
+            {
+              ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
+              break;
+            }
+
+          /* The end of the answer comes first, then the extents. */
+          iodata = ssh_file_server_send_reserve(request,
+                                                SSH_FXP_EXTENDED_REPLY, id,
+                                                8 + 16 *
+                                                SSH_FILE_SERVER_EXTENTS_MAX);
+          ret = ssh_file_server_data_extents(handle->fd, offset, length,
+                                             iodata + 8, &bytes, &to_offset);
+          if (ret != SSH_FX_OK)
+            {
+              ssh_file_server_send_cancel(request);
+              ssh_file_server_send_status(request, id,
+                                          (SshFileClientError)ret);
+              break;
+            }
+          SSH_PUT_64BIT(iodata, to_offset);
+          ssh_file_server_send_commit(request, 8 + 16 * bytes);
+          break;
+        }
+
+      /* We did not list the extension; the client should not have
+         sent it. */
+      ssh_warning("ssh_file_server_receive_proc: unknown extension");
+      ssh_file_server_send_status(request, id, SSH_FX_FAILURE);
+      break;
+
     default:
       ssh_warning("ssh_file_server_receive_proc: unexpected packet: %d",
                   (int)type);
@@ -1110,35 +2013,36 @@ void ssh_file_server_receive_proc(SshPacketType type,
     }
 
   ssh_xfree(attrs);
-  
-  /* Check whether further sends are possible, and if not, stop receives
-     until we can also send data out. */
-  if (!ssh_packet_wrapper_can_send(server->conn))
-    ssh_packet_wrapper_can_receive(server->conn, FALSE);
+
+  /* Let go of the handle; this may close it. */
+  ssh_file_server_release_handle(request);
 }
 
-/* This callback function is called when EOF is received from the client.
-   This causes the server to be destroyed. */
+/* Destroys the server.  Called once EOF has been received and no
+   requests are running. */
 
-void ssh_file_server_eof_proc(void *context)
+void ssh_file_server_destroy(SshFileServer server)
 {
-  SshFileServer server = (SshFileServer)context;
-  SshServerHandle handle;
+  SshFileServerRequest request;
+  SshUInt32 i;
 
   /* Close and free all file handles. */
-  while (server->handles)
-    {
-      /* Get the first handle on the list. */
-      handle = server->handles;
+  for (i = 0; i < server->handles_size; i++)
+    if (server->handles[i] != NULL)
+      ssh_file_server_close_handle(server->handles[i]);
+  ssh_xfree(server->handles);
+  ssh_xfree(server->free_slots);
 
-      /* Close the file handle or directory handle. */
-      if (handle->is_directory)
-        closedir(handle->dir);
-      else
-        close(handle->fd);
+  if (server->pool)
+    ssh_thread_pool_destroy(server->pool);
+  ssh_mutex_destroy(server->lock);
 
-      /* Free the handle.  This also removes it from the list. */
-      ssh_file_server_free_handle(server, handle);
+  while ((request = server->free_requests) != NULL)
+    {
+      server->free_requests = request->next;
+      ssh_buffer_uninit(&request->packet);
+      ssh_buffer_uninit(&request->reply);
+      ssh_xfree(request);
     }
 
   /* Destroy the packet wrapper. */
@@ -1149,6 +2053,192 @@ void ssh_file_server_eof_proc(void *context)
   ssh_xfree(server);
 }
 
+void ssh_file_server_request_done(SshFileServerRequest request);
+
+/* Frees the request after its reply has been sent, and goes on with
+   the CLOSE waiting for it, if any. */
+
+void ssh_file_server_request_free(SshFileServerRequest request)
+{
+  SshFileServer server = request->server;
+  SshFileServerRequest then;
+
+  then = request->then;
+  request->then = NULL;
+  request->reply_type = 0;
+  request->next = server->free_requests;
+  server->free_requests = request;
+  server->requests_running--;
+
+  if (then)
+    ssh_file_server_request_done(then);
+}
+
+/* Called from the event loop when one of the things a request waits
+   for is done.  When all of them are, sends the reply if it has not
+   been sent yet, and frees the request.  If the connection cannot take
+   the reply now, it is queued until it can. */
+
+void ssh_file_server_request_done(SshFileServerRequest request)
+{
+  SshFileServer server = request->server;
+
+  if (--request->holds > 0)
+    return;
+
+  if (request->reply_type != 0)
+    {
+      if (server->unsent != NULL || !ssh_packet_wrapper_can_send(server->conn))
+        {
+          request->next = NULL;
+          if (server->unsent_tail)
+            server->unsent_tail->next = request;
+          else
+            server->unsent = request;
+          server->unsent_tail = request;
+          return;
+        }
+      ssh_packet_wrapper_send(server->conn, request->reply_type,
+                              ssh_buffer_ptr(&request->reply),
+                              ssh_buffer_len(&request->reply));
+    }
+  ssh_file_server_request_free(request);
+}
+
+/* Sends the queued replies, as many as the connection takes. */
+
+void ssh_file_server_send_unsent(SshFileServer server)
+{
+  SshFileServerRequest request;
+
+  while (server->unsent != NULL && ssh_packet_wrapper_can_send(server->conn))
+    {
+      request = server->unsent;
+      server->unsent = request->next;
+      if (server->unsent == NULL)
+        server->unsent_tail = NULL;
+      ssh_packet_wrapper_send(server->conn, request->reply_type,
+                              ssh_buffer_ptr(&request->reply),
+                              ssh_buffer_len(&request->reply));
+      ssh_file_server_request_free(request);
+    }
+}
+
+/* Enables receives if there is room for more requests and their
+   replies, and disables them otherwise. */
+
+void ssh_file_server_check_receive(SshFileServer server)
+{
+  Boolean status;
+
+  status = (server->requests_running < server->max_requests &&
+            ssh_packet_wrapper_can_send(server->conn));
+
+  /* Enabling receives resets the stream callbacks, so only do it when
+     they have been disabled. */
+  if (status != server->receiving)
+    {
+      server->receiving = status;
+      ssh_packet_wrapper_can_receive(server->conn, status);
+    }
+}
+
+/* The operation run in a worker thread. */
+
+void ssh_file_server_process_operation(void *context)
+{
+  ssh_file_server_process((SshFileServerRequest)context);
+}
+
+/* Called from the event loop when a worker has processed a request. */
+
+void ssh_file_server_process_completion(void *context)
+{
+  SshFileServerRequest request = (SshFileServerRequest)context;
+  SshFileServer server = request->server;
+
+  ssh_file_server_request_done(request);
+  ssh_file_server_send_unsent(server);
+
+  if (server->eof_received)
+    {
+      if (server->requests_running == 0)
+        ssh_file_server_destroy(server);
+      return;
+    }
+  ssh_file_server_check_receive(server);
+}
+
+/* This callback function is called whenever a packet is received from
+   the client. */
+
+void ssh_file_server_receive_proc(SshPacketType type,
+                                  const unsigned char *data, size_t len,
+                                  void *context)
+{
+  SshFileServer server = (SshFileServer)context;
+  SshFileServerRequest request;
+
+  if (server->free_requests)
+    {
+      request = server->free_requests;
+      server->free_requests = request->next;
+    }
+  else
+    {
+      request = ssh_xcalloc(1, sizeof(*request));
+      request->server = server;
+      ssh_buffer_init(&request->packet);
+      ssh_buffer_init(&request->reply);
+    }
+  request->next = NULL;
+  request->type = type;
+  request->holds = 1;
+  server->requests_running++;
+
+  if (server->pool == NULL)
+    {
+      /* Process the request now; the replies are sent as they are
+         made. */
+      request->send_now = TRUE;
+      request->data = data;
+      request->len = len;
+      ssh_file_server_process(request);
+      ssh_file_server_request_done(request);
+    }
+  else
+    {
+      /* The packet is only valid during this call, so the worker gets
+         a copy. */
+      request->send_now = FALSE;
+      ssh_buffer_clear(&request->packet);
+      ssh_buffer_append(&request->packet, data, len);
+      request->data = ssh_buffer_ptr(&request->packet);
+      request->len = len;
+      ssh_thread_pool_run(server->pool,
+                          ssh_file_server_process_operation,
+                          ssh_file_server_process_completion,
+                          (void *)request);
+    }
+
+  /* Stop receives if we are running as many requests as we may, or
+     cannot send the replies out. */
+  ssh_file_server_check_receive(server);
+}
+
+/* This callback function is called when EOF is received from the client.
+   This causes the server to be destroyed, once the requests still
+   running are done. */
+
+void ssh_file_server_eof_proc(void *context)
+{
+  SshFileServer server = (SshFileServer)context;
+
+  server->eof_received = TRUE;
+  if (server->requests_running == 0)
+    ssh_file_server_destroy(server);
+}
+
 /* This callback function is called when can_send has returned FALSE, and
    sending is again possible. */
 
@@ -1156,9 +2246,19 @@ void ssh_file_server_can_send_proc(void *context)
 {
   SshFileServer server = (SshFileServer)context;
 
+  /* Send the replies that have been waiting for this. */
+  ssh_file_server_send_unsent(server);
+  if (server->eof_received)
+    {
+      if (server->requests_running == 0)
+        ssh_file_server_destroy(server);
+      return;
+    }
+
   /* Since we can again send packets, we can process more requests.  Thus
-     enable receives. */
-  ssh_packet_wrapper_can_receive(server->conn, TRUE);
+     enable receives, unless we are already running as many requests as
+     we may. */
+  ssh_file_server_check_receive(server);
 }
 
 /* Wraps the given communications channel into a file transfer server.
@@ -1168,10 +2268,27 @@ SshFileServer ssh_file_server_wrap(SshStream stream)
 {
   SshFileServer server;
 
+  if (ssh_file_server_libc_lock == NULL)
+    ssh_file_server_libc_lock = ssh_mutex_create();
+
   /* Allocate a context for the server. */
   server = ssh_xmalloc(sizeof(*server));
   memset(server, 0, sizeof(*server));
   server->handles = NULL;
+  server->handles_size = 0;
+  server->free_slots = NULL;
+  server->num_free_slots = 0;
+  server->handle_serial = 0;
+  server->pool = NULL;
+  server->lock = ssh_mutex_create();
+  server->max_requests = 1;
+  server->requests_running = 0;
+  server->unsent = NULL;
+  server->unsent_tail = NULL;
+  server->free_requests = NULL;
+  server->eof_received = FALSE;
+  server->receiving = TRUE;
+  server->day_valid = FALSE;
   server->conn = ssh_packet_wrap(stream,
                                  ssh_file_server_receive_proc,
                                  ssh_file_server_eof_proc,
@@ -1179,3 +2296,22 @@ SshFileServer ssh_file_server_wrap(SshStream stream)
                                  (void *)server);
   return server;
 }
+
+/* Lets the server run up to `max_requests' requests at a time in
+   worker threads.  Without pread and pwrite the requests seek the
+   descriptor they share with the others, so they are then always run
+   one at a time. */
+
+void ssh_file_server_set_concurrency(SshFileServer server, int max_requests)
+{
+  SSH_PRECOND(server->pool == NULL && server->requests_running == 0);
+
+#if !defined(HAVE_PREAD) || !defined(HAVE_PWRITE)
+  max_requests = 1;
+#endif /* !HAVE_PREAD || !HAVE_PWRITE */
+  if (max_requests <= 1)
+    return;
+  server->pool = ssh_thread_pool_create(max_requests);
+  if (server->pool != NULL)
+    server->max_requests = max_requests;
+}
@@ -108,7 +108,8 @@ void ssh_packet_wrapper_send_eof(SshPacketWrapper wrapper);
    eventually cause packets to be lost.  To give a specific value, it
    is OK to send 10000 bytes after this starts returning FALSE (this
    provision exists to avoid checks in every disconnect and debug
-   message). */
+   message).  One packet of any size can be sent whenever this returns
+   TRUE. */
 Boolean ssh_packet_wrapper_can_send(SshPacketWrapper wrapper);
 
 /* Sends a packet to the underlying stream.  The packet may actually
@@ -130,6 +131,28 @@ void ssh_packet_wrapper_send_encode_va(SshPacketWrapper wrapper,
 				       SshPacketType type,
 				       va_list va);
 
+/* Starts a packet of type `type' directly in the outgoing buffer, with
+   the payload encoded as specified for ssh_encode_buffer, and reserves
+   `len' more bytes at the end of the payload.  Returns a pointer to
+   the reserved space, which the caller may fill in, for example by
+   reading from a file into it.  The packet must then be finished with
+   ssh_packet_wrapper_send_commit or ssh_packet_wrapper_send_cancel
+   before anything else is done with the wrapper; the pointer is not
+   valid after that. */
+unsigned char *ssh_packet_wrapper_send_reserve(SshPacketWrapper wrapper,
+					       SshPacketType type,
+					       size_t len,
+					       ...);
+
+/* Sends the packet started with ssh_packet_wrapper_send_reserve.  Only
+   the first `len' bytes of the reserved space are sent; the rest is
+   given back. */
+void ssh_packet_wrapper_send_commit(SshPacketWrapper wrapper, size_t len);
+
+/* Throws away the packet started with ssh_packet_wrapper_send_reserve
+   without sending anything. */
+void ssh_packet_wrapper_send_cancel(SshPacketWrapper wrapper);
+
 /************************************************************************
  * Functions for implementing an SshStream object that communicates
  * using packets.  (Some callback definitions are shared by 
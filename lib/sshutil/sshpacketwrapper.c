@@ -45,6 +45,12 @@ struct SshPacketWrapperRec
   /* SshBuffer for constructing outgoing packets. */
   SshBuffer outgoing_packet;
 
+  /* Offset in `outgoing' of the packet being built with
+     ssh_packet_wrapper_send_reserve, and the number of bytes reserved
+     at its end. */
+  size_t reserved_offset;
+  size_t reserved_len;
+
   /* Flag indicating that ssh_packet_wrapper_can_send has returned FALSE, and
      thus we should call the can_send callback when sending is again
      possible. */
@@ -136,6 +142,9 @@ Boolean ssh_packet_wrapper_output(SshPacketWrapper down)
   /* All output has drained.  There is no more buffered data. */
   if (down->send_blocked)
     {
+      /* Clear the flag before the callback; the callback may fill the
+         buffer again, and then it must be called again. */
+      down->send_blocked = FALSE;
       down->cannot_destroy = TRUE;
       if (down->can_send)
         (*down->can_send)(down->context);
@@ -145,7 +154,6 @@ Boolean ssh_packet_wrapper_output(SshPacketWrapper down)
           ssh_packet_wrapper_destroy(down);
           return FALSE;
         }
-      down->send_blocked = FALSE;
     }
 
   /* If we should send EOF after output has drained, do it now. */
@@ -500,8 +508,12 @@ void ssh_packet_wrapper_send_encode_va(SshPacketWrapper down,
   ssh_packet_encode_va(&down->outgoing_packet, type, va);
 
   /* Check that we don't overflow maximum buffer size.  Drop the packet
-     if we would. */
-  if (ssh_buffer_len(&down->outgoing) +
+     if we would.  A packet sent while can_send returns TRUE is always
+     taken, however big it is; the file transfer protocol has packets
+     larger than the allowance. */
+  if (ssh_buffer_len(&down->outgoing) >= BUFFER_MAX_SIZE -
+      ALLOW_AFTER_BUFFER_FULL &&
+      ssh_buffer_len(&down->outgoing) +
       ssh_buffer_len(&down->outgoing_packet) >= BUFFER_MAX_SIZE)
     {
       ssh_debug("ssh_packet_wrapper_send_encode_va: flow control problems; "
@@ -518,6 +530,68 @@ void ssh_packet_wrapper_send_encode_va(SshPacketWrapper down,
                           (void *)down);
 }
 
+/* Starts a packet directly in the outgoing buffer, and reserves `len'
+   bytes at its end for the caller to fill in. */
+
+unsigned char *ssh_packet_wrapper_send_reserve(SshPacketWrapper down,
+                                               SshPacketType type,
+                                               size_t len,
+                                               ...)
+{
+  va_list va;
+  unsigned char *p;
+
+  down->reserved_offset = ssh_buffer_len(&down->outgoing);
+  va_start(va, len);
+  ssh_packet_encode_va(&down->outgoing, type, va);
+  va_end(va);
+  ssh_buffer_append_space(&down->outgoing, &p, len);
+  down->reserved_len = len;
+  return p;
+}
+
+/* Sends the packet started with ssh_packet_wrapper_send_reserve, with
+   the first `len' bytes of the reserved space as its last bytes. */
+
+void ssh_packet_wrapper_send_commit(SshPacketWrapper down, size_t len)
+{
+  unsigned char *p;
+  size_t packet_len;
+
+  SSH_PRECOND(len <= down->reserved_len);
+
+  /* Give back the space not used, and add what was used to the length
+     in the packet header. */
+  ssh_buffer_consume_end(&down->outgoing, down->reserved_len - len);
+  down->reserved_len = 0;
+  p = ssh_buffer_ptr(&down->outgoing) + down->reserved_offset;
+  SSH_PUT_32BIT(p, SSH_GET_32BIT(p) + len);
+  packet_len = ssh_buffer_len(&down->outgoing) - down->reserved_offset;
+
+  /* Same check as in ssh_packet_wrapper_send_encode_va. */
+  if (down->reserved_offset >= BUFFER_MAX_SIZE - ALLOW_AFTER_BUFFER_FULL &&
+      down->reserved_offset + packet_len >= BUFFER_MAX_SIZE)
+    {
+      ssh_debug("ssh_packet_wrapper_send_commit: flow control problems; "
+                "outgoing packet dropped.");
+      ssh_buffer_consume_end(&down->outgoing, packet_len);
+      return;
+    }
+
+  /* Reset the callback to ensure that our callback gets called. */
+  ssh_stream_set_callback(down->stream, ssh_packet_wrapper_callback,
+                          (void *)down);
+}
+
+/* Throws away the packet started with ssh_packet_wrapper_send_reserve. */
+
+void ssh_packet_wrapper_send_cancel(SshPacketWrapper down)
+{
+  ssh_buffer_consume_end(&down->outgoing, ssh_buffer_len(&down->outgoing) -
+                         down->reserved_offset);
+  down->reserved_len = 0;
+}
+
 /* Sends a packet to the underlying stream.  The payload will be encoded as
    specified for ssh_encode_buffer. */
 
@@ -22,6 +22,15 @@ Interface to sockets.
 #include "sshbuffer.h"
 #include "sshsocks.h"
 #include "sshurl.h"
+#include "sshtimeouts.h"
+
+/* The most connection attempts that can be in progress at once. */
+#define SSH_TCP_MAX_PARALLEL    8
+
+/* How many addresses of a host are connected to at once, and how many
+   milliseconds to wait for an attempt before starting the next. */
+unsigned int ssh_tcp_connect_parallel = 4;
+long ssh_tcp_connect_stagger = 250;
 
 typedef enum
 {
@@ -33,9 +42,18 @@ typedef enum
   CONNECT_STATE_SOCKS_RECEIVE
 } ConnectState;
 
+/* One of the connection attempts in progress. */
+
+typedef struct ConnectAttemptRec {
+  struct ConnectContextRec *c;          /* the connect operation */
+  void *low;                            /* the low-level connect */
+  const char *address;                  /* address being connected to */
+  Boolean active;                       /* attempt is in progress */
+} ConnectAttemptRec, *ConnectAttempt;
+
 /* A context used to track SOCKS server connection status. */
 
-typedef struct {
+typedef struct ConnectContextRec {
   ConnectState state;                   /* Status of the connect operation. */
   
   /* Information about the target host. */
@@ -61,19 +79,48 @@ typedef struct {
   char *user_name;                      /* user requesting connection */
   SshBuffer *socks_buf;                 /* Socks buffer */
 
+  /* Connection attempts to the addresses of either the host or the
+     socks server. */
+  const char *race_list;                /* addresses being tried */
+  const char *race_next;                /* next address to try, or NULL */
+  unsigned int race_port;               /* port to connect to */
+  SshIpError race_error;                /* error of the last failure */
+  unsigned int attempts_active;         /* attempts in progress */
+  ConnectAttemptRec attempts[SSH_TCP_MAX_PARALLEL];
+
   /* An open stream to either the socks server or the final destination. */
   SshStream stream;
 } *ConnectContext;
 
 
 /* Connects to the given address/port, and makes a stream for it.
-   The address to use is the first address from the list.  This
-   function is defined in the machine-specific file. */
-void ssh_socket_low_connect(const char *address_list, unsigned int port,
-                            SshTcpCallback callback, void *context);
-
-/* Forward declaration; defined later in this file. */
+   The address to use is the first address from the list.  The
+   callback is never called during this call.  Returns a handle that
+   can be given to ssh_socket_low_connect_abort until the callback has
+   been called.  These functions are defined in the machine-specific
+   file. */
+void *ssh_socket_low_connect(const char *address_list, unsigned int port,
+                             SshTcpCallback callback, void *context);
+void ssh_socket_low_connect_abort(void *handle);
+
+/* Forward declarations; defined later in this file. */
 void ssh_socket_connect_step(ConnectContext);
+void ssh_socket_race_abort(ConnectContext c);
+
+/* Sets how many addresses of a host are connected to at once, and how
+   long to wait for an attempt before starting the next. */
+
+void ssh_tcp_set_connect_parallel(unsigned int parallel, long stagger_msec)
+{
+  if (parallel < 1)
+    parallel = 1;
+  if (parallel > SSH_TCP_MAX_PARALLEL)
+    parallel = SSH_TCP_MAX_PARALLEL;
+  if (stagger_msec < 0)
+    stagger_msec = 0;
+  ssh_tcp_connect_parallel = parallel;
+  ssh_tcp_connect_stagger = stagger_msec;
+}
 
 /* Opens a TCP/IP connection to the given port on the host, and calls
    the callback when the connection is either ready or has failed.  The
@@ -175,6 +222,7 @@ void ssh_tcp_connect(const char *host_name_or_address,
 
 void ssh_socket_destroy_connect_context(ConnectContext c)
 {
+  ssh_socket_race_abort(c);
   if (c->host_name)
     ssh_xfree(c->host_name);
   if (c->host_addresses)
@@ -302,37 +350,6 @@ void ssh_socket_connect_socks_lookup_done(SshIpError error,
   ssh_socket_connect_step(c);
 }
 
-/* This callback is called when the target host has been connected, or the
-   attempt has failed.  This will either call user callback or retry. */
-
-void DLLCALLCONV ssh_socket_host_connect_done(SshIpError error,
-                                              SshStream stream,
-                                              void *context)
-{
-  ConnectContext c = (ConnectContext)context;
-
-  if (error != SSH_IP_OK)
-    {
-      /* Get next address. */
-      if (strchr(c->next_address, ','))
-        c->next_address = strchr(c->next_address, ',') + 1;
-      else
-        { /* At end of list; consider it as a failure. */
-          if (ssh_socket_failure(c, error))
-            return;
-          c->next_address = c->host_addresses;
-        }
-      /* Try connecting again. */
-      ssh_socket_low_connect(c->next_address, c->host_port,
-                             ssh_socket_host_connect_done, (void *)c);
-      return;
-    }
-
-  /* Successfully connected to the host.  Call the user callback and
-     destroy context. */
-  ssh_socket_connect_final(c, stream, SSH_IP_OK);
-}
-
 /* We are called whenever a notification is received from the stream.
    This shouldn't really happen unless read/write has failed, though
    I wouldn't count on it.  */
@@ -387,36 +404,16 @@ void ssh_socket_socks_notify(SshStreamNotification notification,
     }
 }
 
-/* This callback is called when a connection to the socks server
-   is complete or has failed.  This will either call the user callback,
-   retry, or switch to the next state. */
+/* This is called when a connection to the socks server is complete.
+   This will either call the user callback, or switch to the next
+   state. */
 
-void DLLCALLCONV ssh_socket_socks_connect_done(SshIpError error,
-                                               SshStream stream,
-                                               void *context)
+void ssh_socket_socks_connected(ConnectContext c, SshStream stream)
 {
-  ConnectContext c = (ConnectContext)context;
   struct SocksInfoRec socksinfo;
   SocksError ret;
   char host_port[64];
 
-  if (error != SSH_IP_OK)
-    {
-      /* Get next address. */
-      if (strchr(c->socks_next_address, ','))
-        c->socks_next_address = strchr(c->socks_next_address, ',') + 1;
-      else
-        { /* At end of list; consider it as a failure. */
-          if (ssh_socket_failure(c, error))
-            return;
-          c->socks_next_address = (char *) c->socks_addresses;
-        }
-      /* Try connecting again. */
-      ssh_socket_low_connect(c->socks_next_address, c->socks_port,
-                             ssh_socket_socks_connect_done, (void *)c);
-      return;
-    }
-
   /* Save the stream. */
   c->stream = stream;
 
@@ -447,6 +444,132 @@ void DLLCALLCONV ssh_socket_socks_connect_done(SshIpError error,
   ssh_socket_connect_step(c);
 }
 
+/* Connection attempts to the addresses of a host (or the socks server)
+   are started one at a time, the next one when the previous has failed
+   or has not succeeded in ssh_tcp_connect_stagger milliseconds, with at
+   most ssh_tcp_connect_parallel of them in progress.  The first one to
+   succeed is used, and the rest are cancelled.  This way a dead address
+   early on the list costs only the stagger delay instead of a full
+   connect timeout. */
+
+void ssh_socket_race_launch(ConnectContext c);
+void ssh_socket_race_stagger(void *context);
+
+/* Cancels the connection attempts in progress. */
+
+void ssh_socket_race_abort(ConnectContext c)
+{
+  int i;
+
+  ssh_cancel_timeouts(ssh_socket_race_stagger, (void *)c);
+  for (i = 0; i < SSH_TCP_MAX_PARALLEL; i++)
+    if (c->attempts[i].active)
+      {
+        ssh_socket_low_connect_abort(c->attempts[i].low);
+        c->attempts[i].active = FALSE;
+      }
+  c->attempts_active = 0;
+}
+
+/* This callback is called when a connection attempt is complete or has
+   failed.  On success, the other attempts are cancelled and the stream
+   is used; on failure, the next address is tried. */
+
+void DLLCALLCONV ssh_socket_race_done(SshIpError error,
+                                      SshStream stream,
+                                      void *context)
+{
+  ConnectAttempt a = (ConnectAttempt)context;
+  ConnectContext c = a->c;
+
+  a->active = FALSE;
+  c->attempts_active--;
+
+  if (error != SSH_IP_OK)
+    {
+      c->race_error = error;
+      ssh_socket_race_launch(c);
+      return;
+    }
+
+  ssh_socket_race_abort(c);
+  if (c->state == CONNECT_STATE_HOST_CONNECT)
+    {
+      /* Successfully connected to the host.  Call the user callback and
+         destroy context. */
+      c->next_address = a->address;
+      ssh_socket_connect_final(c, stream, SSH_IP_OK);
+    }
+  else
+    {
+      c->socks_next_address = a->address;
+      ssh_socket_socks_connected(c, stream);
+    }
+}
+
+void ssh_socket_race_stagger(void *context)
+{
+  ssh_socket_race_launch((ConnectContext)context);
+}
+
+/* Starts an attempt to the next address on the list, if there is room
+   for one. */
+
+void ssh_socket_race_launch(ConnectContext c)
+{
+  ConnectAttempt a;
+  int i;
+
+  ssh_cancel_timeouts(ssh_socket_race_stagger, (void *)c);
+
+  if (c->race_next == NULL)
+    {
+      if (c->attempts_active > 0)
+        return;
+
+      /* At end of list; consider it as a failure. */
+      if (ssh_socket_failure(c, c->race_error))
+        return;
+      c->race_next = c->race_list;
+    }
+  if (c->attempts_active >= ssh_tcp_connect_parallel)
+    return;
+
+  for (i = 0; c->attempts[i].active; i++)
+    ;
+  a = &c->attempts[i];
+  a->c = c;
+  a->address = c->race_next;
+  a->active = TRUE;
+  c->attempts_active++;
+
+  c->race_next = strchr(c->race_next, ',');
+  if (c->race_next)
+    c->race_next++;
+
+  a->low = ssh_socket_low_connect(a->address, c->race_port,
+                                  ssh_socket_race_done, (void *)a);
+
+  /* Start the next one unless this one succeeds soon enough. */
+  if (c->race_next != NULL && c->attempts_active < ssh_tcp_connect_parallel)
+    ssh_register_timeout(ssh_tcp_connect_stagger / 1000,
+                         (ssh_tcp_connect_stagger % 1000) * 1000,
+                         ssh_socket_race_stagger, (void *)c);
+}
+
+/* Starts connecting to the addresses on `list', beginning from `first'. */
+
+void ssh_socket_race_start(ConnectContext c, const char *list,
+                           const char *first, unsigned int port)
+{
+  ssh_socket_race_abort(c);
+  c->race_list = list;
+  c->race_next = first;
+  c->race_port = port;
+  c->race_error = SSH_IP_FAILURE;
+  ssh_socket_race_launch(c);
+}
+
 /* Performs the next step of connecting.  This may be a name server lookup,
    connecting to the socks server, conversation with the socks server, or
    retrying. */
@@ -471,13 +594,13 @@ restart:
       break;
       
     case CONNECT_STATE_HOST_CONNECT:
-      ssh_socket_low_connect(c->next_address, c->host_port,
-                             ssh_socket_host_connect_done, (void *)c);
+      ssh_socket_race_start(c, c->host_addresses, c->next_address,
+                            c->host_port);
       break;
       
     case CONNECT_STATE_SOCKS_CONNECT:
-      ssh_socket_low_connect(c->socks_next_address, c->socks_port,
-                             ssh_socket_socks_connect_done, (void *)c);
+      ssh_socket_race_start(c, (const char *)c->socks_addresses,
+                            c->socks_next_address, c->socks_port);
       break;
       
     case CONNECT_STATE_SOCKS_SEND:
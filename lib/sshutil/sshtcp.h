@@ -102,6 +102,18 @@ ssh_tcp_connect(const char *host_name_or_address,
                 SshTcpCallback callback,
                 void *context);
 
+/* Sets how a host with several addresses is connected to.  An attempt
+   to the first address is started, and if it has neither succeeded nor
+   failed in `stagger_msec' milliseconds, one to the next address is
+   started alongside it, and so on, with at most `parallel' attempts in
+   progress at once.  An attempt that fails starts the next one at once.
+   The first attempt to succeed is used and the others are cancelled.
+   A `parallel' of 1 tries the addresses one at a time.  The defaults
+   are 4 attempts and 250 milliseconds; `parallel' is at most 8.  This
+   also applies to the addresses of the SOCKS server. */
+DLLEXPORT void DLLCALLCONV
+ssh_tcp_set_connect_parallel(unsigned int parallel, long stagger_msec);
+
 /* --------- function for listening for connections ---------- */
 
 typedef struct SshTcpListenerRec *SshTcpListener;
@@ -182,7 +194,10 @@ ssh_tcp_get_host_addrs_by_name_sync(const char *name);
 
 /* Looks up all ip-addresses of the host, returning them as a comma-separated
    list when calling the callback.  The host name may already be an ip
-   address, in which case it is returned directly. */
+   address, in which case it is returned directly.  The lookup is made by a
+   helper process while the event loop runs, and the callback is called
+   from the event loop; results are cached for a few minutes (failures
+   for less), in which case the callback is called during this call. */
 DLLEXPORT void DLLCALLCONV
 ssh_tcp_get_host_addrs_by_name(const char *name, 
                                SshLookupCallback callback,
@@ -204,7 +219,8 @@ ssh_tcp_get_host_by_addr_sync(const char *addr);
 /* Looks up the name of the host by its ip-address.  Verifies that the
    address returned by the name servers also has the original ip address.
    Calls the callback with either error or success.  The callback should
-   copy the returned name. */
+   copy the returned name.  The lookup is made and cached as with
+   ssh_tcp_get_host_addrs_by_name. */
 DLLEXPORT void DLLCALLCONV
 ssh_tcp_get_host_by_addr(const char *addr, SshLookupCallback callback,
                          void *context);
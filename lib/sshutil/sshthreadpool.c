@@ -0,0 +1,366 @@
+/*
+
+sshthreadpool.c
+
+Copyright (c) 1999 SSH Communications Security, Finland
+                   All rights reserved
+
+Running blocking operations in worker threads.  The workers take
+operations from a queue; when one is done, it is moved to a list of
+finished operations and a byte is written to a pipe, which wakes up
+the event loop to call the completions.
+
+*/
+
+#include "sshincludes.h"
+#include "sshunixeloop.h"
+#include "sshthreadpool.h"
+
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif /* HAVE_LIBPTHREAD */
+
+#define SSH_DEBUG_MODULE "SshThreadPool"
+
+#ifdef HAVE_LIBPTHREAD
+
+struct SshMutexRec
+{
+  pthread_mutex_t mutex;
+};
+
+SshMutex ssh_mutex_create(void)
+{
+  SshMutex mutex;
+
+  mutex = ssh_xmalloc(sizeof(*mutex));
+  pthread_mutex_init(&mutex->mutex, NULL);
+  return mutex;
+}
+
+void ssh_mutex_destroy(SshMutex mutex)
+{
+  pthread_mutex_destroy(&mutex->mutex);
+  ssh_xfree(mutex);
+}
+
+void ssh_mutex_lock(SshMutex mutex)
+{
+  pthread_mutex_lock(&mutex->mutex);
+}
+
+void ssh_mutex_unlock(SshMutex mutex)
+{
+  pthread_mutex_unlock(&mutex->mutex);
+}
+
+/* An operation given to the pool. */
+
+typedef struct SshThreadPoolJobRec
+{
+  struct SshThreadPoolJobRec *next;
+  SshThreadPoolOperation operation;
+  SshThreadPoolCompletion completion;
+  void *context;
+} *SshThreadPoolJob;
+
+struct SshThreadPoolRec
+{
+  /* Protects everything below, except the fields only used by the
+     event loop. */
+  pthread_mutex_t lock;
+
+  /* Signalled when an operation is queued, or the pool is being
+     destroyed. */
+  pthread_cond_t work;
+
+  /* Signalled when a worker exits. */
+  pthread_cond_t exited;
+
+  /* Operations not yet started, in order. */
+  SshThreadPoolJob queue;
+  SshThreadPoolJob queue_tail;
+
+  /* Operations that have finished, but whose completion has not been
+     called. */
+  SshThreadPoolJob finished;
+  SshThreadPoolJob finished_tail;
+
+  /* Job structures for reuse. */
+  SshThreadPoolJob free_jobs;
+
+  int max_threads;
+  int num_threads;
+  int idle_threads;
+
+  /* TRUE if a byte has been written to the pipe and not read yet. */
+  Boolean notified;
+
+  /* TRUE when the workers should exit. */
+  Boolean destroyed;
+
+  /* The pipe that wakes up the event loop. */
+  int pipe_fds[2];
+
+  /* Number of operations whose completion has not yet been called.
+     The pipe is only selected for while this is non-zero, so that an
+     idle pool does not keep the event loop running. */
+  int pending;
+
+  /* TRUE while the completions are being called, and TRUE if the pool
+     was destroyed from one of them.  These are only used in the event
+     loop. */
+  Boolean in_completions;
+  Boolean destroy_requested;
+};
+
+void ssh_thread_pool_free(SshThreadPool pool);
+
+/* The main loop of a worker thread. */
+
+void *ssh_thread_pool_worker(void *context)
+{
+  SshThreadPool pool = (SshThreadPool)context;
+  SshThreadPoolJob job;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+    {
+      while (pool->queue == NULL && !pool->destroyed)
+        {
+          pool->idle_threads++;
+          pthread_cond_wait(&pool->work, &pool->lock);
+          pool->idle_threads--;
+        }
+      if (pool->destroyed)
+        break;
+
+      job = pool->queue;
+      pool->queue = job->next;
+      if (pool->queue == NULL)
+        pool->queue_tail = NULL;
+      pthread_mutex_unlock(&pool->lock);
+
+      (*job->operation)(job->context);
+
+      pthread_mutex_lock(&pool->lock);
+      job->next = NULL;
+      if (pool->finished_tail)
+        pool->finished_tail->next = job;
+      else
+        pool->finished = job;
+      pool->finished_tail = job;
+      if (!pool->notified)
+        {
+          pool->notified = TRUE;
+          while (write(pool->pipe_fds[1], "", 1) < 0 && errno == EINTR)
+            ;
+        }
+    }
+  pool->num_threads--;
+  pthread_cond_signal(&pool->exited);
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/* Called from the event loop when workers have finished operations.
+   Calls their completions. */
+
+void ssh_thread_pool_io_callback(unsigned int events, void *context)
+{
+  SshThreadPool pool = (SshThreadPool)context;
+  SshThreadPoolJob job, next;
+  char buf[16];
+
+  while (read(pool->pipe_fds[0], buf, sizeof(buf)) > 0)
+    ;
+
+  pthread_mutex_lock(&pool->lock);
+  job = pool->finished;
+  pool->finished = NULL;
+  pool->finished_tail = NULL;
+  pool->notified = FALSE;
+  pthread_mutex_unlock(&pool->lock);
+
+  pool->in_completions = TRUE;
+  for (; job; job = next)
+    {
+      next = job->next;
+      pool->pending--;
+      if (!pool->destroy_requested)
+        (*job->completion)(job->context);
+
+      pthread_mutex_lock(&pool->lock);
+      job->next = pool->free_jobs;
+      pool->free_jobs = job;
+      pthread_mutex_unlock(&pool->lock);
+    }
+  pool->in_completions = FALSE;
+
+  if (pool->destroy_requested)
+    ssh_thread_pool_free(pool);
+  else if (pool->pending == 0)
+    ssh_io_set_fd_request(pool->pipe_fds[0], 0);
+}
+
+SshThreadPool ssh_thread_pool_create(int max_threads)
+{
+  SshThreadPool pool;
+
+  if (max_threads < 1)
+    return NULL;
+
+  pool = ssh_xcalloc(1, sizeof(*pool));
+  if (pipe(pool->pipe_fds) < 0)
+    {
+      ssh_warning("ssh_thread_pool_create: pipe: %.100s", strerror(errno));
+      ssh_xfree(pool);
+      return NULL;
+    }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->exited, NULL);
+  pool->max_threads = max_threads;
+
+  /* The workers must never block on the pipe; one byte in it is
+     enough anyway. */
+  fcntl(pool->pipe_fds[1], F_SETFL,
+        fcntl(pool->pipe_fds[1], F_GETFL, 0) | O_NONBLOCK);
+  ssh_io_register_fd(pool->pipe_fds[0], ssh_thread_pool_io_callback,
+                     (void *)pool);
+  return pool;
+}
+
+void ssh_thread_pool_run(SshThreadPool pool,
+                         SshThreadPoolOperation operation,
+                         SshThreadPoolCompletion completion,
+                         void *context)
+{
+  SshThreadPoolJob job;
+  pthread_t thread;
+
+  if (pool->pending++ == 0)
+    ssh_io_set_fd_request(pool->pipe_fds[0], SSH_IO_READ);
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->free_jobs)
+    {
+      job = pool->free_jobs;
+      pool->free_jobs = job->next;
+    }
+  else
+    job = ssh_xmalloc(sizeof(*job));
+  job->next = NULL;
+  job->operation = operation;
+  job->completion = completion;
+  job->context = context;
+  if (pool->queue_tail)
+    pool->queue_tail->next = job;
+  else
+    pool->queue = job;
+  pool->queue_tail = job;
+
+  /* Start another worker if none of them is free to take the job. */
+  if (pool->idle_threads == 0 && pool->num_threads < pool->max_threads)
+    {
+      if (pthread_create(&thread, NULL, ssh_thread_pool_worker,
+                         (void *)pool) == 0)
+        {
+          pthread_detach(thread);
+          pool->num_threads++;
+        }
+      else if (pool->num_threads == 0)
+        ssh_fatal("ssh_thread_pool_run: cannot create a thread");
+    }
+  else
+    pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Waits for the workers to exit and frees the pool. */
+
+void ssh_thread_pool_free(SshThreadPool pool)
+{
+  SshThreadPoolJob job;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->destroyed = TRUE;
+  pthread_cond_broadcast(&pool->work);
+  while (pool->num_threads > 0)
+    pthread_cond_wait(&pool->exited, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+
+  ssh_io_unregister_fd(pool->pipe_fds[0], FALSE);
+  close(pool->pipe_fds[0]);
+  close(pool->pipe_fds[1]);
+
+  while ((job = pool->queue) != NULL)
+    {
+      pool->queue = job->next;
+      ssh_xfree(job);
+    }
+  while ((job = pool->finished) != NULL)
+    {
+      pool->finished = job->next;
+      ssh_xfree(job);
+    }
+  while ((job = pool->free_jobs) != NULL)
+    {
+      pool->free_jobs = job->next;
+      ssh_xfree(job);
+    }
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->exited);
+  pthread_mutex_destroy(&pool->lock);
+  ssh_xfree(pool);
+}
+
+void ssh_thread_pool_destroy(SshThreadPool pool)
+{
+  /* The completion loop still uses the pool; it frees the pool when
+     it is done. */
+  if (pool->in_completions)
+    {
+      pool->destroy_requested = TRUE;
+      return;
+    }
+  ssh_thread_pool_free(pool);
+}
+
+#else /* HAVE_LIBPTHREAD */
+
+SshMutex ssh_mutex_create(void)
+{
+  return NULL;
+}
+
+void ssh_mutex_destroy(SshMutex mutex)
+{
+}
+
+void ssh_mutex_lock(SshMutex mutex)
+{
+}
+
+void ssh_mutex_unlock(SshMutex mutex)
+{
+}
+
+SshThreadPool ssh_thread_pool_create(int max_threads)
+{
+  return NULL;
+}
+
+void ssh_thread_pool_run(SshThreadPool pool,
+                         SshThreadPoolOperation operation,
+                         SshThreadPoolCompletion completion,
+                         void *context)
+{
+  ssh_fatal("ssh_thread_pool_run: no threads on this platform");
+}
+
+void ssh_thread_pool_destroy(SshThreadPool pool)
+{
+}
+
+#endif /* HAVE_LIBPTHREAD */
@@ -0,0 +1,70 @@
+/*
+
+sshthreadpool.h
+
+Copyright (c) 1999 SSH Communications Security, Finland
+                   All rights reserved
+
+Running blocking operations (typically file system calls) in worker
+threads, with their completions delivered back in the event loop.
+
+Only the operation itself is run in a worker thread; everything else,
+including the completion callback, runs in the thread that runs the
+event loop.  The operations must not call any functions that are not
+safe to call from several threads at once, unless they protect them
+with a mutex.
+
+If threads are not available on the platform, ssh_thread_pool_create
+returns NULL and the mutex functions do nothing.
+
+*/
+
+#ifndef SSHTHREADPOOL_H
+#define SSHTHREADPOOL_H
+
+/* Data type for a mutex. */
+typedef struct SshMutexRec *SshMutex;
+
+/* Creates a mutex. */
+SshMutex ssh_mutex_create(void);
+
+/* Destroys a mutex.  It must not be locked. */
+void ssh_mutex_destroy(SshMutex mutex);
+
+/* Locks the mutex, waiting for another thread to unlock it first if
+   necessary.  The mutex must not already be locked by this thread. */
+void ssh_mutex_lock(SshMutex mutex);
+
+/* Unlocks the mutex. */
+void ssh_mutex_unlock(SshMutex mutex);
+
+/* Data type for a pool of worker threads. */
+typedef struct SshThreadPoolRec *SshThreadPool;
+
+/* An operation run in a worker thread. */
+typedef void (*SshThreadPoolOperation)(void *context);
+
+/* Called from the event loop after the operation has returned. */
+typedef void (*SshThreadPoolCompletion)(void *context);
+
+/* Creates a pool that runs at most `max_threads' operations at a
+   time.  The threads are started when they are first needed.  Returns
+   NULL if threads are not available, or `max_threads' is less than 1;
+   the caller should then do the work itself. */
+SshThreadPool ssh_thread_pool_create(int max_threads);
+
+/* Runs `operation' in a worker thread, and then `completion' from
+   the event loop.  Operations are started in the order they are
+   given, but may complete in any order.  This never blocks; operations
+   that cannot be started at once are queued. */
+void ssh_thread_pool_run(SshThreadPool pool,
+                         SshThreadPoolOperation operation,
+                         SshThreadPoolCompletion completion,
+                         void *context);
+
+/* Destroys the pool.  This waits for the operations that are running
+   to finish; their completions, and those of the operations not yet
+   started, are not called.  This may be called from a completion. */
+void ssh_thread_pool_destroy(SshThreadPool pool);
+
+#endif /* SSHTHREADPOOL_H */
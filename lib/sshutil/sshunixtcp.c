@@ -22,6 +22,9 @@ Unix-specific code for sockets.
 #include "sshunixfdstream.h"
 #include "sshtimeouts.h"
 #include "sshunixeloop.h"
+#include "sshbuffer.h"
+#include "sshgetput.h"
+#include "sshtime.h"
 
 #define MAX_IP_ADDR_LEN 16
 
@@ -214,25 +217,55 @@ void ssh_socket_low_connect_try(unsigned int events, void *context)
 
 #endif /* NO_NONBLOCKING_CONNECT */
 
-/* Connects to the given address/port, and makes a stream for it.
-   The address to use is the first address from the list. */
+/* Creates the socket and starts connecting.  This is called from the
+   event loop, so the callback is never called during
+   ssh_socket_low_connect. */
 
-void ssh_socket_low_connect(const char *address_list, unsigned int port,
-                            SshTcpCallback callback, void *context)
+void ssh_socket_low_connect_start(void *context)
 {
-  int sock, first_len;
-  LowConnect c;
+  LowConnect c = (LowConnect)context;
 
   /* Create a socket. */
-  sock = socket(AF_INET, SOCK_STREAM, 0);
-  if (sock < 0)
+  c->sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (c->sock < 0)
     {
-      (*callback)(SSH_IP_FAILURE, NULL, context);
+      (*c->callback)(SSH_IP_FAILURE, NULL, c->context);
+      ssh_xfree(c->address);
+      ssh_xfree(c);
       return;
     }
 
   /* Set SO_REUSEADDR. */
-  ssh_socket_set_reuseaddr(sock);
+  ssh_socket_set_reuseaddr(c->sock);
+
+#ifdef NO_NONBLOCKING_CONNECT
+
+  /* Try connect once.  Function calls user callback. */
+  ssh_socket_low_connect_try_once(SSH_IO_WRITE, (void *)c);
+
+#else /* NO_NONBLOCKING_CONNECT */
+
+  /* Register it and request events. */
+  ssh_io_register_fd(c->sock, ssh_socket_low_connect_try, (void *)c);
+  ssh_io_set_fd_request(c->sock, SSH_IO_WRITE);
+
+  /* Fake a callback to start asynchronous connect. */
+  ssh_socket_low_connect_try(SSH_IO_WRITE, (void *)c);
+
+#endif /* NO_NONBLOCKING_CONNECT */
+}
+
+/* Connects to the given address/port, and makes a stream for it.
+   The address to use is the first address from the list.  The
+   callback is called later from the event loop; until then the attempt
+   can be cancelled by passing the returned handle to
+   ssh_socket_low_connect_abort. */
+
+void *ssh_socket_low_connect(const char *address_list, unsigned int port,
+                             SshTcpCallback callback, void *context)
+{
+  int first_len;
+  LowConnect c;
 
   /* Compute the length of the first address on the list. */
   if (strchr(address_list, ','))
@@ -242,7 +275,7 @@ void ssh_socket_low_connect(const char *address_list, unsigned int port,
 
   /* Save data in a context structure. */
   c = ssh_xmalloc(sizeof(*c));
-  c->sock = sock;
+  c->sock = -1;
   c->address = ssh_xmalloc(first_len + 1);
   memcpy(c->address, address_list, first_len);
   c->address[first_len] = '\0';
@@ -250,21 +283,28 @@ void ssh_socket_low_connect(const char *address_list, unsigned int port,
   c->callback = callback;
   c->context = context;
 
-#ifdef NO_NONBLOCKING_CONNECT
-
-  /* Try connect once.  Function calls user callback. */
-  ssh_socket_low_connect_try_once(SSH_IO_WRITE, (void *)c);
-
-#else /* NO_NONBLOCKING_CONNECT */
+  ssh_register_timeout(0L, 0L, ssh_socket_low_connect_start, (void *)c);
+  return (void *)c;
+}
 
-  /* Register it and request events. */
-  ssh_io_register_fd(sock, ssh_socket_low_connect_try, (void *)c);
-  ssh_io_set_fd_request(sock, SSH_IO_WRITE);
+/* Cancels a connection attempt started by ssh_socket_low_connect
+   whose callback has not yet been called.  The callback will not be
+   called. */
 
-  /* Fake a callback to start asynchronous connect. */
-  ssh_socket_low_connect_try(SSH_IO_WRITE, (void *)c);
+void ssh_socket_low_connect_abort(void *handle)
+{
+  LowConnect c = (LowConnect)handle;
 
+  ssh_cancel_timeouts(ssh_socket_low_connect_start, (void *)c);
+  if (c->sock >= 0)
+    {
+#ifndef NO_NONBLOCKING_CONNECT
+      ssh_io_unregister_fd(c->sock, FALSE);
 #endif /* NO_NONBLOCKING_CONNECT */
+      close(c->sock);
+    }
+  ssh_xfree(c->address);
+  ssh_xfree(c);
 }
 
 /* --------- function for listening for connections ---------- */
@@ -596,6 +636,445 @@ char *ssh_tcp_get_host_addrs_by_name_sync(const char *name)
   return ssh_xstrdup(addresses);
 }
 
+/* Name server lookups through the callback interface are made by a helper
+   process, so that the event loop keeps running while gethostbyname()
+   waits for the name servers.  The helper is forked at the first lookup
+   and makes one lookup at a time; it exits when its pipe is closed.  The
+   results, also failed ones, are cached for a while, and lookups of a name
+   already being looked up wait for that one.  Forwarding many connections
+   to the same host thus looks the host up only once. */
+
+#define SSH_TCP_LOOKUP_CACHE_SIZE       64
+#define SSH_TCP_LOOKUP_TTL              300   /* seconds */
+#define SSH_TCP_LOOKUP_NEGATIVE_TTL     30    /* seconds */
+
+typedef struct SshTcpLookupRec
+{
+  struct SshTcpLookupRec *next;
+  Boolean by_addr;                  /* Address to name, or name to addrs. */
+  char *key;
+  SshLookupCallback callback;
+  void *context;
+} *SshTcpLookup;
+
+typedef struct SshTcpLookupCacheRec
+{
+  struct SshTcpLookupCacheRec *next;
+  Boolean by_addr;
+  char *key;
+  char *result;                     /* NULL if not found. */
+  SshTime expires;
+} *SshTcpLookupCache;
+
+static struct
+{
+  pid_t owner;                      /* Process that forked the helper. */
+  pid_t pid;                        /* The helper, or 0 if none. */
+  int to_fd, from_fd;
+  Boolean registered;               /* from_fd is in the event loop. */
+  SshBuffer reply;                  /* Partially received reply. */
+  SshTcpLookup first, last;         /* The first one is at the helper. */
+  SshTcpLookupCache cache;          /* Most recently used first. */
+  unsigned int cache_size;
+} ssh_tcp_resolver;
+
+/* Reads exactly `len' bytes, or returns FALSE. */
+
+static Boolean ssh_tcp_resolver_read(int fd, unsigned char *buf, size_t len)
+{
+  int ret;
+
+  while (len > 0)
+    {
+      ret = read(fd, buf, len);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        return FALSE;
+      buf += ret;
+      len -= ret;
+    }
+  return TRUE;
+}
+
+/* Writes exactly `len' bytes, or returns FALSE. */
+
+static Boolean ssh_tcp_resolver_write(int fd, const unsigned char *buf,
+                                      size_t len)
+{
+  int ret;
+
+  while (len > 0)
+    {
+      ret = write(fd, buf, len);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        return FALSE;
+      buf += ret;
+      len -= ret;
+    }
+  return TRUE;
+}
+
+/* The helper process.  A request is a 32-bit length, a character 'a' or
+   'n', and the address or name.  A reply is a 32-bit length and the
+   result, which is empty if the lookup failed. */
+
+static void ssh_tcp_resolver_child(int in, int out)
+{
+  unsigned char lenbuf[4];
+  char *request, *result;
+  size_t len;
+
+  for (;;)
+    {
+      if (!ssh_tcp_resolver_read(in, lenbuf, 4))
+        _exit(0);
+      len = SSH_GET_32BIT(lenbuf);
+      if (len < 1 || len > 1024)
+        _exit(1);
+      request = ssh_xmalloc(len + 1);
+      if (!ssh_tcp_resolver_read(in, (unsigned char *)request, len))
+        _exit(0);
+      request[len] = '\0';
+
+      if (request[0] == 'a')
+        result = ssh_tcp_get_host_by_addr_sync(request + 1);
+      else
+        result = ssh_tcp_get_host_addrs_by_name_sync(request + 1);
+      ssh_xfree(request);
+
+      len = result ? strlen(result) : 0;
+      SSH_PUT_32BIT(lenbuf, len);
+      if (!ssh_tcp_resolver_write(out, lenbuf, 4) ||
+          !ssh_tcp_resolver_write(out, (unsigned char *)result, len))
+        _exit(0);
+      if (result)
+        ssh_xfree(result);
+    }
+}
+
+/* Stores a result in the cache. */
+
+static void ssh_tcp_lookup_cache_add(Boolean by_addr, const char *key,
+                                     const char *result)
+{
+  SshTcpLookupCache entry, *entryp;
+
+  entry = ssh_xcalloc(1, sizeof(*entry));
+  entry->by_addr = by_addr;
+  entry->key = ssh_xstrdup(key);
+  entry->result = result ? ssh_xstrdup(result) : NULL;
+  entry->expires = ssh_time() +
+    (result ? SSH_TCP_LOOKUP_TTL : SSH_TCP_LOOKUP_NEGATIVE_TTL);
+  entry->next = ssh_tcp_resolver.cache;
+  ssh_tcp_resolver.cache = entry;
+
+  if (++ssh_tcp_resolver.cache_size <= SSH_TCP_LOOKUP_CACHE_SIZE)
+    return;
+
+  /* Drop the least recently used entry. */
+  for (entryp = &ssh_tcp_resolver.cache; (*entryp)->next;
+       entryp = &(*entryp)->next)
+    ;
+  entry = *entryp;
+  *entryp = NULL;
+  ssh_tcp_resolver.cache_size--;
+  ssh_xfree(entry->key);
+  if (entry->result)
+    ssh_xfree(entry->result);
+  ssh_xfree(entry);
+}
+
+/* Looks for a result in the cache, dropping expired entries on the way.
+   Returns the entry, or NULL if there is none. */
+
+static SshTcpLookupCache ssh_tcp_lookup_cache_find(Boolean by_addr,
+                                                   const char *key)
+{
+  SshTcpLookupCache entry, *entryp;
+  SshTime now = ssh_time();
+
+  for (entryp = &ssh_tcp_resolver.cache; *entryp; )
+    {
+      entry = *entryp;
+      if (entry->expires <= now)
+        {
+          *entryp = entry->next;
+          ssh_tcp_resolver.cache_size--;
+          ssh_xfree(entry->key);
+          if (entry->result)
+            ssh_xfree(entry->result);
+          ssh_xfree(entry);
+          continue;
+        }
+      if (entry->by_addr == by_addr && strcmp(entry->key, key) == 0)
+        {
+          /* Move it to the front. */
+          *entryp = entry->next;
+          entry->next = ssh_tcp_resolver.cache;
+          ssh_tcp_resolver.cache = entry;
+          return entry;
+        }
+      entryp = &entry->next;
+    }
+  return NULL;
+}
+
+/* Calls the callback of a lookup with the result, and frees the lookup. */
+
+static void ssh_tcp_lookup_done(SshTcpLookup lookup, const char *result)
+{
+  if (result)
+    (*lookup->callback)(SSH_IP_OK, result, lookup->context);
+  else
+    (*lookup->callback)(SSH_IP_NO_ADDRESS, NULL, lookup->context);
+  ssh_xfree(lookup->key);
+  ssh_xfree(lookup);
+}
+
+static void ssh_tcp_resolver_callback(unsigned int events, void *context);
+
+/* Forks the helper process.  Returns FALSE if that cannot be done. */
+
+static Boolean ssh_tcp_resolver_start(void)
+{
+  int to_child[2], from_child[2], i;
+  pid_t pid;
+
+  if (pipe(to_child) < 0)
+    return FALSE;
+  if (pipe(from_child) < 0)
+    {
+      close(to_child[0]);
+      close(to_child[1]);
+      return FALSE;
+    }
+
+  pid = fork();
+  if (pid < 0)
+    {
+      close(to_child[0]);
+      close(to_child[1]);
+      close(from_child[0]);
+      close(from_child[1]);
+      return FALSE;
+    }
+
+  if (pid == 0)
+    {
+      /* Close everything else, so that the helper does not keep
+         connections of the parent open. */
+      for (i = getdtablesize() - 1; i > 2; i--)
+        if (i != to_child[0] && i != from_child[1])
+          close(i);
+      ssh_tcp_resolver_child(to_child[0], from_child[1]);
+      _exit(0);
+    }
+
+  close(to_child[0]);
+  close(from_child[1]);
+  ssh_tcp_resolver.owner = getpid();
+  ssh_tcp_resolver.pid = pid;
+  ssh_tcp_resolver.to_fd = to_child[1];
+  ssh_tcp_resolver.from_fd = from_child[0];
+  ssh_tcp_resolver.registered = FALSE;
+  ssh_buffer_init(&ssh_tcp_resolver.reply);
+  return TRUE;
+}
+
+/* Forgets the helper.  This is only called when the helper has died, or
+   when it belongs to our parent; a live helper of ours exits when it sees
+   its pipe closed at our exit. */
+
+static void ssh_tcp_resolver_stop(void)
+{
+  if (ssh_tcp_resolver.registered)
+    ssh_io_unregister_fd(ssh_tcp_resolver.from_fd, FALSE);
+  ssh_tcp_resolver.registered = FALSE;
+  close(ssh_tcp_resolver.from_fd);
+  close(ssh_tcp_resolver.to_fd);
+  ssh_buffer_uninit(&ssh_tcp_resolver.reply);
+
+  /* Reap our own helper, unless a SIGCHLD handler already did. */
+#ifdef HAVE_WAITPID
+  if (ssh_tcp_resolver.owner == getpid())
+    while (waitpid(ssh_tcp_resolver.pid, NULL, 0) < 0 && errno == EINTR)
+      ;
+#endif /* HAVE_WAITPID */
+  ssh_tcp_resolver.pid = 0;
+}
+
+/* Sends the first queued lookup to the helper.  If the helper cannot be
+   used, the lookups are made here. */
+
+static void ssh_tcp_resolver_send(void)
+{
+  SshTcpLookup lookup;
+  unsigned char buf[4 + 1 + 1024];
+  size_t len;
+  char *result;
+
+  while ((lookup = ssh_tcp_resolver.first) != NULL)
+    {
+      len = strlen(lookup->key);
+      if (len < 1024 && ssh_tcp_resolver.pid != 0)
+        {
+          SSH_PUT_32BIT(buf, len + 1);
+          buf[4] = lookup->by_addr ? 'a' : 'n';
+          memcpy(buf + 5, lookup->key, len);
+          if (ssh_tcp_resolver_write(ssh_tcp_resolver.to_fd, buf, 5 + len))
+            {
+              /* The pipe is only in the event loop while a lookup is
+                 out, so that an idle helper does not keep the loop
+                 running. */
+              if (!ssh_tcp_resolver.registered)
+                {
+                  ssh_io_register_fd(ssh_tcp_resolver.from_fd,
+                                     ssh_tcp_resolver_callback, NULL);
+                  ssh_io_set_fd_request(ssh_tcp_resolver.from_fd,
+                                        SSH_IO_READ);
+                  ssh_tcp_resolver.registered = TRUE;
+                }
+              return;
+            }
+          ssh_tcp_resolver_stop();
+        }
+
+      /* No helper; block as we used to. */
+      ssh_tcp_resolver.first = lookup->next;
+      if (lookup->by_addr)
+        result = ssh_tcp_get_host_by_addr_sync(lookup->key);
+      else
+        result = ssh_tcp_get_host_addrs_by_name_sync(lookup->key);
+      ssh_tcp_lookup_cache_add(lookup->by_addr, lookup->key, result);
+      ssh_tcp_lookup_done(lookup, result);
+      if (result)
+        ssh_xfree(result);
+    }
+}
+
+/* Called when the helper has written something.  Completes the lookup at
+   the helper, and the queued lookups of the same name. */
+
+static void ssh_tcp_resolver_callback(unsigned int events, void *context)
+{
+  SshTcpLookup lookup, *lookupp, done;
+  unsigned char buf[1024], *ucp;
+  char *result;
+  size_t len;
+  int ret;
+
+  ret = read(ssh_tcp_resolver.from_fd, buf, sizeof(buf));
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+  if (ret <= 0)
+    {
+      /* The helper has died.  The rest is done without it. */
+      ssh_debug("ssh_tcp_resolver_callback: the lookup helper has died");
+      ssh_tcp_resolver_stop();
+      ssh_tcp_resolver_send();
+      return;
+    }
+  ssh_buffer_append(&ssh_tcp_resolver.reply, buf, ret);
+
+  if (ssh_buffer_len(&ssh_tcp_resolver.reply) < 4)
+    return;
+  ucp = ssh_buffer_ptr(&ssh_tcp_resolver.reply);
+  len = SSH_GET_32BIT(ucp);
+  if (ssh_buffer_len(&ssh_tcp_resolver.reply) < 4 + len)
+    return;
+  result = len > 0 ? ssh_xmemdup(ucp + 4, len) : NULL;
+  ssh_buffer_consume(&ssh_tcp_resolver.reply, 4 + len);
+
+  /* Take the lookups of this name off the queue before calling any
+     callbacks, as the callbacks may start new lookups. */
+  done = ssh_tcp_resolver.first;
+  ssh_tcp_resolver.first = done->next;
+  done->next = NULL;
+  for (lookupp = &ssh_tcp_resolver.first; *lookupp; )
+    if ((*lookupp)->by_addr == done->by_addr &&
+        strcmp((*lookupp)->key, done->key) == 0)
+      {
+        lookup = *lookupp;
+        *lookupp = lookup->next;
+        lookup->next = done;
+        done = lookup;
+      }
+    else
+      lookupp = &(*lookupp)->next;
+  ssh_tcp_resolver.last = NULL;
+  for (lookup = ssh_tcp_resolver.first; lookup; lookup = lookup->next)
+    ssh_tcp_resolver.last = lookup;
+
+  ssh_tcp_lookup_cache_add(done->by_addr, done->key, result);
+
+  /* Start the next one. */
+  if (ssh_tcp_resolver.first)
+    ssh_tcp_resolver_send();
+  else
+    {
+      ssh_io_unregister_fd(ssh_tcp_resolver.from_fd, TRUE);
+      ssh_tcp_resolver.registered = FALSE;
+    }
+
+  while (done)
+    {
+      lookup = done;
+      done = done->next;
+      ssh_tcp_lookup_done(lookup, result);
+    }
+  if (result)
+    ssh_xfree(result);
+}
+
+/* Starts a lookup.  The result comes from the cache right away, or from
+   the helper through the event loop. */
+
+static void ssh_tcp_lookup(Boolean by_addr, const char *key,
+                           SshLookupCallback callback, void *context)
+{
+  SshTcpLookupCache entry;
+  SshTcpLookup lookup;
+
+  entry = ssh_tcp_lookup_cache_find(by_addr, key);
+  if (entry)
+    {
+      SSH_DEBUG(5, ("Found %s in the lookup cache.", key));
+      if (entry->result)
+        (*callback)(SSH_IP_OK, entry->result, context);
+      else
+        (*callback)(SSH_IP_NO_ADDRESS, NULL, context);
+      return;
+    }
+
+  /* A helper forked by our parent is not ours to use.  Lookups the
+     parent had going are left to it. */
+  if (ssh_tcp_resolver.pid != 0 && ssh_tcp_resolver.owner != getpid())
+    {
+      ssh_tcp_resolver_stop();
+      ssh_tcp_resolver.first = ssh_tcp_resolver.last = NULL;
+    }
+  if (ssh_tcp_resolver.pid == 0)
+    ssh_tcp_resolver_start();
+
+  lookup = ssh_xcalloc(1, sizeof(*lookup));
+  lookup->by_addr = by_addr;
+  lookup->key = ssh_xstrdup(key);
+  lookup->callback = callback;
+  lookup->context = context;
+  if (ssh_tcp_resolver.first)
+    {
+      /* Queued behind the one at the helper. */
+      ssh_tcp_resolver.last->next = lookup;
+      ssh_tcp_resolver.last = lookup;
+      return;
+    }
+  ssh_tcp_resolver.first = ssh_tcp_resolver.last = lookup;
+  ssh_tcp_resolver_send();
+}
+
 /* Looks up all ip-addresses of the host, returning them as a
    comma-separated list when calling the callback.  The host name may
    already be an ip address, in which case it is returned directly. */
@@ -604,16 +1083,17 @@ void ssh_tcp_get_host_addrs_by_name(const char *name,
                                     SshLookupCallback callback,
                                     void *context)
 {
-  char *addrs; 
+  unsigned char outbuf[16];
+  size_t outbuflen = 4;
 
-  addrs = ssh_tcp_get_host_addrs_by_name_sync(name);
-  if (addrs)
+  /* An ip address needs no lookup. */
+  if (ssh_inet_strtobin(name, outbuf, &outbuflen))
     {
-      (*callback)(SSH_IP_OK, addrs, context);
-      ssh_xfree(addrs);
+      (*callback)(SSH_IP_OK, name, context);
+      return;
     }
-  else
-    (*callback)(SSH_IP_NO_ADDRESS, NULL, context);
+
+  ssh_tcp_lookup(FALSE, name, callback, context);
 }
 
 
@@ -680,16 +1160,7 @@ void ssh_tcp_get_host_by_addr(const char *addr,
                               SshLookupCallback callback,
                               void *context)
 {
-  char *name; 
-
-  name = ssh_tcp_get_host_by_addr_sync(addr);
-  if (name)
-    {
-      (*callback)(SSH_IP_OK, name, context);
-      ssh_xfree(name);
-    }
-  else
-    (*callback)(SSH_IP_NO_ADDRESS, NULL, context);
+  ssh_tcp_lookup(TRUE, addr, callback, context);
 }
 
 /* Looks up the service (port number) by name and protocol.  `protocol' must
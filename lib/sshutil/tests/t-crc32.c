@@ -973,6 +973,32 @@ int main(int ac, char **av)
       buf_len = buf_len_max/2;
     }
 
+  /* Computing the crc in pieces. */
+  crc = crc32_buffer_continue(crc32_buffer(buf, 1000), buf + 1000,
+                              buf_len - 1000);
+  if (crc != crc32_buffer(buf, buf_len))
+    ssh_fatal("Continued crc differs from the crc of the whole buffer!");
+
+  /* Rolling a window over the buffer. */
+  for (pass = 0; pass < 10; pass++)
+    {
+      SshUInt32 table[256];
+      size_t window_len = 1 + random() % 5000;
+
+      crc32_roll_table(table, window_len);
+      crc = crc32_buffer(buf, window_len);
+      for (offset = 1; offset + window_len <= buf_len; offset++)
+        {
+          crc = crc32_roll(table, crc, buf[offset - 1],
+                           buf[offset + window_len - 1]);
+          if (offset % 997 == 0 &&
+              crc != crc32_buffer(buf + offset, window_len))
+            ssh_fatal("Rolled crc differs from the crc of the window!");
+        }
+      if (crc != crc32_buffer(buf + buf_len - window_len, window_len))
+        ssh_fatal("Rolled crc differs from the crc of the last window!");
+    }
+
   ssh_xfree(buf);
   ssh_xfree(mask);
   return 0;
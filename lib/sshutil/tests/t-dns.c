@@ -15,6 +15,8 @@
 
 #include "sshincludes.h"
 #include "sshtcp.h"
+#include "sshtimeouts.h"
+#include "sshunixeloop.h"
 
 void byname_cb(SshIpError error, const char *name, void *context)
 {
@@ -48,6 +50,21 @@ void byaddr_cb(SshIpError error, const char *result, void *context)
     fprintf(stderr, "-- NAME=%s, ADDRS=none\n", name); 
 }
 
+void cached_cb(SshIpError error, const char *result, void *context)
+{
+  char *name = (char *)context;
+
+  fprintf(stderr, "%s NAME=%s, ADDRS=%s (cached)\n",
+          error == SSH_IP_OK ? "++" : "--", name,
+          error == SSH_IP_OK ? result : "none");
+}
+
+void again(void *context)
+{
+  /* This one comes from the cache, during the call. */
+  ssh_tcp_get_host_addrs_by_name((char *)context, cached_cb, context);
+}
+
 int main(int ac, char **av)
 {
   char *addrs, *addr, *name, *oname;
@@ -81,7 +98,11 @@ int main(int ac, char **av)
     fprintf(stderr, "-- NAME=%s, ADDRS=none\n", name); 
       
   /* do the same using the asyncronous interface */
+  ssh_event_loop_initialize();
   ssh_tcp_get_host_addrs_by_name(oname, byaddr_cb, oname);
+  ssh_register_timeout(1L, 0L, again, oname);
+  ssh_event_loop_run();
+  ssh_event_loop_uninitialize();
 
   return 0;
 }
@@ -15,6 +15,9 @@ Simple test program for the file transfer functions.
 #include "sshunixeloop.h"
 #include "sshstreampair.h"
 #include "sshfilexfer.h"
+#include "sshcrypt.h"
+#include "sshcrc32.h"
+#include "sshgetput.h"
 
 SshFileServer server;
 SshFileClient client;
@@ -25,6 +28,16 @@ off_t file_offset;
 int got_realpath;
 char *new_dir;
 
+/* The stress test keeps this many reads outstanding at once, on this
+   many handles. */
+#define STRESS_REQUESTS 10000
+#define STRESS_HANDLES  500
+
+unsigned char *stress_data;
+size_t stress_len;
+SshFileHandle stress_handles[STRESS_HANDLES];
+int stress_opened, stress_reads_done, stress_closed;
+
 
 void attrs_cb(SshFileClientError error,  SshFileAttributes attrs,
               void *context)
@@ -146,10 +159,336 @@ void open_cb(SshFileClientError error, SshFileHandle handle, void *context)
 
 }
 
+void stress_close_cb(SshFileClientError error, void *context)
+{
+  if (error != SSH_FX_OK)
+    ssh_fatal("stress_close_cb: error %d", (int)error);
+  stress_closed++;
+}
+
+void stress_read_cb(SshFileClientError error, const unsigned char *data,
+                    size_t len, void *context)
+{
+  unsigned long i = (unsigned long)context;
+  size_t offset = i % stress_len;
+  int h;
+
+  if (error != SSH_FX_OK)
+    ssh_fatal("stress_read_cb: read %lu: error %d", i, (int)error);
+  if (len == 0 || len > 16 || offset + len > stress_len ||
+      memcmp(data, stress_data + offset, len) != 0)
+    ssh_fatal("stress_read_cb: read %lu: bad data", i);
+
+  /* Close the handles once all the reads are done. */
+  if (++stress_reads_done == STRESS_REQUESTS)
+    for (h = 0; h < STRESS_HANDLES; h++)
+      ssh_file_client_close(stress_handles[h], stress_close_cb, NULL);
+}
+
+void stress_open_cb(SshFileClientError error, SshFileHandle handle,
+                    void *context)
+{
+  unsigned long i;
+
+  if (error != SSH_FX_OK)
+    ssh_fatal("stress_open_cb: error %d", (int)error);
+  stress_handles[(unsigned long)context] = handle;
+
+  /* When all the handles are open, send all the reads at once, spread
+     over the handles. */
+  if (++stress_opened < STRESS_HANDLES)
+    return;
+  for (i = 0; i < STRESS_REQUESTS; i++)
+    ssh_file_client_read(stress_handles[i % STRESS_HANDLES],
+                         (off_t)(i % stress_len), 16,
+                         stress_read_cb, (void *)i);
+}
+
+void copy_open_cb(SshFileClientError error, SshFileHandle handle,
+                  void *context)
+{
+  if (error != SSH_FX_OK)
+    ssh_fatal("copy_open_cb: error %d", (int)error);
+  *(SshFileHandle *)context = handle;
+}
+
+void copy_status_cb(SshFileClientError error, void *context)
+{
+  *(SshFileClientError *)context = error;
+}
+
+/* Copies the file on the server with copy-data, in two pieces given
+   in reverse order, and checks the copy. */
+
+void copy_data_test(SshFileClient copy_client)
+{
+  SshFileHandle src = NULL, dst = NULL;
+  SshFileClientError error1 = SSH_FX_FAILURE, error2 = SSH_FX_FAILURE;
+  SshFileClientError error3 = SSH_FX_OK, error4 = SSH_FX_FAILURE;
+  SshFileClientError error5 = SSH_FX_OK;
+  char name[64];
+  unsigned char *buf;
+  off_t half = stress_len / 2;
+  FILE *f;
+  size_t len;
+
+  snprintf(name, sizeof(name), "copy%d", (int)getpid());
+  ssh_file_client_open(copy_client, "t-filexfer.c", O_RDONLY, NULL,
+                       copy_open_cb, &src);
+  ssh_file_client_open(copy_client, name, O_WRONLY | O_CREAT | O_TRUNC, NULL,
+                       copy_open_cb, &dst);
+  ssh_event_loop_run();
+  if (!ssh_file_client_extension(copy_client, "copy-data@ssh.com", NULL))
+    ssh_fatal("copy_data_test: server does not list copy-data");
+
+  ssh_file_client_copy_data(src, half, stress_len - half, dst, half,
+                            copy_status_cb, &error1);
+  ssh_file_client_copy_data(src, 0, half, dst, 0,
+                            copy_status_cb, &error2);
+  ssh_file_client_copy_data(src, stress_len - 1, 2, dst, stress_len + 10,
+                            copy_status_cb, &error3);
+  ssh_file_client_copy_data(src, 0, (off_t)0x10000000, dst, 0,
+                            copy_status_cb, &error5);
+  /* A threaded server may run a close before the requests sent ahead
+     of it, so wait for them first. */
+  ssh_event_loop_run();
+  ssh_file_client_close(src, copy_status_cb, &error4);
+  ssh_file_client_close(dst, copy_status_cb, &error4);
+  ssh_event_loop_run();
+
+  /* The third copy went past the end of the source; it copied one byte
+     and stopped.  The last one was too long to be done at all. */
+  if (error1 != SSH_FX_OK || error2 != SSH_FX_OK || error3 != SSH_FX_EOF ||
+      error4 != SSH_FX_OK || error5 != SSH_FX_FAILURE)
+    ssh_fatal("copy_data_test: errors %d %d %d %d %d",
+              (int)error1, (int)error2, (int)error3, (int)error4,
+              (int)error5);
+
+  buf = ssh_xmalloc(stress_len + 16);
+  f = fopen(name, "r");
+  if (f == NULL)
+    ssh_fatal("copy_data_test: cannot open %s", name);
+  len = fread(buf, 1, stress_len + 16, f);
+  fclose(f);
+  remove(name);
+  if (len != stress_len + 11 || memcmp(buf, stress_data, stress_len) != 0 ||
+      buf[stress_len + 10] != stress_data[stress_len - 1])
+    ssh_fatal("copy_data_test: bad copy");
+  ssh_xfree(buf);
+  printf("copy-data test done\n");
+}
+
+/* The digests returned by a block-hash request, or the extents
+   returned by a data-extents request. */
+unsigned char hash_digests[64 * SSH_MAX_HASH_DIGEST_LENGTH];
+size_t hash_digests_len;
+
+void hash_data_cb(SshFileClientError error, const unsigned char *data,
+                  size_t len, void *context)
+{
+  *(SshFileClientError *)context = error;
+  if (error == SSH_FX_OK)
+    {
+      if (len > sizeof(hash_digests))
+        ssh_fatal("hash_data_cb: too many digests");
+      memcpy(hash_digests, data, len);
+      hash_digests_len = len;
+    }
+}
+
+/* Hashes the file on the server with block-hash, and checks the
+   digests against those computed here. */
+
+void block_hash_test(SshFileClient hash_client)
+{
+  SshFileHandle handle = NULL;
+  SshFileClientError error1 = SSH_FX_FAILURE, error2 = SSH_FX_OK;
+  SshFileClientError error3 = SSH_FX_OK, error4 = SSH_FX_OK;
+  const char *hashes;
+  unsigned char digest[SSH_MAX_HASH_DIGEST_LENGTH], *p;
+  SshHash hash;
+  size_t block_size, offset, len, digest_len;
+
+  ssh_file_client_open(hash_client, "t-filexfer.c", O_RDONLY, NULL,
+                       copy_open_cb, &handle);
+  ssh_event_loop_run();
+  if (!ssh_file_client_extension(hash_client, "block-hash@ssh.com",
+                                 &hashes) ||
+      strstr(hashes, "md5") == NULL)
+    ssh_fatal("block_hash_test: server does not list block-hash md5");
+  if (ssh_hash_allocate("md5", &hash) != SSH_CRYPTO_OK)
+    ssh_fatal("block_hash_test: no md5");
+  digest_len = ssh_hash_digest_length(hash);
+
+  /* Enough blocks that the last one is short. */
+  block_size = stress_len / 10 + 1;
+  ssh_file_client_block_hash(handle, "md5", 0, stress_len + 100, block_size,
+                             hash_data_cb, &error1);
+  ssh_event_loop_run();
+  if (error1 != SSH_FX_OK)
+    ssh_fatal("block_hash_test: error %d", (int)error1);
+  if (hash_digests_len != 10 * digest_len)
+    ssh_fatal("block_hash_test: %d bytes of digests",
+              (int)hash_digests_len);
+
+  for (offset = 0; offset < stress_len; offset += block_size)
+    {
+      len = (stress_len - offset < block_size) ? stress_len - offset :
+        block_size;
+      ssh_hash_reset(hash);
+      ssh_hash_update(hash, stress_data + offset, len);
+      ssh_hash_final(hash, digest);
+      if (memcmp(digest, hash_digests + offset / block_size * digest_len,
+                 digest_len) != 0)
+        ssh_fatal("block_hash_test: bad digest at %d", (int)offset);
+    }
+
+  /* The same with block-signatures, which adds the CRCs. */
+  ssh_file_client_block_signatures(handle, "md5", 0, stress_len, block_size,
+                                   hash_data_cb, &error1);
+  ssh_event_loop_run();
+  if (error1 != SSH_FX_OK || hash_digests_len != 10 * (4 + digest_len))
+    ssh_fatal("block_hash_test: block-signatures error %d, %d bytes",
+              (int)error1, (int)hash_digests_len);
+  for (offset = 0; offset < stress_len; offset += block_size)
+    {
+      len = (stress_len - offset < block_size) ? stress_len - offset :
+        block_size;
+      p = hash_digests + offset / block_size * (4 + digest_len);
+      ssh_hash_reset(hash);
+      ssh_hash_update(hash, stress_data + offset, len);
+      ssh_hash_final(hash, digest);
+      if (SSH_GET_32BIT(p) != crc32_buffer(stress_data + offset, len) ||
+          memcmp(digest, p + 4, digest_len) != 0)
+        ssh_fatal("block_hash_test: bad signature at %d", (int)offset);
+    }
+  ssh_hash_free(hash);
+
+  /* Past the end of the file, with an unknown hash, and with blocks
+     too large to hash in one request. */
+  ssh_file_client_block_hash(handle, "md5", stress_len, 100, block_size,
+                             hash_data_cb, &error2);
+  ssh_file_client_block_hash(handle, "no-such-hash", 0, 100, block_size,
+                             hash_data_cb, &error3);
+  ssh_file_client_block_hash(handle, "md5", 0, 100, (size_t)0x80000000,
+                             hash_data_cb, &error4);
+  ssh_event_loop_run();
+  ssh_file_client_close(handle, copy_status_cb, &error1);
+  ssh_event_loop_run();
+  if (error2 != SSH_FX_EOF || error3 != SSH_FX_FAILURE ||
+      error4 != SSH_FX_FAILURE)
+    ssh_fatal("block_hash_test: errors %d %d %d",
+              (int)error2, (int)error3, (int)error4);
+  printf("block-hash test done\n");
+}
+
+/* The sparse file for the data-extents test: data at the start and in
+   the middle, and a hole at the end. */
+#define SPARSE_SIZE     0x300000
+#define SPARSE_MIDDLE   0x100000
+
+/* Asks the server for the data extents of a sparse file, and checks
+   that everything outside them is zeros.  Whether the holes are found
+   depends on the file system, so finding none is not an error. */
+
+void data_extents_test(SshFileClient extents_client)
+{
+  SshFileHandle handle = NULL;
+  SshFileClientError error1 = SSH_FX_FAILURE, error2 = SSH_FX_OK;
+  unsigned char *buf, *p;
+  char name[64];
+  SshUInt64 end, offset, len, pos = 0;
+  int fd;
+
+  snprintf(name, sizeof(name), "sparse%d", (int)getpid());
+  fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0 ||
+      write(fd, stress_data, stress_len) != (long)stress_len ||
+      lseek(fd, (off_t)SPARSE_MIDDLE, SEEK_SET) < 0 ||
+      write(fd, stress_data, stress_len) != (long)stress_len ||
+      ftruncate(fd, (off_t)SPARSE_SIZE) < 0)
+    ssh_fatal("data_extents_test: cannot create %s", name);
+  close(fd);
+
+  ssh_file_client_open(extents_client, name, O_RDONLY, NULL,
+                       copy_open_cb, &handle);
+  ssh_event_loop_run();
+  if (!ssh_file_client_extension(extents_client, "data-extents@ssh.com",
+                                 NULL))
+    ssh_fatal("data_extents_test: server does not list data-extents");
+
+  /* Mark the bytes said to hold data, and check the rest. */
+  buf = ssh_xcalloc(1, SPARSE_SIZE);
+  while (pos < SPARSE_SIZE)
+    {
+      ssh_file_client_data_extents(handle, (off_t)pos,
+                                   (off_t)(SPARSE_SIZE - pos),
+                                   hash_data_cb, &error1);
+      ssh_event_loop_run();
+      if (error1 != SSH_FX_OK || hash_digests_len < 8 ||
+          (hash_digests_len - 8) % 16 != 0)
+        ssh_fatal("data_extents_test: error %d, %d bytes",
+                  (int)error1, (int)hash_digests_len);
+      end = SSH_GET_64BIT(hash_digests);
+      if (end <= pos || end > SPARSE_SIZE)
+        ssh_fatal("data_extents_test: bad end %lu", (unsigned long)end);
+      for (p = hash_digests + 8; p < hash_digests + hash_digests_len;
+           p += 16)
+        {
+          offset = SSH_GET_64BIT(p);
+          len = SSH_GET_64BIT(p + 8);
+          if (offset < pos || len == 0 || offset + len > end)
+            ssh_fatal("data_extents_test: bad extent %lu %lu",
+                      (unsigned long)offset, (unsigned long)len);
+          memset(buf + offset, 1, (size_t)len);
+        }
+      pos = end;
+    }
+  if (memchr(buf, 0, stress_len) != NULL ||
+      memchr(buf + SPARSE_MIDDLE, 0, stress_len) != NULL)
+    ssh_fatal("data_extents_test: data reported as a hole");
+
+  ssh_file_client_data_extents(handle, SPARSE_SIZE, 100,
+                               hash_data_cb, &error2);
+  ssh_event_loop_run();
+  ssh_file_client_close(handle, copy_status_cb, &error1);
+  ssh_event_loop_run();
+  remove(name);
+  ssh_xfree(buf);
+  if (error2 != SSH_FX_EOF)
+    ssh_fatal("data_extents_test: error %d past the end", (int)error2);
+  printf("data-extents test done\n");
+}
+
+/* Opens many handles to the same file and reads it through them with
+   many requests outstanding, checking the data. */
+
+void stress_test(SshFileClient stress_client)
+{
+  unsigned long h;
+
+  stress_opened = 0;
+  stress_reads_done = 0;
+  stress_closed = 0;
+  for (h = 0; h < STRESS_HANDLES; h++)
+    ssh_file_client_open(stress_client, "t-filexfer.c", O_RDONLY, NULL,
+                         stress_open_cb, (void *)h);
+  ssh_event_loop_run();
+
+  if (stress_opened != STRESS_HANDLES ||
+      stress_reads_done != STRESS_REQUESTS ||
+      stress_closed != STRESS_HANDLES)
+    ssh_fatal("stress_test: %d opens, %d reads, %d closes done",
+              stress_opened, stress_reads_done, stress_closed);
+  printf("stress test: %d requests on %d handles done\n",
+         STRESS_REQUESTS, STRESS_HANDLES);
+}
+
 int main(int argc, char **argv)
 {
   SshStream s1, s2;
   char temp_string[256];
+  FILE *f;
   
 
   new_dir = NULL;
@@ -176,6 +515,30 @@ int main(int argc, char **argv)
    
   ssh_file_client_stat(client, "t-filexfer", attrs_cb, NULL);
   ssh_event_loop_run();
+
+  /* Read the file to compare with for the stress test. */
+  f = fopen("t-filexfer.c", "r");
+  if (f == NULL)
+    ssh_fatal("cannot open t-filexfer.c");
+  stress_data = ssh_xmalloc(65536);
+  stress_len = fread(stress_data, 1, 65536, f);
+  fclose(f);
+
+  stress_test(client);
+  copy_data_test(client);
+  block_hash_test(client);
+  data_extents_test(client);
+
+  /* Again, with the server running requests in worker threads; the
+     replies then come in any order. */
+  ssh_stream_pair_create(&s1, &s2);
+  server = ssh_file_server_wrap(s1);
+  ssh_file_server_set_concurrency(server, 8);
+  client = ssh_file_client_wrap(s2);
+  stress_test(client);
+  copy_data_test(client);
+  block_hash_test(client);
+  data_extents_test(client);
   
   ssh_event_loop_uninitialize();
   fflush(stdout);
@@ -0,0 +1,95 @@
+/*
+
+t-threadpool.c
+
+Copyright (c) 1999 SSH Communications Security, Finland
+                   All rights reserved
+
+Tests for the worker thread pool.
+
+*/
+
+#include "sshincludes.h"
+#include "sshunixeloop.h"
+#include "sshthreadpool.h"
+
+#define NUM_OPERATIONS 1000
+
+SshThreadPool pool;
+SshMutex mutex;
+
+int operations_run;
+int completions_called;
+int numbers[NUM_OPERATIONS];
+
+void operation(void *context)
+{
+  int *number = (int *)context;
+
+  *number = *number * 2;
+
+  ssh_mutex_lock(mutex);
+  operations_run++;
+  ssh_mutex_unlock(mutex);
+}
+
+void completion(void *context)
+{
+  int *number = (int *)context;
+
+  if (*number != 2 * (number - numbers))
+    ssh_fatal("completion: operation %d not run", (int)(number - numbers));
+  completions_called++;
+}
+
+void destroy_completion(void *context)
+{
+  completions_called++;
+  ssh_thread_pool_destroy(pool);
+}
+
+int main(int argc, char **argv)
+{
+  int i;
+
+  ssh_event_loop_initialize();
+
+  pool = ssh_thread_pool_create(4);
+  if (pool == NULL)
+    {
+      printf("No threads on this platform.\n");
+      ssh_event_loop_uninitialize();
+      return 0;
+    }
+  mutex = ssh_mutex_create();
+
+  /* Run a number of operations, and check that all of them are run and
+     their completions called. */
+  for (i = 0; i < NUM_OPERATIONS; i++)
+    {
+      numbers[i] = i;
+      ssh_thread_pool_run(pool, operation, completion, (void *)&numbers[i]);
+    }
+
+  /* The event loop returns when all the completions have been called. */
+  ssh_event_loop_run();
+  if (operations_run != NUM_OPERATIONS)
+    ssh_fatal("%d operations run, should be %d",
+              operations_run, NUM_OPERATIONS);
+  if (completions_called != NUM_OPERATIONS)
+    ssh_fatal("%d completions called, should be %d",
+              completions_called, NUM_OPERATIONS);
+
+  /* Destroying the pool from a completion. */
+  completions_called = 0;
+  numbers[0] = 0;
+  ssh_thread_pool_run(pool, operation, destroy_completion,
+                      (void *)&numbers[0]);
+  ssh_event_loop_run();
+  if (completions_called != 1)
+    ssh_fatal("destroy from a completion failed");
+
+  ssh_mutex_destroy(mutex);
+  ssh_event_loop_uninitialize();
+  return 0;
+}